@@ -41,6 +41,10 @@
 #include "net.h"
 #include "gdbstub.h"
 #include "hw/smbios.h"
+#include "page_cache.h"
+#include "cpus.h"
+#include "qemu-thread.h"
+#include <zlib.h>
 
 #ifdef TARGET_SPARC
 int graphic_width = 1024;
@@ -85,12 +89,31 @@ const uint32_t arch_type = QEMU_ARCH;
 /***********************************************************/
 /* ram save/restore */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+/* was RAM_SAVE_FLAG_FULL, which no version 3 or later stream carries */
+#define RAM_SAVE_FLAG_CHANNELS 0x01
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
+#define RAM_SAVE_FLAG_XBZRLE   0x40
+#define RAM_SAVE_FLAG_ZERO     0x80
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x100
+#define RAM_SAVE_FLAG_POSTCOPY 0x200
+
+/* full passes over RAM before a post-copy migration switches over */
+#define POSTCOPY_PRECOPY_PASSES 2
+
+/* longest time ram_save_live() keeps scanning in one iteration, in ns */
+#define RAM_SAVE_MAX_WAIT 50000000
+
+/* encoding byte following RAM_SAVE_FLAG_XBZRLE */
+#define ENCODING_FLAG_XBZRLE   0x1
+
+static int is_zero_page(uint8_t *page)
+{
+    return buffer_is_zero(page, TARGET_PAGE_SIZE);
+}
 
 static int is_dup_page(uint8_t *page, uint8_t ch)
 {
@@ -107,87 +130,609 @@ static int is_dup_page(uint8_t *page, uint8_t ch)
     return 1;
 }
 
+/* XBZRLE page cache and the scratch buffers used to encode against it */
+static struct {
+    /* buffer used for XBZRLE encoding */
+    uint8_t *encoded_buf;
+    /* stable copy of the page being encoded */
+    uint8_t *current_buf;
+    /* buffer used for XBZRLE decoding */
+    uint8_t *decoded_buf;
+    /* cache of the pages as last sent to the destination */
+    PageCache *cache;
+} XBZRLE;
+
+typedef struct AccountingInfo {
+    /* pages sent as a single byte, zero pages skipped and full pages sent */
+    uint64_t dup_pages;
+    uint64_t skipped_pages;
+    uint64_t norm_pages;
+    /* dirty bitmap syncs, one per ram_save_live() call */
+    uint64_t iterations;
+    /* pages dirtied per second during the last iteration */
+    uint64_t dirty_pages_rate;
+    int64_t sync_time;
+    /* time the rest of RAM would take at the current bandwidth, in ms */
+    uint64_t expected_downtime;
+    uint64_t xbzrle_bytes;
+    uint64_t xbzrle_pages;
+    uint64_t xbzrle_cache_hit;
+    uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_overflows;
+    uint64_t xbzrle_bytes_saved;
+} AccountingInfo;
+
+static AccountingInfo acct_info;
+
+uint64_t dup_mig_pages_transferred(void)
+{
+    return acct_info.dup_pages;
+}
+
+uint64_t skipped_mig_pages_transferred(void)
+{
+    return acct_info.skipped_pages;
+}
+
+uint64_t norm_mig_pages_transferred(void)
+{
+    return acct_info.norm_pages;
+}
+
+uint64_t norm_mig_bytes_transferred(void)
+{
+    return acct_info.norm_pages * TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_mig_iterations(void)
+{
+    return acct_info.iterations;
+}
+
+uint64_t ram_mig_dirty_pages_rate(void)
+{
+    return acct_info.dirty_pages_rate;
+}
+
+uint64_t ram_mig_expected_downtime(void)
+{
+    return acct_info.expected_downtime;
+}
+
+uint64_t xbzrle_mig_bytes_transferred(void)
+{
+    return acct_info.xbzrle_bytes;
+}
+
+uint64_t xbzrle_mig_pages_transferred(void)
+{
+    return acct_info.xbzrle_pages;
+}
+
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
+uint64_t xbzrle_mig_pages_cache_miss(void)
+{
+    return acct_info.xbzrle_cache_miss;
+}
+
+uint64_t xbzrle_mig_pages_overflow(void)
+{
+    return acct_info.xbzrle_overflows;
+}
+
+uint64_t xbzrle_mig_bytes_saved(void)
+{
+    return acct_info.xbzrle_bytes_saved;
+}
+
+int64_t xbzrle_cache_resize(int64_t new_size)
+{
+    if (new_size < TARGET_PAGE_SIZE) {
+        return -1;
+    }
+
+    if (XBZRLE.cache != NULL) {
+        return cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) *
+            TARGET_PAGE_SIZE;
+    }
+
+    return new_size;
+}
+
+static void xbzrle_cleanup(void)
+{
+    if (XBZRLE.cache) {
+        cache_fini(XBZRLE.cache);
+        XBZRLE.cache = NULL;
+    }
+    g_free(XBZRLE.encoded_buf);
+    XBZRLE.encoded_buf = NULL;
+    g_free(XBZRLE.current_buf);
+    XBZRLE.current_buf = NULL;
+}
+
+static uint64_t bytes_transferred;
+
+/* last block written to the stream, for RAM_SAVE_FLAG_CONTINUE */
+static RAMBlock *last_sent_block;
+
+static void save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                           int flag)
+{
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+
+    qemu_put_be64(f, offset | cont | flag);
+    if (!cont) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr,
+                        strlen(block->idstr));
+        last_sent_block = block;
+    }
+}
+
+/*
+ * Sends the page as a delta against the copy in the XBZRLE cache.
+ * Returns the number of bytes sent, 0 if the page is unchanged since it was
+ * last sent, or -1 if it has to be sent in full.
+ */
+static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
+                            ram_addr_t current_addr, RAMBlock *block,
+                            ram_addr_t offset)
+{
+    int encoded_len, bytes_sent;
+    uint8_t *prev_cached_page;
+
+    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    if (!prev_cached_page) {
+        acct_info.xbzrle_cache_miss++;
+        return -1;
+    }
+    acct_info.xbzrle_cache_hit++;
+
+    /* the guest may keep writing the page, encode from a stable copy */
+    memcpy(XBZRLE.current_buf, current_data, TARGET_PAGE_SIZE);
+
+    /* a delta that is not smaller than the page itself is sent in full */
+    encoded_len = xbzrle_encode_buffer(prev_cached_page, XBZRLE.current_buf,
+                                       TARGET_PAGE_SIZE, XBZRLE.encoded_buf,
+                                       TARGET_PAGE_SIZE - 3);
+    if (encoded_len == 0) {
+        acct_info.xbzrle_bytes_saved += TARGET_PAGE_SIZE;
+        return 0;
+    } else if (encoded_len == -1) {
+        acct_info.xbzrle_overflows++;
+        return -1;
+    }
+
+    /* keep the cache identical to what the destination will have */
+    memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+
+    save_block_hdr(f, block, offset, RAM_SAVE_FLAG_XBZRLE);
+    qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
+    qemu_put_be16(f, encoded_len);
+    qemu_put_buffer(f, XBZRLE.encoded_buf, encoded_len);
+    bytes_sent = encoded_len + 1 + 2;
+
+    acct_info.xbzrle_pages++;
+    acct_info.xbzrle_bytes += bytes_sent;
+    acct_info.xbzrle_bytes_saved += TARGET_PAGE_SIZE - bytes_sent;
+
+    return bytes_sent;
+}
+
+/*
+ * Multi-threaded page compression.  The migration thread hands full pages
+ * to a pool of workers and writes their output to the stream once they are
+ * done; the threads are created when a migration starts and joined when
+ * it ends.
+ */
+
+enum {
+    COMPRESS_IDLE,      /* slot free */
+    COMPRESS_BUSY,      /* worker is compressing the page */
+    COMPRESS_DONE,      /* output ready to be written to the stream */
+};
+
+typedef struct CompressParam {
+    int state;
+    int level;
+    RAMBlock *block;
+    ram_addr_t offset;
+    ram_addr_t addr;
+    uint8_t *page;
+    uint8_t *out;
+    int out_len;
+    z_stream stream;
+    QemuThread thread;
+    QemuCond cond;
+    /* set to make the idle worker exit */
+    int quit;
+} CompressParam;
+
+static CompressParam *comp_param[MAX_COMPRESS_THREADS];
+static int comp_lock_initialized;
+/* number of threads running for the current migration, 0 if disabled */
+static int comp_nr;
+/* protects the state of all CompressParams */
+static QemuMutex comp_lock;
+static QemuCond comp_done_cond;
+
+static int do_compress_page(CompressParam *param)
+{
+    z_stream *stream = &param->stream;
+    int ret;
+
+    if (deflateReset(stream) != Z_OK) {
+        return -1;
+    }
+    stream->next_in = param->page;
+    stream->avail_in = TARGET_PAGE_SIZE;
+    stream->next_out = param->out;
+    stream->avail_out = compressBound(TARGET_PAGE_SIZE);
+
+    ret = deflate(stream, Z_FINISH);
+    if (ret != Z_STREAM_END) {
+        return -1;
+    }
+
+    return stream->next_out - param->out;
+}
+
+static void *do_data_compress(void *opaque)
+{
+    CompressParam *param = opaque;
+    int len;
+
+    qemu_mutex_lock(&comp_lock);
+    for (;;) {
+        while (param->state != COMPRESS_BUSY) {
+            if (param->quit) {
+                qemu_mutex_unlock(&comp_lock);
+                return NULL;
+            }
+            qemu_cond_wait(&param->cond, &comp_lock);
+        }
+        qemu_mutex_unlock(&comp_lock);
+
+        len = do_compress_page(param);
+
+        qemu_mutex_lock(&comp_lock);
+        param->out_len = len;
+        param->state = COMPRESS_DONE;
+        qemu_cond_signal(&comp_done_cond);
+    }
+
+    return NULL;
+}
+
+/*
+ * Stop the workers and free them.  A page that is still being compressed
+ * is finished first, its output is dropped.
+ */
+static void compress_threads_cleanup(void)
+{
+    int idx;
+
+    qemu_mutex_lock(&comp_lock);
+    for (idx = 0; idx < comp_nr; idx++) {
+        comp_param[idx]->quit = 1;
+        qemu_cond_signal(&comp_param[idx]->cond);
+    }
+    qemu_mutex_unlock(&comp_lock);
+
+    for (idx = 0; idx < comp_nr; idx++) {
+        CompressParam *param = comp_param[idx];
+
+        qemu_thread_join(&param->thread);
+        deflateEnd(&param->stream);
+        qemu_cond_destroy(&param->cond);
+        g_free(param->page);
+        g_free(param->out);
+        g_free(param);
+        comp_param[idx] = NULL;
+    }
+    comp_nr = 0;
+}
+
+static int compress_threads_setup(int nr, int level)
+{
+    int i;
+
+    if (!comp_lock_initialized) {
+        qemu_mutex_init(&comp_lock);
+        qemu_cond_init(&comp_done_cond);
+        comp_lock_initialized = 1;
+    }
+
+    for (i = 0; i < nr; i++) {
+        CompressParam *param = g_malloc0(sizeof(*param));
+
+        if (deflateInit(&param->stream, level) != Z_OK) {
+            fprintf(stderr, "Failed to initialize page compression\n");
+            g_free(param);
+            compress_threads_cleanup();
+            return -1;
+        }
+        param->level = level;
+        param->page = g_malloc(TARGET_PAGE_SIZE);
+        param->out = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        qemu_cond_init(&param->cond);
+
+        comp_param[i] = param;
+        comp_nr = i + 1;
+        qemu_thread_create(&param->thread, do_data_compress, param);
+    }
+
+    return 0;
+}
+
+static void flush_compressed_page(QEMUFile *f, CompressParam *param)
+{
+    int bytes_sent;
+
+    if (param->out_len < 0 || param->out_len >= TARGET_PAGE_SIZE) {
+        /* incompressible, send as it is */
+        save_block_hdr(f, param->block, param->offset, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, param->page, TARGET_PAGE_SIZE);
+        bytes_sent = TARGET_PAGE_SIZE;
+    } else {
+        save_block_hdr(f, param->block, param->offset,
+                       RAM_SAVE_FLAG_COMPRESS_PAGE);
+        qemu_put_be32(f, param->out_len);
+        qemu_put_buffer(f, param->out, param->out_len);
+        bytes_sent = param->out_len + 4;
+    }
+    bytes_transferred += bytes_sent;
+
+    qemu_mutex_lock(&comp_lock);
+    param->state = COMPRESS_IDLE;
+    qemu_mutex_unlock(&comp_lock);
+}
+
+static void compress_page_with_threads(QEMUFile *f, RAMBlock *block,
+                                       ram_addr_t offset, ram_addr_t addr,
+                                       const uint8_t *p)
+{
+    CompressParam *param = NULL;
+    int idx;
+
+    qemu_mutex_lock(&comp_lock);
+    while (!param) {
+        for (idx = 0; idx < comp_nr; idx++) {
+            if (comp_param[idx]->state == COMPRESS_IDLE) {
+                param = comp_param[idx];
+                break;
+            }
+        }
+        if (param) {
+            break;
+        }
+        for (idx = 0; idx < comp_nr; idx++) {
+            if (comp_param[idx]->state == COMPRESS_DONE) {
+                param = comp_param[idx];
+                qemu_mutex_unlock(&comp_lock);
+                flush_compressed_page(f, param);
+                qemu_mutex_lock(&comp_lock);
+                break;
+            }
+        }
+        if (!param) {
+            qemu_cond_wait(&comp_done_cond, &comp_lock);
+        }
+    }
+
+    param->block = block;
+    param->offset = offset;
+    param->addr = addr;
+    memcpy(param->page, p, TARGET_PAGE_SIZE);
+    param->state = COMPRESS_BUSY;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&comp_lock);
+}
+
+static void flush_compressed_slot(QEMUFile *f, CompressParam *param)
+{
+    int state;
+
+    qemu_mutex_lock(&comp_lock);
+    while (param->state == COMPRESS_BUSY) {
+        qemu_cond_wait(&comp_done_cond, &comp_lock);
+    }
+    state = param->state;
+    qemu_mutex_unlock(&comp_lock);
+
+    if (state == COMPRESS_DONE) {
+        flush_compressed_page(f, param);
+    }
+}
+
+/* Write out every page still owned by the compression threads */
+static void flush_compressed_data(QEMUFile *f)
+{
+    int idx;
+
+    for (idx = 0; idx < comp_nr; idx++) {
+        flush_compressed_slot(f, comp_param[idx]);
+    }
+}
+
+/* A newer copy of addr is about to be sent, older ones must go first */
+static void flush_compressed_addr(QEMUFile *f, ram_addr_t addr)
+{
+    int idx;
+
+    for (idx = 0; idx < comp_nr; idx++) {
+        if (comp_param[idx]->addr == addr) {
+            flush_compressed_slot(f, comp_param[idx]);
+        }
+    }
+}
+
 static RAMBlock *last_block;
 static ram_addr_t last_offset;
+/* number of times ram_save_block wrapped around to the first block */
+static int ram_passes;
+
+/* zero pages are left out of the first pass, needs a version 5 stream */
+static int ram_zero_skip;
 
+/*
+ * Sends the next dirty page.  Returns the number of pages handled, 0 if
+ * there are no dirty pages left; bytes_transferred is updated as the data
+ * reaches the stream.
+ */
 static int ram_save_block(QEMUFile *f)
 {
     RAMBlock *block = last_block;
     ram_addr_t offset = last_offset;
+    RAMBlock *start_block;
+    ram_addr_t start_offset = offset;
     ram_addr_t current_addr;
-    int bytes_sent = 0;
+    int complete_round = 0;
+    int pages = 0;
 
     if (!block)
         block = QLIST_FIRST(&ram_list.blocks);
+    start_block = block;
 
-    current_addr = block->offset + offset;
+    for (;;) {
+        /* skip clean pages a bitmap word at a time */
+        current_addr = cpu_physical_memory_find_next_dirty(
+            block->offset + offset, block->offset + block->length,
+            MIGRATION_DIRTY_FLAG);
+        offset = current_addr - block->offset;
 
-    do {
-        if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
+        if (complete_round && block == start_block && offset >= start_offset) {
+            break;
+        }
+
+        if (offset >= block->length) {
+            offset = 0;
+            block = QLIST_NEXT(block, next);
+            if (!block) {
+                block = QLIST_FIRST(&ram_list.blocks);
+                complete_round = 1;
+                ram_passes++;
+            }
+        } else {
             uint8_t *p;
-            int cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+            uint8_t ch;
+            int bytes_sent;
+            int ret;
 
             cpu_physical_memory_reset_dirty(current_addr,
                                             current_addr + TARGET_PAGE_SIZE,
                                             MIGRATION_DIRTY_FLAG);
 
             p = block->host + offset;
+            ch = *p;
+
+            if (comp_nr) {
+                flush_compressed_addr(f, current_addr);
+            }
 
-            if (is_dup_page(p, *p)) {
-                qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_COMPRESS);
-                if (!cont) {
-                    qemu_put_byte(f, strlen(block->idstr));
-                    qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                    strlen(block->idstr));
+            if (ram_zero_skip && ch == 0 && is_zero_page(p)) {
+                /*
+                 * The destination discards its RAM before the bulk stage,
+                 * see ram_discard_all(), so zero pages need not be sent
+                 * until they have been dirtied once.
+                 */
+                if (ram_passes > 0) {
+                    save_block_hdr(f, block, offset, RAM_SAVE_FLAG_ZERO);
+                    acct_info.dup_pages++;
+                } else {
+                    acct_info.skipped_pages++;
+                }
+                pages = 1;
+                if (XBZRLE.cache) {
+                    uint8_t *cached = get_cached_data(XBZRLE.cache,
+                                                      current_addr);
+                    if (cached) {
+                        memset(cached, 0, TARGET_PAGE_SIZE);
+                    }
+                }
+            } else if (is_dup_page(p, ch)) {
+                save_block_hdr(f, block, offset, RAM_SAVE_FLAG_COMPRESS);
+                qemu_put_byte(f, ch);
+                bytes_transferred += 1;
+                acct_info.dup_pages++;
+                pages = 1;
+                if (XBZRLE.cache) {
+                    uint8_t *cached = get_cached_data(XBZRLE.cache,
+                                                      current_addr);
+                    if (cached) {
+                        memset(cached, ch, TARGET_PAGE_SIZE);
+                    }
                 }
-                qemu_put_byte(f, *p);
-                bytes_sent = 1;
             } else {
-                qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_PAGE);
-                if (!cont) {
-                    qemu_put_byte(f, strlen(block->idstr));
-                    qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                    strlen(block->idstr));
+                bytes_sent = -1;
+                if (XBZRLE.cache) {
+                    bytes_sent = save_xbzrle_page(f, p, current_addr, block,
+                                                  offset);
+                }
+                if (bytes_sent > 0) {
+                    bytes_transferred += bytes_sent;
+                    pages = 1;
+                } else if (bytes_sent < 0) {
+                    if (XBZRLE.cache) {
+                        /* send the cached copy so both sides agree on it */
+                        p = cache_insert(XBZRLE.cache, current_addr, p);
+                    }
+                    if (comp_nr) {
+                        compress_page_with_threads(f, block, offset,
+                                                   current_addr, p);
+                    } else if (ram_channels_active() &&
+                               (ret = ram_channels_send_page(f, block, offset,
+                                                             p)) <= 0) {
+                        if (ret < 0) {
+                            qemu_file_set_error(f);
+                        }
+                        bytes_transferred += TARGET_PAGE_SIZE;
+                    } else {
+                        /* no data channels, or all of them are full */
+                        save_block_hdr(f, block, offset, RAM_SAVE_FLAG_PAGE);
+                        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+                        bytes_transferred += TARGET_PAGE_SIZE;
+                    }
+                    acct_info.norm_pages++;
+                    pages = 1;
                 }
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                bytes_sent = TARGET_PAGE_SIZE;
             }
 
-            break;
-        }
-
-        offset += TARGET_PAGE_SIZE;
-        if (offset >= block->length) {
-            offset = 0;
-            block = QLIST_NEXT(block, next);
-            if (!block)
-                block = QLIST_FIRST(&ram_list.blocks);
+            /* an unchanged page was skipped, keep looking for a dirty one */
+            if (pages) {
+                break;
+            }
         }
-
-        current_addr = block->offset + offset;
-
-    } while (current_addr != last_block->offset + last_offset);
+    }
 
     last_block = block;
     last_offset = offset;
 
-    return bytes_sent;
+    return pages;
 }
 
-static uint64_t bytes_transferred;
-
 static ram_addr_t ram_save_remaining(void)
 {
     RAMBlock *block;
     ram_addr_t count = 0;
 
     QLIST_FOREACH(block, &ram_list.blocks, next) {
-        ram_addr_t addr;
-        for (addr = block->offset; addr < block->offset + block->length;
-             addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG)) {
-                count++;
+        ram_addr_t end = block->offset + block->length;
+        ram_addr_t addr = block->offset;
+
+        for (;;) {
+            addr = cpu_physical_memory_find_next_dirty(addr, end,
+                                                       MIGRATION_DIRTY_FLAG);
+            if (addr >= end) {
+                break;
             }
+            count++;
+            addr += TARGET_PAGE_SIZE;
         }
     }
 
@@ -248,15 +793,149 @@ static void sort_ram_list(void)
     g_free(blocks);
 }
 
+/*
+ * Tells the destination which pages are still to come after the switch
+ * to post-copy: for each RAMBlock with dirty pages its idstr followed by
+ * one bit per page.  A zero length idstr ends the list.
+ */
+static void ram_save_postcopy_bitmap(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        ram_addr_t i, npages = block->length >> TARGET_PAGE_BITS;
+        ram_addr_t end = block->offset + block->length;
+        ram_addr_t addr = block->offset;
+        uint8_t *bitmap = g_malloc0((npages + 7) / 8);
+        int dirty = 0;
+
+        for (;;) {
+            addr = cpu_physical_memory_find_next_dirty(addr, end,
+                                                       MIGRATION_DIRTY_FLAG);
+            if (addr >= end) {
+                break;
+            }
+            i = (addr - block->offset) >> TARGET_PAGE_BITS;
+            bitmap[i / 8] |= 1 << (i % 8);
+            dirty = 1;
+            addr += TARGET_PAGE_SIZE;
+        }
+
+        if (dirty) {
+            qemu_put_byte(f, strlen(block->idstr));
+            qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+            qemu_put_buffer(f, bitmap, (npages + 7) / 8);
+        }
+        g_free(bitmap);
+    }
+
+    qemu_put_byte(f, 0);
+}
+
+/* auto-converge: throttle steps and how often the dirty rate is checked */
+#define THROTTLE_PCT_INITIAL   20
+#define THROTTLE_PCT_INCREMENT 10
+#define THROTTLE_PERIOD_MS     1000
+
+static struct {
+    /* dirty pages left at the end of the last iteration */
+    uint64_t last_remaining;
+    /* pages dirtied and bytes sent since the start of the period */
+    uint64_t dirty_pages;
+    uint64_t bytes_xfer_start;
+    int64_t period_start;
+    /* consecutive periods in which the dirty rate was too high */
+    int dirty_rate_high_cnt;
+} throttle;
+
+static void ram_throttle_reset(void)
+{
+    memset(&throttle, 0, sizeof(throttle));
+    throttle.period_start = qemu_get_clock_ms(rt_clock);
+}
+
+/*
+ * Called after each sync of the dirty bitmap with the number of dirty
+ * pages.  If the guest dirties memory faster than half the rate at which it
+ * is sent, for two periods in a row, the vCPUs are throttled some more.
+ */
+static void ram_throttle_check(uint64_t remaining)
+{
+    int64_t now = qemu_get_clock_ms(rt_clock);
+    uint64_t bytes_xfer;
+
+    if (remaining > throttle.last_remaining) {
+        throttle.dirty_pages += remaining - throttle.last_remaining;
+    }
+
+    if (now < throttle.period_start + THROTTLE_PERIOD_MS) {
+        return;
+    }
+
+    bytes_xfer = bytes_transferred - throttle.bytes_xfer_start;
+    if (throttle.dirty_pages * TARGET_PAGE_SIZE > bytes_xfer / 2) {
+        if (++throttle.dirty_rate_high_cnt >= 2) {
+            int pct = cpu_throttle_get_percentage();
+
+            throttle.dirty_rate_high_cnt = 0;
+            cpu_throttle_set(pct ? pct + THROTTLE_PCT_INCREMENT :
+                             THROTTLE_PCT_INITIAL);
+        }
+    } else {
+        throttle.dirty_rate_high_cnt = 0;
+    }
+
+    throttle.period_start = now;
+    throttle.dirty_pages = 0;
+    throttle.bytes_xfer_start = bytes_transferred;
+}
+
+/* Called after each sync of the dirty bitmap with the number of dirty pages */
+static void ram_dirty_rate_update(uint64_t remaining)
+{
+    int64_t now = qemu_get_clock_ms(rt_clock);
+    uint64_t dirtied = 0;
+
+    if (remaining > throttle.last_remaining) {
+        dirtied = remaining - throttle.last_remaining;
+    }
+    if (now > acct_info.sync_time) {
+        acct_info.dirty_pages_rate = dirtied * 1000 /
+                                     (now - acct_info.sync_time);
+    }
+    acct_info.sync_time = now;
+    acct_info.iterations++;
+}
+
+/*
+ * Zero page skipping, XBZRLE, compression and data channels need a
+ * version 5 stream.
+ * Without them keep writing version 4, which older destinations can load.
+ */
+void ram_set_params(int blk_enable, int shared, void *opaque)
+{
+    ram_zero_skip = migrate_use_zero_skip();
+    savevm_set_save_version("ram", 0,
+                            ram_zero_skip || migrate_use_xbzrle() ||
+                            migrate_use_compression() ||
+                            ram_channels_active() ? 5 : 4);
+}
+
 int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 {
-    ram_addr_t addr;
     uint64_t bytes_transferred_last;
     double bwidth = 0;
     uint64_t expected_time = 0;
+    int i;
 
     if (stage < 0) {
         cpu_physical_memory_set_dirty_tracking(0);
+        xbzrle_cleanup();
+        if (comp_nr) {
+            compress_threads_cleanup();
+        }
         return 0;
     }
 
@@ -265,22 +944,57 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
         return 0;
     }
 
+    if (stage >= 2) {
+        uint64_t remaining = ram_save_remaining();
+
+        ram_dirty_rate_update(remaining);
+        if (stage == 2 && migrate_use_auto_converge()) {
+            ram_throttle_check(remaining);
+        }
+    }
+
     if (stage == 1) {
         RAMBlock *block;
         bytes_transferred = 0;
         last_block = NULL;
         last_offset = 0;
+        last_sent_block = NULL;
+        ram_passes = 0;
+        ram_throttle_reset();
         sort_ram_list();
 
-        /* Make sure all dirty bits are set */
-        QLIST_FOREACH(block, &ram_list.blocks, next) {
-            for (addr = block->offset; addr < block->offset + block->length;
-                 addr += TARGET_PAGE_SIZE) {
-                if (!cpu_physical_memory_get_dirty(addr,
-                                                   MIGRATION_DIRTY_FLAG)) {
-                    cpu_physical_memory_set_dirty(addr);
-                }
+        if (comp_nr) {
+            /* left over from a migration that failed */
+            compress_threads_cleanup();
+        }
+        if (migrate_use_compression() &&
+            compress_threads_setup(migrate_compress_threads(),
+                                   migrate_compress_level()) < 0) {
+            qemu_file_set_error(f);
+            return 0;
+        }
+
+        xbzrle_cleanup();
+        memset(&acct_info, 0, sizeof(acct_info));
+        acct_info.sync_time = qemu_get_clock_ms(rt_clock);
+        acct_info.iterations = 1;
+        if (migrate_use_xbzrle()) {
+            XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
+                                      TARGET_PAGE_SIZE,
+                                      TARGET_PAGE_SIZE);
+            if (!XBZRLE.cache) {
+                fprintf(stderr, "Error creating cache\n");
+                qemu_file_set_error(f);
+                return 0;
             }
+            XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
+            XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
+        }
+
+        /* Make sure all dirty bits are set */
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            cpu_physical_memory_set_dirty_range(block->offset, block->length,
+                                                MIGRATION_DIRTY_FLAG);
         }
 
         /* Enable dirty memory tracking */
@@ -298,16 +1012,22 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
     bytes_transferred_last = bytes_transferred;
     bwidth = qemu_get_clock_ns(rt_clock);
 
+    i = 0;
     while (!qemu_file_rate_limit(f)) {
-        int bytes_sent;
-
-        bytes_sent = ram_save_block(f);
-        bytes_transferred += bytes_sent;
-        if (bytes_sent == 0) { /* no more blocks */
+        if (ram_save_block(f) == 0) { /* no more blocks */
+            break;
+        }
+        /* skipped zero pages do not count against the rate limit */
+        if ((++i & 63) == 0 &&
+            qemu_get_clock_ns(rt_clock) - bwidth > RAM_SAVE_MAX_WAIT) {
             break;
         }
     }
 
+    if (comp_nr) {
+        flush_compressed_data(f);
+    }
+
     bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
     bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
 
@@ -318,23 +1038,117 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
     }
 
     /* try transferring iterative blocks of memory */
-    if (stage == 3) {
-        int bytes_sent;
-
+    if (stage == 3 && migrate_in_postcopy()) {
+        /* the rest is sent after the destination is running */
+        if (comp_nr) {
+            flush_compressed_data(f);
+            compress_threads_cleanup();
+        }
+        ram_save_postcopy_bitmap(f);
+        cpu_physical_memory_set_dirty_tracking(0);
+        xbzrle_cleanup();
+    } else if (stage == 3) {
         /* flush all remaining blocks regardless of rate limiting */
-        while ((bytes_sent = ram_save_block(f)) != 0) {
-            bytes_transferred += bytes_sent;
+        while (ram_save_block(f) != 0) {
+            /* nothing */
+        }
+        if (comp_nr) {
+            flush_compressed_data(f);
+            compress_threads_cleanup();
         }
         cpu_physical_memory_set_dirty_tracking(0);
+        xbzrle_cleanup();
+    }
+
+    if (ram_channels_active()) {
+        /* the pages on the data channels must land before what follows */
+        qemu_put_be64(f, RAM_SAVE_FLAG_CHANNELS);
+        ram_channels_sync(f);
+        if (stage == 3 && ram_channels_finish() < 0) {
+            qemu_file_set_error(f);
+        }
     }
 
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
-    expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+    throttle.last_remaining = ram_save_remaining();
+    expected_time = throttle.last_remaining * TARGET_PAGE_SIZE / bwidth;
+    acct_info.expected_downtime = expected_time / 1000000;
+
+    if (stage == 2 && migrate_use_postcopy() &&
+        ram_passes >= POSTCOPY_PRECOPY_PASSES) {
+        return 1;
+    }
 
     return (stage == 2) && (expected_time <= migrate_max_downtime());
 }
 
+/*
+ * Sends the page at offset in block idstr on behalf of the destination,
+ * which faulted on it.  The page is sent even if it is clean: zero pages
+ * may have been dropped by the destination during the precopy phase.
+ */
+int ram_postcopy_send_page(QEMUFile *f, const char *idstr, uint64_t offset)
+{
+    RAMBlock *block;
+    ram_addr_t current_addr;
+    uint8_t *p;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(idstr, block->idstr, sizeof(block->idstr))) {
+            break;
+        }
+    }
+    if (!block || offset >= block->length || (offset & ~TARGET_PAGE_MASK)) {
+        fprintf(stderr, "Invalid post-copy page request %s:0x%" PRIx64 "\n",
+                idstr, offset);
+        return -EINVAL;
+    }
+
+    current_addr = block->offset + offset;
+    cpu_physical_memory_reset_dirty(current_addr,
+                                    current_addr + TARGET_PAGE_SIZE,
+                                    MIGRATION_DIRTY_FLAG);
+
+    p = block->host + offset;
+    if (ram_zero_skip && *p == 0 && is_zero_page(p)) {
+        save_block_hdr(f, block, offset, RAM_SAVE_FLAG_ZERO);
+        acct_info.dup_pages++;
+    } else if (is_dup_page(p, *p)) {
+        save_block_hdr(f, block, offset, RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *p);
+        bytes_transferred += 1;
+        acct_info.dup_pages++;
+    } else {
+        save_block_hdr(f, block, offset, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        bytes_transferred += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+
+    /* the guest is waiting for this page */
+    qemu_fflush(f);
+
+    return qemu_file_has_error(f) ? -EIO : 0;
+}
+
+/*
+ * Pushes the pages that were still dirty when the destination took over.
+ * Returns 1 once all of them are sent, 0 if there are more and negative on
+ * error.
+ */
+int ram_postcopy_push(QEMUFile *f)
+{
+    while (!qemu_file_rate_limit(f)) {
+        if (ram_save_block(f) == 0) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+            return 1;
+        }
+    }
+
+    return qemu_file_has_error(f) ? -EIO : 0;
+}
+
 static inline void *host_from_stream_offset(QEMUFile *f,
                                             ram_addr_t offset,
                                             int flags)
@@ -365,15 +1179,311 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     return NULL;
 }
 
-int ram_load(QEMUFile *f, void *opaque, int version_id)
+static int load_xbzrle(QEMUFile *f, void *host)
 {
-    ram_addr_t addr;
-    int flags;
+    uint8_t xh_flags;
+    uint16_t xh_len;
 
-    if (version_id < 3 || version_id > 4) {
-        return -EINVAL;
+    if (!XBZRLE.decoded_buf) {
+        XBZRLE.decoded_buf = g_malloc(TARGET_PAGE_SIZE);
+    }
+
+    xh_flags = qemu_get_byte(f);
+    xh_len = qemu_get_be16(f);
+
+    if (xh_flags != ENCODING_FLAG_XBZRLE) {
+        fprintf(stderr, "Failed to load XBZRLE page - wrong compression!\n");
+        return -1;
+    }
+
+    if (xh_len > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load XBZRLE page - len overflow!\n");
+        return -1;
+    }
+
+    qemu_get_buffer(f, XBZRLE.decoded_buf, xh_len);
+
+    /* decode RLE, the delta applies on top of the page already received */
+    if (xbzrle_decode_buffer(XBZRLE.decoded_buf, xh_len, host,
+                             TARGET_PAGE_SIZE) == -1) {
+        fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Multi-threaded page decompression, the counterpart of the compression
+ * threads.  Pages are inflated straight into guest memory; any other
+ * update of a page waits for a pending decompression of that page first.
+ * The threads are created for the first compressed page of a ram_load and
+ * joined when it returns.
+ */
+
+typedef struct DecompressParam {
+    bool busy;
+    void *des;
+    uint8_t *compbuf;
+    int len;
+    z_stream stream;
+    QemuThread thread;
+    QemuCond cond;
+    /* set to make the idle worker exit */
+    bool quit;
+} DecompressParam;
+
+static DecompressParam *decomp_param[MAX_COMPRESS_THREADS];
+static int decomp_lock_initialized;
+/* number of threads running for the current ram_load, 0 if none yet */
+static int decomp_nr;
+static int decomp_error;
+/* protects the state of all DecompressParams and decomp_error */
+static QemuMutex decomp_lock;
+static QemuCond decomp_done_cond;
+
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+    z_stream *stream = &param->stream;
+    int ret;
+
+    qemu_mutex_lock(&decomp_lock);
+    for (;;) {
+        while (!param->busy) {
+            if (param->quit) {
+                qemu_mutex_unlock(&decomp_lock);
+                return NULL;
+            }
+            qemu_cond_wait(&param->cond, &decomp_lock);
+        }
+        qemu_mutex_unlock(&decomp_lock);
+
+        ret = inflateReset(stream);
+        if (ret == Z_OK) {
+            stream->next_in = param->compbuf;
+            stream->avail_in = param->len;
+            stream->next_out = param->des;
+            stream->avail_out = TARGET_PAGE_SIZE;
+            ret = inflate(stream, Z_FINISH);
+            if (ret == Z_STREAM_END && stream->avail_out != 0) {
+                ret = Z_DATA_ERROR;
+            }
+        }
+
+        qemu_mutex_lock(&decomp_lock);
+        if (ret != Z_STREAM_END) {
+            decomp_error = 1;
+        }
+        param->busy = false;
+        qemu_cond_signal(&decomp_done_cond);
+    }
+
+    return NULL;
+}
+
+/* Stop the workers and free them, pending pages are decompressed first */
+static void decompress_threads_cleanup(void)
+{
+    int idx;
+
+    qemu_mutex_lock(&decomp_lock);
+    for (idx = 0; idx < decomp_nr; idx++) {
+        decomp_param[idx]->quit = true;
+        qemu_cond_signal(&decomp_param[idx]->cond);
+    }
+    qemu_mutex_unlock(&decomp_lock);
+
+    for (idx = 0; idx < decomp_nr; idx++) {
+        DecompressParam *param = decomp_param[idx];
+
+        qemu_thread_join(&param->thread);
+        inflateEnd(&param->stream);
+        qemu_cond_destroy(&param->cond);
+        g_free(param->compbuf);
+        g_free(param);
+        decomp_param[idx] = NULL;
+    }
+    decomp_nr = 0;
+}
+
+static int decompress_threads_setup(int nr)
+{
+    int i;
+
+    if (!decomp_lock_initialized) {
+        qemu_mutex_init(&decomp_lock);
+        qemu_cond_init(&decomp_done_cond);
+        decomp_lock_initialized = 1;
+    }
+
+    decomp_error = 0;
+    for (i = 0; i < nr; i++) {
+        DecompressParam *param = g_malloc0(sizeof(*param));
+
+        if (inflateInit(&param->stream) != Z_OK) {
+            fprintf(stderr, "Failed to initialize page decompression\n");
+            g_free(param);
+            decompress_threads_cleanup();
+            return -1;
+        }
+        param->compbuf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        qemu_cond_init(&param->cond);
+        decomp_param[i] = param;
+        decomp_nr = i + 1;
+        qemu_thread_create(&param->thread, do_data_decompress, param);
+    }
+
+    return 0;
+}
+
+static void decompress_data_with_threads(QEMUFile *f, void *host, int len)
+{
+    DecompressParam *param = NULL;
+    int idx;
+
+    qemu_mutex_lock(&decomp_lock);
+    while (!param) {
+        for (idx = 0; idx < decomp_nr; idx++) {
+            if (!decomp_param[idx]->busy) {
+                param = decomp_param[idx];
+                break;
+            }
+        }
+        if (!param) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_lock);
+        }
+    }
+    qemu_mutex_unlock(&decomp_lock);
+
+    /* only this thread hands out work, the slot stays ours */
+    qemu_get_buffer(f, param->compbuf, len);
+    param->des = host;
+    param->len = len;
+
+    qemu_mutex_lock(&decomp_lock);
+    param->busy = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&decomp_lock);
+}
+
+/* Waits for pending decompressions, of host only if non-NULL */
+static int wait_for_decompress(void *host)
+{
+    int idx, ret;
+
+    qemu_mutex_lock(&decomp_lock);
+    for (idx = 0; idx < decomp_nr; idx++) {
+        if (host && decomp_param[idx]->des != host) {
+            continue;
+        }
+        while (decomp_param[idx]->busy) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_lock);
+        }
+    }
+    ret = decomp_error ? -EIO : 0;
+    qemu_mutex_unlock(&decomp_lock);
+
+    return ret;
+}
+
+/*
+ * Drops the pages the source will send after the switch to post-copy, so
+ * that the guest faults on them, and starts catching those faults.
+ */
+static int ram_load_postcopy_bitmap(QEMUFile *f)
+{
+    char id[256];
+    uint8_t len;
+
+    if (kvm_enabled() && !kvm_has_sync_mmu()) {
+        fprintf(stderr, "Post-copy migration needs KVM synchronous MMU\n");
+        return -ENOTSUP;
+    }
+
+    /* decompressed data must not land in pages that are being dropped */
+    if (decomp_nr && wait_for_decompress(NULL) < 0) {
+        return -EIO;
+    }
+
+    while ((len = qemu_get_byte(f)) != 0) {
+        RAMBlock *block;
+        ram_addr_t i, start, npages;
+        uint8_t *bitmap;
+
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block) {
+            fprintf(stderr, "Can't find block %s!\n", id);
+            return -EINVAL;
+        }
+
+        npages = block->length >> TARGET_PAGE_BITS;
+        bitmap = g_malloc((npages + 7) / 8);
+        qemu_get_buffer(f, bitmap, (npages + 7) / 8);
+
+        for (i = 0; i < npages; i++) {
+            if (!(bitmap[i / 8] & (1 << (i % 8)))) {
+                continue;
+            }
+            start = i;
+            while (i + 1 < npages &&
+                   (bitmap[(i + 1) / 8] & (1 << ((i + 1) % 8)))) {
+                i++;
+            }
+            qemu_madvise(block->host + (start << TARGET_PAGE_BITS),
+                         (i - start + 1) << TARGET_PAGE_BITS,
+                         QEMU_MADV_DONTNEED);
+        }
+        g_free(bitmap);
+    }
+
+    if (qemu_file_has_error(f)) {
+        return -EIO;
     }
 
+    return postcopy_ram_incoming_init(migration_incoming_return_fd());
+}
+
+/*
+ * In version 5 streams zero pages may only be sent once they have been
+ * dirtied, so anything the destination itself put in RAM (ROMs, -kernel)
+ * must go.
+ */
+static void ram_discard_all(void)
+{
+    RAMBlock *block;
+    ram_addr_t offset;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+#if defined(__linux__) && !defined(TARGET_S390X)
+        /* private anonymous memory reads back as zero once discarded */
+        if (!block->fd && !(block->flags & RAM_PREALLOC_MASK) &&
+            (!kvm_enabled() || kvm_has_sync_mmu()) &&
+            qemu_madvise(block->host, block->length,
+                         QEMU_MADV_DONTNEED) == 0) {
+            continue;
+        }
+#endif
+        for (offset = 0; offset < block->length; offset += TARGET_PAGE_SIZE) {
+            if (!is_zero_page(block->host + offset)) {
+                memset(block->host + offset, 0, TARGET_PAGE_SIZE);
+            }
+        }
+    }
+}
+
+static int ram_load_pages(QEMUFile *f, int version_id)
+{
+    ram_addr_t addr;
+    int flags;
+
     do {
         addr = qemu_get_be64(f);
 
@@ -416,6 +1526,10 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
 
                     total_ram_bytes -= length;
                 }
+
+                if (version_id >= 5) {
+                    ram_discard_all();
+                }
             }
         }
 
@@ -431,14 +1545,42 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
                 return -EINVAL;
             }
 
+            if (decomp_nr) {
+                wait_for_decompress(host);
+            }
             ch = qemu_get_byte(f);
-            memset(host, ch, TARGET_PAGE_SIZE);
+            if (ch != 0 || !is_zero_page(host)) {
+                memset(host, ch, TARGET_PAGE_SIZE);
 #ifndef _WIN32
-            if (ch == 0 &&
-                (!kvm_enabled() || kvm_has_sync_mmu())) {
-                qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+                if (ch == 0 &&
+                    (!kvm_enabled() || kvm_has_sync_mmu())) {
+                    qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+                }
+#endif
+            }
+        } else if (flags & RAM_SAVE_FLAG_ZERO) {
+            void *host;
+
+            if (version_id < 5) {
+                return -EINVAL;
+            }
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+
+            if (decomp_nr) {
+                wait_for_decompress(host);
             }
+            /* do not touch pages that are zero already */
+            if (!is_zero_page(host)) {
+                memset(host, 0, TARGET_PAGE_SIZE);
+#ifndef _WIN32
+                if (!kvm_enabled() || kvm_has_sync_mmu()) {
+                    qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+                }
 #endif
+            }
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
             void *host;
 
@@ -447,7 +1589,65 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
             else
                 host = host_from_stream_offset(f, addr, flags);
 
+            if (decomp_nr) {
+                wait_for_decompress(host);
+            }
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
+            void *host;
+
+            if (version_id < 5) {
+                return -EINVAL;
+            }
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+
+            if (decomp_nr) {
+                wait_for_decompress(host);
+            }
+            if (load_xbzrle(f, host) < 0) {
+                return -EINVAL;
+            }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host;
+            int len;
+
+            if (version_id < 5) {
+                return -EINVAL;
+            }
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+
+            len = qemu_get_be32(f);
+            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+                fprintf(stderr, "Invalid compressed page length %d\n", len);
+                return -EINVAL;
+            }
+
+            if (!decomp_nr &&
+                decompress_threads_setup(migrate_decompress_threads()) < 0) {
+                return -EINVAL;
+            }
+            wait_for_decompress(host);
+            decompress_data_with_threads(f, host, len);
+        } else if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            if (version_id == 3) {
+                return -EINVAL;
+            }
+            if (ram_load_postcopy_bitmap(f) < 0) {
+                return -EINVAL;
+            }
+        } else if (flags & RAM_SAVE_FLAG_CHANNELS) {
+            if (version_id < 5) {
+                return -EINVAL;
+            }
+            if (ram_channels_load_sync(f) < 0) {
+                return -EINVAL;
+            }
         }
         if (qemu_file_has_error(f)) {
             return -EIO;
@@ -457,6 +1657,97 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
     return 0;
 }
 
+int ram_load(QEMUFile *f, void *opaque, int version_id)
+{
+    int ret;
+
+    if (version_id < 3 || version_id > 5) {
+        return -EINVAL;
+    }
+
+    ret = ram_load_pages(f, version_id);
+
+    g_free(XBZRLE.decoded_buf);
+    XBZRLE.decoded_buf = NULL;
+
+    /* guest memory must be complete before the devices are loaded */
+    if (decomp_nr) {
+        if (wait_for_decompress(NULL) < 0 && ret == 0) {
+            fprintf(stderr, "Failed to decompress RAM page\n");
+            ret = -EIO;
+        }
+        decompress_threads_cleanup();
+    }
+
+    return ret;
+}
+
+/*
+ * Receives the pages sent after the switch to post-copy, either on request
+ * or pushed by the source, up to RAM_SAVE_FLAG_EOS.  Runs in its own thread
+ * while the guest is running.
+ */
+int ram_postcopy_incoming_load(QEMUFile *f)
+{
+    uint8_t *buf = g_malloc(TARGET_PAGE_SIZE);
+    ram_addr_t addr;
+    int flags, ret = 0;
+
+    do {
+        void *host;
+        uint8_t ch;
+
+        addr = qemu_get_be64(f);
+
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                ret = -EINVAL;
+                break;
+            }
+
+            ch = qemu_get_byte(f);
+            if (ch == 0) {
+                ret = postcopy_place_zero_page(host);
+            } else {
+                memset(buf, ch, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(host, buf);
+            }
+        } else if (flags & RAM_SAVE_FLAG_ZERO) {
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                ret = -EINVAL;
+                break;
+            }
+
+            ret = postcopy_place_zero_page(host);
+        } else if (flags & RAM_SAVE_FLAG_PAGE) {
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                ret = -EINVAL;
+                break;
+            }
+
+            qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+            ret = postcopy_place_page(host, buf);
+        } else if (!(flags & RAM_SAVE_FLAG_EOS)) {
+            fprintf(stderr, "Unexpected flags 0x%x in post-copy stream\n",
+                    flags);
+            ret = -EINVAL;
+        }
+
+        if (ret == 0 && qemu_file_has_error(f)) {
+            ret = -EIO;
+        }
+    } while (ret == 0 && !(flags & RAM_SAVE_FLAG_EOS));
+
+    g_free(buf);
+    return ret;
+}
+
 void qemu_service_io(void)
 {
     qemu_notify_event();
@@ -27,6 +27,7 @@
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
+#define BLK_MIG_FLAG_ZERO_BLOCK         0x08
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
@@ -68,6 +69,7 @@ typedef struct BlkMigBlock {
 typedef struct BlkMigState {
     int blk_enable;
     int shared_base;
+    int zero_blocks;
     QSIMPLEQ_HEAD(bmds_list, BlkMigDevState) bmds_list;
     QSIMPLEQ_HEAD(blk_list, BlkMigBlock) blk_list;
     int submitted;
@@ -86,17 +88,25 @@ static BlkMigState block_mig_state;
 static void blk_send(QEMUFile *f, BlkMigBlock * blk)
 {
     int len;
+    uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
+
+    /* zero blocks go without their data */
+    if (block_mig_state.zero_blocks &&
+        buffer_is_zero(blk->buf, blk->nr_sectors * BDRV_SECTOR_SIZE)) {
+        flags |= BLK_MIG_FLAG_ZERO_BLOCK;
+    }
 
     /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | BLK_MIG_FLAG_DEVICE_BLOCK);
+    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS) | flags);
 
     /* device name */
     len = strlen(blk->bmds->bs->device_name);
     qemu_put_byte(f, len);
     qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
 
-    qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    if (!(flags & BLK_MIG_FLAG_ZERO_BLOCK)) {
+        qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    }
 }
 
 int blk_mig_active(void)
@@ -315,8 +325,19 @@ static void init_blk_migration_it(void *opaque, BlockDriverState *bs)
     }
 }
 
-static void init_blk_migration(Monitor *mon, QEMUFile *f)
+static int init_blk_migration(Monitor *mon, QEMUFile *f)
 {
+    BlockDriverState *bs = NULL;
+
+    /* Devices owned by a block job cannot be tracked by migration as well */
+    while ((bs = bdrv_next(bs))) {
+        if (!bdrv_is_read_only(bs) && bdrv_in_use(bs)) {
+            monitor_printf(mon, "Device %s is in use, cannot migrate it\n",
+                           bs->device_name);
+            return -EBUSY;
+        }
+    }
+
     block_mig_state.submitted = 0;
     block_mig_state.read_done = 0;
     block_mig_state.transferred = 0;
@@ -327,6 +348,7 @@ static void init_blk_migration(Monitor *mon, QEMUFile *f)
     block_mig_state.reads = 0;
 
     bdrv_iterate(init_blk_migration_it, mon);
+    return 0;
 }
 
 static int blk_mig_save_bulked_block(Monitor *mon, QEMUFile *f)
@@ -571,7 +593,10 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
     }
 
     if (stage == 1) {
-        init_blk_migration(mon, f);
+        if (init_blk_migration(mon, f) < 0) {
+            qemu_file_set_error(f);
+            return 0;
+        }
 
         /* start track dirty blocks */
         set_dirty_tracking(1);
@@ -683,9 +708,15 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
 
-            buf = g_malloc(BLOCK_SIZE);
-
-            qemu_get_buffer(f, buf, BLOCK_SIZE);
+            if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+                if (version_id < 2) {
+                    return -EINVAL;
+                }
+                buf = g_malloc0(BLOCK_SIZE);
+            } else {
+                buf = g_malloc(BLOCK_SIZE);
+                qemu_get_buffer(f, buf, BLOCK_SIZE);
+            }
             ret = bdrv_write(bs, addr, buf, nr_sectors);
 
             g_free(buf);
@@ -719,6 +750,11 @@ static void block_set_params(int blk_enable, int shared_base, void *opaque)
 
     /* shared base means that blk_enable = 1 */
     block_mig_state.blk_enable |= shared_base;
+
+    /* zero blocks need a version 2 stream, older destinations load 1 */
+    block_mig_state.zero_blocks = migrate_use_zero_skip();
+    savevm_set_save_version("block", 0,
+                            block_mig_state.zero_blocks ? 2 : 1);
 }
 
 void blk_mig_init(void)
@@ -726,6 +762,6 @@ void blk_mig_init(void)
     QSIMPLEQ_INIT(&block_mig_state.bmds_list);
     QSIMPLEQ_INIT(&block_mig_state.blk_list);
 
-    register_savevm_live(NULL, "block", 0, 1, block_set_params,
+    register_savevm_live(NULL, "block", 0, 2, block_set_params,
                          block_save_live, NULL, block_load, &block_mig_state);
 }
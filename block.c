@@ -29,6 +29,7 @@
 #include "module.h"
 #include "qemu-objects.h"
 #include "qemu-coroutine.h"
+#include "qemu-timer.h"
 
 #ifdef CONFIG_BSD
 #include <sys/types.h>
@@ -44,6 +45,12 @@
 #include <windows.h>
 #endif
 
+typedef enum {
+    BDRV_REQ_COPY_ON_READ = 0x1,
+    BDRV_REQ_NO_THROTTLE  = 0x2,
+    BDRV_REQ_ZERO_WRITE   = 0x4,
+} BdrvRequestFlags;
+
 static BlockDriverAIOCB *bdrv_aio_readv_em(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque);
@@ -71,6 +78,16 @@ static int coroutine_fn bdrv_co_writev_em(BlockDriverState *bs,
                                          int64_t sector_num, int nb_sectors,
                                          QEMUIOVector *iov);
 static int coroutine_fn bdrv_co_flush_em(BlockDriverState *bs);
+static int coroutine_fn bdrv_co_discard_em(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors);
+static BlockDriverAIOCB *bdrv_aio_do_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
+static BlockDriverAIOCB *bdrv_aio_do_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
+static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
+                      int nb_sectors, bool is_write, BdrvRequestFlags flags);
 
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
@@ -84,6 +101,194 @@ static BlockDriverState *bs_snapshots;
 /* If non-zero, use only whitelisted block drivers */
 static int use_bdrv_whitelist;
 
+/* Set while bdrv_drain_all() pushes out requests held back by throttling */
+static bool bdrv_draining;
+
+/* throttling disk I/O limits */
+static void bdrv_block_timer(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+
+    qemu_co_queue_next(&bs->throttled_reqs);
+}
+
+static bool bdrv_io_limits_configured(BlockDriverState *bs)
+{
+    BlockIOLimit *io_limits = &bs->io_limits;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (io_limits->bps[i] || io_limits->iops[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void bdrv_io_limits_enable(BlockDriverState *bs)
+{
+    qemu_co_queue_init(&bs->throttled_reqs);
+    bs->block_timer = qemu_new_timer_ns(vm_clock, bdrv_block_timer, bs);
+    bs->slice_start = qemu_get_clock_ns(vm_clock);
+    bs->slice_end = bs->slice_start + BLOCK_IO_SLICE_TIME;
+    memset(&bs->slice_submitted, 0, sizeof(bs->slice_submitted));
+    bs->io_limits_enabled = true;
+}
+
+/* Waiting requests are restarted and will be submitted without limits */
+static void bdrv_io_limits_disable(BlockDriverState *bs)
+{
+    bs->io_limits_enabled = false;
+
+    while (qemu_co_queue_next(&bs->throttled_reqs)) {
+        /* restart all of them */
+    }
+
+    qemu_del_timer(bs->block_timer);
+    qemu_free_timer(bs->block_timer);
+    bs->block_timer = NULL;
+}
+
+static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
+                                   bool is_write, double elapsed_time,
+                                   double *wait)
+{
+    BlockIOLimit *io_limits = &bs->io_limits;
+    int64_t bps_limit;
+    double slice_time, bytes_limit, bytes_base, bytes_res;
+
+    if (io_limits->bps[BLOCK_IO_LIMIT_TOTAL]) {
+        bps_limit = io_limits->bps[BLOCK_IO_LIMIT_TOTAL];
+    } else if (io_limits->bps[is_write]) {
+        bps_limit = io_limits->bps[is_write];
+    } else {
+        *wait = 0;
+        return false;
+    }
+
+    slice_time = (double)(bs->slice_end - bs->slice_start) /
+                 get_ticks_per_sec();
+    bytes_limit = bps_limit * slice_time;
+    bytes_base = bs->slice_submitted.bytes[is_write];
+    if (io_limits->bps[BLOCK_IO_LIMIT_TOTAL]) {
+        bytes_base += bs->slice_submitted.bytes[!is_write];
+    }
+    bytes_res = (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
+
+    if (bytes_base + bytes_res <= bytes_limit) {
+        *wait = 0;
+        return false;
+    }
+
+    /* the time at which the average rate allows this request */
+    *wait = (bytes_base + bytes_res) / bps_limit - elapsed_time;
+    return true;
+}
+
+static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
+                                    double elapsed_time, double *wait)
+{
+    BlockIOLimit *io_limits = &bs->io_limits;
+    int64_t iops_limit;
+    double slice_time, ios_limit, ios_base;
+
+    if (io_limits->iops[BLOCK_IO_LIMIT_TOTAL]) {
+        iops_limit = io_limits->iops[BLOCK_IO_LIMIT_TOTAL];
+    } else if (io_limits->iops[is_write]) {
+        iops_limit = io_limits->iops[is_write];
+    } else {
+        *wait = 0;
+        return false;
+    }
+
+    slice_time = (double)(bs->slice_end - bs->slice_start) /
+                 get_ticks_per_sec();
+    ios_limit = iops_limit * slice_time;
+    ios_base = bs->slice_submitted.ios[is_write];
+    if (io_limits->iops[BLOCK_IO_LIMIT_TOTAL]) {
+        ios_base += bs->slice_submitted.ios[!is_write];
+    }
+
+    if (ios_base + 1 <= ios_limit) {
+        *wait = 0;
+        return false;
+    }
+
+    *wait = (ios_base + 1) / iops_limit - elapsed_time;
+    return true;
+}
+
+/*
+ * Checks whether a request fits into the limits.  The accounting slice is
+ * extended for as long as requests keep coming, so the limits apply to the
+ * average rate of a busy device while an idle one gets a fresh slice.
+ */
+static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
+                                  bool is_write, int64_t *wait)
+{
+    int64_t now;
+    double elapsed_time, bps_wait, iops_wait;
+    bool bps_ret, iops_ret;
+
+    now = qemu_get_clock_ns(vm_clock);
+    if (now >= bs->slice_start && now < bs->slice_end) {
+        bs->slice_end = now + BLOCK_IO_SLICE_TIME;
+    } else {
+        bs->slice_start = now;
+        bs->slice_end = now + BLOCK_IO_SLICE_TIME;
+        memset(&bs->slice_submitted, 0, sizeof(bs->slice_submitted));
+    }
+
+    elapsed_time = (double)(now - bs->slice_start) / get_ticks_per_sec();
+
+    bps_ret = bdrv_exceed_bps_limits(bs, nb_sectors, is_write, elapsed_time,
+                                     &bps_wait);
+    iops_ret = bdrv_exceed_iops_limits(bs, is_write, elapsed_time,
+                                       &iops_wait);
+    if (bps_ret || iops_ret) {
+        *wait = MAX(bps_wait, iops_wait) * get_ticks_per_sec();
+        return true;
+    }
+
+    *wait = 0;
+    return false;
+}
+
+/*
+ * Holds the calling request back until the limits allow it.  Requests are
+ * submitted in the order they arrived: whoever finds others waiting queues up
+ * behind them, and the head of the queue is woken by the timer.
+ */
+static void coroutine_fn bdrv_io_limits_intercept(BlockDriverState *bs,
+                                                  bool is_write,
+                                                  int nb_sectors)
+{
+    int64_t wait_time;
+    bool throttled = false;
+
+    if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
+        throttled = true;
+        qemu_co_queue_wait(&bs->throttled_reqs);
+    }
+
+    while (bs->io_limits_enabled && !bdrv_draining &&
+           bdrv_exceed_io_limits(bs, nb_sectors, is_write, &wait_time)) {
+        throttled = true;
+        qemu_mod_timer(bs->block_timer,
+                       wait_time + qemu_get_clock_ns(vm_clock));
+        qemu_co_queue_wait_insert_head(&bs->throttled_reqs);
+    }
+
+    if (throttled) {
+        bs->throttled_ops[is_write]++;
+    }
+    bs->slice_submitted.bytes[is_write] +=
+        (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
+    bs->slice_submitted.ios[is_write]++;
+
+    qemu_co_queue_next(&bs->throttled_reqs);
+}
+
 #ifdef _WIN32
 static int is_windows_drive_prefix(const char *filename)
 {
@@ -471,7 +676,8 @@ static int bdrv_open_common(BlockDriverState *bs, const char *filename,
      * Clear flags that are internal to the block layer before opening the
      * image.
      */
-    open_flags = flags & ~(BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING);
+    open_flags = flags & ~(BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING |
+                           BDRV_O_COPY_ON_READ);
 
     /*
      * Snapshots should be writable.
@@ -506,6 +712,11 @@ static int bdrv_open_common(BlockDriverState *bs, const char *filename,
         unlink(filename);
     }
 #endif
+
+    /* Populate the image from its backing file as the guest reads it */
+    if ((flags & BDRV_O_COPY_ON_READ) && !bs->read_only) {
+        bdrv_enable_copy_on_read(bs);
+    }
     return 0;
 
 free_and_fail:
@@ -644,8 +855,8 @@ int bdrv_open(BlockDriverState *bs, const char *filename, int flags,
         }
 
         /* backing files always opened read-only */
-        back_flags =
-            flags & ~(BDRV_O_RDWR | BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING);
+        back_flags = flags & ~(BDRV_O_RDWR | BDRV_O_SNAPSHOT |
+                               BDRV_O_NO_BACKING | BDRV_O_COPY_ON_READ);
 
         ret = bdrv_open(bs->backing_hd, backing_filename, back_flags, back_drv);
         if (ret < 0) {
@@ -667,6 +878,10 @@ int bdrv_open(BlockDriverState *bs, const char *filename, int flags,
             bs->change_cb(bs->change_opaque, CHANGE_MEDIA);
     }
 
+    if (bdrv_io_limits_configured(bs)) {
+        bdrv_io_limits_enable(bs);
+    }
+
     return 0;
 
 unlink_and_fail:
@@ -678,7 +893,15 @@ unlink_and_fail:
 
 void bdrv_close(BlockDriverState *bs)
 {
+    if (bs->io_limits_enabled) {
+        bdrv_io_limits_disable(bs);
+        qemu_aio_flush();
+    }
+
     if (bs->drv) {
+        if ((bs->open_flags & BDRV_O_COPY_ON_READ) && !bs->read_only) {
+            bdrv_disable_copy_on_read(bs);
+        }
         if (bs == bs_snapshots) {
             bs_snapshots = NULL;
         }
@@ -910,12 +1133,20 @@ int bdrv_change_backing_file(BlockDriverState *bs,
     const char *backing_file, const char *backing_fmt)
 {
     BlockDriver *drv = bs->drv;
+    int ret;
 
-    if (drv->bdrv_change_backing_file != NULL) {
-        return drv->bdrv_change_backing_file(bs, backing_file, backing_fmt);
-    } else {
+    if (drv->bdrv_change_backing_file == NULL) {
         return -ENOTSUP;
     }
+
+    ret = drv->bdrv_change_backing_file(bs, backing_file, backing_fmt);
+    if (ret == 0) {
+        pstrcpy(bs->backing_file, sizeof(bs->backing_file),
+                backing_file ? backing_file : "");
+        pstrcpy(bs->backing_format, sizeof(bs->backing_format),
+                backing_fmt ? backing_fmt : "");
+    }
+    return ret;
 }
 
 static int bdrv_check_byte_request(BlockDriverState *bs, int64_t offset,
@@ -978,6 +1209,10 @@ int bdrv_read(BlockDriverState *bs, int64_t sector_num,
         return bdrv_co_readv(bs, sector_num, nb_sectors, &qiov);
     }
 
+    if (bs->copy_on_read) {
+        return bdrv_rw_co(bs, sector_num, buf, nb_sectors, false, 0);
+    }
+
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return -EIO;
 
@@ -1037,6 +1272,11 @@ int bdrv_write(BlockDriverState *bs, int64_t sector_num,
         return bdrv_co_writev(bs, sector_num, nb_sectors, &qiov);
     }
 
+    if (bs->copy_on_read) {
+        return bdrv_rw_co(bs, sector_num, (uint8_t *)buf, nb_sectors, true,
+                          0);
+    }
+
     if (bs->read_only)
         return -EACCES;
     if (bdrv_check_request(bs, sector_num, nb_sectors))
@@ -1171,12 +1411,193 @@ int bdrv_pwrite_sync(BlockDriverState *bs, int64_t offset,
     return 0;
 }
 
-int coroutine_fn bdrv_co_readv(BlockDriverState *bs, int64_t sector_num,
-    int nb_sectors, QEMUIOVector *qiov)
+/*
+ * Requests in coroutine context are tracked so that copy-on-read never races
+ * with a write to the same clusters: while copy-on-read is enabled, both wait
+ * for overlapping requests before they start.
+ */
+struct BdrvTrackedRequest {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    bool is_write;
+    QLIST_ENTRY(BdrvTrackedRequest) list;
+    Coroutine *co;
+    CoQueue wait_queue; /* coroutines blocked on this request */
+};
+
+static void tracked_request_begin(BdrvTrackedRequest *req,
+                                  BlockDriverState *bs,
+                                  int64_t sector_num,
+                                  int nb_sectors, bool is_write)
+{
+    *req = (BdrvTrackedRequest){
+        .bs = bs,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .is_write = is_write,
+        .co = qemu_coroutine_self(),
+    };
+
+    qemu_co_queue_init(&req->wait_queue);
+
+    QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+}
+
+static void tracked_request_end(BdrvTrackedRequest *req)
+{
+    QLIST_REMOVE(req, list);
+
+    while (qemu_co_queue_next(&req->wait_queue)) {
+        /* wake up all waiters */
+    }
+}
+
+/* Widens a request to whole clusters, which copy-on-read works on */
+static void round_to_clusters(BlockDriverState *bs,
+                              int64_t sector_num, int nb_sectors,
+                              int64_t *cluster_sector_num,
+                              int *cluster_nb_sectors)
+{
+    BlockDriverInfo bdi;
+
+    if (bdrv_get_info(bs, &bdi) < 0 || bdi.cluster_size == 0) {
+        *cluster_sector_num = sector_num;
+        *cluster_nb_sectors = nb_sectors;
+    } else {
+        int64_t c = bdi.cluster_size / BDRV_SECTOR_SIZE;
+        *cluster_sector_num = sector_num - sector_num % c;
+        *cluster_nb_sectors = DIV_ROUND_UP(sector_num - *cluster_sector_num +
+                                           nb_sectors, c) * c;
+    }
+}
+
+static bool tracked_request_overlaps(BdrvTrackedRequest *req,
+                                     int64_t sector_num, int nb_sectors)
+{
+    /*        aaaa   bbbb */
+    if (sector_num >= req->sector_num + req->nb_sectors) {
+        return false;
+    }
+    /* bbbb   aaaa        */
+    if (req->sector_num >= sector_num + nb_sectors) {
+        return false;
+    }
+    return true;
+}
+
+static void coroutine_fn wait_for_overlapping_requests(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors)
+{
+    BdrvTrackedRequest *req;
+    int64_t cluster_sector_num;
+    int cluster_nb_sectors;
+    bool retry;
+
+    /* If we touch the same cluster it counts as an overlap.  This guarantees
+     * that allocating writes will be serialized and not race with each other
+     * for the same cluster.  For example, in copy-on-read it ensures that the
+     * CoR read and write operations are atomic and guest writes cannot
+     * interleave between them.
+     */
+    round_to_clusters(bs, sector_num, nb_sectors,
+                      &cluster_sector_num, &cluster_nb_sectors);
+
+    do {
+        retry = false;
+        QLIST_FOREACH(req, &bs->tracked_requests, list) {
+            if (tracked_request_overlaps(req, cluster_sector_num,
+                                         cluster_nb_sectors)) {
+                /* A nested request on the same device would deadlock here */
+                assert(qemu_coroutine_self() != req->co);
+
+                qemu_co_queue_wait(&req->wait_queue);
+                retry = true;
+                break;
+            }
+        }
+    } while (retry);
+}
+
+/*
+ * Copy-on-read is reference counted, block jobs use it internally.  Requests
+ * submitted before it was enabled are not tracked, so wait for them.
+ */
+void bdrv_enable_copy_on_read(BlockDriverState *bs)
+{
+    if (bs->copy_on_read++ == 0) {
+        qemu_aio_flush();
+    }
+}
+
+void bdrv_disable_copy_on_read(BlockDriverState *bs)
 {
+    assert(bs->copy_on_read > 0);
+    bs->copy_on_read--;
+}
+
+static int coroutine_fn bdrv_co_copy_on_readv_bounce(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    /* Perform I/O through a temporary buffer so that users who scribble over
+     * their read buffer while the operation is in progress do not end up
+     * modifying the image file.  This is critical for zero-copy guest I/O
+     * where anything might happen inside guest memory.
+     */
     BlockDriver *drv = bs->drv;
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    int64_t cluster_sector_num;
+    int cluster_nb_sectors;
+    size_t skip_bytes;
+    void *bounce_buffer;
+    int ret;
 
-    trace_bdrv_co_readv(bs, sector_num, nb_sectors);
+    /* Cover entire cluster so no additional backing file I/O is required when
+     * allocating cluster in the image file.
+     */
+    round_to_clusters(bs, sector_num, nb_sectors,
+                      &cluster_sector_num, &cluster_nb_sectors);
+
+    iov.iov_len = cluster_nb_sectors * BDRV_SECTOR_SIZE;
+    iov.iov_base = bounce_buffer = qemu_blockalign(bs, iov.iov_len);
+    qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+    ret = drv->bdrv_co_readv(bs, cluster_sector_num, cluster_nb_sectors,
+                             &bounce_qiov);
+    if (ret < 0) {
+        goto err;
+    }
+
+    ret = drv->bdrv_co_writev(bs, cluster_sector_num, cluster_nb_sectors,
+                              &bounce_qiov);
+    if (ret < 0) {
+        /* It might be okay to ignore write errors for guest requests.  If this
+         * is a deliberate copy-on-read then we don't want to ignore the error.
+         * Simply report it in all cases.
+         */
+        goto err;
+    }
+
+    skip_bytes = (sector_num - cluster_sector_num) * BDRV_SECTOR_SIZE;
+    qemu_iovec_from_buffer(qiov, bounce_buffer + skip_bytes,
+                           nb_sectors * BDRV_SECTOR_SIZE);
+
+err:
+    qemu_vfree(bounce_buffer);
+    return ret;
+}
+
+/*
+ * Handle a read request in coroutine context
+ */
+static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
+    BdrvRequestFlags flags)
+{
+    BlockDriver *drv = bs->drv;
+    BdrvTrackedRequest req;
+    int ret;
 
     if (!drv) {
         return -ENOMEDIUM;
@@ -1185,15 +1606,123 @@ int coroutine_fn bdrv_co_readv(BlockDriverState *bs, int64_t sector_num,
         return -EIO;
     }
 
-    return drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    if (bs->io_limits_enabled && !(flags & BDRV_REQ_NO_THROTTLE)) {
+        bdrv_io_limits_intercept(bs, false, nb_sectors);
+    }
+
+    if (bs->copy_on_read) {
+        flags |= BDRV_REQ_COPY_ON_READ;
+    }
+    if (flags & BDRV_REQ_COPY_ON_READ) {
+        bs->copy_on_read_in_flight++;
+        wait_for_overlapping_requests(bs, sector_num, nb_sectors);
+    }
+
+    tracked_request_begin(&req, bs, sector_num, nb_sectors, false);
+
+    bs->rd_bytes += (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
+    bs->rd_ops++;
+
+    if (flags & BDRV_REQ_COPY_ON_READ) {
+        int pnum;
+
+        ret = bdrv_co_is_allocated(bs, sector_num, nb_sectors, &pnum);
+        if (ret < 0) {
+            goto out;
+        }
+
+        if (!ret || pnum != nb_sectors) {
+            ret = bdrv_co_copy_on_readv_bounce(bs, sector_num, nb_sectors,
+                                               qiov);
+            goto out;
+        }
+    }
+
+    ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+
+out:
+    tracked_request_end(&req);
+
+    if (flags & BDRV_REQ_COPY_ON_READ) {
+        bs->copy_on_read_in_flight--;
+    }
+
+    return ret;
 }
 
-int coroutine_fn bdrv_co_writev(BlockDriverState *bs, int64_t sector_num,
+int coroutine_fn bdrv_co_readv(BlockDriverState *bs, int64_t sector_num,
     int nb_sectors, QEMUIOVector *qiov)
+{
+    trace_bdrv_co_readv(bs, sector_num, nb_sectors);
+
+    return bdrv_co_do_readv(bs, sector_num, nb_sectors, qiov, 0);
+}
+
+/*
+ * Reads through the image and writes back whatever came from the backing
+ * file, so that the range ends up allocated in bs itself.
+ */
+int coroutine_fn bdrv_co_copy_on_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    trace_bdrv_co_copy_on_readv(bs, sector_num, nb_sectors);
+
+    return bdrv_co_do_readv(bs, sector_num, nb_sectors, qiov,
+                            BDRV_REQ_COPY_ON_READ);
+}
+
+/* Largest zeroed bounce buffer used when a driver cannot zero by itself */
+#define MAX_WRITE_ZEROES_BOUNCE_SECTORS 2048
+
+static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
 
-    trace_bdrv_co_writev(bs, sector_num, nb_sectors);
+    if (drv->bdrv_co_write_zeroes) {
+        ret = drv->bdrv_co_write_zeroes(bs, sector_num, nb_sectors);
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+
+    /* Fall back to writing out zeroed buffers */
+    iov.iov_len = MIN(nb_sectors, MAX_WRITE_ZEROES_BOUNCE_SECTORS) *
+                  BDRV_SECTOR_SIZE;
+    iov.iov_base = qemu_blockalign(bs, iov.iov_len);
+    memset(iov.iov_base, 0, iov.iov_len);
+
+    ret = 0;
+    while (nb_sectors > 0) {
+        int num = MIN(nb_sectors, MAX_WRITE_ZEROES_BOUNCE_SECTORS);
+
+        iov.iov_len = num * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = drv->bdrv_co_writev(bs, sector_num, num, &qiov);
+        if (ret < 0) {
+            break;
+        }
+        sector_num += num;
+        nb_sectors -= num;
+    }
+
+    qemu_vfree(iov.iov_base);
+    return ret;
+}
+
+/*
+ * Handle a write request in coroutine context
+ */
+static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
+    BdrvRequestFlags flags)
+{
+    BlockDriver *drv = bs->drv;
+    BdrvTrackedRequest req;
+    int ret;
 
     if (!bs->drv) {
         return -ENOMEDIUM;
@@ -1205,15 +1734,130 @@ int coroutine_fn bdrv_co_writev(BlockDriverState *bs, int64_t sector_num,
         return -EIO;
     }
 
-    if (bs->dirty_bitmap) {
-        set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
+    if (bs->io_limits_enabled && !(flags & BDRV_REQ_NO_THROTTLE)) {
+        bdrv_io_limits_intercept(bs, true, nb_sectors);
+    }
+
+    if (bs->copy_on_read_in_flight) {
+        wait_for_overlapping_requests(bs, sector_num, nb_sectors);
+    }
+
+    tracked_request_begin(&req, bs, sector_num, nb_sectors, true);
+
+    bs->wr_bytes += (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
+    bs->wr_ops++;
+    if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
+        bs->wr_highest_sector = sector_num + nb_sectors - 1;
+    }
+
+    if (flags & BDRV_REQ_ZERO_WRITE) {
+        ret = bdrv_co_do_write_zeroes(bs, sector_num, nb_sectors);
+    } else {
+        ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
+    }
+
+    if (bs->dirty_bitmap) {
+        set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
+    }
+
+    tracked_request_end(&req);
+
+    return ret;
+}
+
+int coroutine_fn bdrv_co_writev(BlockDriverState *bs, int64_t sector_num,
+    int nb_sectors, QEMUIOVector *qiov)
+{
+    trace_bdrv_co_writev(bs, sector_num, nb_sectors);
+
+    return bdrv_co_do_writev(bs, sector_num, nb_sectors, qiov, 0);
+}
+
+/*
+ * Zero a range of sectors.  Drivers that know how to do it without
+ * writing out data (e.g. by deallocating clusters) implement
+ * bdrv_co_write_zeroes, all others are sent zeroed buffers.
+ */
+int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
+{
+    trace_bdrv_co_write_zeroes(bs, sector_num, nb_sectors);
+
+    return bdrv_co_do_writev(bs, sector_num, nb_sectors, NULL,
+                             BDRV_REQ_ZERO_WRITE);
+}
+
+#define NOT_DONE 0x7fffffff
+
+typedef struct RwCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    QEMUIOVector *qiov;
+    bool is_write;
+    BdrvRequestFlags flags;
+    int ret;
+} RwCo;
+
+static void coroutine_fn bdrv_rw_co_entry(void *opaque)
+{
+    RwCo *rwco = opaque;
+
+    /* the caller waits in qemu_aio_wait(), which does not run timers */
+    if (!rwco->is_write) {
+        rwco->ret = bdrv_co_do_readv(rwco->bs, rwco->sector_num,
+                                     rwco->nb_sectors, rwco->qiov,
+                                     rwco->flags | BDRV_REQ_NO_THROTTLE);
+    } else {
+        rwco->ret = bdrv_co_do_writev(rwco->bs, rwco->sector_num,
+                                      rwco->nb_sectors, rwco->qiov,
+                                      rwco->flags | BDRV_REQ_NO_THROTTLE);
+    }
+}
+
+/*
+ * Runs a synchronous request in a coroutine, so that it takes part in
+ * request tracking while copy-on-read is enabled.
+ */
+static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
+                      int nb_sectors, bool is_write, BdrvRequestFlags flags)
+{
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+    Coroutine *co;
+    RwCo rwco = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .qiov = &qiov,
+        .is_write = is_write,
+        .flags = flags,
+        .ret = NOT_DONE,
+    };
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    co = qemu_coroutine_create(bdrv_rw_co_entry);
+    qemu_coroutine_enter(co, &rwco);
+    while (rwco.ret == NOT_DONE) {
+        qemu_aio_wait();
     }
 
-    if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
-        bs->wr_highest_sector = sector_num + nb_sectors - 1;
+    return rwco.ret;
+}
+
+int bdrv_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+                      int nb_sectors)
+{
+    if (qemu_in_coroutine()) {
+        return bdrv_co_write_zeroes(bs, sector_num, nb_sectors);
     }
 
-    return drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
+    return bdrv_rw_co(bs, sector_num, NULL, nb_sectors, true,
+                      BDRV_REQ_ZERO_WRITE);
 }
 
 /**
@@ -1546,6 +2190,87 @@ BlockErrorAction bdrv_get_on_error(BlockDriverState *bs, int is_read)
     return is_read ? bs->on_read_error : bs->on_write_error;
 }
 
+/* Takes effect the next time the image is opened */
+void bdrv_set_cache_size(BlockDriverState *bs, uint64_t l2_size,
+                         uint64_t l2_coverage, uint64_t refcount_size)
+{
+    bs->l2_cache_size = l2_size;
+    bs->l2_cache_coverage = l2_coverage;
+    bs->refcount_cache_size = refcount_size;
+}
+
+/* A total limit excludes the read and write limits of the same kind */
+bool bdrv_io_limits_valid(BlockIOLimit *io_limits)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (io_limits->bps[i] < 0 || io_limits->iops[i] < 0) {
+            return false;
+        }
+    }
+
+    if (io_limits->bps[BLOCK_IO_LIMIT_TOTAL] &&
+        (io_limits->bps[BLOCK_IO_LIMIT_READ] ||
+         io_limits->bps[BLOCK_IO_LIMIT_WRITE])) {
+        return false;
+    }
+    if (io_limits->iops[BLOCK_IO_LIMIT_TOTAL] &&
+        (io_limits->iops[BLOCK_IO_LIMIT_READ] ||
+         io_limits->iops[BLOCK_IO_LIMIT_WRITE])) {
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Limits set on a closed device take effect when it is opened, an open one
+ * switches immediately.  Requests that are waiting are re-evaluated against
+ * the new limits, or submitted right away if there are none left.
+ */
+void bdrv_set_io_limits(BlockDriverState *bs, BlockIOLimit *io_limits)
+{
+    bs->io_limits = *io_limits;
+
+    if (!bs->drv) {
+        return;
+    }
+
+    if (!bdrv_io_limits_configured(bs)) {
+        if (bs->io_limits_enabled) {
+            bdrv_io_limits_disable(bs);
+        }
+    } else if (!bs->io_limits_enabled) {
+        bdrv_io_limits_enable(bs);
+    } else {
+        qemu_mod_timer(bs->block_timer, qemu_get_clock_ns(vm_clock));
+    }
+}
+
+/*
+ * Waits for all requests to complete, including the ones that are held back
+ * by I/O throttling.  Those are submitted without waiting for the limits.
+ */
+void bdrv_drain_all(void)
+{
+    BlockDriverState *bs;
+    bool busy;
+
+    bdrv_draining = true;
+    do {
+        busy = false;
+        QTAILQ_FOREACH(bs, &bdrv_states, list) {
+            if (bs->io_limits_enabled &&
+                qemu_co_queue_next(&bs->throttled_reqs)) {
+                busy = true;
+            }
+        }
+        qemu_aio_flush();
+    } while (busy);
+    bdrv_draining = false;
+}
+
 void bdrv_set_removable(BlockDriverState *bs, int removable)
 {
     bs->removable = removable;
@@ -1730,15 +2455,75 @@ int bdrv_has_zero_init(BlockDriverState *bs)
     return 1;
 }
 
-int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
+/*
+ * Discarded sectors read back as undefined data, so they are marked dirty
+ * for block migration and mirroring.  Drivers without discard support
+ * silently ignore the request.
+ */
+int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
+                                 int nb_sectors)
 {
-    if (!bs->drv) {
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
         return -ENOMEDIUM;
     }
-    if (!bs->drv->bdrv_discard) {
-        return 0;
+    if (bdrv_check_request(bs, sector_num, nb_sectors)) {
+        return -EIO;
+    }
+    if (bs->read_only) {
+        return -EROFS;
+    }
+
+    if (bs->dirty_bitmap) {
+        set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
+    }
+
+    if (drv->bdrv_co_discard) {
+        return drv->bdrv_co_discard(bs, sector_num, nb_sectors);
+    } else if (drv->bdrv_aio_discard) {
+        return bdrv_co_discard_em(bs, sector_num, nb_sectors);
+    } else if (drv->bdrv_discard) {
+        return drv->bdrv_discard(bs, sector_num, nb_sectors);
+    }
+    return 0;
+}
+
+typedef struct DiscardCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    int ret;
+} DiscardCo;
+
+static void coroutine_fn bdrv_discard_co_entry(void *opaque)
+{
+    DiscardCo *rwco = opaque;
+
+    rwco->ret = bdrv_co_discard(rwco->bs, rwco->sector_num, rwco->nb_sectors);
+}
+
+int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
+{
+    Coroutine *co;
+    DiscardCo rwco = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .ret = NOT_DONE,
+    };
+
+    if (qemu_in_coroutine()) {
+        return bdrv_co_discard(bs, sector_num, nb_sectors);
+    }
+
+    co = qemu_coroutine_create(bdrv_discard_co_entry);
+    qemu_coroutine_enter(co, &rwco);
+    while (rwco.ret == NOT_DONE) {
+        qemu_aio_wait();
     }
-    return bs->drv->bdrv_discard(bs, sector_num, nb_sectors);
+
+    return rwco.ret;
 }
 
 /*
@@ -1768,6 +2553,19 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     return bs->drv->bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
 }
 
+/*
+ * Same as bdrv_is_allocated(), for callers in coroutine context.  Drivers
+ * whose metadata is protected by a CoMutex must provide their own version.
+ */
+int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, int *pnum)
+{
+    if (bs->drv->bdrv_co_is_allocated) {
+        return bs->drv->bdrv_co_is_allocated(bs, sector_num, nb_sectors, pnum);
+    }
+    return bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
+}
+
 void bdrv_mon_event(const BlockDriverState *bdrv,
                     BlockMonEventAction action, int is_read)
 {
@@ -1797,6 +2595,22 @@ void bdrv_mon_event(const BlockDriverState *bdrv,
     qobject_decref(data);
 }
 
+static void bdrv_put_io_limits(QDict *qdict, BlockIOLimit *io_limits)
+{
+    qdict_put(qdict, "bps",
+              qint_from_int(io_limits->bps[BLOCK_IO_LIMIT_TOTAL]));
+    qdict_put(qdict, "bps_rd",
+              qint_from_int(io_limits->bps[BLOCK_IO_LIMIT_READ]));
+    qdict_put(qdict, "bps_wr",
+              qint_from_int(io_limits->bps[BLOCK_IO_LIMIT_WRITE]));
+    qdict_put(qdict, "iops",
+              qint_from_int(io_limits->iops[BLOCK_IO_LIMIT_TOTAL]));
+    qdict_put(qdict, "iops_rd",
+              qint_from_int(io_limits->iops[BLOCK_IO_LIMIT_READ]));
+    qdict_put(qdict, "iops_wr",
+              qint_from_int(io_limits->iops[BLOCK_IO_LIMIT_WRITE]));
+}
+
 static void bdrv_print_dict(QObject *obj, void *opaque)
 {
     QDict *bs_dict;
@@ -1825,6 +2639,16 @@ static void bdrv_print_dict(QObject *obj, void *opaque)
                             qdict_get_bool(qdict, "ro"),
                             qdict_get_str(qdict, "drv"),
                             qdict_get_bool(qdict, "encrypted"));
+
+        monitor_printf(mon, " bps=%" PRId64 " bps_rd=%" PRId64
+                            " bps_wr=%" PRId64 " iops=%" PRId64
+                            " iops_rd=%" PRId64 " iops_wr=%" PRId64,
+                            qdict_get_int(qdict, "bps"),
+                            qdict_get_int(qdict, "bps_rd"),
+                            qdict_get_int(qdict, "bps_wr"),
+                            qdict_get_int(qdict, "iops"),
+                            qdict_get_int(qdict, "iops_rd"),
+                            qdict_get_int(qdict, "iops_wr"));
     } else {
         monitor_printf(mon, " [not inserted]");
     }
@@ -1867,6 +2691,8 @@ void bdrv_info(Monitor *mon, QObject **ret_data)
                           qstring_from_str(bs->backing_file));
             }
 
+            bdrv_put_io_limits(qobject_to_qdict(obj), &bs->io_limits);
+
             qdict_put_obj(bs_dict, "inserted", obj);
         }
         qlist_append_obj(bs_list, bs_obj);
@@ -1888,11 +2714,26 @@ static void bdrv_stats_iter(QObject *data, void *opaque)
                         " wr_bytes=%" PRId64
                         " rd_operations=%" PRId64
                         " wr_operations=%" PRId64
+                        " rd_throttled_operations=%" PRId64
+                        " wr_throttled_operations=%" PRId64
                         "\n",
                         qdict_get_int(qdict, "rd_bytes"),
                         qdict_get_int(qdict, "wr_bytes"),
                         qdict_get_int(qdict, "rd_operations"),
-                        qdict_get_int(qdict, "wr_operations"));
+                        qdict_get_int(qdict, "wr_operations"),
+                        qdict_get_int(qdict, "rd_throttled_operations"),
+                        qdict_get_int(qdict, "wr_throttled_operations"));
+    if (qdict_haskey(qdict, "l2_cache_hits")) {
+        monitor_printf(mon, "    l2_cache_hits=%" PRId64
+                            " l2_cache_misses=%" PRId64
+                            " refcount_cache_hits=%" PRId64
+                            " refcount_cache_misses=%" PRId64
+                            "\n",
+                            qdict_get_int(qdict, "l2_cache_hits"),
+                            qdict_get_int(qdict, "l2_cache_misses"),
+                            qdict_get_int(qdict, "refcount_cache_hits"),
+                            qdict_get_int(qdict, "refcount_cache_misses"));
+    }
 }
 
 void bdrv_stats_print(Monitor *mon, const QObject *data)
@@ -1902,6 +2743,7 @@ void bdrv_stats_print(Monitor *mon, const QObject *data)
 
 static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
 {
+    BlockDriverInfo bdi;
     QObject *res;
     QDict *dict;
 
@@ -1910,14 +2752,29 @@ static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
                              "'wr_bytes': %" PRId64 ","
                              "'rd_operations': %" PRId64 ","
                              "'wr_operations': %" PRId64 ","
-                             "'wr_highest_offset': %" PRId64
+                             "'wr_highest_offset': %" PRId64 ","
+                             "'rd_throttled_operations': %" PRId64 ","
+                             "'wr_throttled_operations': %" PRId64
                              "} }",
                              bs->rd_bytes, bs->wr_bytes,
                              bs->rd_ops, bs->wr_ops,
                              bs->wr_highest_sector *
-                             (uint64_t)BDRV_SECTOR_SIZE);
+                             (uint64_t)BDRV_SECTOR_SIZE,
+                             bs->throttled_ops[0], bs->throttled_ops[1]);
     dict  = qobject_to_qdict(res);
 
+    if (bdrv_get_info(bs, &bdi) == 0 && bdi.has_cache_stats) {
+        QDict *stats = qobject_to_qdict(qdict_get(dict, "stats"));
+
+        qdict_put(stats, "l2_cache_hits", qint_from_int(bdi.l2_cache_hits));
+        qdict_put(stats, "l2_cache_misses",
+                  qint_from_int(bdi.l2_cache_misses));
+        qdict_put(stats, "refcount_cache_hits",
+                  qint_from_int(bdi.refcount_cache_hits));
+        qdict_put(stats, "refcount_cache_misses",
+                  qint_from_int(bdi.refcount_cache_misses));
+    }
+
     if (*bs->device_name) {
         qdict_put(dict, "device", qstring_from_str(bs->device_name));
     }
@@ -2233,12 +3090,19 @@ char *bdrv_snapshot_dump(char *buf, int buf_size, QEMUSnapshotInfo *sn)
 /**************************************************************/
 /* async I/Os */
 
+static BlockDriverAIOCB *bdrv_aio_co_do_rw(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           QEMUIOVector *qiov,
+                                           int nb_sectors,
+                                           BlockDriverCompletionFunc *cb,
+                                           void *opaque,
+                                           bool is_write);
+
 BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
                                  QEMUIOVector *qiov, int nb_sectors,
                                  BlockDriverCompletionFunc *cb, void *opaque)
 {
     BlockDriver *drv = bs->drv;
-    BlockDriverAIOCB *ret;
 
     trace_bdrv_aio_readv(bs, sector_num, nb_sectors, opaque);
 
@@ -2247,6 +3111,23 @@ BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return NULL;
 
+    /* throttled or tracked requests need to run in a coroutine */
+    if (bs->io_limits_enabled || bs->copy_on_read) {
+        return bdrv_aio_co_do_rw(bs, sector_num, qiov, nb_sectors,
+                                 cb, opaque, false);
+    }
+
+    return bdrv_aio_do_readv(bs, sector_num, qiov, nb_sectors, cb, opaque);
+}
+
+/* Submits a request to the driver without throttling or request tracking */
+static BlockDriverAIOCB *bdrv_aio_do_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *ret;
+
     ret = drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
                               cb, opaque);
 
@@ -2300,8 +3181,6 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
                                   BlockDriverCompletionFunc *cb, void *opaque)
 {
     BlockDriver *drv = bs->drv;
-    BlockDriverAIOCB *ret;
-    BlockCompleteData *blk_cb_data;
 
     trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
 
@@ -2312,6 +3191,23 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return NULL;
 
+    /* throttled or tracked requests need to run in a coroutine */
+    if (bs->io_limits_enabled || bs->copy_on_read) {
+        return bdrv_aio_co_do_rw(bs, sector_num, qiov, nb_sectors,
+                                 cb, opaque, true);
+    }
+
+    return bdrv_aio_do_writev(bs, sector_num, qiov, nb_sectors, cb, opaque);
+}
+
+static BlockDriverAIOCB *bdrv_aio_do_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *ret;
+    BlockCompleteData *blk_cb_data;
+
     if (bs->dirty_bitmap) {
         blk_cb_data = blk_dirty_cb_alloc(bs, sector_num, nb_sectors, cb,
                                          opaque);
@@ -2593,6 +3489,36 @@ void bdrv_aio_cancel(BlockDriverAIOCB *acb)
     acb->pool->cancel(acb);
 }
 
+/*
+ * Calls to bdrv_io_plug() and bdrv_io_unplug() nest.  Drivers that do not
+ * batch requests themselves pass the hint on to their protocol.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    trace_bdrv_io_plug(bs);
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    trace_bdrv_io_unplug(bs);
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
 
 /**************************************************************/
 /* async block device emulation */
@@ -2689,7 +3615,7 @@ typedef struct BlockDriverAIOCBCoroutine {
 
 static void bdrv_aio_co_cancel_em(BlockDriverAIOCB *blockacb)
 {
-    qemu_aio_flush();
+    bdrv_drain_all();
 }
 
 static AIOPool bdrv_em_co_aio_pool = {
@@ -2746,6 +3672,103 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
     return &acb->common;
 }
 
+static void coroutine_fn bdrv_co_do_rw(void *opaque)
+{
+    BlockDriverAIOCBCoroutine *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+
+    if (!acb->is_write) {
+        acb->req.error = bdrv_co_do_readv(bs, acb->req.sector,
+            acb->req.nb_sectors, acb->req.qiov, 0);
+    } else {
+        acb->req.error = bdrv_co_do_writev(bs, acb->req.sector,
+            acb->req.nb_sectors, acb->req.qiov, 0);
+    }
+
+    acb->bh = qemu_bh_new(bdrv_co_rw_bh, acb);
+    qemu_bh_schedule(acb->bh);
+}
+
+static BlockDriverAIOCB *bdrv_aio_co_do_rw(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           QEMUIOVector *qiov,
+                                           int nb_sectors,
+                                           BlockDriverCompletionFunc *cb,
+                                           void *opaque,
+                                           bool is_write)
+{
+    Coroutine *co;
+    BlockDriverAIOCBCoroutine *acb;
+
+    acb = qemu_aio_get(&bdrv_em_co_aio_pool, bs, cb, opaque);
+    acb->req.sector = sector_num;
+    acb->req.nb_sectors = nb_sectors;
+    acb->req.qiov = qiov;
+    acb->is_write = is_write;
+
+    co = qemu_coroutine_create(bdrv_co_do_rw);
+    qemu_coroutine_enter(co, acb);
+
+    return &acb->common;
+}
+
+static void coroutine_fn bdrv_aio_discard_co_entry(void *opaque)
+{
+    BlockDriverAIOCBCoroutine *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+
+    acb->req.error = bdrv_co_discard(bs, acb->req.sector, acb->req.nb_sectors);
+    acb->bh = qemu_bh_new(bdrv_co_rw_bh, acb);
+    qemu_bh_schedule(acb->bh);
+}
+
+static void coroutine_fn bdrv_aio_write_zeroes_co_entry(void *opaque)
+{
+    BlockDriverAIOCBCoroutine *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+
+    acb->req.error = bdrv_co_do_writev(bs, acb->req.sector,
+        acb->req.nb_sectors, NULL, BDRV_REQ_ZERO_WRITE);
+    acb->bh = qemu_bh_new(bdrv_co_rw_bh, acb);
+    qemu_bh_schedule(acb->bh);
+}
+
+BlockDriverAIOCB *bdrv_aio_write_zeroes(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    Coroutine *co;
+    BlockDriverAIOCBCoroutine *acb;
+
+    trace_bdrv_aio_write_zeroes(bs, sector_num, nb_sectors, opaque);
+
+    acb = qemu_aio_get(&bdrv_em_co_aio_pool, bs, cb, opaque);
+    acb->req.sector = sector_num;
+    acb->req.nb_sectors = nb_sectors;
+    co = qemu_coroutine_create(bdrv_aio_write_zeroes_co_entry);
+    qemu_coroutine_enter(co, acb);
+
+    return &acb->common;
+}
+
+BlockDriverAIOCB *bdrv_aio_discard(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    Coroutine *co;
+    BlockDriverAIOCBCoroutine *acb;
+
+    trace_bdrv_aio_discard(bs, sector_num, nb_sectors, opaque);
+
+    acb = qemu_aio_get(&bdrv_em_co_aio_pool, bs, cb, opaque);
+    acb->req.sector = sector_num;
+    acb->req.nb_sectors = nb_sectors;
+    co = qemu_coroutine_create(bdrv_aio_discard_co_entry);
+    qemu_coroutine_enter(co, acb);
+
+    return &acb->common;
+}
+
 static BlockDriverAIOCB *bdrv_co_aio_readv_em(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
@@ -2808,8 +3831,6 @@ static void bdrv_rw_em_cb(void *opaque, int ret)
     *(int *)opaque = ret;
 }
 
-#define NOT_DONE 0x7fffffff
-
 static int bdrv_read_em(BlockDriverState *bs, int64_t sector_num,
                         uint8_t *buf, int nb_sectors)
 {
@@ -2822,7 +3843,7 @@ static int bdrv_read_em(BlockDriverState *bs, int64_t sector_num,
     iov.iov_base = (void *)buf;
     iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
     qemu_iovec_init_external(&qiov, &iov, 1);
-    acb = bdrv_aio_readv(bs, sector_num, &qiov, nb_sectors,
+    acb = bdrv_aio_do_readv(bs, sector_num, &qiov, nb_sectors,
         bdrv_rw_em_cb, &async_ret);
     if (acb == NULL) {
         async_ret = -1;
@@ -2850,7 +3871,7 @@ static int bdrv_write_em(BlockDriverState *bs, int64_t sector_num,
     iov.iov_base = (void *)buf;
     iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
     qemu_iovec_init_external(&qiov, &iov, 1);
-    acb = bdrv_aio_writev(bs, sector_num, &qiov, nb_sectors,
+    acb = bdrv_aio_do_writev(bs, sector_num, &qiov, nb_sectors,
         bdrv_rw_em_cb, &async_ret);
     if (acb == NULL) {
         async_ret = -1;
@@ -2926,12 +3947,13 @@ static int coroutine_fn bdrv_co_io_em(BlockDriverState *bs, int64_t sector_num,
     };
     BlockDriverAIOCB *acb;
 
+    /* accounting and dirty tracking were done by bdrv_co_do_readv/writev */
     if (is_write) {
-        acb = bdrv_aio_writev(bs, sector_num, iov, nb_sectors,
-                              bdrv_co_io_em_complete, &co);
+        acb = bs->drv->bdrv_aio_writev(bs, sector_num, iov, nb_sectors,
+                                       bdrv_co_io_em_complete, &co);
     } else {
-        acb = bdrv_aio_readv(bs, sector_num, iov, nb_sectors,
-                             bdrv_co_io_em_complete, &co);
+        acb = bs->drv->bdrv_aio_readv(bs, sector_num, iov, nb_sectors,
+                                      bdrv_co_io_em_complete, &co);
     }
 
     trace_bdrv_co_io(is_write, acb);
@@ -2972,6 +3994,23 @@ static int coroutine_fn bdrv_co_flush_em(BlockDriverState *bs)
     return co.ret;
 }
 
+static int coroutine_fn bdrv_co_discard_em(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors)
+{
+    CoroutineIOCompletion co = {
+        .coroutine = qemu_coroutine_self(),
+    };
+    BlockDriverAIOCB *acb;
+
+    acb = bs->drv->bdrv_aio_discard(bs, sector_num, nb_sectors,
+                                    bdrv_co_io_em_complete, &co);
+    if (!acb) {
+        return -EIO;
+    }
+    qemu_coroutine_yield();
+    return co.ret;
+}
+
 /**************************************************************/
 /* removable device support */
 
@@ -3133,6 +4172,58 @@ int bdrv_in_use(BlockDriverState *bs)
     return bs->in_use;
 }
 
+/*
+ * Starts a job on bs.  Only one job can run on a device at a time and the
+ * device stays in use until the job calls block_job_complete().
+ */
+void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
+                       BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockJob *job;
+
+    if (bs->job || bdrv_in_use(bs)) {
+        return NULL;
+    }
+    bdrv_set_in_use(bs, 1);
+
+    job = g_malloc0(job_type->instance_size);
+    job->job_type = job_type;
+    job->bs = bs;
+    job->cb = cb;
+    job->opaque = opaque;
+    bs->job = job;
+    return job;
+}
+
+void block_job_complete(BlockJob *job, int ret)
+{
+    BlockDriverState *bs = job->bs;
+
+    assert(bs->job == job);
+    job->cb(job->opaque, ret);
+    bs->job = NULL;
+    g_free(job);
+    bdrv_set_in_use(bs, 0);
+}
+
+int block_job_set_speed(BlockJob *job, int64_t value)
+{
+    if (!job->job_type->set_speed) {
+        return -ENOTSUP;
+    }
+    return job->job_type->set_speed(job, value);
+}
+
+void block_job_cancel(BlockJob *job)
+{
+    job->cancelled = true;
+}
+
+bool block_job_is_cancelled(BlockJob *job)
+{
+    return job->cancelled;
+}
+
 int bdrv_img_create(const char *filename, const char *fmt,
                     const char *base_filename, const char *base_fmt,
                     char *options, uint64_t img_size, int flags)
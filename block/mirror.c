@@ -0,0 +1,333 @@
+/*
+ * Image mirroring
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "block_int.h"
+#include "qemu-coroutine.h"
+#include "qemu-error.h"
+#include "ratelimit.h"
+
+enum {
+    /*
+     * Size of data buffer for copying.  One dirty chunk is copied per
+     * iteration so that a chunk that is clean after the copy stays clean
+     * unless the guest writes to it again.
+     */
+    MIRROR_SECTORS = BDRV_SECTORS_PER_DIRTY_CHUNK,
+    MIRROR_BUFFER_SIZE = MIRROR_SECTORS * BDRV_SECTOR_SIZE, /* in bytes */
+};
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+typedef struct MirrorBlockJob {
+    BlockJob common;
+    RateLimit limit;
+    BlockDriverState *target;
+    QEMUBH *bh;
+} MirrorBlockJob;
+
+static int coroutine_fn mirror_iteration(MirrorBlockJob *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         void *buf)
+{
+    BlockDriverState *source = s->common.bs;
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len  = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+    QEMUIOVector qiov;
+    int ret;
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    /* Guest writes that complete from now on mark the chunk dirty again, so
+     * the bitmap must be cleared before the data is read.
+     */
+    bdrv_reset_dirty(source, sector_num, nb_sectors);
+
+    ret = bdrv_co_readv(source, sector_num, nb_sectors, &qiov);
+    if (ret < 0) {
+        return ret;
+    }
+    return bdrv_co_writev(s->target, sector_num, nb_sectors, &qiov);
+}
+
+/*
+ * Find the next dirty chunk at or after sector_num, wrapping around at the
+ * end of the device.  Must only be called when the dirty count is non-zero.
+ */
+static int64_t mirror_next_dirty(BlockDriverState *bs, int64_t sector_num,
+                                 int64_t end)
+{
+    sector_num &= ~((int64_t)MIRROR_SECTORS - 1);
+    for (;;) {
+        if (sector_num >= end) {
+            sector_num = 0;
+        }
+        if (bdrv_get_dirty(bs, sector_num)) {
+            return sector_num;
+        }
+        sector_num += MIRROR_SECTORS;
+    }
+}
+
+/*
+ * Copy the chunks that are still dirty and flush the target.  Called outside
+ * of coroutine context, so the synchronous requests below do not yield to
+ * the guest; requests submitted from bottom halves while they wait are
+ * drained and their chunks copied before the loop ends.
+ */
+static int mirror_sync(MirrorBlockJob *s)
+{
+    BlockDriverState *bs = s->common.bs;
+    int64_t sector_num, end = s->common.len >> BDRV_SECTOR_BITS;
+    void *buf;
+    int ret = 0;
+    int n;
+
+    buf = qemu_blockalign(bs, MIRROR_BUFFER_SIZE);
+    for (;;) {
+        bdrv_drain_all();
+        if (bdrv_get_dirty_count(bs) == 0) {
+            ret = bdrv_flush(s->target);
+            if (ret < 0) {
+                break;
+            }
+            bdrv_drain_all();
+            if (bdrv_get_dirty_count(bs) == 0) {
+                break;
+            }
+        }
+
+        sector_num = mirror_next_dirty(bs, 0, end);
+        n = MIN(end - sector_num, MIRROR_SECTORS);
+        trace_mirror_one_iteration(s, sector_num, n);
+        bdrv_reset_dirty(bs, sector_num, n);
+        ret = bdrv_read(bs, sector_num, buf, n);
+        if (ret < 0) {
+            break;
+        }
+        ret = bdrv_write(s->target, sector_num, buf, n);
+        if (ret < 0) {
+            break;
+        }
+    }
+    qemu_vfree(buf);
+    return ret;
+}
+
+/*
+ * Switch the device over to the mirror.  Must be called right after
+ * mirror_sync() without returning to the main loop in between.
+ */
+static int mirror_pivot(MirrorBlockJob *s)
+{
+    BlockDriverState *bs = s->common.bs;
+    BlockDriver *old_drv = bs->drv, *drv = s->target->drv;
+    char old_filename[1024], filename[1024];
+    int flags = bs->open_flags;
+    int ret;
+
+    pstrcpy(old_filename, sizeof(old_filename), bs->filename);
+    pstrcpy(filename, sizeof(filename), s->target->filename);
+    bdrv_delete(s->target);
+    s->target = NULL;
+
+    bdrv_set_dirty_tracking(bs, 0);
+    bdrv_close(bs);
+    ret = bdrv_open(bs, filename, flags | BDRV_O_NO_BACKING, drv);
+    if (ret < 0) {
+        /* Fall back to the source, which is still consistent */
+        if (bdrv_open(bs, old_filename, flags, old_drv) < 0) {
+            error_report("could not reopen %s after failed switch to %s",
+                         old_filename, filename);
+        }
+    }
+    return ret;
+}
+
+static void mirror_cleanup(MirrorBlockJob *s, int ret)
+{
+    if (s->target) {
+        bdrv_set_dirty_tracking(s->common.bs, 0);
+        bdrv_delete(s->target);
+        s->target = NULL;
+    }
+    block_job_complete(&s->common, ret);
+}
+
+/*
+ * Finish the job outside of the coroutine.  Requests that the guest submits
+ * while the coroutine yields in the flush or the reopen would only mark
+ * their chunks dirty after the last copy and be lost on the switch, and
+ * bs must not be closed under requests that are still in flight.
+ */
+static void mirror_complete_bh(void *opaque)
+{
+    MirrorBlockJob *s = opaque;
+    int ret;
+
+    qemu_bh_delete(s->bh);
+    s->bh = NULL;
+
+    if (block_job_is_cancelled(&s->common)) {
+        ret = 0;
+    } else {
+        ret = mirror_sync(s);
+        if (ret == 0) {
+            ret = mirror_pivot(s);
+        }
+    }
+    mirror_cleanup(s, ret);
+}
+
+static void coroutine_fn mirror_run(void *opaque)
+{
+    MirrorBlockJob *s = opaque;
+    BlockDriverState *bs = s->common.bs;
+    int64_t sector_num, end, dirty;
+    int ret = 0;
+    int n;
+    void *buf;
+
+    s->common.len = bdrv_getlength(bs);
+    if (s->common.len < 0) {
+        ret = s->common.len;
+        goto out;
+    }
+
+    end = s->common.len >> BDRV_SECTOR_BITS;
+    buf = qemu_blockalign(bs, MIRROR_BUFFER_SIZE);
+
+    /* Bulk phase: copy the whole device once.  Guest writes to chunks that
+     * were already copied are caught by the dirty bitmap.
+     */
+    for (sector_num = 0; sector_num < end; sector_num += n) {
+        uint64_t delay_ns = 0;
+
+        n = MIN(end - sector_num, MIRROR_SECTORS);
+wait_bulk:
+        /* Yield even without a rate limit so that qemu_aio_flush() returns */
+        co_sleep_ns(rt_clock, delay_ns);
+        if (block_job_is_cancelled(&s->common)) {
+            goto done;
+        }
+        if (s->common.speed) {
+            delay_ns = ratelimit_calculate_delay(&s->limit, n);
+            if (delay_ns > 0) {
+                goto wait_bulk;
+            }
+        }
+
+        trace_mirror_one_iteration(s, sector_num, n);
+        ret = mirror_iteration(s, sector_num, n, buf);
+        if (ret < 0) {
+            goto done;
+        }
+        s->common.offset += n * BDRV_SECTOR_SIZE;
+    }
+
+    /* Dirty phase: copy chunks written by the guest until none are left */
+    sector_num = 0;
+    for (;;) {
+        uint64_t delay_ns = 0;
+
+        dirty = bdrv_get_dirty_count(bs);
+        if (dirty == 0) {
+            /* Writes still in flight only mark their chunks on completion */
+            bdrv_drain_all();
+            dirty = bdrv_get_dirty_count(bs);
+            if (dirty == 0) {
+                break;
+            }
+        }
+        s->common.offset = MAX(0, s->common.len - dirty * MIRROR_BUFFER_SIZE);
+
+        sector_num = mirror_next_dirty(bs, sector_num, end);
+        n = MIN(end - sector_num, MIRROR_SECTORS);
+wait_dirty:
+        co_sleep_ns(rt_clock, delay_ns);
+        if (block_job_is_cancelled(&s->common)) {
+            goto done;
+        }
+        if (s->common.speed) {
+            delay_ns = ratelimit_calculate_delay(&s->limit, n);
+            if (delay_ns > 0) {
+                goto wait_dirty;
+            }
+        }
+        if (!bdrv_get_dirty(bs, sector_num)) {
+            /* Chunk was copied or rewritten while sleeping, look again */
+            continue;
+        }
+
+        trace_mirror_one_iteration(s, sector_num, n);
+        ret = mirror_iteration(s, sector_num, n, buf);
+        if (ret < 0) {
+            goto done;
+        }
+        sector_num += n;
+    }
+
+    s->common.offset = s->common.len;
+    qemu_vfree(buf);
+    s->bh = qemu_bh_new(mirror_complete_bh, s);
+    qemu_bh_schedule(s->bh);
+    return;
+
+done:
+    qemu_vfree(buf);
+out:
+    mirror_cleanup(s, ret);
+}
+
+static int mirror_set_speed(BlockJob *job, int64_t value)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    if (value < 0) {
+        return -EINVAL;
+    }
+    job->speed = value;
+    ratelimit_set_speed(&s->limit, value / BDRV_SECTOR_SIZE, SLICE_TIME);
+    return 0;
+}
+
+static BlockJobType mirror_job_type = {
+    .instance_size = sizeof(MirrorBlockJob),
+    .job_type      = "mirror",
+    .set_speed     = mirror_set_speed,
+};
+
+/*
+ * Copy bs to target while the guest keeps running and switch bs over to
+ * target once both are in sync.  The job takes ownership of target.
+ */
+int mirror_start(BlockDriverState *bs, BlockDriverState *target,
+                 int64_t speed, BlockDriverCompletionFunc *cb, void *opaque)
+{
+    MirrorBlockJob *s;
+    Coroutine *co;
+
+    if (speed < 0) {
+        return -EINVAL;
+    }
+
+    s = block_job_create(&mirror_job_type, bs, cb, opaque);
+    if (!s) {
+        return -EBUSY; /* bs must already be in use */
+    }
+    mirror_set_speed(&s->common, speed);
+    s->target = target;
+    bdrv_set_dirty_tracking(bs, 1);
+
+    co = qemu_coroutine_create(mirror_run);
+    trace_mirror_start(bs, s, co, opaque);
+    qemu_coroutine_enter(co, s);
+    return 0;
+}
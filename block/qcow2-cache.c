@@ -27,35 +27,71 @@
 #include "qcow2.h"
 
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
+    /* Second chance bit for the clock replacement */
+    bool    referenced;
     int     ref;
+    /* Next entry in the same hash bucket, or -1 */
+    int     next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
+    /* All tables in one block, entry i uses table_size bytes at i */
+    uint8_t*                tables;
+    /* Hash of the table offset to the first entry of the chain, or -1 */
+    int*                    buckets;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     bucket_mask;
+    int                     table_bits;
+    int                     clock_hand;
     bool                    depends_on_flush;
     bool                    writethrough;
+    uint64_t                hits;
+    uint64_t                misses;
 };
 
+static inline void *qcow2_cache_table(Qcow2Cache *c, int i)
+{
+    return c->tables + ((size_t)i << c->table_bits);
+}
+
+static inline int qcow2_cache_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    uint64_t n = offset >> c->table_bits;
+
+    return (n ^ (n >> 16)) & c->bucket_mask;
+}
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     bool writethrough)
 {
     BDRVQcowState *s = bs->opaque;
     Qcow2Cache *c;
+    int nb_buckets;
     int i;
 
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->tables = qemu_blockalign(bs, (size_t)num_tables * s->cluster_size);
+    c->table_bits = s->cluster_bits;
     c->writethrough = writethrough;
 
+    nb_buckets = 1;
+    while (nb_buckets < num_tables) {
+        nb_buckets <<= 1;
+    }
+    c->bucket_mask = nb_buckets - 1;
+    c->buckets = g_malloc(sizeof(*c->buckets) * nb_buckets);
+    for (i = 0; i < nb_buckets; i++) {
+        c->buckets[i] = -1;
+    }
+
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        c->entries[i].next = -1;
     }
 
     return c;
@@ -67,9 +103,10 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->tables);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -119,7 +156,7 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset, qcow2_cache_table(c, i),
         s->cluster_size);
     if (ret < 0) {
         return ret;
@@ -181,34 +218,66 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
     c->depends_on_flush = true;
 }
 
-static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
+static int qcow2_cache_find(Qcow2Cache *c, uint64_t offset)
 {
     int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
 
+    for (i = c->buckets[qcow2_cache_bucket(c, offset)]; i >= 0;
+         i = c->entries[i].next)
+    {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    int *head = &c->buckets[qcow2_cache_bucket(c, c->entries[i].offset)];
+
+    c->entries[i].next = *head;
+    *head = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_bucket(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].next;
+    }
+    *p = c->entries[i].next;
+    c->entries[i].next = -1;
+}
+
+/*
+ * Clock replacement: entries that were used since the hand last passed them
+ * get a second chance, unused entries are preferred over everything else.
+ */
+static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
+{
+    int i, n;
+
+    for (n = 0; n < 2 * c->size; n++) {
+        i = c->clock_hand;
+        c->clock_hand = (c->clock_hand + 1) % c->size;
 
-    for (i = 0; i < c->size; i++) {
         if (c->entries[i].ref) {
             continue;
         }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+        if (c->entries[i].offset && c->entries[i].referenced) {
+            c->entries[i].referenced = false;
+            continue;
         }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
+        return i;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -219,11 +288,12 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     int ret;
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_find(c, offset);
+    if (i >= 0) {
+        c->hits++;
+        goto found;
     }
+    c->misses++;
 
     /* If not, write a table back and replace it */
     i = qcow2_cache_find_entry_to_replace(c);
@@ -236,28 +306,31 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         return ret;
     }
 
-    c->entries[i].offset = 0;
+    /* Nobody may find the entry while its table is being replaced */
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
+        c->entries[i].offset = 0;
+    }
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_table(c, i),
+                         s->cluster_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    c->entries[i].referenced = true;
     c->entries[i].ref++;
-    *table = c->entries[i].table;
+    *table = qcow2_cache_table(c, i);
     return 0;
 }
 
@@ -273,18 +346,46 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
+/*
+ * Returns the table at offset if it is cached, without loading it or taking
+ * a reference.  Never yields, so the caller can use the table for as long
+ * as it does not yield itself.
+ */
+void *qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    i = qcow2_cache_find(c, offset);
+    if (i < 0) {
+        return NULL;
+    }
+
+    c->hits++;
+    c->entries[i].referenced = true;
+    return qcow2_cache_table(c, i);
+}
+
+static int qcow2_cache_table_index(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t diff = (uint8_t *)table - c->tables;
+
+    if (diff < 0 || diff >= ((ptrdiff_t)c->size << c->table_bits) ||
+        (diff & ((1 << c->table_bits) - 1))) {
+        return -1;
+    }
+
+    return diff >> c->table_bits;
+}
+
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
     int i;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
+    i = qcow2_cache_table_index(c, *table);
+    if (i < 0) {
+        return -ENOENT;
     }
-    return -ENOENT;
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -301,14 +402,11 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
     int i;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
+    i = qcow2_cache_table_index(c, table);
+    if (i < 0) {
+        abort();
     }
-    abort();
 
-found:
     c->entries[i].dirty = true;
 }
 
@@ -324,3 +422,9 @@ bool qcow2_cache_set_writethrough(BlockDriverState *bs, Qcow2Cache *c,
     c->writethrough = enable;
     return old;
 }
+
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses)
+{
+    *hits = c->hits;
+    *misses = c->misses;
+}
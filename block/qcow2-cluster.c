@@ -378,21 +378,14 @@ static int copy_sectors(BlockDriverState *bs, uint64_t start_sect,
 /*
  * get_cluster_offset
  *
- * For a given offset of the disk image, find the cluster offset in
- * qcow2 file. The offset is stored in *cluster_offset.
- *
- * on entry, *num is the number of contiguous clusters we'd like to
- * access following offset.
- *
- * on exit, *num is the number of contiguous clusters we can read.
- *
- * Return 0, if the offset is found
- * Return -errno, otherwise.
- *
+ * Shared by qcow2_get_cluster_offset() and qcow2_get_cluster_offset_cached().
+ * With cached_only set, the L2 table is only looked up in the cache and the
+ * function never yields; -EAGAIN is returned if the table is not cached.
+ * With for_write set, only clusters that can be overwritten in place are
+ * counted, and -EAGAIN is returned if there are none.
  */
-
-int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
-    int *num, uint64_t *cluster_offset)
+static int get_cluster_offset(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset, bool cached_only, bool for_write)
 {
     BDRVQcowState *s = bs->opaque;
     unsigned int l1_index, l2_index;
@@ -400,6 +393,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int l1_bits, c;
     unsigned int index_in_cluster, nb_clusters;
     uint64_t nb_available, nb_needed;
+    uint64_t l2_entry = 0;
     int ret;
 
     index_in_cluster = (offset >> 9) & (s->cluster_sectors - 1);
@@ -421,36 +415,53 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         nb_needed = nb_available;
     }
 
-    *cluster_offset = 0;
-
     /* seek the the l2 offset in the l1 table */
 
     l1_index = offset >> l1_bits;
-    if (l1_index >= s->l1_size)
-        goto out;
-
-    l2_offset = s->l1_table[l1_index];
+    if (l1_index >= s->l1_size) {
+        l2_offset = 0;
+    } else {
+        l2_offset = s->l1_table[l1_index];
+    }
 
     /* seek the l2 table of the given l2 offset */
 
-    if (!l2_offset)
+    if (!l2_offset) {
+        if (for_write) {
+            return -EAGAIN;
+        }
         goto out;
+    }
 
     /* load the l2 table in memory */
 
     l2_offset &= ~QCOW_OFLAG_COPIED;
-    ret = l2_load(bs, l2_offset, &l2_table);
-    if (ret < 0) {
-        return ret;
+    if (cached_only) {
+        l2_table = qcow2_cache_lookup(s->l2_table_cache, l2_offset);
+        if (!l2_table) {
+            return -EAGAIN;
+        }
+    } else {
+        ret = l2_load(bs, l2_offset, &l2_table);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     /* find the cluster offset for the given disk offset */
 
     l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    l2_entry = be64_to_cpu(l2_table[l2_index]);
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
-    if (!*cluster_offset) {
+    if (for_write) {
+        /* clusters with a refcount of 1, that nobody else points to */
+        c = 0;
+        if (l2_entry & QCOW_OFLAG_COPIED) {
+            c = count_contiguous_clusters(nb_clusters, s->cluster_size,
+                    &l2_table[l2_index], 0, 0);
+        }
+    } else if (!l2_entry) {
         /* how many empty clusters ? */
         c = count_contiguous_free_clusters(nb_clusters, &l2_table[l2_index]);
     } else {
@@ -459,7 +470,13 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
                 &l2_table[l2_index], 0, QCOW_OFLAG_COPIED);
     }
 
-    qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    if (!cached_only) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    }
+
+    if (for_write && !c) {
+        return -EAGAIN;
+    }
 
    nb_available = (c * s->cluster_sectors);
 out:
@@ -468,10 +485,46 @@ out:
 
     *num = nb_available - index_in_cluster;
 
-    *cluster_offset &=~QCOW_OFLAG_COPIED;
+    *cluster_offset = l2_entry & ~QCOW_OFLAG_COPIED;
     return 0;
 }
 
+/*
+ * get_cluster_offset
+ *
+ * For a given offset of the disk image, find the cluster offset in
+ * qcow2 file. The offset is stored in *cluster_offset.
+ *
+ * on entry, *num is the number of contiguous clusters we'd like to
+ * access following offset.
+ *
+ * on exit, *num is the number of contiguous clusters we can read.
+ *
+ * Return 0, if the offset is found
+ * Return -errno, otherwise.
+ *
+ */
+
+int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset)
+{
+    return get_cluster_offset(bs, offset, num, cluster_offset, false, false);
+}
+
+/*
+ * Like qcow2_get_cluster_offset(), but only looks at cached L2 tables and
+ * never yields, so that it can be called without holding s->lock.  Returns
+ * -EAGAIN if the lookup needs the L2 table from disk, or if for_write is
+ * set and the clusters cannot be overwritten in place; the caller must then
+ * take the slow path.
+ */
+int qcow2_get_cluster_offset_cached(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset, bool for_write)
+{
+    return get_cluster_offset(bs, offset, num, cluster_offset, true,
+                             for_write);
+}
+
 /*
  * get_cluster_table
  *
@@ -950,7 +1003,7 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     unsigned int nb_clusters;
     int ret;
 
-    end_offset = offset + (nb_sectors << BDRV_SECTOR_BITS);
+    end_offset = offset + ((uint64_t)nb_sectors << BDRV_SECTOR_BITS);
 
     /* Round start up and end down */
     offset = align_offset(offset, s->cluster_size);
@@ -144,6 +144,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     int len, i, ret = 0;
     QCowHeader header;
     uint64_t ext_end;
+    uint64_t l2_cache_tables, refcount_cache_tables;
     bool writethrough;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
@@ -230,8 +231,36 @@ static int qcow2_open(BlockDriverState *bs, int flags)
 
     /* alloc L2 table/refcount block cache */
     writethrough = ((flags & BDRV_O_CACHE_WB) == 0);
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE, writethrough);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE,
+
+    /* one L2 table maps l2_size clusters of guest data */
+    l2_cache_tables = L2_CACHE_SIZE;
+    if (bs->l2_cache_coverage) {
+        l2_cache_tables = DIV_ROUND_UP(bs->l2_cache_coverage,
+                                       (uint64_t)s->l2_size << s->cluster_bits);
+    } else if (bs->l2_cache_size) {
+        l2_cache_tables = bs->l2_cache_size >> s->cluster_bits;
+    }
+    /* there is no point in caching more tables than the image can have */
+    l2_cache_tables = MIN(l2_cache_tables, s->l1_size);
+    l2_cache_tables = MAX(l2_cache_tables, MIN_L2_CACHE_SIZE);
+
+    refcount_cache_tables = REFCOUNT_CACHE_SIZE;
+    if (bs->refcount_cache_size) {
+        refcount_cache_tables = bs->refcount_cache_size >> s->cluster_bits;
+    }
+    /*
+     * likewise no more refcount blocks than the table references or the
+     * guest data needs; a block holds the 16-bit refcounts of
+     * cluster_size / 2 clusters
+     */
+    refcount_cache_tables = MIN(refcount_cache_tables,
+        MAX(s->refcount_table_size,
+            DIV_ROUND_UP(header.size, 1ULL << (2 * s->cluster_bits - 1))));
+    refcount_cache_tables = MIN(refcount_cache_tables, INT_MAX);
+    refcount_cache_tables = MAX(refcount_cache_tables, REFCOUNT_CACHE_SIZE);
+
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_tables, writethrough);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_tables,
         writethrough);
 
     s->cluster_cache = g_malloc(s->cluster_size);
@@ -355,6 +384,25 @@ static int qcow2_is_allocated(BlockDriverState *bs, int64_t sector_num,
     return (cluster_offset != 0);
 }
 
+static int coroutine_fn qcow2_co_is_allocated(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, int *pnum)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+    int ret;
+
+    *pnum = nb_sectors;
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_get_cluster_offset(bs, sector_num << 9, pnum, &cluster_offset);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        *pnum = 0;
+        return ret;
+    }
+
+    return (cluster_offset != 0);
+}
+
 /* handle reading after the end of the backing file */
 int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
                   int64_t sector_num, int nb_sectors)
@@ -443,8 +491,14 @@ static int qcow2_aio_read_cb(QCowAIOCB *acb)
             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors);
     }
 
-    ret = qcow2_get_cluster_offset(bs, acb->sector_num << 9,
-        &acb->cur_nr_sectors, &acb->cluster_offset);
+    ret = qcow2_get_cluster_offset_cached(bs, acb->sector_num << 9,
+        &acb->cur_nr_sectors, &acb->cluster_offset, false);
+    if (ret == -EAGAIN) {
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_get_cluster_offset(bs, acb->sector_num << 9,
+            &acb->cur_nr_sectors, &acb->cluster_offset);
+        qemu_co_mutex_unlock(&s->lock);
+    }
     if (ret < 0) {
         return ret;
     }
@@ -463,10 +517,8 @@ static int qcow2_aio_read_cb(QCowAIOCB *acb)
                 acb->sector_num, acb->cur_nr_sectors);
             if (n1 > 0) {
                 BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-                qemu_co_mutex_unlock(&s->lock);
                 ret = bdrv_co_readv(bs->backing_hd, acb->sector_num,
                                     n1, &acb->hd_qiov);
-                qemu_co_mutex_lock(&s->lock);
                 if (ret < 0) {
                     return ret;
                 }
@@ -479,14 +531,18 @@ static int qcow2_aio_read_cb(QCowAIOCB *acb)
         }
     } else if (acb->cluster_offset & QCOW_OFLAG_COMPRESSED) {
         /* add AIO support for compressed blocks ? */
+        qemu_co_mutex_lock(&s->lock);
         ret = qcow2_decompress_cluster(bs, acb->cluster_offset);
         if (ret < 0) {
+            qemu_co_mutex_unlock(&s->lock);
             return ret;
         }
 
+        /* s->cluster_cache is shared by all requests */
         qemu_iovec_from_buffer(&acb->hd_qiov,
             s->cluster_cache + index_in_cluster * 512,
             512 * acb->cur_nr_sectors);
+        qemu_co_mutex_unlock(&s->lock);
 
         return 1;
     } else {
@@ -512,11 +568,9 @@ static int qcow2_aio_read_cb(QCowAIOCB *acb)
         }
 
         BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
-        qemu_co_mutex_unlock(&s->lock);
         ret = bdrv_co_readv(bs->file,
                             (acb->cluster_offset >> 9) + index_in_cluster,
                             acb->cur_nr_sectors, &acb->hd_qiov);
-        qemu_co_mutex_lock(&s->lock);
         if (ret < 0) {
             return ret;
         }
@@ -553,17 +607,15 @@ static QCowAIOCB *qcow2_aio_setup(BlockDriverState *bs, int64_t sector_num,
 static int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                           int nb_sectors, QEMUIOVector *qiov)
 {
-    BDRVQcowState *s = bs->opaque;
     QCowAIOCB *acb;
     int ret;
 
     acb = qcow2_aio_setup(bs, sector_num, qiov, nb_sectors, NULL, NULL, 0);
 
-    qemu_co_mutex_lock(&s->lock);
+    /* s->lock is only taken for L2 loads and compressed clusters */
     do {
         ret = qcow2_aio_read_cb(acb);
     } while (ret > 0);
-    qemu_co_mutex_unlock(&s->lock);
 
     qemu_iovec_destroy(&acb->hd_qiov);
     qemu_aio_release(acb);
@@ -598,12 +650,16 @@ static int qcow2_aio_write_cb(QCowAIOCB *acb)
     int n_end;
     int ret;
 
-    ret = qcow2_alloc_cluster_link_l2(bs, &acb->l2meta);
-
-    run_dependent_requests(s, &acb->l2meta);
+    if (acb->l2meta.nb_clusters) {
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_alloc_cluster_link_l2(bs, &acb->l2meta);
+        run_dependent_requests(s, &acb->l2meta);
+        qemu_co_mutex_unlock(&s->lock);
 
-    if (ret < 0) {
-        return ret;
+        acb->l2meta.nb_clusters = 0;
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     acb->remaining_sectors -= acb->cur_nr_sectors;
@@ -621,13 +677,25 @@ static int qcow2_aio_write_cb(QCowAIOCB *acb)
         n_end > QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors)
         n_end = QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors;
 
-    ret = qcow2_alloc_cluster_offset(bs, acb->sector_num << 9,
-        index_in_cluster, n_end, &acb->cur_nr_sectors, &acb->l2meta);
-    if (ret < 0) {
+    /* rewrites of clusters that are only ours need no metadata update */
+    ret = -EAGAIN;
+    if (!s->crypt_method) {
+        acb->cur_nr_sectors = acb->remaining_sectors;
+        ret = qcow2_get_cluster_offset_cached(bs, acb->sector_num << 9,
+            &acb->cur_nr_sectors, &acb->cluster_offset, true);
+    }
+    if (ret == -EAGAIN) {
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_alloc_cluster_offset(bs, acb->sector_num << 9,
+            index_in_cluster, n_end, &acb->cur_nr_sectors, &acb->l2meta);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0) {
+            return ret;
+        }
+        acb->cluster_offset = acb->l2meta.cluster_offset;
+    } else if (ret < 0) {
         return ret;
     }
-
-    acb->cluster_offset = acb->l2meta.cluster_offset;
     assert((acb->cluster_offset & 511) == 0);
 
     qemu_iovec_reset(&acb->hd_qiov);
@@ -652,11 +720,9 @@ static int qcow2_aio_write_cb(QCowAIOCB *acb)
     }
 
     BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
-    qemu_co_mutex_unlock(&s->lock);
     ret = bdrv_co_writev(bs->file,
                          (acb->cluster_offset >> 9) + index_in_cluster,
                          acb->cur_nr_sectors, &acb->hd_qiov);
-    qemu_co_mutex_lock(&s->lock);
     if (ret < 0) {
         return ret;
     }
@@ -676,11 +742,10 @@ static int qcow2_co_writev(BlockDriverState *bs,
     acb = qcow2_aio_setup(bs, sector_num, qiov, nb_sectors, NULL, NULL, 1);
     s->cluster_cache_offset = -1; /* disable compressed cache */
 
-    qemu_co_mutex_lock(&s->lock);
+    /* s->lock is only taken to allocate clusters and link them in */
     do {
         ret = qcow2_aio_write_cb(acb);
     } while (ret > 0);
-    qemu_co_mutex_unlock(&s->lock);
 
     qemu_iovec_destroy(&acb->hd_qiov);
     qemu_aio_release(acb);
@@ -1050,11 +1115,79 @@ static int qcow2_make_empty(BlockDriverState *bs)
     return 0;
 }
 
-static int qcow2_discard(BlockDriverState *bs, int64_t sector_num,
-    int nb_sectors)
+static int coroutine_fn qcow2_co_discard(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
 {
-    return qcow2_discard_clusters(bs, sector_num << BDRV_SECTOR_BITS,
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_discard_clusters(bs, sector_num << BDRV_SECTOR_BITS,
         nb_sectors);
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
+
+static int coroutine_fn qcow2_write_zeroed_buffer(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    iov.iov_base = qemu_blockalign(bs, iov.iov_len);
+    memset(iov.iov_base, 0, iov.iov_len);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = qcow2_co_writev(bs, sector_num, nb_sectors, &qiov);
+
+    qemu_vfree(iov.iov_base);
+    return ret;
+}
+
+/*
+ * Without a backing file unallocated clusters read as zeroes, so clusters
+ * that are zeroed as a whole are simply deallocated.  Only the partial
+ * clusters at the start and end of the range are written out.
+ */
+static int coroutine_fn qcow2_co_write_zeroes(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t start, end;
+    int ret;
+
+    /* Would need a zero flag in L2 entries, which the format doesn't have */
+    if (bs->backing_hd) {
+        return -ENOTSUP;
+    }
+
+    start = (sector_num + s->cluster_sectors - 1) & ~(s->cluster_sectors - 1);
+    end = (sector_num + nb_sectors) & ~(s->cluster_sectors - 1);
+    if (start >= end) {
+        return -ENOTSUP;
+    }
+
+    if (start > sector_num) {
+        ret = qcow2_write_zeroed_buffer(bs, sector_num, start - sector_num);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_discard_clusters(bs, start << BDRV_SECTOR_BITS, end - start);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (sector_num + nb_sectors > end) {
+        ret = qcow2_write_zeroed_buffer(bs, end,
+                                        sector_num + nb_sectors - end);
+    }
+    return ret;
 }
 
 static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
@@ -1212,6 +1345,11 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     BDRVQcowState *s = bs->opaque;
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
+    bdi->has_cache_stats = true;
+    qcow2_cache_get_stats(s->l2_table_cache, &bdi->l2_cache_hits,
+                          &bdi->l2_cache_misses);
+    qcow2_cache_get_stats(s->refcount_block_cache, &bdi->refcount_cache_hits,
+                          &bdi->refcount_cache_misses);
     return 0;
 }
 
@@ -1316,6 +1454,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_create        = qcow2_create,
     .bdrv_flush         = qcow2_flush,
     .bdrv_is_allocated  = qcow2_is_allocated,
+    .bdrv_co_is_allocated = qcow2_co_is_allocated,
     .bdrv_set_key       = qcow2_set_key,
     .bdrv_make_empty    = qcow2_make_empty,
 
@@ -1323,7 +1462,8 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_co_writev     = qcow2_co_writev,
     .bdrv_aio_flush     = qcow2_aio_flush,
 
-    .bdrv_discard           = qcow2_discard,
+    .bdrv_co_discard        = qcow2_co_discard,
+    .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_truncate          = qcow2_truncate,
     .bdrv_write_compressed  = qcow2_write_compressed,
 
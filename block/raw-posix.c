@@ -76,10 +76,6 @@
 #include <sys/diskslice.h>
 #endif
 
-#ifdef CONFIG_XFS
-#include <xfs/xfs.h>
-#endif
-
 //#define DEBUG_FLOPPY
 
 //#define DEBUG_BLOCK
@@ -131,9 +127,7 @@ typedef struct BDRVRawState {
 #endif
     uint8_t *aligned_buf;
     unsigned aligned_buf_size;
-#ifdef CONFIG_XFS
-    bool is_xfs : 1;
-#endif
+    bool has_write_zeroes;
 } BDRVRawState;
 
 static int fd_open(BlockDriverState *bs);
@@ -217,6 +211,7 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
     }
     s->fd = fd;
     s->aligned_buf = NULL;
+    s->has_write_zeroes = true;
 
     if ((bdrv_flags & BDRV_O_NOCACHE)) {
         /*
@@ -252,12 +247,6 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
 #endif
     }
 
-#ifdef CONFIG_XFS
-    if (platform_test_xfs_fd(s->fd)) {
-        s->is_xfs = 1;
-    }
-#endif
-
     return 0;
 
 out_free_buf:
@@ -604,6 +593,28 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
                        cb, opaque, type);
 }
 
+static void raw_aio_plug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_plug(s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_aio_unplug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_unplug(s->aio_ctx);
+    }
+#endif
+}
+
 static BlockDriverAIOCB *raw_aio_readv(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
@@ -620,6 +631,37 @@ static BlockDriverAIOCB *raw_aio_writev(BlockDriverState *bs,
                           cb, opaque, QEMU_AIO_WRITE);
 }
 
+#ifdef CONFIG_LINUX_AIO
+/*
+ * Returns the file descriptor of a raw image that is opened for Linux AIO,
+ * for users that submit requests on their own instead of going through the
+ * block layer.
+ */
+int raw_get_aio_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s;
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+
+    if (!strcmp(bs->drv->format_name, "raw")) {
+        bs = bs->file;
+    }
+
+    /* raw-posix has several protocols, they all share raw_aio_readv */
+    if (!bs || !bs->drv || bs->drv->bdrv_aio_readv != raw_aio_readv) {
+        return -ENOTSUP;
+    }
+
+    s = bs->opaque;
+    if (!s->use_aio) {
+        return -ENOTSUP;
+    }
+    return s->fd;
+}
+#endif
+
 static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
@@ -631,6 +673,73 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
+/*
+ * Punches a hole into image files and passes the discard down to host block
+ * devices.  This runs in the thread pool because it can take a while on
+ * large ranges.
+ */
+static BlockDriverAIOCB *raw_aio_discard(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (fd_open(bs) < 0)
+        return NULL;
+
+    return paio_submit(bs, s->fd, sector_num, NULL, nb_sectors, cb, opaque,
+                       QEMU_AIO_DISCARD);
+}
+
+typedef struct RawWriteZeroesCo {
+    Coroutine *co;
+    int ret;
+} RawWriteZeroesCo;
+
+static void raw_write_zeroes_cb(void *opaque, int ret)
+{
+    RawWriteZeroesCo *zco = opaque;
+
+    zco->ret = ret;
+    qemu_coroutine_enter(zco->co, NULL);
+}
+
+/*
+ * Zeroes a range with fallocate(FALLOC_FL_ZERO_RANGE) on image files and
+ * BLKZEROOUT on host block devices, so no zeroed buffers have to be
+ * written.  -ENOTSUP makes the block layer fall back to writing them.
+ */
+static int coroutine_fn raw_co_write_zeroes(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
+{
+    BDRVRawState *s = bs->opaque;
+    RawWriteZeroesCo zco = {
+        .co = qemu_coroutine_self(),
+    };
+
+    if (!s->has_write_zeroes) {
+        return -ENOTSUP;
+    }
+    if (fd_open(bs) < 0) {
+        return -EIO;
+    }
+
+    if (!paio_submit(bs, s->fd, sector_num, NULL, nb_sectors,
+                     raw_write_zeroes_cb, &zco, QEMU_AIO_WRITE_ZEROES)) {
+        return -EIO;
+    }
+    qemu_coroutine_yield();
+
+    /* Don't bother the thread pool again if the host can't do it */
+    if (zco.ret == -ENOTSUP) {
+        s->has_write_zeroes = false;
+    } else if (zco.ret == -EINVAL) {
+        /* e.g. a misaligned range, write out zeroes for this one only */
+        return -ENOTSUP;
+    }
+    return zco.ret;
+}
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
@@ -838,37 +947,6 @@ static int raw_flush(BlockDriverState *bs)
     return qemu_fdatasync(s->fd);
 }
 
-#ifdef CONFIG_XFS
-static int xfs_discard(BDRVRawState *s, int64_t sector_num, int nb_sectors)
-{
-    struct xfs_flock64 fl;
-
-    memset(&fl, 0, sizeof(fl));
-    fl.l_whence = SEEK_SET;
-    fl.l_start = sector_num << 9;
-    fl.l_len = (int64_t)nb_sectors << 9;
-
-    if (xfsctl(NULL, s->fd, XFS_IOC_UNRESVSP64, &fl) < 0) {
-        DEBUG_BLOCK_PRINT("cannot punch hole (%s)\n", strerror(errno));
-        return -errno;
-    }
-
-    return 0;
-}
-#endif
-
-static int raw_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
-{
-#ifdef CONFIG_XFS
-    BDRVRawState *s = bs->opaque;
-
-    if (s->is_xfs) {
-        return xfs_discard(s, sector_num, nb_sectors);
-    }
-#endif
-
-    return 0;
-}
 
 static QEMUOptionParameter raw_create_options[] = {
     {
@@ -890,11 +968,14 @@ static BlockDriver bdrv_file = {
     .bdrv_close = raw_close,
     .bdrv_create = raw_create,
     .bdrv_flush = raw_flush,
-    .bdrv_discard = raw_discard,
 
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
     .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_aio_discard = raw_aio_discard,
+    .bdrv_co_write_zeroes = raw_co_write_zeroes,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
@@ -1164,6 +1245,10 @@ static BlockDriver bdrv_host_device = {
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_aio_discard   = raw_aio_discard,
+    .bdrv_co_write_zeroes = raw_co_write_zeroes,
+    .bdrv_io_plug       = raw_aio_plug,
+    .bdrv_io_unplug     = raw_aio_unplug,
 
     .bdrv_read          = raw_read,
     .bdrv_write         = raw_write,
@@ -11,6 +11,7 @@
 #include "blockdev.h"
 #include "monitor.h"
 #include "qerror.h"
+#include "qjson.h"
 #include "qemu-option.h"
 #include "qemu-config.h"
 #include "sysemu.h"
@@ -236,10 +237,13 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     int ro = 0;
     int bdrv_flags = 0;
     int on_read_error, on_write_error;
+    uint64_t l2_cache_size, l2_cache_coverage, refcount_cache_size;
+    BlockIOLimit io_limits;
     const char *devaddr;
     DriveInfo *dinfo;
     int is_extboot = 0;
     int snapshot = 0;
+    int copy_on_read;
     int ret;
 
     translation = BIOS_ATA_TRANSLATION_AUTO;
@@ -256,6 +260,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
 
     snapshot = qemu_opt_get_bool(opts, "snapshot", 0);
     ro = qemu_opt_get_bool(opts, "readonly", 0);
+    copy_on_read = qemu_opt_get_bool(opts, "copy-on-read", 0);
 
     file = qemu_opt_get(opts, "file");
     serial = qemu_opt_get(opts, "serial");
@@ -398,6 +403,36 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         }
     }
 
+    l2_cache_size = qemu_opt_get_size(opts, "l2-cache-size", 0);
+    l2_cache_coverage = qemu_opt_get_size(opts, "l2-cache-coverage", 0);
+    refcount_cache_size = qemu_opt_get_size(opts, "refcount-cache-size", 0);
+    if (l2_cache_size && l2_cache_coverage) {
+        error_report("l2-cache-size and l2-cache-coverage are mutually "
+                     "exclusive");
+        return NULL;
+    }
+
+    /* disk I/O throttling */
+    io_limits.bps[BLOCK_IO_LIMIT_TOTAL] =
+                           qemu_opt_get_number(opts, "bps", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_READ] =
+                           qemu_opt_get_number(opts, "bps_rd", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_WRITE] =
+                           qemu_opt_get_number(opts, "bps_wr", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_TOTAL] =
+                           qemu_opt_get_number(opts, "iops", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_READ] =
+                           qemu_opt_get_number(opts, "iops_rd", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
+                           qemu_opt_get_number(opts, "iops_wr", 0);
+
+    if (!bdrv_io_limits_valid(&io_limits)) {
+        error_report("bps and iops values must not be negative, and "
+                     "bps(iops) cannot be combined with bps_rd/bps_wr"
+                     "(iops_rd/iops_wr)");
+        return NULL;
+    }
+
     if ((devaddr = qemu_opt_get(opts, "addr")) != NULL) {
         if (type != IF_VIRTIO) {
             error_report("addr is not supported by this bus type");
@@ -482,6 +517,9 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     }
 
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
+    bdrv_set_cache_size(dinfo->bdrv, l2_cache_size, l2_cache_coverage,
+                        refcount_cache_size);
+    bdrv_set_io_limits(dinfo->bdrv, &io_limits);
 
     switch(type) {
     case IF_IDE:
@@ -542,6 +580,14 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
 
     bdrv_flags |= ro ? 0 : BDRV_O_RDWR;
 
+    if (copy_on_read) {
+        if (ro) {
+            error_report("warning: disabling copy-on-read on readonly drive");
+        } else {
+            bdrv_flags |= BDRV_O_COPY_ON_READ;
+        }
+    }
+
     ret = bdrv_open(dinfo->bdrv, file, bdrv_flags, drv);
     if (ret < 0) {
         error_report("could not open disk image %s: %s",
@@ -631,7 +677,7 @@ int do_snapshot_blkdev(Monitor *mon, const QDict *qdict, QObject **ret_data)
         goto out;
     }
 
-    qemu_aio_flush();
+    bdrv_drain_all();
     bdrv_flush(bs);
 
     bdrv_close(bs);
@@ -756,7 +802,7 @@ int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
     }
 
     /* quiesce block driver; prevent further io */
-    qemu_aio_flush();
+    bdrv_drain_all();
     bdrv_flush(bs);
     bdrv_close(bs);
 
@@ -803,3 +849,260 @@ int do_block_resize(Monitor *mon, const QDict *qdict, QObject **ret_data)
 
     return 0;
 }
+
+int do_block_set_io_throttle(Monitor *mon,
+                             const QDict *qdict, QObject **ret_data)
+{
+    BlockIOLimit io_limits;
+    const char *devname = qdict_get_str(qdict, "device");
+    BlockDriverState *bs;
+
+    bs = bdrv_find(devname);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, devname);
+        return -1;
+    }
+
+    io_limits.bps[BLOCK_IO_LIMIT_TOTAL] = qdict_get_try_int(qdict, "bps", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_READ] = qdict_get_try_int(qdict, "bps_rd", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_WRITE] = qdict_get_try_int(qdict, "bps_wr", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_TOTAL] = qdict_get_try_int(qdict, "iops", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_READ] =
+                        qdict_get_try_int(qdict, "iops_rd", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
+                        qdict_get_try_int(qdict, "iops_wr", 0);
+
+    if (!bdrv_io_limits_valid(&io_limits)) {
+        qerror_report(QERR_INVALID_PARAMETER_COMBINATION);
+        return -1;
+    }
+
+    bdrv_set_io_limits(bs, &io_limits);
+
+    return 0;
+}
+
+static QObject *qobject_from_block_job(BlockJob *job)
+{
+    return qobject_from_jsonf("{ 'type': %s,"
+                              "'device': %s,"
+                              "'len': %" PRId64 ","
+                              "'offset': %" PRId64 ","
+                              "'speed': %" PRId64 " }",
+                              job->job_type->job_type,
+                              bdrv_get_device_name(job->bs),
+                              job->len,
+                              job->offset,
+                              job->speed);
+}
+
+static void block_job_cb(void *opaque, int ret)
+{
+    BlockDriverState *bs = opaque;
+    QObject *obj;
+
+    obj = qobject_from_block_job(bs->job);
+    if (ret < 0) {
+        QDict *dict = qobject_to_qdict(obj);
+        qdict_put(dict, "error", qstring_from_str(strerror(-ret)));
+    }
+
+    if (block_job_is_cancelled(bs->job)) {
+        monitor_protocol_event(QEVENT_BLOCK_JOB_CANCELLED, obj);
+    } else {
+        monitor_protocol_event(QEVENT_BLOCK_JOB_COMPLETED, obj);
+    }
+    qobject_decref(obj);
+}
+
+int do_block_stream(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    int64_t speed = qdict_get_try_int(qdict, "speed", 0);
+    BlockDriverState *bs;
+    int ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+
+    if (!bs->backing_hd) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "device",
+                      "a device with a backing file");
+        return -1;
+    }
+
+    ret = stream_start(bs, speed, block_job_cb, bs);
+    if (ret == -EBUSY) {
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        return -1;
+    } else if (ret < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "speed",
+                      "a non-negative value");
+        return -1;
+    }
+
+    return 0;
+}
+
+int do_drive_mirror(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    const char *target = qdict_get_str(qdict, "target");
+    const char *format = qdict_get_try_str(qdict, "format");
+    int64_t speed = qdict_get_try_int(qdict, "speed", 0);
+    BlockDriverState *bs, *target_bs;
+    BlockDriver *drv;
+    int64_t size;
+    int flags, ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+    if (!bdrv_is_inserted(bs)) {
+        qerror_report(QERR_DEVICE_NOT_ACTIVE, device);
+        return -1;
+    }
+    if (bs->job || bdrv_in_use(bs)) {
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        return -1;
+    }
+    if (speed < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "speed",
+                      "a non-negative value");
+        return -1;
+    }
+
+    if (!format) {
+        format = bs->drv->format_name;
+    }
+    drv = bdrv_find_format(format);
+    if (!drv) {
+        qerror_report(QERR_INVALID_BLOCK_FORMAT, format);
+        return -1;
+    }
+
+    /* The mirror is a full copy, it does not share the backing file */
+    size = bdrv_getlength(bs);
+    flags = bs->open_flags | BDRV_O_RDWR;
+    flags &= ~(BDRV_O_SNAPSHOT | BDRV_O_COPY_ON_READ);
+    ret = bdrv_img_create(target, format, NULL, NULL, NULL, size, flags);
+    if (ret) {
+        return -1;
+    }
+
+    target_bs = bdrv_new("");
+    ret = bdrv_open(target_bs, target, flags | BDRV_O_NO_BACKING, drv);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        qerror_report(QERR_OPEN_FILE_FAILED, target);
+        return -1;
+    }
+
+    ret = mirror_start(bs, target_bs, speed, block_job_cb, bs);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        return -1;
+    }
+
+    return 0;
+}
+
+static BlockJob *find_block_job(const char *device)
+{
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs || !bs->job) {
+        return NULL;
+    }
+    return bs->job;
+}
+
+int do_block_job_set_speed(Monitor *mon, const QDict *qdict,
+                           QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    int64_t value = qdict_get_int(qdict, "value");
+    BlockJob *job = find_block_job(device);
+    int ret;
+
+    if (!job) {
+        qerror_report(QERR_BLOCK_JOB_NOT_ACTIVE, device);
+        return -1;
+    }
+
+    ret = block_job_set_speed(job, value);
+    if (ret == -ENOTSUP) {
+        qerror_report(QERR_UNSUPPORTED);
+        return -1;
+    } else if (ret < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "value",
+                      "a non-negative value");
+        return -1;
+    }
+
+    return 0;
+}
+
+int do_block_job_cancel(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockJob *job = find_block_job(device);
+
+    if (!job) {
+        qerror_report(QERR_BLOCK_JOB_NOT_ACTIVE, device);
+        return -1;
+    }
+
+    block_job_cancel(job);
+    return 0;
+}
+
+static void block_job_iter(QObject *obj, void *opaque)
+{
+    Monitor *mon = opaque;
+    QDict *job = qobject_to_qdict(obj);
+
+    monitor_printf(mon, "Type %s, device %s: Completed %" PRId64
+                   " of %" PRId64 " bytes, speed limit %" PRId64
+                   " bytes/s\n",
+                   qdict_get_str(job, "type"),
+                   qdict_get_str(job, "device"),
+                   qdict_get_int(job, "offset"),
+                   qdict_get_int(job, "len"),
+                   qdict_get_int(job, "speed"));
+}
+
+void do_info_block_jobs_print(Monitor *mon, const QObject *data)
+{
+    QList *list = qobject_to_qlist(data);
+
+    if (qlist_empty(list)) {
+        monitor_printf(mon, "No active jobs\n");
+        return;
+    }
+    qlist_iter(list, block_job_iter, mon);
+}
+
+static void do_info_block_jobs_one(void *opaque, BlockDriverState *bs)
+{
+    QList *list = opaque;
+
+    if (bs->job) {
+        qlist_append_obj(list, qobject_from_block_job(bs->job));
+    }
+}
+
+void do_info_block_jobs(Monitor *mon, QObject **ret_data)
+{
+    QList *list = qlist_new();
+
+    bdrv_iterate(do_info_block_jobs_one, list);
+    *ret_data = QOBJECT(list);
+}
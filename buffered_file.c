@@ -15,10 +15,17 @@
 #include "hw/hw.h"
 #include "qemu-timer.h"
 #include "qemu-char.h"
+#include "qemu-thread.h"
 #include "buffered_file.h"
 
 //#define DEBUG_BUFFERED_FILE
 
+/* length of a rate limiting period, in ms */
+#define BUFFER_DELAY 100
+
+/* the producer is held back once this much data waits to be written */
+#define BUFFER_MAX_PENDING (1 << 20)
+
 typedef struct QEMUFileBuffered
 {
     BufferedPutFunc *put_buffer;
@@ -28,13 +35,26 @@ typedef struct QEMUFileBuffered
     void *opaque;
     QEMUFile *file;
     int has_error;
-    int freeze_output;
+    int closing;
+    /* set if the file was closed from put_ready, the thread frees it */
+    int closed_in_thread;
     size_t bytes_xfer;
     size_t xfer_limit;
+    /* the producer is held back once buffer holds this much */
+    size_t max_pending;
+    /* called once without the global mutex after the next flush */
+    BufferedWaitFunc *wait;
+    /* filled by the savevm code, with the global mutex held */
     uint8_t *buffer;
     size_t buffer_size;
     size_t buffer_capacity;
-    QEMUTimer *timer;
+    /* written out by the migration thread, without the global mutex */
+    uint8_t *out;
+    size_t out_size;
+    size_t out_offset;
+    size_t out_capacity;
+    /* protects buffer and bytes_xfer */
+    QemuMutex lock;
 } QEMUFileBuffered;
 
 #ifdef DEBUG_BUFFERED_FILE
@@ -45,6 +65,19 @@ typedef struct QEMUFileBuffered
     do { } while (0)
 #endif
 
+/*
+ * The migration thread is created with the first outgoing migration and
+ * drives one buffered file at a time.  It writes the data out and waits for
+ * the backend without holding the global mutex, and only takes it to call
+ * put_ready, which queues the next chunk of the migration stream.
+ */
+static QemuThread buffered_thread;
+static int buffered_thread_created;
+static QemuMutex buffered_thread_lock;
+static QemuCond buffered_thread_cond;
+/* the file the thread is driving, NULL while it is idle */
+static QEMUFileBuffered *buffered_current;
+
 static void buffered_append(QEMUFileBuffered *s,
                             const uint8_t *buf, size_t size)
 {
@@ -69,48 +102,64 @@ static void buffered_append(QEMUFileBuffered *s,
     s->buffer_size += size;
 }
 
-static void buffered_flush(QEMUFileBuffered *s)
+static int buffered_pending(QEMUFileBuffered *s)
 {
-    size_t offset = 0;
-
-    if (s->has_error) {
-        DPRINTF("flush when error, bailing\n");
-        return;
-    }
-
-    DPRINTF("flushing %zu byte(s) of data\n", s->buffer_size);
+    return s->out_offset < s->out_size || s->buffer_size;
+}
 
-    while (offset < s->buffer_size) {
+/*
+ * Writes out what has been queued so far.  Returns 1 if the backend is not
+ * ready for more, 0 once everything is written or on error.
+ */
+static int buffered_flush(QEMUFileBuffered *s)
+{
+    while (!s->has_error) {
         ssize_t ret;
 
-        ret = s->put_buffer(s->opaque, s->buffer + offset,
-                            s->buffer_size - offset);
+        if (s->out_offset == s->out_size) {
+            uint8_t *tmp = s->out;
+            size_t capacity = s->out_capacity;
+
+            /* swap buffers so the producer can go on queueing */
+            qemu_mutex_lock(&s->lock);
+            s->out = s->buffer;
+            s->out_size = s->buffer_size;
+            s->out_capacity = s->buffer_capacity;
+            s->buffer = tmp;
+            s->buffer_size = 0;
+            s->buffer_capacity = capacity;
+            qemu_mutex_unlock(&s->lock);
+            s->out_offset = 0;
+
+            if (!s->out_size) {
+                return 0;
+            }
+            DPRINTF("flushing %zu byte(s) of data\n", s->out_size);
+        }
+
+        ret = s->put_buffer(s->opaque, s->out + s->out_offset,
+                            s->out_size - s->out_offset);
         if (ret == -EAGAIN) {
-            DPRINTF("backend not ready, freezing\n");
-            s->freeze_output = 1;
-            break;
+            DPRINTF("backend not ready\n");
+            return 1;
         }
 
         if (ret <= 0) {
             DPRINTF("error flushing data, %zd\n", ret);
             s->has_error = 1;
             break;
-        } else {
-            DPRINTF("flushed %zd byte(s)\n", ret);
-            offset += ret;
         }
+
+        DPRINTF("flushed %zd byte(s)\n", ret);
+        s->out_offset += ret;
     }
 
-    DPRINTF("flushed %zu of %zu byte(s)\n", offset, s->buffer_size);
-    memmove(s->buffer, s->buffer + offset, s->buffer_size - offset);
-    s->buffer_size -= offset;
+    return 0;
 }
 
 static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, int size)
 {
     QEMUFileBuffered *s = opaque;
-    int offset = 0;
-    ssize_t ret;
 
     DPRINTF("putting %d bytes at %" PRId64 "\n", size, pos);
 
@@ -119,72 +168,57 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, in
         return -EINVAL;
     }
 
-    DPRINTF("unfreezing output\n");
-    s->freeze_output = 0;
-
-    buffered_flush(s);
+    qemu_mutex_lock(&s->lock);
+    buffered_append(s, buf, size);
+    s->bytes_xfer += size;
+    qemu_mutex_unlock(&s->lock);
 
-    while (!s->freeze_output && offset < size) {
-        if (s->bytes_xfer > s->xfer_limit) {
-            DPRINTF("transfer limit exceeded when putting\n");
-            break;
-        }
-
-        ret = s->put_buffer(s->opaque, buf + offset, size - offset);
-        if (ret == -EAGAIN) {
-            DPRINTF("backend not ready, freezing\n");
-            s->freeze_output = 1;
-            break;
-        }
-
-        if (ret <= 0) {
-            DPRINTF("error putting\n");
-            s->has_error = 1;
-            offset = -EINVAL;
-            break;
-        }
-
-        DPRINTF("put %zd byte(s)\n", ret);
-        offset += ret;
-        s->bytes_xfer += ret;
-    }
-
-    if (offset >= 0) {
-        DPRINTF("buffering %d bytes\n", size - offset);
-        buffered_append(s, buf + offset, size - offset);
-        offset = size;
-    }
-
-    if (pos == 0 && size == 0) {
-        DPRINTF("file is ready\n");
-        if (s->bytes_xfer <= s->xfer_limit) {
-            DPRINTF("notifying client\n");
-            s->put_ready(s->opaque);
-        }
-    }
+    return size;
+}
 
-    return offset;
+static void buffered_free(QEMUFileBuffered *s)
+{
+    qemu_mutex_destroy(&s->lock);
+    g_free(s->buffer);
+    g_free(s->out);
+    g_free(s);
 }
 
 static int buffered_close(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
+    int in_thread = qemu_thread_is_self(&buffered_thread);
     int ret;
 
     DPRINTF("closing\n");
 
-    while (!s->has_error && s->buffer_size) {
-        buffered_flush(s);
-        if (s->freeze_output)
-            s->wait_for_unfreeze(s);
+    qemu_mutex_lock(&buffered_thread_lock);
+    s->closing = 1;
+    if (!in_thread) {
+        /* the thread may be waiting for the global mutex to call put_ready */
+        qemu_mutex_unlock_iothread();
+        while (buffered_current == s) {
+            qemu_cond_wait(&buffered_thread_cond, &buffered_thread_lock);
+        }
+        qemu_mutex_unlock(&buffered_thread_lock);
+        qemu_mutex_lock_iothread();
+    } else {
+        qemu_mutex_unlock(&buffered_thread_lock);
+    }
+
+    while (!s->has_error && buffered_pending(s)) {
+        if (buffered_flush(s)) {
+            s->wait_for_unfreeze(s->opaque);
+        }
     }
 
     ret = s->close(s->opaque);
 
-    qemu_del_timer(s->timer);
-    qemu_free_timer(s->timer);
-    g_free(s->buffer);
-    g_free(s);
+    if (in_thread) {
+        s->closed_in_thread = 1;
+    } else {
+        buffered_free(s);
+    }
 
     return ret;
 }
@@ -192,17 +226,71 @@ static int buffered_close(void *opaque)
 static int buffered_rate_limit(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
+    int ret = 0;
 
     if (s->has_error)
         return 0;
 
-    if (s->freeze_output)
-        return 1;
+    qemu_mutex_lock(&s->lock);
+    if (s->bytes_xfer > s->xfer_limit ||
+        s->buffer_size >= s->max_pending) {
+        ret = 1;
+    }
+    qemu_mutex_unlock(&s->lock);
 
-    if (s->bytes_xfer > s->xfer_limit)
-        return 1;
+    return ret;
+}
 
-    return 0;
+/*
+ * Counts len bytes that were sent next to the file, on the RAM data
+ * channels, against its bandwidth limit.
+ */
+void qemu_buffered_file_account(QEMUFile *f, size_t len)
+{
+    QEMUFileBuffered *s;
+
+    qemu_mutex_lock(&buffered_thread_lock);
+    s = buffered_current;
+    if (s && s->file == f) {
+        qemu_mutex_lock(&s->lock);
+        s->bytes_xfer += len;
+        qemu_mutex_unlock(&s->lock);
+    }
+    qemu_mutex_unlock(&buffered_thread_lock);
+}
+
+/*
+ * Changes how much data may wait to be written before the producer is held
+ * back, BUFFER_MAX_PENDING by default.
+ */
+void qemu_buffered_file_set_max_pending(QEMUFile *f, size_t max)
+{
+    QEMUFileBuffered *s;
+
+    qemu_mutex_lock(&buffered_thread_lock);
+    s = buffered_current;
+    if (s && s->file == f) {
+        qemu_mutex_lock(&s->lock);
+        s->max_pending = max;
+        qemu_mutex_unlock(&s->lock);
+    }
+    qemu_mutex_unlock(&buffered_thread_lock);
+}
+
+/*
+ * Makes the thread call wait once everything queued so far is written out,
+ * without the global mutex, before it calls put_ready again.
+ */
+void qemu_buffered_file_wait(QEMUFile *f, BufferedWaitFunc *wait)
+{
+    QEMUFileBuffered *s;
+
+    qemu_mutex_lock(&buffered_thread_lock);
+    s = buffered_current;
+    if (s && s->file == f) {
+        s->wait = wait;
+    }
+    qemu_mutex_unlock(&buffered_thread_lock);
 }
 
 static int64_t buffered_set_rate_limit(void *opaque, int64_t new_rate)
@@ -228,26 +316,80 @@ static int64_t buffered_get_rate_limit(void *opaque)
     return s->xfer_limit;
 }
 
-static void buffered_rate_tick(void *opaque)
+static void buffered_file_run(QEMUFileBuffered *s)
 {
-    QEMUFileBuffered *s = opaque;
+    int64_t slice_start = qemu_get_clock_ms(rt_clock);
 
-    if (s->has_error) {
-        buffered_close(s);
-        return;
+    while (!s->closing) {
+        int64_t now = qemu_get_clock_ms(rt_clock);
+        size_t bytes_xfer;
+
+        if (now >= slice_start + BUFFER_DELAY) {
+            qemu_mutex_lock(&s->lock);
+            s->bytes_xfer = 0;
+            qemu_mutex_unlock(&s->lock);
+            slice_start = now;
+        }
+
+        if (buffered_flush(s)) {
+            s->wait_for_unfreeze(s->opaque);
+            continue;
+        }
+
+        if (s->wait) {
+            BufferedWaitFunc *wait = s->wait;
+
+            s->wait = NULL;
+            if (!s->has_error) {
+                wait(s->opaque);
+            }
+        }
+
+        qemu_mutex_lock(&s->lock);
+        bytes_xfer = s->bytes_xfer;
+        qemu_mutex_unlock(&s->lock);
+
+        if (!s->has_error && bytes_xfer > s->xfer_limit) {
+            DPRINTF("transfer limit exceeded, sleeping\n");
+            usleep((slice_start + BUFFER_DELAY - now) * 1000);
+            continue;
+        }
+
+        qemu_mutex_lock_iothread();
+        if (!s->closing) {
+            if (s->has_error) {
+                qemu_file_set_error(s->file);
+            }
+            DPRINTF("notifying client\n");
+            s->put_ready(s->opaque);
+        }
+        qemu_mutex_unlock_iothread();
     }
+}
 
-    qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock) + 100);
+static void *buffered_file_thread(void *opaque)
+{
+    QEMUFileBuffered *s;
 
-    if (s->freeze_output)
-        return;
+    qemu_mutex_lock(&buffered_thread_lock);
+    for (;;) {
+        while (!buffered_current) {
+            qemu_cond_wait(&buffered_thread_cond, &buffered_thread_lock);
+        }
+        s = buffered_current;
+        qemu_mutex_unlock(&buffered_thread_lock);
 
-    s->bytes_xfer = 0;
+        buffered_file_run(s);
 
-    buffered_flush(s);
+        qemu_mutex_lock(&buffered_thread_lock);
+        buffered_current = NULL;
+        qemu_cond_broadcast(&buffered_thread_cond);
+        if (s->closed_in_thread) {
+            buffered_free(s);
+        }
+    }
 
-    /* Add some checks around this */
-    s->put_ready(s->opaque);
+    return NULL;
 }
 
 QEMUFile *qemu_fopen_ops_buffered(void *opaque,
@@ -263,19 +405,36 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque,
 
     s->opaque = opaque;
     s->xfer_limit = bytes_per_sec / 10;
+    s->max_pending = BUFFER_MAX_PENDING;
     s->put_buffer = put_buffer;
     s->put_ready = put_ready;
     s->wait_for_unfreeze = wait_for_unfreeze;
     s->close = close;
+    qemu_mutex_init(&s->lock);
 
     s->file = qemu_fopen_ops(s, buffered_put_buffer, NULL,
                              buffered_close, buffered_rate_limit,
                              buffered_set_rate_limit,
 			     buffered_get_rate_limit);
 
-    s->timer = qemu_new_timer_ms(rt_clock, buffered_rate_tick, s);
+    if (!buffered_thread_created) {
+        qemu_mutex_init(&buffered_thread_lock);
+        qemu_cond_init(&buffered_thread_cond);
+        qemu_thread_create(&buffered_thread, buffered_file_thread, NULL);
+        buffered_thread_created = 1;
+    }
 
-    qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock) + 100);
+    /*
+     * put_ready is called from the thread once the caller drops the global
+     * mutex.  The previous migration may still be on its way out.
+     */
+    qemu_mutex_lock(&buffered_thread_lock);
+    while (buffered_current) {
+        qemu_cond_wait(&buffered_thread_cond, &buffered_thread_lock);
+    }
+    buffered_current = s;
+    qemu_cond_broadcast(&buffered_thread_cond);
+    qemu_mutex_unlock(&buffered_thread_lock);
 
     return s->file;
 }
@@ -20,6 +20,7 @@ typedef ssize_t (BufferedPutFunc)(void *opaque, const void *data, size_t size);
 typedef void (BufferedPutReadyFunc)(void *opaque);
 typedef void (BufferedWaitForUnfreezeFunc)(void *opaque);
 typedef int (BufferedCloseFunc)(void *opaque);
+typedef void (BufferedWaitFunc)(void *opaque);
 
 QEMUFile *qemu_fopen_ops_buffered(void *opaque, size_t xfer_limit,
                                   BufferedPutFunc *put_buffer,
@@ -27,4 +28,8 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque, size_t xfer_limit,
                                   BufferedWaitForUnfreezeFunc *wait_for_unfreeze,
                                   BufferedCloseFunc *close);
 
+void qemu_buffered_file_account(QEMUFile *f, size_t len);
+void qemu_buffered_file_set_max_pending(QEMUFile *f, size_t max);
+void qemu_buffered_file_wait(QEMUFile *f, BufferedWaitFunc *wait);
+
 #endif
@@ -487,7 +487,8 @@ typedef struct RAMBlock {
 } RAMBlock;
 
 typedef struct RAMList {
-    uint8_t *phys_dirty;
+    /* one bit per page for each DIRTY_MEMORY_* client */
+    unsigned long *dirty_memory[DIRTY_MEMORY_NUM];
     QLIST_HEAD(, RAMBlock) blocks;
 } RAMList;
 extern RAMList ram_list;
@@ -513,52 +514,68 @@ extern int mem_prealloc;
 /* Set if TLB entry is an IO callback.  */
 #define TLB_MMIO        (1 << 5)
 
-#define VGA_DIRTY_FLAG       0x01
-#define CODE_DIRTY_FLAG      0x02
-#define MIGRATION_DIRTY_FLAG 0x08
+#define VGA_DIRTY_FLAG       (1 << DIRTY_MEMORY_VGA)
+#define CODE_DIRTY_FLAG      (1 << DIRTY_MEMORY_CODE)
+#define MIGRATION_DIRTY_FLAG (1 << DIRTY_MEMORY_MIGRATION)
+#define ALL_DIRTY_FLAGS      ((1 << DIRTY_MEMORY_NUM) - 1)
 
-/* read dirty bit (return 0 or 1) */
-static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
+static inline int cpu_physical_memory_get_dirty(ram_addr_t addr,
+                                                int dirty_flags)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] == 0xff;
+    unsigned long page = addr >> TARGET_PAGE_BITS;
+    int client, ret = 0;
+
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        if ((dirty_flags & (1 << client)) &&
+            (ram_list.dirty_memory[client][page / HOST_LONG_BITS] &
+             (1UL << (page % HOST_LONG_BITS)))) {
+            ret |= 1 << client;
+        }
+    }
+    return ret;
 }
 
 static inline int cpu_physical_memory_get_dirty_flags(ram_addr_t addr)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS];
+    return cpu_physical_memory_get_dirty(addr, ALL_DIRTY_FLAGS);
 }
 
-static inline int cpu_physical_memory_get_dirty(ram_addr_t addr,
-                                                int dirty_flags)
+/* read dirty bit (return 0 or 1) */
+static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] & dirty_flags;
+    return cpu_physical_memory_get_dirty_flags(addr) == ALL_DIRTY_FLAGS;
 }
 
-static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
+static inline void cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
+                                                       int dirty_flags)
 {
-    ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] = 0xff;
+    unsigned long page = addr >> TARGET_PAGE_BITS;
+    int client;
+
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        if (dirty_flags & (1 << client)) {
+            ram_list.dirty_memory[client][page / HOST_LONG_BITS] |=
+                1UL << (page % HOST_LONG_BITS);
+        }
+    }
 }
 
-static inline int cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
-                                                      int dirty_flags)
+static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] |= dirty_flags;
+    cpu_physical_memory_set_dirty_flags(addr, ALL_DIRTY_FLAGS);
 }
 
-static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
-                                                        int length,
-                                                        int dirty_flags)
-{
-    int i, mask, len;
-    uint8_t *p;
-
-    len = length >> TARGET_PAGE_BITS;
-    mask = ~dirty_flags;
-    p = ram_list.phys_dirty + (start >> TARGET_PAGE_BITS);
-    for (i = 0; i < len; i++) {
-        p[i] &= mask;
-    }
-}
+void cpu_physical_memory_set_dirty_range(ram_addr_t start, ram_addr_t length,
+                                         int dirty_flags);
+void cpu_physical_memory_mask_dirty_range(ram_addr_t start, ram_addr_t length,
+                                          int dirty_flags);
+ram_addr_t cpu_physical_memory_find_next_dirty(ram_addr_t start,
+                                               ram_addr_t end,
+                                               int dirty_flag);
+void cpu_physical_memory_dirty_alloc(ram_addr_t end);
+void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
+                                            ram_addr_t start,
+                                            ram_addr_t pages);
 
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
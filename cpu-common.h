@@ -22,6 +22,14 @@ enum device_endian {
     DEVICE_LITTLE_ENDIAN,
 };
 
+/* Clients of the dirty memory tracking, each has its own bitmap.  To be
+ * replaced with dynamic registration.
+ */
+#define DIRTY_MEMORY_VGA       0
+#define DIRTY_MEMORY_CODE      1
+#define DIRTY_MEMORY_MIGRATION 2
+#define DIRTY_MEMORY_NUM       3
+
 /* address in the RAM (different from a physical address) */
 #if defined(CONFIG_XEN_BACKEND) && TARGET_PHYS_ADDR_BITS == 64
 typedef uint64_t ram_addr_t;
@@ -213,6 +213,7 @@ typedef struct CPUWatchpoint {
     struct QemuThread *thread;                                          \
     struct QemuCond *halt_cond;                                         \
     int thread_kicked;                                                  \
+    int throttle_pending; /* Sleep before running again */              \
     struct qemu_work_item *queued_work_first, *queued_work_last;        \
     const char *cpu_model_str;                                          \
     struct KVMState *kvm_state;                                         \
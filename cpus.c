@@ -125,7 +125,7 @@ static void do_vm_stop(int reason)
         vm_running = 0;
         pause_all_vcpus();
         vm_state_notify(0, reason);
-        qemu_aio_flush();
+        bdrv_drain_all();
         bdrv_flush_all();
         monitor_protocol_event(QEVENT_STOP, NULL);
     }
@@ -391,11 +391,6 @@ static int qemu_signal_init(void)
     sigset_t set;
 
 #ifdef CONFIG_IOTHREAD
-    /* SIGUSR2 used by posix-aio-compat.c */
-    sigemptyset(&set);
-    sigaddset(&set, SIGUSR2);
-    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
-
     /*
      * SIG_IPI must be blocked in the main thread and must not be caught
      * by sigwait() in the signal thread. Otherwise, the cpu thread will
@@ -624,6 +619,20 @@ void qemu_notify_event(void)
 void qemu_mutex_lock_iothread(void) {}
 void qemu_mutex_unlock_iothread(void) {}
 
+/* vCPUs run in the I/O thread, putting them to sleep would stall it too */
+void cpu_throttle_set(int new_throttle_pct)
+{
+}
+
+void cpu_throttle_stop(void)
+{
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return 0;
+}
+
 void cpu_stop_current(void)
 {
 }
@@ -652,6 +661,16 @@ static QemuCond qemu_system_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
 
+/*
+ * vCPU throttling: every timeslice of guest execution each vCPU is kicked
+ * out and sleeps for long enough to make up the throttle percentage.
+ */
+#define CPU_THROTTLE_PCT_MAX 99
+#define CPU_THROTTLE_TIMESLICE_NS 10000000
+
+static QEMUTimer *throttle_timer;
+static int throttle_percentage;
+
 int qemu_init_main_loop(void)
 {
     int ret;
@@ -765,6 +784,68 @@ static void qemu_tcg_wait_io_event(void)
     }
 }
 
+static void cpu_throttle_sleep(CPUState *env)
+{
+    double pct;
+    int64_t sleeptime_ns;
+
+    if (!env->throttle_pending) {
+        return;
+    }
+    env->throttle_pending = 0;
+    if (!throttle_percentage) {
+        return;
+    }
+
+    pct = (double)throttle_percentage / 100;
+    sleeptime_ns = (int64_t)((pct / (1 - pct)) * CPU_THROTTLE_TIMESLICE_NS);
+
+    qemu_mutex_unlock(&qemu_global_mutex);
+    usleep(sleeptime_ns / 1000);
+    qemu_mutex_lock(&qemu_global_mutex);
+}
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    CPUState *env;
+    double pct;
+
+    if (!throttle_percentage) {
+        return;
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        env->throttle_pending = 1;
+        qemu_cpu_kick(env);
+    }
+
+    pct = (double)throttle_percentage / 100;
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_NS / (1 - pct));
+}
+
+void cpu_throttle_set(int new_throttle_pct)
+{
+    new_throttle_pct = MIN(MAX(new_throttle_pct, 1), CPU_THROTTLE_PCT_MAX);
+
+    if (!throttle_timer) {
+        throttle_timer = qemu_new_timer_ns(rt_clock, cpu_throttle_timer_tick,
+                                           NULL);
+    }
+    throttle_percentage = new_throttle_pct;
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_NS);
+}
+
+void cpu_throttle_stop(void)
+{
+    throttle_percentage = 0;
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return throttle_percentage;
+}
+
 static void qemu_kvm_wait_io_event(CPUState *env)
 {
     while (cpu_thread_is_idle(env)) {
@@ -809,6 +890,7 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
             }
         }
         qemu_kvm_wait_io_event(env);
+        cpu_throttle_sleep(env);
     }
 
     return NULL;
@@ -840,6 +922,8 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
             qemu_notify_event();
         }
         qemu_tcg_wait_io_event();
+        /* one thread runs all vCPUs, it only has to sleep once */
+        cpu_throttle_sleep(first_cpu);
     }
 
     return NULL;
@@ -1022,9 +1106,25 @@ void cpu_stop_current(void)
     }
 }
 
+static bool qemu_in_vcpu_thread(void)
+{
+    CPUState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (env->thread && qemu_cpu_is_self(env)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * A vCPU cannot wait for itself to stop and defers to the iothread, other
+ * threads holding the global mutex (e.g. migration) stop the VM right away.
+ */
 void vm_stop(int reason)
 {
-    if (!qemu_thread_is_self(&io_thread)) {
+    if (qemu_in_vcpu_thread()) {
         qemu_system_vmstop_request(reason);
         /*
          * FIXME: should not return to device code in case
@@ -415,3 +415,138 @@ int64_t strtosz(const char *nptr, char **end)
 {
     return strtosz_suffix(nptr, end, STRTOSZ_DEFSUFFIX_MB);
 }
+
+/*
+ * Zero buffer detection, used to skip zero pages and sectors when migrating
+ * or converting images.  The vector versions need buf aligned and len a
+ * multiple of BUFFER_ZERO_ALIGN, which pages and sectors always are.
+ */
+#define BUFFER_ZERO_ALIGN 128
+
+static int buffer_zero_int(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    const long *l;
+
+    while (len && ((uintptr_t)p % sizeof(long))) {
+        if (*p) {
+            return 0;
+        }
+        p++;
+        len--;
+    }
+
+    /*
+     * Unroll the loop to smooth out the effect of memory latency.
+     */
+    for (l = (const long *)p; len >= 4 * sizeof(long);
+         l += 4, len -= 4 * sizeof(long)) {
+        if (l[0] | l[1] | l[2] | l[3]) {
+            return 0;
+        }
+    }
+
+    for (p = (const unsigned char *)l; len; p++, len--) {
+        if (*p) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+static int buffer_zero_sse2(const void *buf, size_t len)
+{
+    const __m128i *p = buf;
+    const __m128i zero = _mm_setzero_si128();
+    size_t i;
+
+    for (i = 0; i < len / sizeof(__m128i); i += 4) {
+        __m128i t = _mm_or_si128(_mm_or_si128(p[i], p[i + 1]),
+                                 _mm_or_si128(p[i + 2], p[i + 3]));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xffff) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <cpuid.h>
+#include <immintrin.h>
+
+static int buffer_zero_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = buf;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(__m256i); i += 4) {
+        __m256i t = _mm256_or_si256(_mm256_or_si256(p[i], p[i + 1]),
+                                    _mm256_or_si256(p[i + 2], p[i + 3]));
+
+        if (!_mm256_testz_si256(t, t)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+#pragma GCC pop_options
+
+static int cpu_has_avx2(void)
+{
+    unsigned int a, b, c, d;
+    uint32_t xcr0_lo, xcr0_hi;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return 0;
+    }
+
+    /* the OS must save the YMM registers as well */
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE)) {
+        return 0;
+    }
+    asm("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & 6) != 6) {
+        return 0;
+    }
+
+    __cpuid_count(7, 0, a, b, c, d);
+    return !!(b & bit_AVX2);
+}
+#endif
+
+static int (*buffer_zero_accel)(const void *buf, size_t len) =
+#if defined(__SSE2__)
+    buffer_zero_sse2;
+#else
+    buffer_zero_int;
+#endif
+
+static void __attribute__((constructor)) buffer_zero_init(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (cpu_has_avx2()) {
+        buffer_zero_accel = buffer_zero_avx2;
+    }
+#endif
+}
+
+/* Returns 1 if the len bytes at buf are all zero */
+int buffer_is_zero(const void *buf, size_t len)
+{
+    if (((uintptr_t)buf | len) % BUFFER_ZERO_ALIGN) {
+        return buffer_zero_int(buf, len);
+    }
+
+    return buffer_zero_accel(buf, len);
+}
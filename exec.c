@@ -40,6 +40,8 @@
 #include "qemu-timer.h"
 #include "memory.h"
 #include "exec-memory.h"
+#include "bitmap.h"
+#include "host-utils.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -2098,6 +2100,114 @@ static inline void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry,
     }
 }
 
+/* Makes the dirty bitmaps cover RAM up to end, new pages start clean */
+void cpu_physical_memory_dirty_alloc(ram_addr_t end)
+{
+    static unsigned long dirty_memory_longs;
+    unsigned long longs = BITS_TO_LONGS(end >> TARGET_PAGE_BITS);
+    int client;
+
+    if (longs <= dirty_memory_longs) {
+        return;
+    }
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        ram_list.dirty_memory[client] =
+            g_realloc(ram_list.dirty_memory[client],
+                      longs * sizeof(unsigned long));
+        memset(ram_list.dirty_memory[client] + dirty_memory_longs, 0,
+               (longs - dirty_memory_longs) * sizeof(unsigned long));
+    }
+    dirty_memory_longs = longs;
+}
+
+void cpu_physical_memory_set_dirty_range(ram_addr_t start, ram_addr_t length,
+                                         int dirty_flags)
+{
+    int client;
+
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        if (dirty_flags & (1 << client)) {
+            bitmap_set(ram_list.dirty_memory[client],
+                       start >> TARGET_PAGE_BITS, length >> TARGET_PAGE_BITS);
+        }
+    }
+}
+
+void cpu_physical_memory_mask_dirty_range(ram_addr_t start, ram_addr_t length,
+                                          int dirty_flags)
+{
+    int client;
+
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        if (dirty_flags & (1 << client)) {
+            bitmap_clear(ram_list.dirty_memory[client],
+                         start >> TARGET_PAGE_BITS, length >> TARGET_PAGE_BITS);
+        }
+    }
+}
+
+/*
+ * Returns the address of the first page in [start, end) that is dirty for
+ * the single flag dirty_flag, or end if there is none.  Clean pages are
+ * skipped a word of the bitmap at a time.
+ */
+ram_addr_t cpu_physical_memory_find_next_dirty(ram_addr_t start,
+                                               ram_addr_t end,
+                                               int dirty_flag)
+{
+    unsigned long page;
+
+    page = find_next_bit(ram_list.dirty_memory[ctz32(dirty_flag)],
+                         end >> TARGET_PAGE_BITS, start >> TARGET_PAGE_BITS);
+    return MIN((ram_addr_t)page << TARGET_PAGE_BITS, end);
+}
+
+/*
+ * Merges a little endian dirty log, as returned by KVM, for the pages
+ * starting at RAM address start into all dirty bitmaps.  When start is
+ * aligned to a bitmap word the log is merged a word at a time.
+ */
+void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
+                                            ram_addr_t start,
+                                            ram_addr_t pages)
+{
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long i, len = BITS_TO_LONGS(pages);
+    int client;
+
+    if (!(page % BITS_PER_LONG)) {
+        unsigned long word = page / BITS_PER_LONG;
+
+        for (i = 0; i < len; i++) {
+            unsigned long c = leul_to_cpu(bitmap[i]);
+
+            if (!c) {
+                continue;
+            }
+            if (i == len - 1 && pages % BITS_PER_LONG) {
+                c &= BITMAP_LAST_WORD_MASK(pages);
+            }
+            for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+                ram_list.dirty_memory[client][word + i] |= c;
+            }
+        }
+    } else {
+        for (i = 0; i < len; i++) {
+            unsigned long c = leul_to_cpu(bitmap[i]);
+
+            while (c) {
+                int j = ctz64(c);
+
+                c &= ~(1ul << j);
+                if (i * BITS_PER_LONG + j < pages) {
+                    cpu_physical_memory_set_dirty(
+                        start + ((i * BITS_PER_LONG + j) << TARGET_PAGE_BITS));
+                }
+            }
+        }
+    }
+}
+
 /* Note: start and end must be within the same ram block.  */
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags)
@@ -2992,10 +3102,9 @@ ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
 
     QLIST_INSERT_HEAD(&ram_list.blocks, new_block, next);
 
-    ram_list.phys_dirty = g_realloc(ram_list.phys_dirty,
-                                       last_ram_offset() >> TARGET_PAGE_BITS);
-    memset(ram_list.phys_dirty + (new_block->offset >> TARGET_PAGE_BITS),
-           0xff, size >> TARGET_PAGE_BITS);
+    cpu_physical_memory_dirty_alloc(last_ram_offset());
+    cpu_physical_memory_set_dirty_range(new_block->offset, size,
+                                        ALL_DIRTY_FLAGS);
 
     if (kvm_enabled())
         kvm_setup_guest_memory(new_block->host, size);
@@ -3346,11 +3455,11 @@ static void notdirty_mem_writeb(void *opaque, target_phys_addr_t ram_addr,
 #endif
     }
     stb_p(qemu_get_ram_ptr(ram_addr), val);
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
+    dirty_flags |= (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG);
     cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff)
+    if (dirty_flags == ALL_DIRTY_FLAGS)
         tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
 }
 
@@ -3366,11 +3475,11 @@ static void notdirty_mem_writew(void *opaque, target_phys_addr_t ram_addr,
 #endif
     }
     stw_p(qemu_get_ram_ptr(ram_addr), val);
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
+    dirty_flags |= (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG);
     cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff)
+    if (dirty_flags == ALL_DIRTY_FLAGS)
         tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
 }
 
@@ -3386,11 +3495,11 @@ static void notdirty_mem_writel(void *opaque, target_phys_addr_t ram_addr,
 #endif
     }
     stl_p(qemu_get_ram_ptr(ram_addr), val);
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
+    dirty_flags |= (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG);
     cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff)
+    if (dirty_flags == ALL_DIRTY_FLAGS)
         tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
 }
 
@@ -3956,7 +4065,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                     tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
                     /* set dirty bit */
                     cpu_physical_memory_set_dirty_flags(
-                        addr1, (0xff & ~CODE_DIRTY_FLAG));
+                        addr1, (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG));
                 }
 		/* qemu doesn't execute guest code directly, but kvm does
 		   therefore flush instruction caches */
@@ -4171,7 +4280,7 @@ void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
                     tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
                     /* set dirty bit */
                     cpu_physical_memory_set_dirty_flags(
-                        addr1, (0xff & ~CODE_DIRTY_FLAG));
+                        addr1, (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG));
                 }
                 addr1 += l;
                 access_len -= l;
@@ -4434,7 +4543,7 @@ void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
                 tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
                 /* set dirty bit */
                 cpu_physical_memory_set_dirty_flags(
-                    addr1, (0xff & ~CODE_DIRTY_FLAG));
+                    addr1, (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG));
             }
         }
     }
@@ -4523,7 +4632,7 @@ static inline void stl_phys_internal(target_phys_addr_t addr, uint32_t val,
             tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
             /* set dirty bit */
             cpu_physical_memory_set_dirty_flags(addr1,
-                (0xff & ~CODE_DIRTY_FLAG));
+                (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG));
         }
     }
 }
@@ -4601,7 +4710,7 @@ static inline void stw_phys_internal(target_phys_addr_t addr, uint32_t val,
             tb_invalidate_phys_page_range(addr1, addr1 + 2, 0);
             /* set dirty bit */
             cpu_physical_memory_set_dirty_flags(addr1,
-                (0xff & ~CODE_DIRTY_FLAG));
+                (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG));
         }
     }
 }
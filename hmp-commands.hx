@@ -70,6 +70,91 @@ but should be used with extreme caution.  Note that this command only
 resizes image files, it can not resize block devices like LVM volumes.
 ETEXI
 
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr",
+        .help       = "change I/O throttle limits for a block drive",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_set_io_throttle,
+    },
+
+STEXI
+@item block_set_io_throttle @var{device} @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}
+@findex block_set_io_throttle
+Change I/O throttle limits for a block drive to @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}.
+A limit of 0 means unlimited, a total limit cannot be combined with the
+read and write limits of the same kind.
+ETEXI
+
+    {
+        .name       = "block_stream",
+        .args_type  = "device:B,speed:o?",
+        .params     = "device [speed]",
+        .help       = "copy data from a backing file into a block device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream,
+    },
+
+STEXI
+@item block_stream @var{device} [@var{speed}]
+@findex block_stream
+Copy data from the backing file into @var{device} in the background while
+the guest is running, limited to @var{speed} bytes per second if given.
+When all data has been copied the backing file is no longer used.
+ETEXI
+
+    {
+        .name       = "drive_mirror",
+        .args_type  = "device:B,target:s,format:s?,speed:o?",
+        .params     = "device target [format] [speed]",
+        .help       = "copy a block device to a new image and switch to it",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_drive_mirror,
+    },
+
+STEXI
+@item drive_mirror @var{device} @var{target} [@var{format}] [@var{speed}]
+@findex drive_mirror
+Copy @var{device} to a new image @var{target} in the background while the
+guest is running, limited to @var{speed} bytes per second if given.  Guest
+writes that happen during the copy are tracked and copied again.  Once the
+two images are in sync the device is switched over to @var{target}.
+@var{format} defaults to the format of the current image.
+ETEXI
+
+    {
+        .name       = "block_job_set_speed",
+        .args_type  = "device:B,value:o",
+        .params     = "device value",
+        .help       = "set maximum speed for a background block operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_set_speed,
+    },
+
+STEXI
+@item block_job_set_speed @var{device} @var{value}
+@findex block_job_set_speed
+Set maximum speed for a background block operation on @var{device} to
+@var{value} bytes per second.  A value of 0 means unlimited.
+ETEXI
+
+    {
+        .name       = "block_job_cancel",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "stop an active background block operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_cancel,
+    },
+
+STEXI
+@item block_job_cancel @var{device}
+@findex block_job_cancel
+Stop an active background block operation on @var{device}.  The operation
+stops at the next chunk boundary and a BLOCK_JOB_CANCELLED event is emitted.
+ETEXI
+
 
     {
         .name       = "eject",
@@ -755,24 +840,43 @@ ETEXI
 
     {
         .name       = "migrate",
-        .args_type  = "detach:-d,blk:-b,inc:-i,uri:s",
-        .params     = "[-d] [-b] [-i] uri",
+        .args_type  = "detach:-d,blk:-b,inc:-i,xbzrle:-x,compress:-c,postcopy:-p,auto-converge:-a,zero-skip:-z,uri:s",
+        .params     = "[-d] [-b] [-i] [-x] [-c] [-p] [-a] [-z] uri",
         .help       = "migrate to URI (using -d to not wait for completion)"
 		      "\n\t\t\t -b for migration without shared storage with"
 		      " full copy of disk\n\t\t\t -i for migration without "
 		      "shared storage with incremental copy of disk "
-		      "(base image shared between src and destination)",
+		      "(base image shared between src and destination)"
+		      "\n\t\t\t -x to delta-encode (XBZRLE) pages that are"
+		      " sent again"
+		      "\n\t\t\t -c to compress pages with multiple threads"
+		      "\n\t\t\t -p to switch to the destination after a"
+		      " bounded precopy and send the rest on demand"
+		      "\n\t\t\t -a to throttle the guest CPUs if it dirties"
+		      " memory too fast for the migration to converge"
+		      "\n\t\t\t -z to skip zero pages and disk blocks in"
+		      " the first pass (destination must support it)",
         .user_print = monitor_user_noop,	
 	.mhandler.cmd_new = do_migrate,
     },
 
 
 STEXI
-@item migrate [-d] [-b] [-i] @var{uri}
+@item migrate [-d] [-b] [-i] [-x] [-c] [-p] [-a] [-z] @var{uri}
 @findex migrate
 Migrate to @var{uri} (using -d to not wait for completion).
 	-b for migration with full copy of disk
 	-i for migration with incremental copy of disk (base image is shared)
+	-x for XBZRLE delta encoding of pages that are sent again
+	-c for multi-threaded zlib compression of pages
+	-p for post-copy: after two passes over RAM the guest is resumed on
+	   the destination, which fetches the remaining pages on access while
+	   the source pushes them in the background (tcp and unix only)
+	-a for auto-converge: the guest CPUs are throttled, progressively,
+	   while the guest dirties memory faster than it can be sent
+	-z to leave zero pages out of the first pass over RAM and to send
+	   zero disk blocks without their data; the destination discards
+	   its RAM first, so it must be a version that supports this
 ETEXI
 
     {
@@ -819,6 +923,64 @@ STEXI
 @item migrate_set_downtime @var{second}
 @findex migrate_set_downtime
 Set maximum tolerated downtime (in seconds) for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_cache_size",
+        .args_type  = "value:o",
+        .params     = "value",
+        .help       = "set cache size (in bytes) for XBZRLE migrations,"
+                      "the cache size will be rounded down to the nearest "
+                      "power of 2.\n"
+                      "The cache size affects the number of cache misses."
+                      "In case of a high cache miss ratio you need to increase"
+                      " the cache size",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_cache_size,
+    },
+
+STEXI
+@item migrate_set_cache_size @var{value}
+@findex migrate_set_cache_size
+Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "migrate_set_compress_params",
+        .args_type  = "level:i?,threads:i?,dthreads:i?",
+        .params     = "[level] [threads] [dthreads]",
+        .help       = "set the zlib level (0-9), the number of compression "
+                      "threads and the number of decompression threads "
+                      "for compressed migrations",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_compress_params,
+    },
+
+STEXI
+@item migrate_set_compress_params [@var{level}] [@var{threads}] [@var{dthreads}]
+@findex migrate_set_compress_params
+Set the zlib compression @var{level}, the number of compression @var{threads}
+used by the source and the number of decompression @var{dthreads} used by the
+destination of migrations started with -c.
+ETEXI
+
+    {
+        .name       = "migrate_set_channels",
+        .args_type  = "channels:i",
+        .params     = "channels",
+        .help       = "set the number of extra tcp connections RAM pages "
+                      "are striped over (0 to disable)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_channels,
+    },
+
+STEXI
+@item migrate_set_channels @var{channels}
+@findex migrate_set_channels
+Stripe the full RAM pages of tcp migrations over @var{channels} extra
+connections, each served by its own thread, next to the main migration
+stream.  0, the default, sends everything on the main stream.  Cannot be
+combined with -p or -c.
 ETEXI
 
     {
@@ -1300,12 +1462,16 @@ Show various information about the system state.
 show the version of QEMU
 @item info network
 show the various VLANs and the associated devices
+@item info nic-tx-stats
+show transmit statistics of network cards
 @item info chardev
 show the character devices
 @item info block
 show the block devices
 @item info blockstats
 show block device statistics
+@item info block-jobs
+show progress of ongoing block device operations
 @item info registers
 show the cpu registers
 @item info cpus
@@ -46,6 +46,18 @@ int event_notifier_test_and_clear(EventNotifier *e)
     return r == sizeof(value);
 }
 
+int event_notifier_set(EventNotifier *e)
+{
+    static const uint64_t value = 1;
+    ssize_t r;
+
+    do {
+        r = write(e->fd, &value, sizeof(value));
+    } while (r < 0 && errno == EINTR);
+
+    return r == sizeof(value) ? 0 : -errno;
+}
+
 int event_notifier_test(EventNotifier *e)
 {
     uint64_t value;
@@ -11,6 +11,7 @@ int event_notifier_init(EventNotifier *, int active);
 void event_notifier_cleanup(EventNotifier *);
 int event_notifier_get_fd(EventNotifier *);
 int event_notifier_test_and_clear(EventNotifier *);
+int event_notifier_set(EventNotifier *);
 int event_notifier_test(EventNotifier *);
 
 #endif
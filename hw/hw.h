@@ -263,6 +263,8 @@ int register_savevm_live(DeviceState *dev,
                          LoadStateHandler *load_state,
                          void *opaque);
 
+void savevm_set_save_version(const char *idstr, int instance_id,
+                             int version_id);
 void unregister_savevm(DeviceState *dev, const char *idstr, void *opaque);
 void register_device_unmigratable(DeviceState *dev, const char *idstr,
                                                                 void *opaque);
@@ -129,7 +129,7 @@ static int s390_virtio_blk_init(VirtIOS390Device *dev)
     VirtIODevice *vdev;
 
     vdev = virtio_blk_init((DeviceState *)dev, &dev->block,
-                           &dev->block_serial);
+                           &dev->block_serial, false);
     if (!vdev) {
         return -1;
     }
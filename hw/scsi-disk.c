@@ -234,6 +234,86 @@ static void scsi_write_complete(void * opaque, int ret)
     }
 }
 
+static void scsi_write_zeroes_complete(void *opaque, int ret)
+{
+    SCSIDiskReq *r = (SCSIDiskReq *)opaque;
+
+    r->req.aiocb = NULL;
+
+    if (ret) {
+        if (scsi_handle_rw_error(r, -ret, SCSI_REQ_STATUS_RETRY_WRITE)) {
+            return;
+        }
+    }
+
+    scsi_req_complete(&r->req, GOOD);
+}
+
+static void scsi_write_same_data(SCSIDiskReq *r);
+
+static void scsi_write_same_complete(void *opaque, int ret)
+{
+    SCSIDiskReq *r = (SCSIDiskReq *)opaque;
+    uint32_t n;
+
+    r->req.aiocb = NULL;
+
+    if (ret) {
+        if (scsi_handle_rw_error(r, -ret, SCSI_REQ_STATUS_RETRY_WRITE)) {
+            return;
+        }
+    }
+
+    n = r->iov.iov_len / 512;
+    r->sector += n;
+    r->sector_count -= n;
+    if (r->sector_count == 0) {
+        scsi_req_complete(&r->req, GOOD);
+    } else {
+        scsi_write_same_data(r);
+    }
+}
+
+/*
+ * WRITE SAME without UNMAP: fetch the single data block, then either zero
+ * the whole range at once or replicate the block over the DMA buffer and
+ * write it out a buffer at a time.
+ */
+static void scsi_write_same_data(SCSIDiskReq *r)
+{
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+    uint8_t *buf = r->iov.iov_base;
+    uint32_t n, off;
+
+    if (r->iov.iov_len == 0) {
+        r->iov.iov_len = s->qdev.blocksize;
+        scsi_req_data(&r->req, r->iov.iov_len);
+        return;
+    }
+
+    if (buffer_is_zero(buf, s->qdev.blocksize)) {
+        r->req.aiocb = bdrv_aio_write_zeroes(s->bs, r->sector,
+                                             r->sector_count,
+                                             scsi_write_zeroes_complete, r);
+        if (r->req.aiocb == NULL) {
+            scsi_write_zeroes_complete(r, -ENOMEM);
+        }
+        return;
+    }
+
+    n = MIN(r->sector_count, SCSI_DMA_BUF_SIZE / 512);
+    for (off = r->iov.iov_len; off < n * 512; off += s->qdev.blocksize) {
+        memcpy(buf + off, buf, s->qdev.blocksize);
+    }
+    r->iov.iov_len = n * 512;
+    qemu_iovec_init_external(&r->qiov, &r->iov, 1);
+    r->req.aiocb = bdrv_aio_writev(s->bs, r->sector, &r->qiov, n,
+                                   scsi_write_same_complete, r);
+    if (r->req.aiocb == NULL) {
+        scsi_write_same_complete(r, -ENOMEM);
+    }
+}
+
 static void scsi_write_data(SCSIRequest *req)
 {
     SCSIDiskReq *r = DO_UPCAST(SCSIDiskReq, req, req);
@@ -249,6 +329,12 @@ static void scsi_write_data(SCSIRequest *req)
         return;
     }
 
+    if (r->req.cmd.buf[0] == WRITE_SAME_10 ||
+        r->req.cmd.buf[0] == WRITE_SAME_16) {
+        scsi_write_same_data(r);
+        return;
+    }
+
     n = r->iov.iov_len / 512;
     if (n) {
         qemu_iovec_init_external(&r->qiov, &r->iov, 1);
@@ -448,7 +534,7 @@ static int scsi_disk_emulate_inquiry(SCSIRequest *req, uint8_t *outbuf)
         {
             outbuf[3] = buflen = 8;
             outbuf[4] = 0;
-            outbuf[5] = 0x40; /* write same with unmap supported */
+            outbuf[5] = 0x60; /* write same(10/16) with unmap supported */
             outbuf[6] = 0;
             outbuf[7] = 0;
             break;
@@ -938,6 +1024,7 @@ static int32_t scsi_send_command(SCSIRequest *req, uint8_t *buf)
     SCSIDiskReq *r = DO_UPCAST(SCSIDiskReq, req, req);
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, req->dev);
     int32_t len;
+    uint64_t nb_blocks;
     uint8_t command;
     uint8_t *outbuf;
     int rc;
@@ -1031,31 +1118,49 @@ static int32_t scsi_send_command(SCSIRequest *req, uint8_t *buf)
             goto illegal_lba;
         }
         break;
+    case WRITE_SAME_10:
     case WRITE_SAME_16:
-        len = r->req.cmd.xfer / s->qdev.blocksize;
+        if (command == WRITE_SAME_10) {
+            nb_blocks = buf[8] | (buf[7] << 8);
+        } else {
+            nb_blocks = buf[13] | (buf[12] << 8) | (buf[11] << 16) |
+                        ((uint32_t)buf[10] << 24);
+        }
 
-        DPRINTF("WRITE SAME(16) (sector %" PRId64 ", count %d)\n",
-                r->req.cmd.lba, len);
+        DPRINTF("WRITE SAME(%d) (sector %" PRId64 ", count %" PRId64 ")\n",
+                command == WRITE_SAME_10 ? 10 : 16, r->req.cmd.lba,
+                nb_blocks);
 
         if (r->req.cmd.lba > s->max_lba) {
             goto illegal_lba;
         }
 
-        /*
-         * We only support WRITE SAME with the unmap bit set for now.
-         */
-        if (!(buf[1] & 0x8)) {
+        /* A block count of zero means up to the end of the medium */
+        if (nb_blocks == 0) {
+            nb_blocks = s->max_lba + 1 - r->req.cmd.lba;
+        }
+        if (nb_blocks > s->max_lba + 1 - r->req.cmd.lba) {
+            goto illegal_lba;
+        }
+        if (nb_blocks * s->cluster_size > INT_MAX) {
             goto fail;
         }
 
-        rc = bdrv_discard(s->bs, r->req.cmd.lba * s->cluster_size,
-                          len * s->cluster_size);
-        if (rc < 0) {
-            /* XXX: better error code ?*/
-            goto fail;
+        if (buf[1] & 0x8) {
+            rc = bdrv_discard(s->bs, r->req.cmd.lba * s->cluster_size,
+                              nb_blocks * s->cluster_size);
+            if (rc < 0) {
+                /* XXX: better error code ?*/
+                goto fail;
+            }
+            break;
         }
 
-        break;
+        /* The data block is fetched and written by scsi_write_same_data() */
+        r->sector = r->req.cmd.lba * s->cluster_size;
+        r->sector_count = nb_blocks * s->cluster_size;
+        r->iov.iov_len = 0;
+        return -s->qdev.blocksize;
     case REQUEST_SENSE:
         abort();
     default:
@@ -134,8 +134,9 @@ bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
     return vhost_dev_query(&net->dev, dev);
 }
 
-int vhost_net_start(struct vhost_net *net,
-                    VirtIODevice *dev)
+static int vhost_net_start_one(struct vhost_net *net,
+                               VirtIODevice *dev,
+                               int vq_index)
 {
     struct vhost_vring_file file = { };
     int r;
@@ -146,6 +147,7 @@ int vhost_net_start(struct vhost_net *net,
 
     net->dev.nvqs = 2;
     net->dev.vqs = net->vqs;
+    net->dev.vq_index = vq_index;
     r = vhost_dev_start(&net->dev, dev);
     if (r < 0) {
         return r;
@@ -176,8 +178,8 @@ fail:
     return r;
 }
 
-void vhost_net_stop(struct vhost_net *net,
-                    VirtIODevice *dev)
+static void vhost_net_stop_one(struct vhost_net *net,
+                               VirtIODevice *dev)
 {
     struct vhost_vring_file file = { .fd = -1 };
 
@@ -192,6 +194,58 @@ void vhost_net_stop(struct vhost_net *net,
     }
 }
 
+/* Start one vhost device per queue pair; ncs[i] is the tap backend of
+ * pair i, whose rx/tx virtqueues are 2 * i and 2 * i + 1. */
+int vhost_net_start(VirtIODevice *dev, VLANClientState **ncs,
+                    int total_queues)
+{
+    int r, i;
+
+    if (!dev->binding->set_guest_notifiers) {
+        fprintf(stderr, "binding does not support guest notifiers\n");
+        return -ENOSYS;
+    }
+
+    r = dev->binding->set_guest_notifiers(dev->binding_opaque, true);
+    if (r < 0) {
+        fprintf(stderr, "Error binding guest notifier: %d\n", -r);
+        return r;
+    }
+
+    for (i = 0; i < total_queues; i++) {
+        r = vhost_net_start_one(tap_get_vhost_net(ncs[i]), dev, i * 2);
+        if (r < 0) {
+            goto err;
+        }
+    }
+
+    return 0;
+
+err:
+    while (--i >= 0) {
+        vhost_net_stop_one(tap_get_vhost_net(ncs[i]), dev);
+    }
+    dev->binding->set_guest_notifiers(dev->binding_opaque, false);
+    return r;
+}
+
+void vhost_net_stop(VirtIODevice *dev, VLANClientState **ncs,
+                    int total_queues)
+{
+    int r, i;
+
+    for (i = 0; i < total_queues; i++) {
+        vhost_net_stop_one(tap_get_vhost_net(ncs[i]), dev);
+    }
+
+    r = dev->binding->set_guest_notifiers(dev->binding_opaque, false);
+    if (r < 0) {
+        fprintf(stderr, "vhost guest notifier cleanup failed: %d\n", r);
+        fflush(stderr);
+    }
+    assert(r >= 0);
+}
+
 void vhost_net_cleanup(struct vhost_net *net)
 {
     vhost_dev_cleanup(&net->dev);
@@ -213,13 +267,13 @@ bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
     return false;
 }
 
-int vhost_net_start(struct vhost_net *net,
-		    VirtIODevice *dev)
+int vhost_net_start(VirtIODevice *dev, VLANClientState **ncs,
+                    int total_queues)
 {
     return -ENOSYS;
 }
-void vhost_net_stop(struct vhost_net *net,
-		    VirtIODevice *dev)
+void vhost_net_stop(VirtIODevice *dev, VLANClientState **ncs,
+                    int total_queues)
 {
 }
 
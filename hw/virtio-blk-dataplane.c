@@ -0,0 +1,805 @@
+/*
+ * Dedicated thread for virtio-blk I/O processing
+ *
+ * The data plane services one virtio-blk queue outside the global mutex:
+ * guest kicks arrive on the queue's ioeventfd, requests are submitted to
+ * the host with Linux AIO and completions are signalled to the guest
+ * through the queue's guest notifier (an irqfd when KVM provides one).
+ * The ring is accessed directly through a private copy of the guest RAM
+ * layout, so nothing on the I/O path touches the block layer or the
+ * virtio core.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <libaio.h>
+#include <linux/virtio_ring.h>
+
+#include "hw.h"
+#include "qemu-thread.h"
+#include "qemu-error.h"
+#include "qemu-barrier.h"
+#include "iov.h"
+#include "block.h"
+#include "trace.h"
+#include "virtio-blk.h"
+#include "virtio-blk-dataplane.h"
+
+/* requests mapped by one ring scan before they are handed to the kernel */
+#define IOV_POOL_SIZE           (2 * VIRTQUEUE_MAX_SIZE)
+
+#define MAX_EVENTS              128
+
+typedef struct {
+    target_phys_addr_t guest_addr;
+    uint64_t size;
+    void *host_addr;
+} HostMemRegion;
+
+typedef struct {
+    struct iocb iocb;
+    unsigned int head;
+    unsigned char *status;
+    size_t len;
+} VirtIOBlockDataPlaneReq;
+
+struct VirtIOBlockDataPlane {
+    VirtIODevice *vdev;
+    VirtQueue *vq;
+    BlockDriverState *bs;
+    const char *serial;
+    int fd;
+    uint64_t nb_sectors;
+
+    bool starting;
+    bool started;
+    bool stopping;
+    bool disabled;
+
+    /* guest RAM layout, updated by the main loop and read by the thread */
+    CPUPhysMemoryClient client;
+    QemuMutex mem_lock;
+    HostMemRegion *regions;
+    int nregions;
+
+    QemuThread thread;
+    EventNotifier stop_notifier;
+
+    struct vring vr;
+    uint16_t last_avail_idx;
+    uint16_t signalled_used;
+    bool signalled_used_valid;
+    bool need_notify;
+    bool broken;
+
+    VirtIOBlockDataPlaneReq *reqs;
+    unsigned int inflight;
+
+    io_context_t io_ctx;
+    int io_efd;
+    struct iocb *pending[VIRTQUEUE_MAX_SIZE];
+    unsigned int num_pending;
+    struct iovec iov_pool[IOV_POOL_SIZE];
+    unsigned int iov_used;
+};
+
+static void data_plane_set_memory(CPUPhysMemoryClient *client,
+                                  target_phys_addr_t start_addr,
+                                  ram_addr_t size,
+                                  ram_addr_t phys_offset,
+                                  bool log_dirty)
+{
+    VirtIOBlockDataPlane *s = container_of(client, VirtIOBlockDataPlane,
+                                           client);
+    ram_addr_t flags = phys_offset & ~TARGET_PAGE_MASK;
+    target_phys_addr_t end_addr = start_addr + size;
+    HostMemRegion *regions, *old;
+    int i, n = 0;
+
+    if (log_dirty) {
+        flags = IO_MEM_UNASSIGNED;
+    }
+
+    regions = g_new(HostMemRegion, s->nregions + 2);
+
+    /* Drop whatever the new mapping covers, keeping the parts outside it */
+    for (i = 0; i < s->nregions; i++) {
+        HostMemRegion *r = &s->regions[i];
+        target_phys_addr_t r_end = r->guest_addr + r->size;
+
+        if (r_end <= start_addr || r->guest_addr >= end_addr) {
+            regions[n++] = *r;
+            continue;
+        }
+        if (r->guest_addr < start_addr) {
+            regions[n].guest_addr = r->guest_addr;
+            regions[n].size = start_addr - r->guest_addr;
+            regions[n].host_addr = r->host_addr;
+            n++;
+        }
+        if (r_end > end_addr) {
+            regions[n].guest_addr = end_addr;
+            regions[n].size = r_end - end_addr;
+            regions[n].host_addr = (uint8_t *)r->host_addr +
+                                   (end_addr - r->guest_addr);
+            n++;
+        }
+    }
+
+    if (flags == IO_MEM_RAM) {
+        regions[n].guest_addr = start_addr;
+        regions[n].size = size;
+        regions[n].host_addr = qemu_get_ram_ptr(phys_offset);
+        n++;
+    }
+
+    qemu_mutex_lock(&s->mem_lock);
+    old = s->regions;
+    s->regions = regions;
+    s->nregions = n;
+    qemu_mutex_unlock(&s->mem_lock);
+
+    g_free(old);
+}
+
+static int data_plane_sync_dirty_bitmap(CPUPhysMemoryClient *client,
+                                        target_phys_addr_t start_addr,
+                                        target_phys_addr_t end_addr)
+{
+    return 0;
+}
+
+static int data_plane_migration_log(CPUPhysMemoryClient *client, int enable)
+{
+    return 0;
+}
+
+/* Returns the host address of a guest range that is entirely RAM */
+static void *data_plane_map(VirtIOBlockDataPlane *s, target_phys_addr_t addr,
+                            uint64_t len)
+{
+    void *host_addr = NULL;
+    int i;
+
+    qemu_mutex_lock(&s->mem_lock);
+    for (i = 0; i < s->nregions; i++) {
+        HostMemRegion *r = &s->regions[i];
+
+        if (addr >= r->guest_addr && addr - r->guest_addr < r->size) {
+            if (len <= r->size - (addr - r->guest_addr)) {
+                host_addr = (uint8_t *)r->host_addr + (addr - r->guest_addr);
+            }
+            break;
+        }
+    }
+    qemu_mutex_unlock(&s->mem_lock);
+
+    return host_addr;
+}
+
+static void data_plane_bad_ring(VirtIOBlockDataPlane *s, const char *msg)
+{
+    fprintf(stderr, "virtio-blk data plane: %s, stopping queue processing\n",
+            msg);
+    s->broken = true;
+}
+
+static void data_plane_disable_notification(VirtIOBlockDataPlane *s)
+{
+    if (!(s->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        s->vr.used->flags |= VRING_USED_F_NO_NOTIFY;
+    }
+}
+
+/* Returns true if the guest queued more requests while we were enabling */
+static bool data_plane_enable_notification(VirtIOBlockDataPlane *s)
+{
+    if (s->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        vring_avail_event(&s->vr) = s->last_avail_idx;
+    } else {
+        s->vr.used->flags &= ~VRING_USED_F_NO_NOTIFY;
+    }
+    /* Make the flag visible before checking the index once more */
+    smp_mb();
+    return *(volatile uint16_t *)&s->vr.avail->idx != s->last_avail_idx;
+}
+
+static bool data_plane_should_notify(VirtIOBlockDataPlane *s)
+{
+    uint16_t old, new;
+    bool v;
+
+    /* Flush the used ring before reading the guest's suppression state */
+    smp_mb();
+
+    if ((s->vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) &&
+        s->inflight == 0 && s->vr.avail->idx == s->last_avail_idx) {
+        return true;
+    }
+
+    if (!(s->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        return !(s->vr.avail->flags & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+
+    v = s->signalled_used_valid;
+    old = s->signalled_used;
+    new = s->signalled_used = s->vr.used->idx;
+    s->signalled_used_valid = true;
+    return !v || vring_need_event(vring_used_event(&s->vr), new, old);
+}
+
+static void data_plane_notify_guest(VirtIOBlockDataPlane *s)
+{
+    if (!s->need_notify) {
+        return;
+    }
+    s->need_notify = false;
+
+    if (data_plane_should_notify(s)) {
+        event_notifier_set(virtio_queue_get_guest_notifier(s->vq));
+    }
+}
+
+static void data_plane_complete(VirtIOBlockDataPlane *s,
+                                VirtIOBlockDataPlaneReq *req,
+                                unsigned char status)
+{
+    uint16_t idx = s->vr.used->idx;
+    struct vring_used_elem *elem = &s->vr.used->ring[idx % s->vr.num];
+
+    trace_virtio_blk_data_plane_complete(s, req->head, status);
+
+    *req->status = status;
+    elem->id = req->head;
+    elem->len = req->len + sizeof(struct virtio_blk_inhdr);
+    /* The element must be visible before the index that publishes it */
+    smp_wmb();
+    s->vr.used->idx = idx + 1;
+
+    s->inflight--;
+    s->need_notify = true;
+}
+
+/*
+ * Maps the descriptor chain at head into iov.  Device-readable buffers come
+ * first, *out_num of them, followed by the device-writable ones.
+ */
+static int data_plane_map_chain(VirtIOBlockDataPlane *s, unsigned int head,
+                                struct iovec *iov, unsigned int max,
+                                unsigned int *out_num)
+{
+    struct vring_desc *table = s->vr.desc;
+    unsigned int table_len = s->vr.num;
+    unsigned int i = head, n = 0, in = 0, count = 0;
+    bool indirect = false;
+    struct vring_desc desc;
+
+    *out_num = 0;
+    for (;;) {
+        if (++count > table_len) {
+            data_plane_bad_ring(s, "descriptor chain loops");
+            return -EINVAL;
+        }
+        /* The guest may change the descriptor under our feet */
+        desc = *(volatile struct vring_desc *)&table[i];
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (indirect || desc.len == 0 ||
+                desc.len % sizeof(struct vring_desc)) {
+                data_plane_bad_ring(s, "invalid indirect descriptor");
+                return -EINVAL;
+            }
+            table = data_plane_map(s, desc.addr, desc.len);
+            if (!table) {
+                data_plane_bad_ring(s, "indirect table is not in RAM");
+                return -EINVAL;
+            }
+            table_len = desc.len / sizeof(struct vring_desc);
+            indirect = true;
+            i = count = 0;
+            continue;
+        }
+
+        if (n == max) {
+            data_plane_bad_ring(s, "too many descriptors in request");
+            return -EINVAL;
+        }
+        iov[n].iov_base = data_plane_map(s, desc.addr, desc.len);
+        if (!iov[n].iov_base) {
+            data_plane_bad_ring(s, "buffer is not in RAM");
+            return -EINVAL;
+        }
+        iov[n].iov_len = desc.len;
+        n++;
+
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            in++;
+        } else if (in) {
+            data_plane_bad_ring(s, "readable buffer after writable one");
+            return -EINVAL;
+        } else {
+            (*out_num)++;
+        }
+
+        if (!(desc.flags & VRING_DESC_F_NEXT)) {
+            break;
+        }
+        i = desc.next;
+        if (i >= table_len) {
+            data_plane_bad_ring(s, "descriptor index out of range");
+            return -EINVAL;
+        }
+    }
+
+    return n;
+}
+
+static bool data_plane_pop(VirtIOBlockDataPlane *s, unsigned int *head)
+{
+    uint16_t avail_idx = *(volatile uint16_t *)&s->vr.avail->idx;
+
+    if (avail_idx == s->last_avail_idx) {
+        return false;
+    }
+    if ((uint16_t)(avail_idx - s->last_avail_idx) > s->vr.num) {
+        data_plane_bad_ring(s, "avail index out of range");
+        return false;
+    }
+
+    /* Read the ring entry only after the index that published it */
+    smp_rmb();
+
+    *head = s->vr.avail->ring[s->last_avail_idx % s->vr.num];
+    if (*head >= s->vr.num) {
+        data_plane_bad_ring(s, "head index out of range");
+        return false;
+    }
+    s->last_avail_idx++;
+    return true;
+}
+
+/* Returns true if the request was queued for submission */
+static bool data_plane_do_rw(VirtIOBlockDataPlane *s,
+                             VirtIOBlockDataPlaneReq *req,
+                             struct iovec *iov, unsigned int niov,
+                             uint64_t sector, bool is_write)
+{
+    size_t len = iov_size(iov, niov);
+
+    if (len % BDRV_SECTOR_SIZE || sector > s->nb_sectors ||
+        len / BDRV_SECTOR_SIZE > s->nb_sectors - sector) {
+        data_plane_complete(s, req, VIRTIO_BLK_S_IOERR);
+        return false;
+    }
+
+    req->len = len;
+    if (is_write) {
+        io_prep_pwritev(&req->iocb, s->fd, iov, niov,
+                        sector * BDRV_SECTOR_SIZE);
+    } else {
+        io_prep_preadv(&req->iocb, s->fd, iov, niov,
+                       sector * BDRV_SECTOR_SIZE);
+    }
+    io_set_eventfd(&req->iocb, s->io_efd);
+
+    s->pending[s->num_pending++] = &req->iocb;
+    return true;
+}
+
+static void data_plane_do_request(VirtIOBlockDataPlane *s, unsigned int head)
+{
+    VirtIOBlockDataPlaneReq *req = &s->reqs[head];
+    struct iovec *iov = &s->iov_pool[s->iov_used];
+    struct virtio_blk_outhdr hdr;
+    struct iovec *in_iov, *last;
+    unsigned int out_num, in_num;
+    uint32_t type;
+    uint64_t sector;
+    int n;
+
+    n = data_plane_map_chain(s, head, iov, IOV_POOL_SIZE - s->iov_used,
+                             &out_num);
+    if (n < 0) {
+        return;
+    }
+    in_num = n - out_num;
+    in_iov = iov + out_num;
+
+    if (in_num < 1 || in_iov[in_num - 1].iov_len < 1 ||
+        iov_to_buf(iov, out_num, &hdr, 0, sizeof(hdr)) != sizeof(hdr)) {
+        data_plane_bad_ring(s, "malformed request");
+        return;
+    }
+
+    /* The status byte is the last byte the guest lets us write */
+    last = &in_iov[in_num - 1];
+    req->status = (unsigned char *)last->iov_base + last->iov_len - 1;
+    if (--last->iov_len == 0) {
+        in_num--;
+    }
+    req->head = head;
+    req->len = 0;
+    s->inflight++;
+
+    type = ldl_p(&hdr.type);
+    sector = ldq_p(&hdr.sector);
+    trace_virtio_blk_data_plane_request(s, head, type, sector);
+
+    switch (type & ~VIRTIO_BLK_T_BARRIER) {
+    case VIRTIO_BLK_T_IN:
+        if (data_plane_do_rw(s, req, in_iov, in_num, sector, false)) {
+            s->iov_used += n;
+        }
+        break;
+    case VIRTIO_BLK_T_OUT:
+    {
+        size_t skip = sizeof(hdr);
+
+        /* Skip the header, it is not part of the data */
+        while (skip) {
+            if (iov->iov_len <= skip) {
+                skip -= iov->iov_len;
+                iov++;
+                out_num--;
+            } else {
+                iov->iov_base = (char *)iov->iov_base + skip;
+                iov->iov_len -= skip;
+                skip = 0;
+            }
+        }
+        if (data_plane_do_rw(s, req, iov, out_num, sector, true)) {
+            s->iov_used += n;
+        }
+        break;
+    }
+    case VIRTIO_BLK_T_FLUSH:
+        data_plane_complete(s, req, fdatasync(s->fd) == 0 ?
+                            VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR);
+        break;
+    case VIRTIO_BLK_T_GET_ID: {
+        char id[VIRTIO_BLK_ID_BYTES];
+
+        /*
+         * NB: per existing s/n string convention the string is
+         * terminated by '\0' only when shorter than buffer.
+         */
+        strncpy(id, s->serial ? s->serial : "", sizeof(id));
+        req->len = iov_from_buf(in_iov, in_num, id, 0, sizeof(id));
+        data_plane_complete(s, req, VIRTIO_BLK_S_OK);
+        break;
+    }
+    default:
+        data_plane_complete(s, req, VIRTIO_BLK_S_UNSUPP);
+        break;
+    }
+}
+
+static void data_plane_submit(VirtIOBlockDataPlane *s)
+{
+    unsigned int done = 0;
+    int ret;
+
+    while (done < s->num_pending) {
+        ret = io_submit(s->io_ctx, s->num_pending - done, s->pending + done);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            /* The ring has at most io_setup()'s worth of requests in flight,
+             * so anything else is a host error that the guest has to see */
+            for (; done < s->num_pending; done++) {
+                data_plane_complete(s, container_of(s->pending[done],
+                                                    VirtIOBlockDataPlaneReq,
+                                                    iocb),
+                                    VIRTIO_BLK_S_IOERR);
+            }
+            break;
+        }
+        done += ret;
+    }
+
+    trace_virtio_blk_data_plane_submit(s, s->num_pending);
+    s->num_pending = 0;
+    s->iov_used = 0;
+}
+
+static void data_plane_handle_notify(VirtIOBlockDataPlane *s)
+{
+    unsigned int head;
+
+    for (;;) {
+        data_plane_disable_notification(s);
+
+        while (!s->broken && data_plane_pop(s, &head)) {
+            data_plane_do_request(s, head);
+
+            /* Keep room for a maximally sized chain */
+            if (s->iov_used > IOV_POOL_SIZE - VIRTQUEUE_MAX_SIZE) {
+                data_plane_submit(s);
+            }
+        }
+
+        if (s->broken || !data_plane_enable_notification(s)) {
+            break;
+        }
+    }
+
+    data_plane_submit(s);
+    data_plane_notify_guest(s);
+}
+
+static void data_plane_handle_io(VirtIOBlockDataPlane *s)
+{
+    struct io_event events[MAX_EVENTS];
+    struct timespec ts = { 0, 0 };
+    uint64_t val;
+    ssize_t ret;
+    int i, n;
+
+    /* The counter is only a wakeup, io_getevents() tells what completed */
+    ret = read(s->io_efd, &val, sizeof(val));
+
+    do {
+        n = io_getevents(s->io_ctx, 0, MAX_EVENTS, events, &ts);
+        for (i = 0; i < n; i++) {
+            VirtIOBlockDataPlaneReq *req =
+                container_of(events[i].obj, VirtIOBlockDataPlaneReq, iocb);
+
+            ret = ((uint64_t)events[i].res2 << 32) | events[i].res;
+            data_plane_complete(s, req, ret == req->len ?
+                                VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR);
+        }
+    } while (n == MAX_EVENTS);
+
+    data_plane_notify_guest(s);
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+    EventNotifier *host_notifier = virtio_queue_get_host_notifier(s->vq);
+    struct pollfd pfd[3];
+    bool stopping = false;
+
+    pfd[0].fd = event_notifier_get_fd(host_notifier);
+    pfd[1].fd = s->io_efd;
+    pfd[2].fd = event_notifier_get_fd(&s->stop_notifier);
+    pfd[0].events = pfd[1].events = pfd[2].events = POLLIN;
+
+    /* The guest may have queued requests before we took over the queue */
+    data_plane_handle_notify(s);
+
+    /* Once asked to stop, stop taking requests but let the inflight ones
+     * complete, the main loop takes the queue over after we return */
+    while (!stopping || s->inflight > 0) {
+        if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "virtio-blk data plane: poll failed: %s\n",
+                    strerror(errno));
+            abort();
+        }
+
+        if (pfd[2].revents & POLLIN) {
+            stopping = true;
+            pfd[0].fd = -1;
+            pfd[2].fd = -1;
+        }
+        if (pfd[0].revents & POLLIN) {
+            event_notifier_test_and_clear(host_notifier);
+            if (!s->broken) {
+                data_plane_handle_notify(s);
+            }
+        }
+        if (pfd[1].revents & POLLIN) {
+            data_plane_handle_io(s);
+        }
+    }
+
+    return NULL;
+}
+
+static int data_plane_map_ring(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+    unsigned int num = virtio_queue_get_num(vdev, 0);
+
+    if (num == 0 || num > VIRTQUEUE_MAX_SIZE) {
+        return -EINVAL;
+    }
+
+    /* The event index fields trail the avail and used rings */
+    s->vr.num = num;
+    s->vr.desc = data_plane_map(s, virtio_queue_get_desc_addr(vdev, 0),
+                                virtio_queue_get_desc_size(vdev, 0));
+    s->vr.avail = data_plane_map(s, virtio_queue_get_avail_addr(vdev, 0),
+                                 virtio_queue_get_avail_size(vdev, 0));
+    s->vr.used = data_plane_map(s, virtio_queue_get_used_addr(vdev, 0),
+                                virtio_queue_get_used_size(vdev, 0) +
+                                sizeof(uint16_t));
+    if (!s->vr.desc || !s->vr.avail || !s->vr.used) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+bool virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+    const VirtIOBindings *binding = vdev->binding;
+    void *opaque = vdev->binding_opaque;
+    int r;
+
+    if (s->started || s->starting) {
+        return true;
+    }
+    if (s->stopping || s->disabled ||
+        !(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK) || !vdev->vm_running) {
+        return false;
+    }
+    if (!binding->set_host_notifier || !binding->set_guest_notifiers) {
+        error_report("virtio-blk: data plane needs ioeventfd support");
+        s->disabled = true;
+        return false;
+    }
+
+    s->starting = true;
+
+    /* Requests that went through the block layer must be done before the
+     * thread starts writing to the same image behind its back */
+    bdrv_drain_all();
+    bdrv_get_geometry(s->bs, &s->nb_sectors);
+
+    if (data_plane_map_ring(s) < 0) {
+        error_report("virtio-blk: data plane cannot map the virtqueue");
+        goto fail;
+    }
+
+    r = io_setup(s->vr.num, &s->io_ctx);
+    if (r < 0) {
+        error_report("virtio-blk: io_setup failed: %s", strerror(-r));
+        goto fail;
+    }
+    s->io_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s->io_efd < 0) {
+        error_report("virtio-blk: eventfd failed: %s", strerror(errno));
+        goto fail_io;
+    }
+    r = event_notifier_init(&s->stop_notifier, 0);
+    if (r < 0) {
+        error_report("virtio-blk: eventfd failed: %s", strerror(-r));
+        goto fail_efd;
+    }
+
+    r = binding->set_guest_notifiers(opaque, true);
+    if (r < 0) {
+        error_report("virtio-blk: failed to set guest notifier: %s",
+                     strerror(-r));
+        goto fail_stop;
+    }
+    /* A kick pending on the ioeventfd is handed to virtio_blk_handle_output,
+     * which finds us starting and leaves the ring to the thread */
+    r = binding->set_host_notifier(opaque, 0, true);
+    if (r < 0) {
+        error_report("virtio-blk: failed to set host notifier: %s",
+                     strerror(-r));
+        goto fail_guest;
+    }
+
+    s->last_avail_idx = virtio_queue_get_last_avail_idx(vdev, 0);
+    s->signalled_used_valid = false;
+    s->need_notify = false;
+    s->broken = false;
+    s->inflight = 0;
+    s->num_pending = 0;
+    s->iov_used = 0;
+
+    qemu_thread_create(&s->thread, data_plane_thread, s);
+
+    s->starting = false;
+    s->started = true;
+    trace_virtio_blk_data_plane_start(s);
+    return true;
+
+fail_guest:
+    binding->set_guest_notifiers(opaque, false);
+fail_stop:
+    event_notifier_cleanup(&s->stop_notifier);
+fail_efd:
+    close(s->io_efd);
+fail_io:
+    io_destroy(s->io_ctx);
+fail:
+    s->starting = false;
+    s->disabled = true;
+    error_report("virtio-blk: falling back to the main loop");
+    return false;
+}
+
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+    const VirtIOBindings *binding = vdev->binding;
+    void *opaque = vdev->binding_opaque;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_blk_data_plane_stop(s);
+
+    event_notifier_set(&s->stop_notifier);
+    qemu_thread_join(&s->thread);
+
+    /* Hand the ring back to the virtio core where the thread left it */
+    virtio_queue_set_last_avail_idx(vdev, 0, s->last_avail_idx);
+    virtio_queue_invalidate_signalled_used(vdev, 0);
+
+    event_notifier_cleanup(&s->stop_notifier);
+    close(s->io_efd);
+    io_destroy(s->io_ctx);
+
+    /* Kicks that arrived after the thread stopped polling are processed by
+     * virtio_blk_handle_output here, start() refuses while we are stopping */
+    binding->set_host_notifier(opaque, 0, false);
+    binding->set_guest_notifiers(opaque, false);
+
+    s->started = false;
+    s->stopping = false;
+}
+
+VirtIOBlockDataPlane *virtio_blk_data_plane_create(VirtIODevice *vdev,
+                                                   BlockDriverState *bs,
+                                                   const char *serial)
+{
+    VirtIOBlockDataPlane *s;
+    int fd;
+
+    fd = raw_get_aio_fd(bs);
+    if (fd < 0) {
+        error_report("virtio-blk: x-data-plane requires a raw image opened "
+                     "with cache=none,aio=native");
+        return NULL;
+    }
+
+    s = g_malloc0(sizeof(*s));
+    s->vdev = vdev;
+    s->vq = virtio_get_queue(vdev, 0);
+    s->bs = bs;
+    s->serial = serial;
+    s->fd = fd;
+    s->reqs = g_new0(VirtIOBlockDataPlaneReq, VIRTQUEUE_MAX_SIZE);
+
+    qemu_mutex_init(&s->mem_lock);
+    s->client.set_memory = data_plane_set_memory;
+    s->client.sync_dirty_bitmap = data_plane_sync_dirty_bitmap;
+    s->client.migration_log = data_plane_migration_log;
+    s->client.log_start = NULL;
+    s->client.log_stop = NULL;
+    cpu_register_phys_memory_client(&s->client);
+
+    /* The block layer does not see our requests, keep block jobs away */
+    bdrv_set_in_use(bs, 1);
+
+    return s;
+}
+
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+
+    virtio_blk_data_plane_stop(s);
+    bdrv_set_in_use(s->bs, 0);
+    cpu_unregister_phys_memory_client(&s->client);
+    qemu_mutex_destroy(&s->mem_lock);
+    g_free(s->regions);
+    g_free(s->reqs);
+    g_free(s);
+}
@@ -15,7 +15,11 @@
 #include "qemu-error.h"
 #include "trace.h"
 #include "blockdev.h"
+#include "iov.h"
 #include "virtio-blk.h"
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#include "virtio-blk-dataplane.h"
+#endif
 #ifdef __linux__
 # include <scsi/sg.h>
 #endif
@@ -31,6 +35,9 @@ typedef struct VirtIOBlock
     char *serial;
     unsigned short sector_mask;
     DeviceState *qdev;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOBlockDataPlane *dataplane;
+#endif
 } VirtIOBlock;
 
 static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
@@ -237,11 +244,33 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
 }
 #endif /* __linux__ */
 
+/* Limits advertised to the guest for VIRTIO_BLK_T_DISCARD */
+#define VIRTIO_BLK_MAX_DISCARD_SECTORS  (INT_MAX >> BDRV_SECTOR_BITS)
+#define VIRTIO_BLK_MAX_DISCARD_SEG      32
+
+/* Discard ranges collected from one batch of requests before merging */
+#define VIRTIO_BLK_MAX_DISCARD_RANGES   256
+
+typedef struct DiscardRange {
+    int64_t sector;
+    int nb_sectors;
+} DiscardRange;
+
 typedef struct MultiReqBuffer {
     BlockRequest        blkreq[32];
     unsigned int        num_writes;
+    DiscardRange        discard[VIRTIO_BLK_MAX_DISCARD_RANGES];
+    unsigned int        num_discards;
+    VirtIOBlockReq      *discard_reqs;
 } MultiReqBuffer;
 
+/* Completes all discard requests of a batch once every merged range is done */
+typedef struct VirtIOBlockDiscardCB {
+    VirtIOBlockReq *reqs;
+    int pending;
+    int error;
+} VirtIOBlockDiscardCB;
+
 static void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
 {
     int i, ret;
@@ -262,6 +291,142 @@ static void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
     mrb->num_writes = 0;
 }
 
+static void virtio_blk_discard_complete(void *opaque, int ret)
+{
+    VirtIOBlockDiscardCB *dcb = opaque;
+    VirtIOBlockReq *req, *next;
+
+    trace_virtio_blk_discard_complete(dcb, ret);
+
+    if (ret < 0 && !dcb->error) {
+        dcb->error = ret;
+    }
+    if (--dcb->pending > 0) {
+        return;
+    }
+
+    for (req = dcb->reqs; req; req = next) {
+        next = req->next;
+        virtio_blk_req_complete(req, dcb->error ? VIRTIO_BLK_S_IOERR
+                                                : VIRTIO_BLK_S_OK);
+    }
+    g_free(dcb);
+}
+
+static int discard_range_cmp(const void *a, const void *b)
+{
+    const DiscardRange *ra = a, *rb = b;
+
+    if (ra->sector < rb->sector) {
+        return -1;
+    }
+    return ra->sector > rb->sector;
+}
+
+static void virtio_submit_discards(BlockDriverState *bs, MultiReqBuffer *mrb)
+{
+    VirtIOBlockDiscardCB *dcb;
+    DiscardRange *r = mrb->discard;
+    unsigned int i, n;
+
+    if (!mrb->discard_reqs) {
+        return;
+    }
+
+    dcb = g_malloc0(sizeof(*dcb));
+    dcb->reqs = mrb->discard_reqs;
+    /* Hold a reference so that ranges failing right away cannot free dcb */
+    dcb->pending = 1;
+
+    /*
+     * Guests tend to discard many small neighbouring ranges, e.g. when a
+     * filesystem frees an extent block by block.  Merge overlapping and
+     * adjacent ranges so that the host sees as few discards as possible.
+     */
+    qsort(r, mrb->num_discards, sizeof(*r), discard_range_cmp);
+    for (i = 0, n = 0; i < mrb->num_discards; i++) {
+        if (n > 0 && r[i].sector <= r[n - 1].sector + r[n - 1].nb_sectors) {
+            int64_t end = MAX(r[n - 1].sector + r[n - 1].nb_sectors,
+                              r[i].sector + r[i].nb_sectors);
+
+            if (end - r[n - 1].sector <= VIRTIO_BLK_MAX_DISCARD_SECTORS) {
+                r[n - 1].nb_sectors = end - r[n - 1].sector;
+                continue;
+            }
+        }
+        r[n++] = r[i];
+    }
+
+    trace_virtio_submit_discards(dcb, mrb->num_discards, n);
+
+    for (i = 0; i < n; i++) {
+        dcb->pending++;
+        if (!bdrv_aio_discard(bs, r[i].sector, r[i].nb_sectors,
+                              virtio_blk_discard_complete, dcb)) {
+            virtio_blk_discard_complete(dcb, -EIO);
+        }
+    }
+
+    mrb->num_discards = 0;
+    mrb->discard_reqs = NULL;
+    virtio_blk_discard_complete(dcb, 0);
+}
+
+static void virtio_blk_handle_discard(VirtIOBlockReq *req, MultiReqBuffer *mrb)
+{
+    VirtIOBlock *s = req->dev;
+    struct virtio_blk_discard seg[VIRTIO_BLK_MAX_DISCARD_SEG];
+    uint64_t capacity, sector;
+    uint32_t nb_sectors;
+    size_t size;
+    int i, n;
+
+    if (!s->conf->discard_granularity) {
+        virtio_blk_req_complete(req, VIRTIO_BLK_S_UNSUPP);
+        return;
+    }
+
+    size = iov_size(&req->elem.out_sg[1], req->elem.out_num - 1);
+    if (size == 0 || size % sizeof(seg[0]) || size > sizeof(seg)) {
+        virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
+        return;
+    }
+    n = size / sizeof(seg[0]);
+    iov_to_buf(&req->elem.out_sg[1], req->elem.out_num - 1, seg, 0, size);
+
+    /* Check all ranges first, the request fails or succeeds as a whole */
+    bdrv_get_geometry(s->bs, &capacity);
+    for (i = 0; i < n; i++) {
+        sector = ldq_p(&seg[i].sector);
+        nb_sectors = ldl_p(&seg[i].num_sectors);
+
+        if (ldl_p(&seg[i].flags)) {
+            virtio_blk_req_complete(req, VIRTIO_BLK_S_UNSUPP);
+            return;
+        }
+        if (nb_sectors == 0 || nb_sectors > VIRTIO_BLK_MAX_DISCARD_SECTORS ||
+            sector > capacity || nb_sectors > capacity - sector ||
+            ((sector | nb_sectors) & s->sector_mask)) {
+            virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
+            return;
+        }
+    }
+
+    trace_virtio_blk_handle_discard(req, n);
+
+    if (mrb->num_discards + n > VIRTIO_BLK_MAX_DISCARD_RANGES) {
+        virtio_submit_discards(s->bs, mrb);
+    }
+    for (i = 0; i < n; i++) {
+        mrb->discard[mrb->num_discards].sector = ldq_p(&seg[i].sector);
+        mrb->discard[mrb->num_discards].nb_sectors =
+            ldl_p(&seg[i].num_sectors);
+        mrb->num_discards++;
+    }
+    req->next = mrb->discard_reqs;
+    mrb->discard_reqs = req;
+}
+
 static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     BlockDriverAIOCB *acb;
@@ -270,6 +435,7 @@ static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
      * Make sure all outstanding writes are posted to the backing device.
      */
     virtio_submit_multiwrite(req->dev->bs, mrb);
+    virtio_submit_discards(req->dev->bs, mrb);
 
     acb = bdrv_aio_flush(req->dev->bs, virtio_blk_flush_complete, req);
     if (!acb) {
@@ -355,7 +521,10 @@ static void virtio_blk_handle_request(VirtIOBlockReq *req,
 
     type = ldl_p(&req->out->type);
 
-    if (type & VIRTIO_BLK_T_FLUSH) {
+    /* Not a combination of the flag-style types below, so test it first */
+    if ((type & ~VIRTIO_BLK_T_BARRIER) == VIRTIO_BLK_T_DISCARD) {
+        virtio_blk_handle_discard(req, mrb);
+    } else if (type & VIRTIO_BLK_T_FLUSH) {
         virtio_blk_handle_flush(req, mrb);
     } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
         virtio_blk_handle_scsi(req);
@@ -389,11 +558,24 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
         .num_writes = 0,
     };
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* Some guests kick before setting DRIVER_OK, so the data plane is
+     * started on the first kick and ignores the ones it has taken over */
+    if (s->dataplane && virtio_blk_data_plane_start(s->dataplane)) {
+        return;
+    }
+#endif
+
+    bdrv_io_plug(s->bs);
+
     while ((req = virtio_blk_get_request(s))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_submit_discards(s->bs, &mrb);
+
+    bdrv_io_unplug(s->bs);
 
     /*
      * FIXME: Want to check for completions before returning to guest mode,
@@ -415,12 +597,18 @@ static void virtio_blk_dma_restart_bh(void *opaque)
 
     s->rq = NULL;
 
+    bdrv_io_plug(s->bs);
+
     while (req) {
+        VirtIOBlockReq *next = req->next;
         virtio_blk_handle_request(req, &mrb);
-        req = req->next;
+        req = next;
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_submit_discards(s->bs, &mrb);
+
+    bdrv_io_unplug(s->bs);
 }
 
 static void virtio_blk_dma_restart_cb(void *opaque, int running, int reason)
@@ -438,6 +626,14 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running, int reason)
 
 static void virtio_blk_reset(VirtIODevice *vdev)
 {
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
+    if (s->dataplane) {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+#endif
+
     /*
      * This should cancel pending requests, but can't do nicely until there
      * are per-device request lists.
@@ -445,6 +641,21 @@ static void virtio_blk_reset(VirtIODevice *vdev)
     qemu_aio_flush();
 }
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+static void virtio_blk_set_status(VirtIODevice *vdev, uint8_t status)
+{
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
+    /* The thread must not touch guest memory once the driver lets go of the
+     * device or the VM stops; the main loop takes over the ring until the
+     * next kick */
+    if (s->dataplane &&
+        (!(status & VIRTIO_CONFIG_S_DRIVER_OK) || !vdev->vm_running)) {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+}
+#endif
+
 /* coalesce internal state, copy to pci i/o region 0
  */
 static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
@@ -468,6 +679,12 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     blkcfg.alignment_offset = 0;
     blkcfg.min_io_size = s->conf->min_io_size / blkcfg.blk_size;
     blkcfg.opt_io_size = s->conf->opt_io_size / blkcfg.blk_size;
+    if (s->conf->discard_granularity) {
+        stl_raw(&blkcfg.max_discard_sectors, VIRTIO_BLK_MAX_DISCARD_SECTORS);
+        stl_raw(&blkcfg.max_discard_seg, VIRTIO_BLK_MAX_DISCARD_SEG);
+        stl_raw(&blkcfg.discard_sector_alignment,
+                s->conf->discard_granularity / BDRV_SECTOR_SIZE);
+    }
     memcpy(config, &blkcfg, sizeof(struct virtio_blk_config));
 }
 
@@ -485,6 +702,16 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     
     if (bdrv_is_read_only(s->bs))
         features |= 1 << VIRTIO_BLK_F_RO;
+    else if (s->conf->discard_granularity)
+        features |= 1 << VIRTIO_BLK_F_DISCARD;
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* The data plane only handles read, write, flush and get-id */
+    if (s->dataplane) {
+        features &= ~(1 << VIRTIO_BLK_F_DISCARD);
+        features &= ~(1 << VIRTIO_BLK_F_SCSI);
+    }
+#endif
 
     return features;
 }
@@ -537,7 +764,7 @@ static void virtio_blk_change_cb(void *opaque, int reason)
 }
 
 VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
-                              char **serial)
+                              char **serial, bool data_plane)
 {
     VirtIOBlock *s;
     int cylinders, heads, secs;
@@ -577,10 +804,33 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
 
     s->vq = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
 
+    if (data_plane) {
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+        s->dataplane = virtio_blk_data_plane_create(&s->vdev, s->bs,
+                                                    s->serial);
+        if (!s->dataplane) {
+            virtio_cleanup(&s->vdev);
+            return NULL;
+        }
+        s->vdev.set_status = virtio_blk_set_status;
+#else
+        error_report("virtio-blk: x-data-plane is not supported by this "
+                     "QEMU build");
+        virtio_cleanup(&s->vdev);
+        return NULL;
+#endif
+    }
+
     qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     s->qdev = dev;
     register_savevm(dev, "virtio-blk", virtio_blk_id++, 2,
                     virtio_blk_save, virtio_blk_load, s);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* The ring state lives in the data plane thread while it runs */
+    if (s->dataplane) {
+        register_device_unmigratable(dev, "virtio-blk", s);
+    }
+#endif
     bdrv_set_removable(s->bs, 0);
     bdrv_set_change_cb(s->bs, virtio_blk_change_cb, s);
     s->bs->buffer_alignment = conf->logical_block_size;
@@ -593,6 +843,10 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
 void virtio_blk_exit(VirtIODevice *vdev)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    virtio_blk_data_plane_destroy(s->dataplane);
+    s->dataplane = NULL;
+#endif
     unregister_savevm(s->qdev, "virtio-blk", s);
     virtio_cleanup(vdev);
 }
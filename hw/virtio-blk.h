@@ -33,6 +33,7 @@
 /* #define VIRTIO_BLK_F_IDENTIFY   8       ATA IDENTIFY supported, DEPRECATED */
 #define VIRTIO_BLK_F_WCACHE     9       /* write cache enabled */
 #define VIRTIO_BLK_F_TOPOLOGY   10      /* Topology information is available */
+#define VIRTIO_BLK_F_DISCARD    13      /* Discard command is supported */
 
 #define VIRTIO_BLK_ID_BYTES     20      /* ID string length */
 
@@ -49,6 +50,12 @@ struct virtio_blk_config
     uint8_t alignment_offset;
     uint16_t min_io_size;
     uint32_t opt_io_size;
+    uint8_t wce;
+    uint8_t unused;
+    uint16_t num_queues;
+    uint32_t max_discard_sectors;
+    uint32_t max_discard_seg;
+    uint32_t discard_sector_alignment;
 } __attribute__((packed));
 
 /* These two define direction. */
@@ -64,6 +71,9 @@ struct virtio_blk_config
 /* return the device ID string */
 #define VIRTIO_BLK_T_GET_ID     8
 
+/* Discard sectors, the payload is an array of virtio_blk_discard */
+#define VIRTIO_BLK_T_DISCARD    11
+
 /* Barrier before this op. */
 #define VIRTIO_BLK_T_BARRIER    0x80000000
 
@@ -78,6 +88,14 @@ struct virtio_blk_outhdr
     uint64_t sector;
 };
 
+/* One range of a VIRTIO_BLK_T_DISCARD request */
+struct virtio_blk_discard
+{
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+};
+
 #define VIRTIO_BLK_S_OK         0
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
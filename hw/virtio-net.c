@@ -20,32 +20,81 @@
 #include "qemu-timer.h"
 #include "virtio-net.h"
 #include "vhost_net.h"
+#include "qjson.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
 #define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
-typedef struct VirtIONet
+/* tx=adaptive re-evaluates the tx mode of a queue every window.  A queue
+ * that the guest kicks more than TX_ADAPTIVE_KICKS times per window for
+ * less than two packets per kick coalesces kicks with the tx timer; a
+ * queue that sends fewer than TX_ADAPTIVE_KICKS / 2 packets per window
+ * goes back to flushing from a bottom half as soon as it is kicked. */
+#define TX_ADAPTIVE_WINDOW   (100 * SCALE_MS)
+#define TX_ADAPTIVE_KICKS    1000
+
+enum {
+    VIRTIO_NET_TX_BH,
+    VIRTIO_NET_TX_TIMER,
+    VIRTIO_NET_TX_ADAPTIVE,
+};
+
+static const char *const virtio_net_tx_modes[] = {
+    [VIRTIO_NET_TX_BH] = "bh",
+    [VIRTIO_NET_TX_TIMER] = "timer",
+    [VIRTIO_NET_TX_ADAPTIVE] = "adaptive",
+};
+
+typedef struct VirtIONet VirtIONet;
+
+/* One rx/tx virtqueue pair, backed by one queue of the peer */
+typedef struct VirtIONetQueue
 {
-    VirtIODevice vdev;
-    uint8_t mac[ETH_ALEN];
-    uint16_t status;
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
-    VirtQueue *ctrl_vq;
-    NICState *nic;
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
-    uint32_t tx_timeout;
-    int32_t tx_burst;
+    /* kicks are coalesced with tx_timer rather than handled by tx_bh */
+    int tx_use_timer;
     int tx_waiting;
-    uint32_t has_vnet_hdr;
-    uint8_t has_ufo;
+    uint64_t tx_kicks;
+    uint64_t tx_batches;
+    uint64_t tx_packets;
+    /* start of the current tx=adaptive window and counters at that time */
+    int64_t tx_window_start;
+    uint64_t tx_window_kicks;
+    uint64_t tx_window_packets;
+    /* set while the peer delivers a burst of packets */
+    int rx_batch;
+    /* rx elements filled but not yet flushed to the guest */
+    unsigned int rx_pending;
     struct {
         VirtQueueElement elem;
         ssize_t len;
     } async_tx;
+    NICState *nic;
+    /* backing configuration of nic for all queues but the first */
+    NICConf conf;
+    VirtIONet *n;
+} VirtIONetQueue;
+
+struct VirtIONet
+{
+    VirtIODevice vdev;
+    uint8_t mac[ETH_ALEN];
+    uint16_t status;
+    VirtIONetQueue *vqs;
+    VirtQueue *ctrl_vq;
+    /* the nic of the first queue */
+    NICState *nic;
+    uint32_t tx_timeout;
+    int32_t tx_burst;
+    int tx_mode;
+    void (*handle_tx)(VirtIODevice *vdev, VirtQueue *vq);
+    uint32_t has_vnet_hdr;
+    uint8_t has_ufo;
     int mergeable_rx_bufs;
     uint8_t promisc;
     uint8_t allmulti;
@@ -63,7 +112,11 @@ typedef struct VirtIONet
     } mac_table;
     uint32_t *vlans;
     DeviceState *qdev;
-} VirtIONet;
+    int multiqueue;
+    uint16_t max_queues;
+    uint16_t curr_queues;
+    size_t config_size;
+};
 
 /* TODO
  * - we could suppress RX interrupt if we were so inclined.
@@ -74,14 +127,26 @@ static VirtIONet *to_virtio_net(VirtIODevice *vdev)
     return (VirtIONet *)vdev;
 }
 
+static VirtIONetQueue *virtio_net_get_queue(VLANClientState *nc)
+{
+    return DO_UPCAST(NICState, nc, nc)->opaque;
+}
+
+/* rx and tx virtqueues of a queue pair are 2 * i and 2 * i + 1 */
+static int vq2q(int queue_index)
+{
+    return queue_index / 2;
+}
+
 static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
 {
     VirtIONet *n = to_virtio_net(vdev);
     struct virtio_net_config netcfg;
 
     stw_p(&netcfg.status, n->status);
+    stw_p(&netcfg.max_virtqueue_pairs, n->max_queues);
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
-    memcpy(config, &netcfg, sizeof(netcfg));
+    memcpy(config, &netcfg, n->config_size);
 }
 
 static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
@@ -89,7 +154,7 @@ static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
     VirtIONet *n = to_virtio_net(vdev);
     struct virtio_net_config netcfg;
 
-    memcpy(&netcfg, config, sizeof(netcfg));
+    memcpy(&netcfg, config, n->config_size);
 
     if (memcmp(netcfg.mac, n->mac, ETH_ALEN)) {
         memcpy(n->mac, netcfg.mac, ETH_ALEN);
@@ -105,6 +170,10 @@ static bool virtio_net_started(VirtIONet *n, uint8_t status)
 
 static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
 {
+    VLANClientState *peers[VIRTIO_NET_MAX_QUEUES];
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i;
+
     if (!n->nic->nc.peer) {
         return;
     }
@@ -119,12 +188,15 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
                               !n->nic->nc.peer->link_down) {
         return;
     }
+    for (i = 0; i < queues; i++) {
+        peers[i] = n->vqs[i].nic->nc.peer;
+    }
     if (!n->vhost_started) {
         int r;
         if (!vhost_net_query(tap_get_vhost_net(n->nic->nc.peer), &n->vdev)) {
             return;
         }
-        r = vhost_net_start(tap_get_vhost_net(n->nic->nc.peer), &n->vdev);
+        r = vhost_net_start(&n->vdev, peers, queues);
         if (r < 0) {
             error_report("unable to start vhost net: %d: "
                          "falling back on userspace virtio", -r);
@@ -132,7 +204,7 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
             n->vhost_started = 1;
         }
     } else {
-        vhost_net_stop(tap_get_vhost_net(n->nic->nc.peer), &n->vdev);
+        vhost_net_stop(&n->vdev, peers, queues);
         n->vhost_started = 0;
     }
 }
@@ -140,32 +212,38 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q;
+    int i;
 
     virtio_net_vhost_status(n, status);
 
-    if (!n->tx_waiting) {
-        return;
-    }
+    for (i = 0; i < n->max_queues; i++) {
+        q = &n->vqs[i];
 
-    if (virtio_net_started(n, status) && !n->vhost_started) {
-        if (n->tx_timer) {
-            qemu_mod_timer(n->tx_timer,
-                           qemu_get_clock_ns(vm_clock) + n->tx_timeout);
-        } else {
-            qemu_bh_schedule(n->tx_bh);
+        if (!q->tx_waiting) {
+            continue;
         }
-    } else {
-        if (n->tx_timer) {
-            qemu_del_timer(n->tx_timer);
+
+        if (virtio_net_started(n, status) && !n->vhost_started) {
+            if (q->tx_use_timer) {
+                qemu_mod_timer(q->tx_timer,
+                               qemu_get_clock_ns(vm_clock) + n->tx_timeout);
+            } else {
+                qemu_bh_schedule(q->tx_bh);
+            }
         } else {
-            qemu_bh_cancel(n->tx_bh);
+            if (q->tx_use_timer) {
+                qemu_del_timer(q->tx_timer);
+            } else {
+                qemu_bh_cancel(q->tx_bh);
+            }
         }
     }
 }
 
 static void virtio_net_set_link_status(VLANClientState *nc)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONet *n = virtio_net_get_queue(nc)->n;
     uint16_t old_status = n->status;
 
     if (nc->link_down)
@@ -179,6 +257,33 @@ static void virtio_net_set_link_status(VLANClientState *nc)
     virtio_net_set_status(&n->vdev, n->vdev.status);
 }
 
+/* Only the first curr_queues queues of the peer carry traffic */
+static void virtio_net_set_queues(VirtIONet *n)
+{
+    int i;
+
+    if (n->max_queues == 1) {
+        return;
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        VLANClientState *peer = n->vqs[i].nic->nc.peer;
+
+        if (!peer) {
+            continue;
+        }
+        if (i < n->curr_queues) {
+            if (tap_enable(peer) < 0) {
+                error_report("virtio-net: unable to enable queue %d", i);
+            }
+        } else {
+            if (tap_disable(peer) < 0) {
+                error_report("virtio-net: unable to disable queue %d", i);
+            }
+        }
+    }
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = to_virtio_net(vdev);
@@ -198,6 +303,10 @@ static void virtio_net_reset(VirtIODevice *vdev)
     n->mac_table.uni_overflow = 0;
     memset(n->mac_table.macs, 0, MAC_TABLE_ENTRIES * ETH_ALEN);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+
+    /* Back to a single queue until the guest asks for more */
+    n->curr_queues = 1;
+    virtio_net_set_queues(n);
 }
 
 static int peer_has_vnet_hdr(VirtIONet *n)
@@ -226,11 +335,18 @@ static int peer_has_ufo(VirtIONet *n)
 static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    int i;
 
     features |= (1 << VIRTIO_NET_F_MAC);
 
+    if (n->max_queues == 1 || !(features & (1 << VIRTIO_NET_F_CTRL_VQ))) {
+        features &= ~(0x1 << VIRTIO_NET_F_MQ);
+    }
+
     if (peer_has_vnet_hdr(n)) {
-        tap_using_vnet_hdr(n->nic->nc.peer, 1);
+        for (i = 0; i < n->max_queues; i++) {
+            tap_using_vnet_hdr(n->vqs[i].nic->nc.peer, 1);
+        }
     } else {
         features &= ~(0x1 << VIRTIO_NET_F_CSUM);
         features &= ~(0x1 << VIRTIO_NET_F_HOST_TSO4);
@@ -273,20 +389,61 @@ static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
     return features;
 }
 
-static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
+static void virtio_net_set_offload(VirtIONet *n, uint32_t features)
 {
-    VirtIONet *n = to_virtio_net(vdev);
-
-    n->mergeable_rx_bufs = !!(features & (1 << VIRTIO_NET_F_MRG_RXBUF));
+    int i;
 
-    if (n->has_vnet_hdr) {
-        tap_set_offload(n->nic->nc.peer,
+    for (i = 0; i < n->max_queues; i++) {
+        tap_set_offload(n->vqs[i].nic->nc.peer,
                         (features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
                         (features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
                         (features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
                         (features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
                         (features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
     }
+}
+
+static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq);
+static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq);
+
+/* Lay out the virtqueues as rx0, tx0, ..., rxN, txN, ctrl where N is the
+ * number of queue pairs visible to the guest. */
+static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
+{
+    int i, max = multiqueue ? n->max_queues : 1;
+
+    n->multiqueue = multiqueue;
+
+    for (i = 2; i <= n->max_queues * 2; i++) {
+        virtio_del_queue(&n->vdev, i);
+    }
+
+    for (i = 1; i < max; i++) {
+        n->vqs[i].rx_vq = virtio_add_queue(&n->vdev, 256,
+                                           virtio_net_handle_rx);
+        n->vqs[i].tx_vq = virtio_add_queue(&n->vdev, 256, n->handle_tx);
+    }
+
+    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
+
+    virtio_net_set_queues(n);
+}
+
+static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
+{
+    VirtIONet *n = to_virtio_net(vdev);
+    int multiqueue = !!(features & (1 << VIRTIO_NET_F_MQ));
+    int i;
+
+    n->mergeable_rx_bufs = !!(features & (1 << VIRTIO_NET_F_MRG_RXBUF));
+
+    if (multiqueue != n->multiqueue) {
+        virtio_net_set_multiqueue(n, multiqueue);
+    }
+
+    if (n->has_vnet_hdr) {
+        virtio_net_set_offload(n, features);
+    }
     if (!n->nic->nc.peer ||
         n->nic->nc.peer->info->type != NET_CLIENT_TYPE_TAP) {
         return;
@@ -294,7 +451,10 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
     if (!tap_get_vhost_net(n->nic->nc.peer)) {
         return;
     }
-    vhost_net_ack_features(tap_get_vhost_net(n->nic->nc.peer), features);
+    for (i = 0; i < n->max_queues; i++) {
+        vhost_net_ack_features(tap_get_vhost_net(n->vqs[i].nic->nc.peer),
+                               features);
+    }
 }
 
 static int virtio_net_handle_rx_mode(VirtIONet *n, uint8_t cmd,
@@ -404,6 +564,33 @@ static int virtio_net_handle_vlan_table(VirtIONet *n, uint8_t cmd,
     return VIRTIO_NET_OK;
 }
 
+static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
+                                VirtQueueElement *elem)
+{
+    struct virtio_net_ctrl_mq mq;
+    uint16_t queues;
+
+    if (elem->out_num != 2 || elem->out_sg[1].iov_len != sizeof(mq)) {
+        error_report("virtio-net ctrl invalid mq command");
+        return VIRTIO_NET_ERR;
+    }
+
+    queues = lduw_p(elem->out_sg[1].iov_base);
+
+    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET ||
+        queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+        queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
+        queues > n->max_queues ||
+        !n->multiqueue) {
+        return VIRTIO_NET_ERR;
+    }
+
+    n->curr_queues = queues;
+    virtio_net_set_queues(n);
+
+    return VIRTIO_NET_OK;
+}
+
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
@@ -432,6 +619,8 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             status = virtio_net_handle_mac(n, ctrl.cmd, &elem);
         else if (ctrl.class == VIRTIO_NET_CTRL_VLAN)
             status = virtio_net_handle_vlan_table(n, ctrl.cmd, &elem);
+        else if (ctrl.class == VIRTIO_NET_CTRL_MQ)
+            status = virtio_net_handle_mq(n, ctrl.cmd, &elem);
 
         stb_p(elem.in_sg[elem.in_num - 1].iov_base, status);
 
@@ -442,11 +631,37 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 
 /* RX */
 
+static void virtio_net_rx_flush(VirtIONetQueue *q)
+{
+    if (!q->rx_pending) {
+        return;
+    }
+
+    virtqueue_flush(q->rx_vq, q->rx_pending);
+    q->rx_pending = 0;
+    virtio_notify(&q->n->vdev, q->rx_vq);
+}
+
+/* Completed rx buffers of a burst are returned to the guest with a
+ * single used ring update and notification when the burst ends */
+static void virtio_net_receive_batch(VLANClientState *nc, bool start)
+{
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+
+    q->rx_batch = start;
+    if (!start) {
+        virtio_net_rx_flush(q);
+    }
+}
+
 static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
-    qemu_flush_queued_packets(&n->nic->nc);
+    virtio_net_receive_batch(&q->nic->nc, true);
+    qemu_flush_queued_packets(&q->nic->nc);
+    virtio_net_receive_batch(&q->nic->nc, false);
 
     /* We now have RX buffers, signal to the IO thread to break out of the
      * select to re-poll the tap file descriptor */
@@ -455,36 +670,42 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 
 static int virtio_net_can_receive(VLANClientState *nc)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    VirtIONet *n = q->n;
     if (!n->vdev.vm_running) {
         return 0;
     }
 
-    if (!virtio_queue_ready(n->rx_vq) ||
+    if (q - n->vqs >= n->curr_queues) {
+        return 0;
+    }
+
+    if (!virtio_queue_ready(q->rx_vq) ||
         !(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return 0;
 
     return 1;
 }
 
-static int virtio_net_has_buffers(VirtIONet *n, int bufsize)
+static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
 {
-    if (virtio_queue_empty(n->rx_vq) ||
+    VirtIONet *n = q->n;
+    if (virtio_queue_empty(q->rx_vq) ||
         (n->mergeable_rx_bufs &&
-         !virtqueue_avail_bytes(n->rx_vq, bufsize, 0))) {
-        virtio_queue_set_notification(n->rx_vq, 1);
+         !virtqueue_avail_bytes(q->rx_vq, bufsize, 0))) {
+        virtio_queue_set_notification(q->rx_vq, 1);
 
         /* To avoid a race condition where the guest has made some buffers
          * available after the above check but before notification was
          * enabled, check for available buffers again.
          */
-        if (virtio_queue_empty(n->rx_vq) ||
+        if (virtio_queue_empty(q->rx_vq) ||
             (n->mergeable_rx_bufs &&
-             !virtqueue_avail_bytes(n->rx_vq, bufsize, 0)))
+             !virtqueue_avail_bytes(q->rx_vq, bufsize, 0)))
             return 0;
     }
 
-    virtio_queue_set_notification(n->rx_vq, 0);
+    virtio_queue_set_notification(q->rx_vq, 0);
     return 1;
 }
 
@@ -595,11 +816,12 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
 
 static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    VirtIONet *n = q->n;
     struct virtio_net_hdr_mrg_rxbuf *mhdr = NULL;
     size_t guest_hdr_len, offset, i, host_hdr_len;
 
-    if (!virtio_net_can_receive(&n->nic->nc))
+    if (!virtio_net_can_receive(nc))
         return -1;
 
     /* hdr_len refers to the header we supply to the guest */
@@ -608,7 +830,7 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
 
 
     host_hdr_len = n->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
-    if (!virtio_net_has_buffers(n, size + guest_hdr_len - host_hdr_len))
+    if (!virtio_net_has_buffers(q, size + guest_hdr_len - host_hdr_len))
         return 0;
 
     if (!receive_filter(n, buf, size))
@@ -623,7 +845,7 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
 
         total = 0;
 
-        if (virtqueue_pop(n->rx_vq, &elem) == 0) {
+        if (virtqueue_pop(q->rx_vq, &elem) == 0) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -675,37 +897,55 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
         }
 
         /* signal other side */
-        virtqueue_fill(n->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, &elem, total, q->rx_pending + i++);
     }
 
     if (mhdr) {
         stw_p(&mhdr->num_buffers, i);
     }
 
-    virtqueue_flush(n->rx_vq, i);
-    virtio_notify(&n->vdev, n->rx_vq);
+    q->rx_pending += i;
+    if (!q->rx_batch) {
+        virtio_net_rx_flush(q);
+    }
 
     return size;
 }
 
-static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq);
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(VLANClientState *nc, ssize_t len)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    VirtIONet *n = q->n;
+
+    virtqueue_push(q->tx_vq, &q->async_tx.elem, q->async_tx.len);
+    virtio_notify(&n->vdev, q->tx_vq);
 
-    virtqueue_push(n->tx_vq, &n->async_tx.elem, n->async_tx.len);
-    virtio_notify(&n->vdev, n->tx_vq);
+    q->async_tx.elem.out_num = q->async_tx.len = 0;
 
-    n->async_tx.elem.out_num = n->async_tx.len = 0;
+    /* The packet was purged, we are being torn down */
+    if (len == 0) {
+        return;
+    }
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q);
 }
 
 /* TX */
-static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
+static void virtio_net_tx_account(VirtIONetQueue *q, int32_t num_packets)
 {
+    if (num_packets > 0) {
+        q->tx_batches++;
+        q->tx_packets += num_packets;
+    }
+}
+
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+    VirtQueue *vq = q->tx_vq;
     VirtQueueElement elem;
     int32_t num_packets = 0;
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -714,8 +954,8 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
 
     assert(n->vdev.vm_running);
 
-    if (n->async_tx.elem.out_num) {
-        virtio_queue_set_notification(n->tx_vq, 0);
+    if (q->async_tx.elem.out_num) {
+        virtio_queue_set_notification(vq, 0);
         return num_packets;
     }
 
@@ -747,12 +987,13 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
             len += hdr_len;
         }
 
-        ret = qemu_sendv_packet_async(&n->nic->nc, out_sg, out_num,
+        ret = qemu_sendv_packet_async(&q->nic->nc, out_sg, out_num,
                                       virtio_net_tx_complete);
         if (ret == 0) {
-            virtio_queue_set_notification(n->tx_vq, 0);
-            n->async_tx.elem = elem;
-            n->async_tx.len  = len;
+            virtio_queue_set_notification(vq, 0);
+            q->async_tx.elem = elem;
+            q->async_tx.len  = len;
+            virtio_net_tx_account(q, num_packets);
             return -EBUSY;
         }
 
@@ -765,28 +1006,32 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
             break;
         }
     }
+    virtio_net_tx_account(q, num_packets);
     return num_packets;
 }
 
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    q->tx_kicks++;
 
     /* This happens when device was stopped but VCPU wasn't. */
     if (!n->vdev.vm_running) {
-        n->tx_waiting = 1;
+        q->tx_waiting = 1;
         return;
     }
 
-    if (n->tx_waiting) {
+    if (q->tx_waiting) {
         virtio_queue_set_notification(vq, 1);
-        qemu_del_timer(n->tx_timer);
-        n->tx_waiting = 0;
-        virtio_net_flush_tx(n, vq);
+        qemu_del_timer(q->tx_timer);
+        q->tx_waiting = 0;
+        virtio_net_flush_tx(q);
     } else {
-        qemu_mod_timer(n->tx_timer,
+        qemu_mod_timer(q->tx_timer,
                        qemu_get_clock_ns(vm_clock) + n->tx_timeout);
-        n->tx_waiting = 1;
+        q->tx_waiting = 1;
         virtio_queue_set_notification(vq, 0);
     }
 }
@@ -794,48 +1039,98 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    q->tx_kicks++;
 
-    if (unlikely(n->tx_waiting)) {
+    if (unlikely(q->tx_waiting)) {
         return;
     }
-    n->tx_waiting = 1;
+    q->tx_waiting = 1;
     /* This happens when device was stopped but VCPU wasn't. */
     if (!n->vdev.vm_running) {
         return;
     }
     virtio_queue_set_notification(vq, 0);
-    qemu_bh_schedule(n->tx_bh);
+    qemu_bh_schedule(q->tx_bh);
+}
+
+/* Pick the tx mode of an idle queue from the traffic of the last window */
+static void virtio_net_tx_adapt(VirtIONetQueue *q)
+{
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    uint64_t kicks, packets;
+
+    if (now - q->tx_window_start < TX_ADAPTIVE_WINDOW) {
+        return;
+    }
+
+    kicks = q->tx_kicks - q->tx_window_kicks;
+    packets = q->tx_packets - q->tx_window_packets;
+
+    if (!q->tx_use_timer) {
+        if (kicks > TX_ADAPTIVE_KICKS && packets < 2 * kicks) {
+            q->tx_use_timer = 1;
+        }
+    } else {
+        if (packets < TX_ADAPTIVE_KICKS / 2) {
+            q->tx_use_timer = 0;
+        }
+    }
+
+    q->tx_window_start = now;
+    q->tx_window_kicks = q->tx_kicks;
+    q->tx_window_packets = q->tx_packets;
+}
+
+static void virtio_net_handle_tx_adaptive(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    /* Only switch while neither the timer nor the bottom half is pending */
+    if (!q->tx_waiting) {
+        virtio_net_tx_adapt(q);
+    }
+
+    if (q->tx_use_timer) {
+        virtio_net_handle_tx_timer(vdev, vq);
+    } else {
+        virtio_net_handle_tx_bh(vdev, vq);
+    }
 }
 
 static void virtio_net_tx_timer(void *opaque)
 {
-    VirtIONet *n = opaque;
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
     assert(n->vdev.vm_running);
 
-    n->tx_waiting = 0;
+    q->tx_waiting = 0;
 
     /* Just in case the driver is not ready on more */
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return;
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q);
 }
 
 static void virtio_net_tx_bh(void *opaque)
 {
-    VirtIONet *n = opaque;
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
     int32_t ret;
 
     assert(n->vdev.vm_running);
 
-    n->tx_waiting = 0;
+    q->tx_waiting = 0;
 
     /* Just in case the driver is not ready on more */
     if (unlikely(!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)))
         return;
 
-    ret = virtio_net_flush_tx(n, n->tx_vq);
+    ret = virtio_net_flush_tx(q);
     if (ret == -EBUSY) {
         return; /* Notification re-enable handled by tx_complete */
     }
@@ -843,25 +1138,26 @@ static void virtio_net_tx_bh(void *opaque)
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
     if (ret >= n->tx_burst) {
-        qemu_bh_schedule(n->tx_bh);
-        n->tx_waiting = 1;
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
         return;
     }
 
     /* If less than a full burst, re-enable notification and flush
      * anything that may have come in while we weren't looking.  If
      * we find something, assume the guest is still active and reschedule */
-    virtio_queue_set_notification(n->tx_vq, 1);
-    if (virtio_net_flush_tx(n, n->tx_vq) > 0) {
-        virtio_queue_set_notification(n->tx_vq, 0);
-        qemu_bh_schedule(n->tx_bh);
-        n->tx_waiting = 1;
+    virtio_queue_set_notification(q->tx_vq, 1);
+    if (virtio_net_flush_tx(q) > 0) {
+        virtio_queue_set_notification(q->tx_vq, 0);
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
     }
 }
 
 static void virtio_net_save(QEMUFile *f, void *opaque)
 {
     VirtIONet *n = opaque;
+    int i;
 
     /* At this point, backend must be stopped, otherwise
      * it might keep writing to memory. */
@@ -869,7 +1165,7 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     virtio_save(&n->vdev, f);
 
     qemu_put_buffer(f, n->mac, ETH_ALEN);
-    qemu_put_be32(f, n->tx_waiting);
+    qemu_put_be32(f, n->vqs[0].tx_waiting);
     qemu_put_be32(f, n->mergeable_rx_bufs);
     qemu_put_be16(f, n->status);
     qemu_put_byte(f, n->promisc);
@@ -885,6 +1181,13 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     qemu_put_byte(f, n->nouni);
     qemu_put_byte(f, n->nobcast);
     qemu_put_byte(f, n->has_ufo);
+    if (n->max_queues > 1) {
+        qemu_put_be16(f, n->max_queues);
+        qemu_put_be16(f, n->curr_queues);
+        for (i = 1; i < n->curr_queues; i++) {
+            qemu_put_be32(f, n->vqs[i].tx_waiting);
+        }
+    }
 }
 
 static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
@@ -898,7 +1201,7 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
     virtio_load(&n->vdev, f);
 
     qemu_get_buffer(f, n->mac, ETH_ALEN);
-    n->tx_waiting = qemu_get_be32(f);
+    n->vqs[0].tx_waiting = qemu_get_be32(f);
     n->mergeable_rx_bufs = qemu_get_be32(f);
 
     if (version_id >= 3)
@@ -937,13 +1240,10 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
 
         if (n->has_vnet_hdr) {
-            tap_using_vnet_hdr(n->nic->nc.peer, 1);
-            tap_set_offload(n->nic->nc.peer,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+            for (i = 0; i < n->max_queues; i++) {
+                tap_using_vnet_hdr(n->vqs[i].nic->nc.peer, 1);
+            }
+            virtio_net_set_offload(n, n->vdev.guest_features);
         }
     }
 
@@ -966,6 +1266,25 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    if (n->max_queues > 1) {
+        if (n->max_queues != qemu_get_be16(f)) {
+            error_report("virtio-net: different max_queues");
+            return -1;
+        }
+
+        n->curr_queues = qemu_get_be16(f);
+        if (n->curr_queues > n->max_queues) {
+            error_report("virtio-net: curr_queues %d > max_queues %d",
+                         n->curr_queues, n->max_queues);
+            return -1;
+        }
+        for (i = 1; i < n->curr_queues; i++) {
+            n->vqs[i].tx_waiting = qemu_get_be32(f);
+        }
+    }
+
+    virtio_net_set_queues(n);
+
     /* Find the first multicast entry in the saved MAC filter */
     for (i = 0; i < n->mac_table.in_use; i++) {
         if (n->mac_table.macs[i * ETH_ALEN] & 1) {
@@ -978,9 +1297,48 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
 
 static void virtio_net_cleanup(VLANClientState *nc)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    VirtIONet *n = q->n;
 
-    n->nic = NULL;
+    if (n->nic == q->nic) {
+        n->nic = NULL;
+    }
+    q->nic = NULL;
+}
+
+static QObject *virtio_net_query_tx_stats(VLANClientState *nc)
+{
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    VirtIONet *n = q->n;
+    uint64_t kicks = 0, batches = 0, packets = 0;
+    int i, timer_queues = 0;
+
+    /* All queues are reported once, through the nic of the first one */
+    if (q != &n->vqs[0]) {
+        return NULL;
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        kicks += n->vqs[i].tx_kicks;
+        batches += n->vqs[i].tx_batches;
+        packets += n->vqs[i].tx_packets;
+        if (n->vqs[i].tx_use_timer) {
+            timer_queues++;
+        }
+    }
+
+    return qobject_from_jsonf("{ 'name': %s,"
+                              "'tx': %s,"
+                              "'kicks': %" PRId64 ","
+                              "'batches': %" PRId64 ","
+                              "'packets': %" PRId64 ","
+                              "'average-batch': %" PRId64 ","
+                              "'timer-queues': %d }",
+                              nc->name,
+                              virtio_net_tx_modes[n->tx_mode],
+                              kicks, batches, packets,
+                              batches ? packets / batches : 0,
+                              timer_queues);
 }
 
 static NetClientInfo net_virtio_info = {
@@ -990,17 +1348,50 @@ static NetClientInfo net_virtio_info = {
     .receive = virtio_net_receive,
         .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
+    .receive_batch = virtio_net_receive_batch,
+    .query_tx_stats = virtio_net_query_tx_stats,
 };
 
 VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
                               virtio_net_conf *net)
 {
     VirtIONet *n;
+    VLANClientState *peers[VIRTIO_NET_MAX_QUEUES];
+    int i, queues = 1;
+    size_t config_size;
+
+    /* A multiqueue netdev has one peer per queue, all sharing its name */
+    if (conf->peer && !conf->vlan) {
+        queues = qemu_find_netdev_queues(conf->peer->name, peers,
+                                         VIRTIO_NET_MAX_QUEUES);
+        if (queues > VIRTIO_NET_MAX_QUEUES) {
+            error_report("virtio-net: netdev %s has %d queues, "
+                         "at most %d are supported", conf->peer->name,
+                         queues, VIRTIO_NET_MAX_QUEUES);
+            return NULL;
+        }
+        if (queues < 1 || peers[0] != conf->peer) {
+            queues = 1;
+        }
+        for (i = 1; i < queues; i++) {
+            if (peers[i]->peer) {
+                error_report("virtio-net: queue %d of netdev %s is "
+                             "already in use", i, conf->peer->name);
+                return NULL;
+            }
+        }
+    }
+
+    config_size = queues > 1 ? sizeof(struct virtio_net_config) :
+        offsetof(struct virtio_net_config, max_virtqueue_pairs);
 
     n = (VirtIONet *)virtio_common_init("virtio-net", VIRTIO_ID_NET,
-                                        sizeof(struct virtio_net_config),
-                                        sizeof(VirtIONet));
+                                        config_size, sizeof(VirtIONet));
 
+    n->config_size = config_size;
+    n->max_queues = queues;
+    n->curr_queues = 1;
+    n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
     n->vdev.get_config = virtio_net_get_config;
     n->vdev.set_config = virtio_net_set_config;
     n->vdev.get_features = virtio_net_get_features;
@@ -1008,33 +1399,68 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
     n->vdev.bad_features = virtio_net_bad_features;
     n->vdev.reset = virtio_net_reset;
     n->vdev.set_status = virtio_net_set_status;
-    n->rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
+    n->vqs[0].rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
 
-    if (net->tx && strcmp(net->tx, "timer") && strcmp(net->tx, "bh")) {
+    n->tx_mode = VIRTIO_NET_TX_BH;
+    if (net->tx && !strcmp(net->tx, "timer")) {
+        n->tx_mode = VIRTIO_NET_TX_TIMER;
+    } else if (net->tx && !strcmp(net->tx, "adaptive")) {
+        n->tx_mode = VIRTIO_NET_TX_ADAPTIVE;
+    } else if (net->tx && strcmp(net->tx, "bh")) {
         error_report("virtio-net: "
-                     "Unknown option tx=%s, valid options: \"timer\" \"bh\"",
+                     "Unknown option tx=%s, valid options: "
+                     "\"timer\" \"bh\" \"adaptive\"",
                      net->tx);
         error_report("Defaulting to \"bh\"");
     }
 
-    if (net->tx && !strcmp(net->tx, "timer")) {
-        n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_timer);
-        n->tx_timer = qemu_new_timer_ns(vm_clock, virtio_net_tx_timer, n);
-        n->tx_timeout = net->txtimer;
-    } else {
-        n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_bh);
-        n->tx_bh = qemu_bh_new(virtio_net_tx_bh, n);
+    switch (n->tx_mode) {
+    case VIRTIO_NET_TX_TIMER:
+        n->handle_tx = virtio_net_handle_tx_timer;
+        break;
+    case VIRTIO_NET_TX_ADAPTIVE:
+        n->handle_tx = virtio_net_handle_tx_adaptive;
+        break;
+    default:
+        n->handle_tx = virtio_net_handle_tx_bh;
+        break;
+    }
+    n->tx_timeout = net->txtimer;
+    n->vqs[0].tx_vq = virtio_add_queue(&n->vdev, 256, n->handle_tx);
+
+    /* The virtqueues of the other queues are added once the guest
+     * acknowledges VIRTIO_NET_F_MQ */
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        q->n = n;
+        if (n->tx_mode != VIRTIO_NET_TX_BH) {
+            q->tx_timer = qemu_new_timer_ns(vm_clock, virtio_net_tx_timer, q);
+        }
+        if (n->tx_mode != VIRTIO_NET_TX_TIMER) {
+            q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+        }
+        q->tx_use_timer = n->tx_mode == VIRTIO_NET_TX_TIMER;
     }
     n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
     qemu_macaddr_default_if_unset(&conf->macaddr);
     memcpy(&n->mac[0], &conf->macaddr, sizeof(n->mac));
     n->status = VIRTIO_NET_S_LINK_UP;
 
-    n->nic = qemu_new_nic(&net_virtio_info, conf, dev->info->name, dev->id, n);
+    n->nic = qemu_new_nic(&net_virtio_info, conf, dev->info->name, dev->id,
+                          &n->vqs[0]);
+    n->vqs[0].nic = n->nic;
+    for (i = 1; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        q->conf = *conf;
+        q->conf.peer = peers[i];
+        q->nic = qemu_new_nic(&net_virtio_info, &q->conf, dev->info->name,
+                              dev->id, q);
+    }
 
     qemu_format_nic_info_str(&n->nic->nc, conf->macaddr.a);
 
-    n->tx_waiting = 0;
     n->tx_burst = net->txburst;
     n->mergeable_rx_bufs = 0;
     n->promisc = 1; /* for compatibility */
@@ -1055,24 +1481,32 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
 void virtio_net_exit(VirtIODevice *vdev)
 {
     VirtIONet *n = DO_UPCAST(VirtIONet, vdev, vdev);
+    int i;
 
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
 
-    qemu_purge_queued_packets(&n->nic->nc);
-
     unregister_savevm(n->qdev, "virtio-net", n);
 
     g_free(n->mac_table.macs);
     g_free(n->vlans);
 
-    if (n->tx_timer) {
-        qemu_del_timer(n->tx_timer);
-        qemu_free_timer(n->tx_timer);
-    } else {
-        qemu_bh_delete(n->tx_bh);
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        qemu_purge_queued_packets(&q->nic->nc);
+
+        if (q->tx_timer) {
+            qemu_del_timer(q->tx_timer);
+            qemu_free_timer(q->tx_timer);
+        }
+        if (q->tx_bh) {
+            qemu_bh_delete(q->tx_bh);
+        }
+
+        qemu_del_vlan_client(&q->nic->nc);
     }
 
-    qemu_del_vlan_client(&n->nic->nc);
+    g_free(n->vqs);
     virtio_cleanup(&n->vdev);
 }
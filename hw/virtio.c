@@ -667,6 +667,15 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     return &vdev->vq[i];
 }
 
+void virtio_del_queue(VirtIODevice *vdev, int n)
+{
+    if (n < 0 || n >= VIRTIO_PCI_QUEUE_MAX) {
+        abort();
+    }
+
+    vdev->vq[n].vring.num = 0;
+}
+
 void virtio_irq(VirtQueue *vq)
 {
     trace_virtio_irq(vq);
@@ -764,6 +773,7 @@ void virtio_save(VirtIODevice *vdev, QEMUFile *f)
 int virtio_load(VirtIODevice *vdev, QEMUFile *f)
 {
     int num, i, ret;
+    uint32_t config_len;
     uint32_t features;
     uint32_t supported_features =
         vdev->binding->get_features(vdev->binding_opaque);
@@ -786,10 +796,20 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
     if (vdev->set_features)
         vdev->set_features(vdev, features);
     vdev->guest_features = features;
-    vdev->config_len = qemu_get_be32(f);
+    /* e.g. a multiqueue source has a larger virtio-net config */
+    config_len = qemu_get_be32(f);
+    if (config_len != vdev->config_len) {
+        error_report("virtio: config size %u does not match %zu",
+                     config_len, vdev->config_len);
+        return -1;
+    }
     qemu_get_buffer(f, vdev->config, vdev->config_len);
 
     num = qemu_get_be32(f);
+    if (num < 0 || num > VIRTIO_PCI_QUEUE_MAX) {
+        error_report("virtio: %d queues exceed the maximum", num);
+        return -1;
+    }
 
     for (i = 0; i < num; i++) {
         vdev->vq[i].vring.num = qemu_get_be32(f);
@@ -948,11 +968,22 @@ void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
     vdev->vq[n].last_avail_idx = idx;
 }
 
+/* Someone else signalled the guest behind our back, start over */
+void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
+{
+    vdev->vq[n].signalled_used_valid = false;
+}
+
 VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n)
 {
     return vdev->vq + n;
 }
 
+int virtio_get_queue_index(VirtQueue *vq)
+{
+    return vq - &vq->vdev->vq[0];
+}
+
 EventNotifier *virtio_queue_get_guest_notifier(VirtQueue *vq)
 {
     return &vq->guest_notifier;
@@ -11,6 +11,7 @@
 #include "qemu-aio.h"
 #include "block_int.h"
 #include "block/raw-posix-aio.h"
+#include "trace.h"
 
 #include <sys/eventfd.h>
 #include <libaio.h>
@@ -25,6 +26,9 @@
  */
 #define MAX_EVENTS 128
 
+/* Requests queued while plugged before they are submitted anyway */
+#define MAX_QUEUED_IO MAX_EVENTS
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -38,6 +42,15 @@ struct qemu_laio_state {
     io_context_t ctx;
     int efd;
     int count;
+
+    /* requests held back by laio_io_plug(), submitted in one io_submit() */
+    struct iocb *io_q[MAX_QUEUED_IO];
+    int io_q_len;
+    int plugged;
+
+    /* queued requests that could not be submitted, completed from fail_bh */
+    QLIST_HEAD(, qemu_laiocb) failed;
+    QEMUBH *fail_bh;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -68,6 +81,61 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
     qemu_aio_release(laiocb);
 }
 
+static void ioq_fail_bh(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+    struct qemu_laiocb *laiocb;
+
+    while ((laiocb = QLIST_FIRST(&s->failed)) != NULL) {
+        QLIST_REMOVE(laiocb, node);
+        qemu_laio_process_completion(s, laiocb);
+    }
+}
+
+/*
+ * Submits the queued requests with a single io_submit().  If the kernel
+ * cannot take all of them while others are still in flight, the rest stays
+ * queued and is retried when completions come in.  Otherwise requests that
+ * cannot be submitted are failed.  Their callbacks run from a bottom half,
+ * the caller may be in the middle of submitting requests itself.
+ */
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    int ret, i;
+
+    while (s->io_q_len > 0) {
+        do {
+            ret = io_submit(s->ctx, s->io_q_len, s->io_q);
+        } while (ret == -EINTR);
+        trace_laio_ioq_submit(s, s->io_q_len, ret);
+
+        if (ret > 0) {
+            s->io_q_len -= ret;
+            memmove(s->io_q, s->io_q + ret, s->io_q_len * sizeof(s->io_q[0]));
+            continue;
+        }
+        if ((ret == 0 || ret == -EAGAIN) && s->count > s->io_q_len) {
+            return;
+        }
+        break;
+    }
+
+    if (s->io_q_len == 0) {
+        return;
+    }
+
+    /* backwards, so that the callbacks run in submission order */
+    for (i = s->io_q_len - 1; i >= 0; i--) {
+        struct qemu_laiocb *laiocb =
+                container_of(s->io_q[i], struct qemu_laiocb, iocb);
+
+        laiocb->ret = ret < 0 ? ret : -EIO;
+        QLIST_INSERT_HEAD(&s->failed, laiocb, node);
+    }
+    s->io_q_len = 0;
+    qemu_bh_schedule(s->fail_bh);
+}
+
 /*
  * All requests are directly processed when they complete, so there's nothing
  * left to do during qemu_aio_wait().
@@ -80,27 +148,30 @@ static int qemu_laio_process_requests(void *opaque)
 static void qemu_laio_completion_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
+    struct io_event events[MAX_EVENTS];
+    struct timespec ts = { 0 };
+    uint64_t val;
+    ssize_t ret;
+    int nevents, i;
 
-    while (1) {
-        struct io_event events[MAX_EVENTS];
-        uint64_t val;
-        ssize_t ret;
-        struct timespec ts = { 0 };
-        int nevents, i;
-
-        do {
-            ret = read(s->efd, &val, sizeof(val));
-        } while (ret == -1 && errno == EINTR);
-
-        if (ret == -1 && errno == EAGAIN)
-            break;
+    do {
+        ret = read(s->efd, &val, sizeof(val));
+    } while (ret == -1 && errno == EINTR);
 
-        if (ret != 8)
-            break;
+    if (ret != 8)
+        return;
 
+    /*
+     * Reap everything that has completed by now, not just the number of
+     * events the eventfd counted.  Requests that finish while we process a
+     * batch are picked up here instead of costing another trip through the
+     * main loop; the eventfd wakeup they cause then finds nothing to do.
+     */
+    do {
         do {
-            nevents = io_getevents(s->ctx, val, MAX_EVENTS, events, &ts);
+            nevents = io_getevents(s->ctx, 0, MAX_EVENTS, events, &ts);
         } while (nevents == -EINTR);
+        trace_laio_completion_cb(s, nevents);
 
         for (i = 0; i < nevents; i++) {
             struct iocb *iocb = events[i].obj;
@@ -110,6 +181,11 @@ static void qemu_laio_completion_cb(void *opaque)
             laiocb->ret = io_event_ret(&events[i]);
             qemu_laio_process_completion(s, laiocb);
         }
+    } while (nevents == MAX_EVENTS);
+
+    /* retry requests the kernel could not take earlier */
+    if (s->io_q_len > 0 && !s->plugged) {
+        ioq_submit(s);
     }
 }
 
@@ -117,17 +193,49 @@ static int qemu_laio_flush_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
 
+    /*
+     * Somebody waits for our requests to complete.  Queued requests would
+     * never do so, whether or not the caller plugged us.
+     */
+    if (s->io_q_len > 0) {
+        ioq_submit(s);
+    }
+
     return (s->count > 0) ? 1 : 0;
 }
 
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
+    struct qemu_laio_state *s = laiocb->ctx;
     struct io_event event;
-    int ret;
-
-    if (laiocb->ret != -EINPROGRESS)
+    struct qemu_laiocb *failed;
+    int ret, i;
+
+    if (laiocb->ret != -EINPROGRESS) {
+        /* a failed submission whose callback is still pending in fail_bh */
+        QLIST_FOREACH(failed, &s->failed, node) {
+            if (failed == laiocb) {
+                QLIST_REMOVE(laiocb, node);
+                laiocb->ret = -ECANCELED;
+                qemu_laio_process_completion(s, laiocb);
+                break;
+            }
+        }
         return;
+    }
+
+    /* a request that is still queued never reached the kernel */
+    for (i = 0; i < s->io_q_len; i++) {
+        if (s->io_q[i] == &laiocb->iocb) {
+            s->io_q_len--;
+            memmove(&s->io_q[i], &s->io_q[i + 1],
+                    (s->io_q_len - i) * sizeof(s->io_q[0]));
+            laiocb->ret = -ECANCELED;
+            qemu_laio_process_completion(s, laiocb);
+            return;
+        }
+    }
 
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
@@ -187,19 +295,48 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         goto out_free_aiocb;
     }
     io_set_eventfd(&laiocb->iocb, s->efd);
-    s->count++;
 
+    if (s->plugged) {
+        if (s->io_q_len == MAX_QUEUED_IO) {
+            ioq_submit(s);
+            if (s->io_q_len == MAX_QUEUED_IO) {
+                goto out_free_aiocb;
+            }
+        }
+        s->count++;
+        s->io_q[s->io_q_len++] = iocbs;
+        return &laiocb->common;
+    }
+
+    s->count++;
     if (io_submit(s->ctx, 1, &iocbs) < 0)
         goto out_dec_count;
     return &laiocb->common;
 
-out_free_aiocb:
-    qemu_aio_release(laiocb);
 out_dec_count:
     s->count--;
+out_free_aiocb:
+    qemu_aio_release(laiocb);
     return NULL;
 }
 
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->plugged > 0);
+    if (--s->plugged == 0 && s->io_q_len > 0) {
+        ioq_submit(s);
+    }
+}
+
 void *laio_init(void)
 {
     struct qemu_laio_state *s;
@@ -213,6 +350,9 @@ void *laio_init(void)
     if (io_setup(MAX_EVENTS, &s->ctx) != 0)
         goto out_close_efd;
 
+    QLIST_INIT(&s->failed);
+    s->fail_bh = qemu_bh_new(ioq_fail_bh, s);
+
     qemu_aio_set_fd_handler(s->efd, qemu_laio_completion_cb, NULL,
         qemu_laio_flush_cb, qemu_laio_process_requests, s);
 
@@ -28,6 +28,15 @@
     do { } while (0)
 #endif
 
+/* destination of the outgoing migration, for the RAM data channels */
+static struct sockaddr_in outgoing_addr;
+
+/* RAM data channels of outgoing_mig that are still connecting */
+static FdMigrationState *outgoing_mig;
+static int channel_fds[MAX_MIGRATION_CHANNELS];
+static int channel_nr;
+static int channel_pending;
+
 static int socket_errno(FdMigrationState *s)
 {
     return socket_error();
@@ -38,6 +47,11 @@ static int socket_write(FdMigrationState *s, const void * buf, size_t size)
     return send(s->fd, buf, size, 0);
 }
 
+static int socket_read(FdMigrationState *s, void *buf, size_t size)
+{
+    return qemu_recv(s->fd, buf, size, 0);
+}
+
 static int tcp_close(FdMigrationState *s)
 {
     DPRINTF("tcp_close\n");
@@ -48,6 +62,142 @@ static int tcp_close(FdMigrationState *s)
     return 0;
 }
 
+/* Drops the data channels that are still connecting, if they belong to s */
+static void tcp_abort_channels(FdMigrationState *s)
+{
+    int i;
+
+    if (outgoing_mig != s) {
+        return;
+    }
+    for (i = 0; i < channel_nr; i++) {
+        if (channel_fds[i] != -1) {
+            qemu_set_fd_handler2(channel_fds[i], NULL, NULL, NULL, NULL);
+            closesocket(channel_fds[i]);
+            channel_fds[i] = -1;
+        }
+    }
+    outgoing_mig = NULL;
+}
+
+/*
+ * The connection of data channel i is up: identify it to the destination
+ * and hand the socket to the sender thread, which expects blocking I/O.
+ * The header fits in the empty socket buffer, so sending it does not block.
+ */
+static int tcp_start_channel(int i)
+{
+    int fd = channel_fds[i];
+    uint32_t hdr[2];
+
+    socket_set_block(fd);
+    hdr[0] = cpu_to_be32(RAM_CHANNEL_MAGIC);
+    hdr[1] = cpu_to_be32(i);
+    if (send_all(fd, hdr, sizeof(hdr)) != sizeof(hdr)) {
+        return -1;
+    }
+
+    if (--channel_pending == 0) {
+        FdMigrationState *s = outgoing_mig;
+
+        outgoing_mig = NULL;
+        ram_channels_setup(channel_fds, channel_nr);
+        migrate_fd_connect(s);
+    }
+    return 0;
+}
+
+static void tcp_channel_failed(int i)
+{
+    FdMigrationState *s = outgoing_mig;
+
+    DPRINTF("connecting channel %d failed\n", i);
+    tcp_abort_channels(s);
+    migrate_fd_error(s);
+}
+
+static void tcp_channel_wait_for_connect(void *opaque)
+{
+    int i = (intptr_t)opaque;
+    int fd = channel_fds[i];
+    int val, ret;
+    socklen_t valsize = sizeof(val);
+
+    do {
+        ret = getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *) &val, &valsize);
+    } while (ret == -1 && socket_error() == EINTR);
+
+    qemu_set_fd_handler2(fd, NULL, NULL, NULL, NULL);
+
+    if (ret < 0 || val != 0 || tcp_start_channel(i) < 0) {
+        tcp_channel_failed(i);
+    }
+}
+
+/*
+ * Opens the RAM data channels once the main connection is up, without
+ * blocking the main loop; the migration starts when all of them are
+ * connected.  The destination accepts them when the first sync point
+ * arrives, until then they wait on its listening socket.
+ */
+static void tcp_connect_channels(FdMigrationState *s, int nr)
+{
+    int i, ret;
+
+    outgoing_mig = s;
+    channel_nr = nr;
+    channel_pending = nr;
+    for (i = 0; i < nr; i++) {
+        channel_fds[i] = -1;
+    }
+
+    for (i = 0; i < nr && outgoing_mig == s; i++) {
+        channel_fds[i] = qemu_socket(PF_INET, SOCK_STREAM, 0);
+        if (channel_fds[i] == -1) {
+            tcp_channel_failed(i);
+            return;
+        }
+        socket_set_nonblock(channel_fds[i]);
+
+        do {
+            ret = connect(channel_fds[i], (struct sockaddr *)&outgoing_addr,
+                          sizeof(outgoing_addr));
+            if (ret == -1) {
+                ret = -socket_error();
+            }
+        } while (ret == -EINTR);
+
+        if (ret == -EINPROGRESS || ret == -EWOULDBLOCK) {
+            qemu_set_fd_handler2(channel_fds[i], NULL, NULL,
+                                 tcp_channel_wait_for_connect,
+                                 (void *)(intptr_t)i);
+        } else if (ret < 0 || tcp_start_channel(i) < 0) {
+            tcp_channel_failed(i);
+            return;
+        }
+    }
+}
+
+static void tcp_migrate_connected(FdMigrationState *s)
+{
+    if (migrate_channels()) {
+        tcp_connect_channels(s, migrate_channels());
+        return;
+    }
+    migrate_fd_connect(s);
+}
+
+static void tcp_migrate_cancel(MigrationState *mig_state)
+{
+    tcp_abort_channels(migrate_to_fms(mig_state));
+    migrate_fd_cancel(mig_state);
+}
+
+static void tcp_migrate_release(MigrationState *mig_state)
+{
+    tcp_abort_channels(migrate_to_fms(mig_state));
+    migrate_fd_release(mig_state);
+}
 
 static void tcp_wait_for_connect(void *opaque)
 {
@@ -68,7 +218,7 @@ static void tcp_wait_for_connect(void *opaque)
     qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
 
     if (val == 0)
-        migrate_fd_connect(s);
+        tcp_migrate_connected(s);
     else {
         DPRINTF("error connecting %d\n", val);
         migrate_fd_error(s);
@@ -88,15 +238,17 @@ MigrationState *tcp_start_outgoing_migration(Monitor *mon,
 
     if (parse_host_port(&addr, host_port) < 0)
         return NULL;
+    outgoing_addr = addr;
 
     s = g_malloc0(sizeof(*s));
 
     s->get_error = socket_errno;
     s->write = socket_write;
+    s->read = socket_read;
     s->close = tcp_close;
-    s->mig_state.cancel = migrate_fd_cancel;
+    s->mig_state.cancel = tcp_migrate_cancel;
     s->mig_state.get_status = migrate_fd_get_status;
-    s->mig_state.release = migrate_fd_release;
+    s->mig_state.release = tcp_migrate_release;
 
     s->mig_state.blk = blk;
     s->mig_state.shared = inc;
@@ -129,7 +281,7 @@ MigrationState *tcp_start_outgoing_migration(Monitor *mon,
         DPRINTF("connect failed\n");
         migrate_fd_error(s);
     } else if (ret >= 0)
-        migrate_fd_connect(s);
+        tcp_migrate_connected(s);
 
     return &s->mig_state;
 }
@@ -140,7 +292,7 @@ static void tcp_accept_incoming_migration(void *opaque)
     socklen_t addrlen = sizeof(addr);
     int s = (intptr_t)opaque;
     QEMUFile *f;
-    int c;
+    int c, ret;
 
     do {
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
@@ -159,7 +311,14 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
-    process_incoming_migration(f);
+    /* RAM data channels connect to the same socket */
+    migration_incoming_set_listen_fd(s);
+    ret = process_incoming_migration(f, c);
+    migration_incoming_set_listen_fd(-1);
+    if (ret == 1) {
+        /* post-copy closes the connection when it is done */
+        goto out2;
+    }
     qemu_fclose(f);
 out:
     close(c);
@@ -189,7 +348,8 @@ int tcp_start_incoming_migration(const char *host_port)
     if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1)
         goto err;
 
-    if (listen(s, 1) == -1)
+    /* room for the RAM data channels that queue up behind the migration */
+    if (listen(s, 1 + MAX_MIGRATION_CHANNELS) == -1)
         goto err;
 
     qemu_set_fd_handler2(s, NULL, tcp_accept_incoming_migration, NULL,
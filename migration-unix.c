@@ -38,6 +38,11 @@ static int unix_write(FdMigrationState *s, const void * buf, size_t size)
     return write(s->fd, buf, size);
 }
 
+static int unix_read(FdMigrationState *s, void *buf, size_t size)
+{
+    return read(s->fd, buf, size);
+}
+
 static int unix_close(FdMigrationState *s)
 {
     DPRINTF("unix_close\n");
@@ -92,6 +97,7 @@ MigrationState *unix_start_outgoing_migration(Monitor *mon,
 
     s->get_error = unix_errno;
     s->write = unix_write;
+    s->read = unix_read;
     s->close = unix_close;
     s->mig_state.cancel = migrate_fd_cancel;
     s->mig_state.get_status = migrate_fd_get_status;
@@ -167,12 +173,18 @@ static void unix_accept_incoming_migration(void *opaque)
         goto out;
     }
 
-    process_incoming_migration(f);
-    qemu_fclose(f);
+    if (process_incoming_migration(f, c) == 1) {
+        /* post-copy closes the connection when it is done */
+        c = -1;
+    } else {
+        qemu_fclose(f);
+    }
 out:
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
     close(s);
-    close(c);
+    if (c != -1) {
+        close(c);
+    }
 }
 
 int unix_start_incoming_migration(const char *path)
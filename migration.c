@@ -20,6 +20,8 @@
 #include "qemu_socket.h"
 #include "block-migration.h"
 #include "qemu-objects.h"
+#include "cpus.h"
+#include "qemu-timer.h"
 
 //#define DEBUG_MIGRATION
 
@@ -34,6 +36,46 @@
 /* Migration speed throttling */
 static int64_t max_throttle = (32 << 20);
 
+/* Delta-encode pages that are resent, against a cache of sent pages */
+static int use_xbzrle;
+static int64_t xbzrle_cache_size = (64 << 20);
+
+/* Compress full pages with zlib on a pool of threads */
+static int use_compression;
+static int compress_level = 1;
+static int compress_threads = 8;
+static int decompress_threads = 2;
+
+/* Throttle the vCPUs if the guest dirties memory faster than we send it */
+static int use_auto_converge;
+
+/* Leave zero pages out of the first pass, the destination discards its RAM */
+static int use_zero_skip;
+
+/* Switch to the destination early and send the rest of RAM on demand */
+static int use_postcopy;
+static int postcopy_active;
+
+/*
+ * Set while the migration thread waits for the RAM data channels after the
+ * final stage; the guest is stopped then, remember how to finish up.
+ */
+static int channels_draining;
+static int drain_vm_running;
+static int64_t drain_stop_time;
+
+/* pushed data a requested page may have to wait behind, in bytes */
+#define POSTCOPY_MAX_PENDING (64 << 10)
+
+/* Stripe full pages over this many extra tcp connections */
+static int migration_channels;
+
+/* channel the destination uses to request pages during post-copy */
+static int incoming_return_fd = -1;
+
+/* socket the destination accepts RAM data channels from */
+static int incoming_listen_fd = -1;
+
 static MigrationState *current_migration;
 
 static NotifierList migration_state_notifiers =
@@ -61,8 +103,15 @@ int qemu_start_incoming_migration(const char *uri)
     return ret;
 }
 
-void process_incoming_migration(QEMUFile *f)
+/*
+ * return_fd is the socket the migration stream arrives on, or -1 if the
+ * transport has no way back to the source.  Returns 1 if post-copy took
+ * over f and return_fd, which the caller must then leave alone.
+ */
+int process_incoming_migration(QEMUFile *f, int return_fd)
 {
+    incoming_return_fd = return_fd;
+
     if (qemu_loadvm_state(f) < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(0);
@@ -74,6 +123,23 @@ void process_incoming_migration(QEMUFile *f)
 
     if (autostart)
         vm_start();
+
+    return postcopy_ram_incoming_running();
+}
+
+int migration_incoming_return_fd(void)
+{
+    return incoming_return_fd;
+}
+
+void migration_incoming_set_listen_fd(int fd)
+{
+    incoming_listen_fd = fd;
+}
+
+int migration_incoming_listen_fd(void)
+{
+    return incoming_listen_fd;
 }
 
 int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
@@ -83,6 +149,11 @@ int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
     int detach = qdict_get_try_bool(qdict, "detach", 0);
     int blk = qdict_get_try_bool(qdict, "blk", 0);
     int inc = qdict_get_try_bool(qdict, "inc", 0);
+    int xbzrle = qdict_get_try_bool(qdict, "xbzrle", 0);
+    int compress = qdict_get_try_bool(qdict, "compress", 0);
+    int postcopy = qdict_get_try_bool(qdict, "postcopy", 0);
+    int auto_converge = qdict_get_try_bool(qdict, "auto-converge", 0);
+    int zero_skip = qdict_get_try_bool(qdict, "zero-skip", 0);
     const char *uri = qdict_get_str(qdict, "uri");
 
     if (current_migration &&
@@ -95,6 +166,25 @@ int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
         return -1;
     }
 
+    if (postcopy && !strstart(uri, "tcp:", NULL) &&
+        !strstart(uri, "unix:", NULL)) {
+        monitor_printf(mon, "post-copy needs a tcp or unix migration\n");
+        return -1;
+    }
+
+    if (migration_channels && strstart(uri, "tcp:", NULL) &&
+        (postcopy || compress)) {
+        monitor_printf(mon, "data channels cannot be combined with %s\n",
+                       postcopy ? "post-copy" : "compression");
+        return -1;
+    }
+
+    use_xbzrle = xbzrle;
+    use_compression = compress;
+    use_postcopy = postcopy;
+    use_auto_converge = auto_converge;
+    use_zero_skip = zero_skip;
+
     if (strstart(uri, "tcp:", &p)) {
         s = tcp_start_outgoing_migration(mon, p, max_throttle, detach,
                                          blk, inc);
@@ -180,6 +270,142 @@ int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
     return 0;
 }
 
+int migrate_use_xbzrle(void)
+{
+    return use_xbzrle;
+}
+
+int64_t migrate_xbzrle_cache_size(void)
+{
+    return xbzrle_cache_size;
+}
+
+int do_migrate_set_cache_size(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data)
+{
+    int64_t d;
+
+    d = qdict_get_int(qdict, "value");
+    if (d <= 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "value",
+                      "a positive size");
+        return -1;
+    }
+
+    /* Resizes a running migration's cache, if any */
+    if (xbzrle_cache_resize(d) < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "value",
+                      "a size of at least one page");
+        return -1;
+    }
+    xbzrle_cache_size = d;
+
+    return 0;
+}
+
+int migrate_use_compression(void)
+{
+    return use_compression;
+}
+
+int migrate_compress_level(void)
+{
+    return compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    return compress_threads;
+}
+
+int migrate_decompress_threads(void)
+{
+    return decompress_threads;
+}
+
+int do_migrate_set_compress_params(Monitor *mon, const QDict *qdict,
+                                   QObject **ret_data)
+{
+    int64_t level = compress_level;
+    int64_t threads = compress_threads;
+    int64_t dthreads = decompress_threads;
+
+    if (qdict_haskey(qdict, "level")) {
+        level = qdict_get_int(qdict, "level");
+    }
+    if (qdict_haskey(qdict, "threads")) {
+        threads = qdict_get_int(qdict, "threads");
+    }
+    if (qdict_haskey(qdict, "dthreads")) {
+        dthreads = qdict_get_int(qdict, "dthreads");
+    }
+
+    if (level < 0 || level > 9) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "level",
+                      "an integer in the range of 0 to 9");
+        return -1;
+    }
+    if (threads < 1 || threads > MAX_COMPRESS_THREADS) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "threads",
+                      "an integer in the range of 1 to 64");
+        return -1;
+    }
+    if (dthreads < 1 || dthreads > MAX_COMPRESS_THREADS) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "dthreads",
+                      "an integer in the range of 1 to 64");
+        return -1;
+    }
+
+    /* takes effect with the next migration */
+    compress_level = level;
+    compress_threads = threads;
+    decompress_threads = dthreads;
+
+    return 0;
+}
+
+int migrate_channels(void)
+{
+    return migration_channels;
+}
+
+int do_migrate_set_channels(Monitor *mon, const QDict *qdict,
+                            QObject **ret_data)
+{
+    int64_t channels = qdict_get_int(qdict, "channels");
+
+    if (channels < 0 || channels > MAX_MIGRATION_CHANNELS) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "channels",
+                      "an integer in the range of 0 to 16");
+        return -1;
+    }
+
+    /* takes effect with the next migration */
+    migration_channels = channels;
+
+    return 0;
+}
+
+int migrate_use_auto_converge(void)
+{
+    return use_auto_converge;
+}
+
+int migrate_use_zero_skip(void)
+{
+    return use_zero_skip;
+}
+
+int migrate_use_postcopy(void)
+{
+    return use_postcopy;
+}
+
+int migrate_in_postcopy(void)
+{
+    return postcopy_active;
+}
+
 static void migrate_print_status(Monitor *mon, const char *name,
                                  const QDict *status_dict)
 {
@@ -193,6 +419,21 @@ static void migrate_print_status(Monitor *mon, const char *name,
                         qdict_get_int(qdict, "remaining") >> 10);
     monitor_printf(mon, "total %s: %" PRIu64 " kbytes\n", name,
                         qdict_get_int(qdict, "total") >> 10);
+
+    if (qdict_haskey(qdict, "duplicate")) {
+        monitor_printf(mon, "duplicate: %" PRIu64 " pages\n",
+                       qdict_get_int(qdict, "duplicate"));
+        monitor_printf(mon, "skipped: %" PRIu64 " pages\n",
+                       qdict_get_int(qdict, "skipped"));
+        monitor_printf(mon, "normal: %" PRIu64 " pages\n",
+                       qdict_get_int(qdict, "normal"));
+        monitor_printf(mon, "normal bytes: %" PRIu64 " kbytes\n",
+                       qdict_get_int(qdict, "normal-bytes") >> 10);
+        monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages/s\n",
+                       qdict_get_int(qdict, "dirty-pages-rate"));
+        monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
+                       qdict_get_int(qdict, "dirty-sync-count"));
+    }
 }
 
 void do_info_migrate_print(Monitor *mon, const QObject *data)
@@ -204,6 +445,21 @@ void do_info_migrate_print(Monitor *mon, const QObject *data)
     monitor_printf(mon, "Migration status: %s\n",
                    qdict_get_str(qdict, "status"));
 
+    if (qdict_haskey(qdict, "total-time")) {
+        monitor_printf(mon, "total time: %" PRIu64 " milliseconds\n",
+                       qdict_get_int(qdict, "total-time"));
+    }
+
+    if (qdict_haskey(qdict, "expected-downtime")) {
+        monitor_printf(mon, "expected downtime: %" PRIu64 " milliseconds\n",
+                       qdict_get_int(qdict, "expected-downtime"));
+    }
+
+    if (qdict_haskey(qdict, "downtime")) {
+        monitor_printf(mon, "downtime: %" PRIu64 " milliseconds\n",
+                       qdict_get_int(qdict, "downtime"));
+    }
+
     if (qdict_haskey(qdict, "ram")) {
         migrate_print_status(mon, "ram", qdict);
     }
@@ -211,6 +467,32 @@ void do_info_migrate_print(Monitor *mon, const QObject *data)
     if (qdict_haskey(qdict, "disk")) {
         migrate_print_status(mon, "disk", qdict);
     }
+
+    if (qdict_haskey(qdict, "cpu-throttle-percentage")) {
+        monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                       qdict_get_int(qdict, "cpu-throttle-percentage"));
+    }
+
+    if (qdict_haskey(qdict, "xbzrle-cache")) {
+        QDict *xbzrle;
+
+        xbzrle = qobject_to_qdict(qdict_get(qdict, "xbzrle-cache"));
+
+        monitor_printf(mon, "cache size: %" PRIu64 " bytes\n",
+                       qdict_get_int(xbzrle, "cache-size"));
+        monitor_printf(mon, "xbzrle transferred: %" PRIu64 " kbytes\n",
+                       qdict_get_int(xbzrle, "bytes") >> 10);
+        monitor_printf(mon, "xbzrle pages: %" PRIu64 " pages\n",
+                       qdict_get_int(xbzrle, "pages"));
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       qdict_get_int(xbzrle, "cache-hit"));
+        monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
+                       qdict_get_int(xbzrle, "cache-miss"));
+        monitor_printf(mon, "xbzrle overflow: %" PRIu64 "\n",
+                       qdict_get_int(xbzrle, "overflow"));
+        monitor_printf(mon, "xbzrle saved: %" PRIu64 " kbytes\n",
+                       qdict_get_int(xbzrle, "bytes-saved") >> 10);
+    }
 }
 
 static void migrate_put_status(QDict *qdict, const char *name,
@@ -224,6 +506,30 @@ static void migrate_put_status(QDict *qdict, const char *name,
     qdict_put_obj(qdict, name, obj);
 }
 
+static void migrate_put_ram_status(QDict *qdict)
+{
+    QObject *obj;
+
+    obj = qobject_from_jsonf("{ 'transferred': %" PRId64 ", "
+                               "'remaining': %" PRId64 ", "
+                               "'total': %" PRId64 ", "
+                               "'duplicate': %" PRId64 ", "
+                               "'skipped': %" PRId64 ", "
+                               "'normal': %" PRId64 ", "
+                               "'normal-bytes': %" PRId64 ", "
+                               "'dirty-pages-rate': %" PRId64 ", "
+                               "'dirty-sync-count': %" PRId64 " }",
+                             ram_bytes_transferred(), ram_bytes_remaining(),
+                             ram_bytes_total(),
+                             dup_mig_pages_transferred(),
+                             skipped_mig_pages_transferred(),
+                             norm_mig_pages_transferred(),
+                             norm_mig_bytes_transferred(),
+                             ram_mig_dirty_pages_rate(),
+                             ram_mig_iterations());
+    qdict_put_obj(qdict, "ram", obj);
+}
+
 void do_info_migrate(Monitor *mon, QObject **ret_data)
 {
     QDict *qdict;
@@ -234,9 +540,13 @@ void do_info_migrate(Monitor *mon, QObject **ret_data)
         case MIG_STATE_ACTIVE:
             qdict = qdict_new();
             qdict_put(qdict, "status", qstring_from_str("active"));
+            qdict_put(qdict, "total-time",
+                      qint_from_int(qemu_get_clock_ms(rt_clock) -
+                                    s->start_time));
+            qdict_put(qdict, "expected-downtime",
+                      qint_from_int(ram_mig_expected_downtime()));
 
-            migrate_put_status(qdict, "ram", ram_bytes_transferred(),
-                               ram_bytes_remaining(), ram_bytes_total());
+            migrate_put_ram_status(qdict);
 
             if (blk_mig_active()) {
                 migrate_put_status(qdict, "disk", blk_mig_bytes_transferred(),
@@ -244,10 +554,42 @@ void do_info_migrate(Monitor *mon, QObject **ret_data)
                                    blk_mig_bytes_total());
             }
 
+            if (migrate_use_auto_converge()) {
+                qdict_put(qdict, "cpu-throttle-percentage",
+                          qint_from_int(cpu_throttle_get_percentage()));
+            }
+
+            if (migrate_use_xbzrle()) {
+                QObject *obj;
+
+                obj = qobject_from_jsonf("{ 'cache-size': %" PRId64 ", "
+                                           "'bytes': %" PRId64 ", "
+                                           "'pages': %" PRId64 ", "
+                                           "'cache-hit': %" PRId64 ", "
+                                           "'cache-miss': %" PRId64 ", "
+                                           "'overflow': %" PRId64 ", "
+                                           "'bytes-saved': %" PRId64 " }",
+                                         migrate_xbzrle_cache_size(),
+                                         xbzrle_mig_bytes_transferred(),
+                                         xbzrle_mig_pages_transferred(),
+                                         xbzrle_mig_pages_cache_hit(),
+                                         xbzrle_mig_pages_cache_miss(),
+                                         xbzrle_mig_pages_overflow(),
+                                         xbzrle_mig_bytes_saved());
+                qdict_put_obj(qdict, "xbzrle-cache", obj);
+            }
+
             *ret_data = QOBJECT(qdict);
             break;
         case MIG_STATE_COMPLETED:
-            *ret_data = qobject_from_jsonf("{ 'status': 'completed' }");
+            qdict = qdict_new();
+            qdict_put(qdict, "status", qstring_from_str("completed"));
+            qdict_put(qdict, "total-time", qint_from_int(s->total_time));
+            qdict_put(qdict, "downtime", qint_from_int(s->downtime));
+
+            migrate_put_ram_status(qdict);
+
+            *ret_data = QOBJECT(qdict);
             break;
         case MIG_STATE_ERROR:
             *ret_data = qobject_from_jsonf("{ 'status': 'failed' }");
@@ -261,6 +603,56 @@ void do_info_migrate(Monitor *mon, QObject **ret_data)
 
 /* shared migration helpers */
 
+/* a page request: idstr length, idstr and be64 offset in the RAMBlock */
+static uint8_t postcopy_req[1 + 255 + 8];
+static int postcopy_req_len;
+
+static void migrate_fd_postcopy_read(void *opaque)
+{
+    FdMigrationState *s = opaque;
+    ssize_t ret;
+
+    for (;;) {
+        do {
+            ret = s->read(s, postcopy_req + postcopy_req_len,
+                          sizeof(postcopy_req) - postcopy_req_len);
+        } while (ret == -1 && (s->get_error(s)) == EINTR);
+
+        if (ret == -1 && (s->get_error(s)) == EAGAIN) {
+            return;
+        }
+        if (ret <= 0) {
+            DPRINTF("post-copy return path closed\n");
+            migrate_fd_error(s);
+            return;
+        }
+        postcopy_req_len += ret;
+
+        while (postcopy_req_len > 0 &&
+               postcopy_req_len >= 1 + postcopy_req[0] + 8) {
+            char idstr[256];
+            uint64_t offset;
+            int len = postcopy_req[0];
+
+            memcpy(idstr, postcopy_req + 1, len);
+            idstr[len] = 0;
+            memcpy(&offset, postcopy_req + 1 + len, 8);
+
+            DPRINTF("page request %s:0x%" PRIx64 "\n", idstr,
+                    be64_to_cpu(offset));
+            if (ram_postcopy_send_page(s->file, idstr,
+                                       be64_to_cpu(offset)) < 0) {
+                migrate_fd_error(s);
+                return;
+            }
+
+            len += 1 + 8;
+            postcopy_req_len -= len;
+            memmove(postcopy_req, postcopy_req + len, postcopy_req_len);
+        }
+    }
+}
+
 void migrate_fd_monitor_suspend(FdMigrationState *s, Monitor *mon)
 {
     s->mon = mon;
@@ -284,6 +676,24 @@ int migrate_fd_cleanup(FdMigrationState *s)
 {
     int ret = 0;
 
+    postcopy_active = 0;
+    cpu_throttle_stop();
+    ram_channels_cancel();
+
+    if (channels_draining) {
+        /* the destination never got all of the stream, keep running here */
+        channels_draining = 0;
+        if (drain_vm_running) {
+            vm_start();
+        }
+    }
+
+    /* the flags only apply to this migration, not to a later savevm */
+    use_xbzrle = 0;
+    use_compression = 0;
+    use_postcopy = 0;
+    use_auto_converge = 0;
+    use_zero_skip = 0;
     qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
 
     if (s->file) {
@@ -306,14 +716,10 @@ int migrate_fd_cleanup(FdMigrationState *s)
     return ret;
 }
 
-void migrate_fd_put_notify(void *opaque)
-{
-    FdMigrationState *s = opaque;
-
-    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
-    qemu_file_put_notify(s->file);
-}
-
+/*
+ * Called from the migration thread without the global mutex, errors are
+ * picked up by migrate_fd_put_ready() through the file.
+ */
 ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size)
 {
     FdMigrationState *s = opaque;
@@ -326,13 +732,6 @@ ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size)
     if (ret == -1)
         ret = -(s->get_error(s));
 
-    if (ret == -EAGAIN) {
-        qemu_set_fd_handler2(s->fd, NULL, NULL, migrate_fd_put_notify, s);
-    } else if (ret < 0) {
-        s->state = MIG_STATE_ERROR;
-        notifier_list_notify(&migration_state_notifiers, NULL);
-    }
-
     return ret;
 }
 
@@ -340,6 +739,7 @@ void migrate_fd_connect(FdMigrationState *s)
 {
     int ret;
 
+    s->mig_state.start_time = qemu_get_clock_ms(rt_clock);
     s->file = qemu_fopen_ops_buffered(s,
                                       s->bandwidth_limit,
                                       migrate_fd_put_buffer,
@@ -355,43 +755,145 @@ void migrate_fd_connect(FdMigrationState *s)
         migrate_fd_error(s);
         return;
     }
-    
-    migrate_fd_put_ready(s);
+
+    /* the migration thread takes it from here */
 }
 
+/* Called from the migration thread without the global mutex */
+static void migrate_fd_wait_for_channels(void *opaque)
+{
+    DPRINTF("waiting for the data channels\n");
+    ram_channels_wait();
+}
+
+static void migrate_fd_completed(FdMigrationState *s, int state,
+                                 int old_vm_running, int64_t stop_time)
+{
+    if (migrate_fd_cleanup(s) < 0) {
+        if (old_vm_running) {
+            vm_start();
+        }
+        state = MIG_STATE_ERROR;
+    }
+    /* the destination starts the guest once the stream is complete */
+    s->mig_state.downtime = qemu_get_clock_ms(rt_clock) - stop_time;
+    s->mig_state.total_time = qemu_get_clock_ms(rt_clock) -
+                              s->mig_state.start_time;
+    s->state = state;
+    notifier_list_notify(&migration_state_notifiers, NULL);
+}
+
+/* Called from the migration thread with the global mutex held */
 void migrate_fd_put_ready(void *opaque)
 {
     FdMigrationState *s = opaque;
+    int ret;
 
     if (s->state != MIG_STATE_ACTIVE) {
         DPRINTF("put_ready returning because of non-active state\n");
         return;
     }
 
+    if (qemu_file_has_error(s->file)) {
+        DPRINTF("error writing to the migration stream\n");
+        migrate_fd_error(s);
+        return;
+    }
+
+    if (channels_draining) {
+        int old_vm_running = drain_vm_running;
+
+        /* the thread already waited for them, this does not block */
+        channels_draining = 0;
+        if (ram_channels_wait() < 0) {
+            if (old_vm_running) {
+                vm_start();
+            }
+            migrate_fd_completed(s, MIG_STATE_ERROR, 0, drain_stop_time);
+        } else {
+            migrate_fd_completed(s, MIG_STATE_COMPLETED, old_vm_running,
+                                 drain_stop_time);
+        }
+        return;
+    }
+
+    if (postcopy_active) {
+        ret = ram_postcopy_push(s->file);
+
+        if (ret < 0) {
+            migrate_fd_error(s);
+        } else if (ret == 1) {
+            DPRINTF("post-copy done\n");
+            s->mig_state.total_time = qemu_get_clock_ms(rt_clock) -
+                                      s->mig_state.start_time;
+            s->state = MIG_STATE_COMPLETED;
+            if (migrate_fd_cleanup(s) < 0) {
+                s->state = MIG_STATE_ERROR;
+            }
+            notifier_list_notify(&migration_state_notifiers, NULL);
+        }
+        return;
+    }
+
     DPRINTF("iterate\n");
-    if (qemu_savevm_state_iterate(s->mon, s->file) == 1) {
+    ret = qemu_savevm_state_iterate(s->mon, s->file);
+    if (ret < 0) {
+        migrate_fd_error(s);
+    } else if (ret == 1) {
         int state;
         int old_vm_running = vm_running;
+        int64_t stop_time = qemu_get_clock_ms(rt_clock);
 
         DPRINTF("done iterating\n");
         vm_stop(VMSTOP_MIGRATE);
 
+        if (use_postcopy) {
+            /* from here on the guest runs on the destination */
+            postcopy_active = 1;
+            postcopy_req_len = 0;
+            if (qemu_savevm_state_complete_postcopy(s->mon, s->file) < 0) {
+                if (old_vm_running) {
+                    vm_start();
+                }
+                migrate_fd_error(s);
+                return;
+            }
+            DPRINTF("switched to post-copy\n");
+            s->mig_state.downtime = qemu_get_clock_ms(rt_clock) - stop_time;
+            /* page requests must not wait behind the bandwidth limit */
+            qemu_file_set_rate_limit(s->file, INT64_MAX);
+            /*
+             * nor behind a long backlog of pushed pages: they are appended
+             * to what the background push queued, so keep that short
+             */
+            qemu_buffered_file_set_max_pending(s->file, POSTCOPY_MAX_PENDING);
+            /* page requests are served from the main loop */
+            qemu_set_fd_handler2(s->fd, NULL, migrate_fd_postcopy_read, NULL,
+                                 s);
+            qemu_notify_event();
+            return;
+        }
+
         if ((qemu_savevm_state_complete(s->mon, s->file)) < 0) {
             if (old_vm_running) {
                 vm_start();
             }
             state = MIG_STATE_ERROR;
+        } else if (ram_channels_active()) {
+            /*
+             * The channels may still be writing out pages, wait for them
+             * in the migration thread without the global mutex and finish
+             * on the next put_ready.
+             */
+            channels_draining = 1;
+            drain_vm_running = old_vm_running;
+            drain_stop_time = stop_time;
+            qemu_buffered_file_wait(s->file, migrate_fd_wait_for_channels);
+            return;
         } else {
             state = MIG_STATE_COMPLETED;
         }
-        if (migrate_fd_cleanup(s) < 0) {
-            if (old_vm_running) {
-                vm_start();
-            }
-            state = MIG_STATE_ERROR;
-        }
-        s->state = state;
-        notifier_list_notify(&migration_state_notifiers, NULL);
+        migrate_fd_completed(s, state, old_vm_running, stop_time);
     }
 }
 
@@ -442,11 +944,13 @@ void migrate_fd_wait_for_unfreeze(void *opaque)
 
     do {
         fd_set wfds;
+        /* bounded, so that the migration thread notices a cancel */
+        struct timeval tv = { 0, 100000 };
 
         FD_ZERO(&wfds);
         FD_SET(s->fd, &wfds);
 
-        ret = select(s->fd + 1, NULL, &wfds, NULL, NULL);
+        ret = select(s->fd + 1, NULL, &wfds, NULL, &tv);
     } while (ret == -1 && (s->get_error(s)) == EINTR);
 }
 
@@ -23,6 +23,12 @@
 #define MIG_STATE_CANCELLED	1
 #define MIG_STATE_ACTIVE	2
 
+#define MAX_COMPRESS_THREADS	64
+
+#define MAX_MIGRATION_CHANNELS	16
+/* first word on a RAM data channel, followed by its index */
+#define RAM_CHANNEL_MAGIC	0x5152434e
+
 typedef struct MigrationState MigrationState;
 
 struct MigrationState
@@ -33,6 +39,10 @@ struct MigrationState
     void (*release)(MigrationState *s);
     int blk;
     int shared;
+    /* in ms of rt_clock */
+    int64_t start_time;
+    int64_t total_time;
+    int64_t downtime;
 };
 
 typedef struct FdMigrationState FdMigrationState;
@@ -48,10 +58,17 @@ struct FdMigrationState
     int (*get_error)(struct FdMigrationState*);
     int (*close)(struct FdMigrationState*);
     int (*write)(struct FdMigrationState*, const void *, size_t);
+    int (*read)(struct FdMigrationState*, void *, size_t);
     void *opaque;
 };
 
-void process_incoming_migration(QEMUFile *f);
+int process_incoming_migration(QEMUFile *f, int return_fd);
+
+int migration_incoming_return_fd(void);
+
+void migration_incoming_set_listen_fd(int fd);
+
+int migration_incoming_listen_fd(void);
 
 int qemu_start_incoming_migration(const char *uri);
 
@@ -66,6 +83,37 @@ uint64_t migrate_max_downtime(void);
 int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
                             QObject **ret_data);
 
+int migrate_use_xbzrle(void);
+
+int64_t migrate_xbzrle_cache_size(void);
+
+int do_migrate_set_cache_size(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data);
+
+int migrate_use_compression(void);
+
+int migrate_compress_level(void);
+
+int migrate_compress_threads(void);
+
+int migrate_decompress_threads(void);
+
+int do_migrate_set_compress_params(Monitor *mon, const QDict *qdict,
+                                   QObject **ret_data);
+
+int migrate_channels(void);
+
+int do_migrate_set_channels(Monitor *mon, const QDict *qdict,
+                            QObject **ret_data);
+
+int migrate_use_auto_converge(void);
+
+int migrate_use_zero_skip(void);
+
+int migrate_use_postcopy(void);
+
+int migrate_in_postcopy(void);
+
 void do_info_migrate_print(Monitor *mon, const QObject *data);
 
 void do_info_migrate(Monitor *mon, QObject **ret_data);
@@ -112,8 +160,6 @@ void migrate_fd_error(FdMigrationState *s);
 
 int migrate_fd_cleanup(FdMigrationState *s);
 
-void migrate_fd_put_notify(void *opaque);
-
 ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size);
 
 void migrate_fd_connect(FdMigrationState *s);
@@ -142,10 +188,53 @@ int get_migration_state(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
-
+uint64_t dup_mig_pages_transferred(void);
+uint64_t skipped_mig_pages_transferred(void);
+uint64_t norm_mig_pages_transferred(void);
+uint64_t norm_mig_bytes_transferred(void);
+uint64_t ram_mig_iterations(void);
+uint64_t ram_mig_dirty_pages_rate(void);
+uint64_t ram_mig_expected_downtime(void);
+
+void ram_set_params(int blk_enable, int shared, void *opaque);
 int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque);
 int ram_load(QEMUFile *f, void *opaque, int version_id);
 
+int ram_postcopy_send_page(QEMUFile *f, const char *idstr, uint64_t offset);
+int ram_postcopy_push(QEMUFile *f);
+int ram_postcopy_incoming_load(QEMUFile *f);
+
+struct RAMBlock;
+
+void ram_channels_setup(const int *fds, int nr);
+int ram_channels_active(void);
+int ram_channels_send_page(QEMUFile *f, struct RAMBlock *block,
+                           uint64_t offset, const uint8_t *p);
+void ram_channels_sync(QEMUFile *f);
+int ram_channels_finish(void);
+int ram_channels_wait(void);
+void ram_channels_cancel(void);
+int ram_channels_load_sync(QEMUFile *f);
+
+int postcopy_ram_supported(void);
+int postcopy_ram_incoming_init(int fd);
+int postcopy_ram_incoming_listen(QEMUFile *f);
+int postcopy_ram_incoming_running(void);
+int postcopy_place_page(void *host, const void *from);
+int postcopy_place_zero_page(void *host);
+
+int64_t xbzrle_cache_resize(int64_t new_size);
+uint64_t xbzrle_mig_bytes_transferred(void);
+uint64_t xbzrle_mig_pages_transferred(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
+uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_overflow(void);
+uint64_t xbzrle_mig_bytes_saved(void);
+
+int xbzrle_encode_buffer(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int slen, uint8_t *dst, int dlen);
+int xbzrle_decode_buffer(const uint8_t *src, int slen, uint8_t *dst, int dlen);
+
 extern int incoming_expected;
 
 #endif
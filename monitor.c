@@ -468,6 +468,12 @@ void monitor_protocol_event(MonitorEvent event, QObject *data)
         case QEVENT_SPICE_DISCONNECTED:
             event_name = "SPICE_DISCONNECTED";
             break;
+        case QEVENT_BLOCK_JOB_COMPLETED:
+            event_name = "BLOCK_JOB_COMPLETED";
+            break;
+        case QEVENT_BLOCK_JOB_CANCELLED:
+            event_name = "BLOCK_JOB_CANCELLED";
+            break;
         default:
             abort();
             break;
@@ -2900,6 +2906,14 @@ static const mon_cmd_t info_cmds[] = {
         .help       = "show the network state",
         .mhandler.info = do_info_network,
     },
+    {
+        .name       = "nic-tx-stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show transmit statistics of network cards",
+        .user_print = do_info_nic_tx_stats_print,
+        .mhandler.info_new = do_info_nic_tx_stats,
+    },
     {
         .name       = "chardev",
         .args_type  = "",
@@ -2924,6 +2938,14 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+    {
+        .name       = "block-jobs",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show progress of ongoing block device operations",
+        .user_print = do_info_block_jobs_print,
+        .mhandler.info_new = do_info_block_jobs,
+    },
     {
         .name       = "registers",
         .args_type  = "",
@@ -3223,6 +3245,22 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+    {
+        .name       = "block-jobs",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show progress of ongoing block device operations",
+        .user_print = do_info_block_jobs_print,
+        .mhandler.info_new = do_info_block_jobs,
+    },
+    {
+        .name       = "nic-tx-stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show transmit statistics of network cards",
+        .user_print = do_info_nic_tx_stats_print,
+        .mhandler.info_new = do_info_nic_tx_stats,
+    },
     {
         .name       = "cpus",
         .args_type  = "",
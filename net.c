@@ -36,6 +36,7 @@
 #include "qemu_socket.h"
 #include "hw/qdev.h"
 #include "iov.h"
+#include "qlist.h"
 
 static QTAILQ_HEAD(, VLANState) vlans;
 static QTAILQ_HEAD(, VLANClientState) non_vlan_clients;
@@ -521,6 +522,28 @@ ssize_t qemu_send_packet_async(VLANClientState *sender,
                                              buf, size, sent_cb);
 }
 
+/* Packets sent between qemu_send_batch_begin() and qemu_send_batch_end()
+ * form a burst, which lets the peer defer per-packet completion work such
+ * as guest notification until the end of the burst.  Only peers of
+ * non-VLAN clients are told about bursts. */
+void qemu_send_batch_begin(VLANClientState *sender)
+{
+    VLANClientState *peer = sender->peer;
+
+    if (peer && peer->info->receive_batch) {
+        peer->info->receive_batch(peer, true);
+    }
+}
+
+void qemu_send_batch_end(VLANClientState *sender)
+{
+    VLANClientState *peer = sender->peer;
+
+    if (peer && peer->info->receive_batch) {
+        peer->info->receive_batch(peer, false);
+    }
+}
+
 void qemu_send_packet(VLANClientState *vc, const uint8_t *buf, int size)
 {
     qemu_send_packet_async(vc, buf, size, NULL);
@@ -668,6 +691,28 @@ VLANClientState *qemu_find_netdev(const char *id)
     return NULL;
 }
 
+/* Returns the queues of a multiqueue netdev, the first one is what
+ * qemu_find_netdev() returns */
+int qemu_find_netdev_queues(const char *id, VLANClientState **vcs, int max)
+{
+    VLANClientState *vc;
+    int n = 0;
+
+    QTAILQ_FOREACH(vc, &non_vlan_clients, next) {
+        if (vc->info->type == NET_CLIENT_TYPE_NIC) {
+            continue;
+        }
+        if (!strcmp(vc->name, id)) {
+            if (n < max) {
+                vcs[n] = vc;
+            }
+            n++;
+        }
+    }
+
+    return n;
+}
+
 static int nic_get_free_idx(void)
 {
     int index;
@@ -975,6 +1020,10 @@ static const struct {
                 .name = "vhostforce",
                 .type = QEMU_OPT_BOOL,
                 .help = "force vhost on for non-MSIX virtio guests",
+            }, {
+                .name = "queues",
+                .type = QEMU_OPT_NUMBER,
+                .help = "number of queues the tap interface is opened with",
         },
 #endif /* _WIN32 */
             { /* end of list */ }
@@ -1223,15 +1272,23 @@ int do_netdev_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
         qerror_report(QERR_DEVICE_NOT_FOUND, id);
         return -1;
     }
-    qemu_del_vlan_client(vc);
+    /* Deleting a queue unlinks it, so this walks all queues of the netdev */
+    do {
+        qemu_del_vlan_client(vc);
+    } while ((vc = qemu_find_netdev(id)));
     qemu_opts_del(qemu_opts_find(qemu_find_opts("netdev"), id));
     return 0;
 }
 
 static void print_net_client(Monitor *mon, VLANClientState *vc)
 {
-    monitor_printf(mon, "%s: type=%s,%s\n", vc->name,
+    monitor_printf(mon, "%s: type=%s,%s", vc->name,
                    net_client_types[vc->info->type].type, vc->info_str);
+    if (vc->send_queue && qemu_net_queue_dropped(vc->send_queue)) {
+        monitor_printf(mon, ",dropped=%" PRIu64,
+                       qemu_net_queue_dropped(vc->send_queue));
+    }
+    monitor_printf(mon, "\n");
 }
 
 void do_info_network(Monitor *mon)
@@ -1263,6 +1320,56 @@ void do_info_network(Monitor *mon)
     }
 }
 
+static void nic_tx_stats_iter(QObject *obj, void *opaque)
+{
+    Monitor *mon = opaque;
+    QDict *stats = qobject_to_qdict(obj);
+
+    monitor_printf(mon, "%s: tx=%s kicks=%" PRId64 " batches=%" PRId64
+                   " packets=%" PRId64 " average-batch=%" PRId64
+                   " timer-queues=%" PRId64 "\n",
+                   qdict_get_str(stats, "name"),
+                   qdict_get_str(stats, "tx"),
+                   qdict_get_int(stats, "kicks"),
+                   qdict_get_int(stats, "batches"),
+                   qdict_get_int(stats, "packets"),
+                   qdict_get_int(stats, "average-batch"),
+                   qdict_get_int(stats, "timer-queues"));
+}
+
+void do_info_nic_tx_stats_print(Monitor *mon, const QObject *data)
+{
+    QList *list = qobject_to_qlist(data);
+
+    if (qlist_empty(list)) {
+        monitor_printf(mon, "No NIC reports transmit statistics\n");
+        return;
+    }
+    qlist_iter(list, nic_tx_stats_iter, mon);
+}
+
+static void do_info_nic_tx_stats_one(NICState *nic, void *opaque)
+{
+    QList *list = opaque;
+    QObject *obj;
+
+    if (!nic->nc.info->query_tx_stats) {
+        return;
+    }
+    obj = nic->nc.info->query_tx_stats(&nic->nc);
+    if (obj) {
+        qlist_append_obj(list, obj);
+    }
+}
+
+void do_info_nic_tx_stats(Monitor *mon, QObject **ret_data)
+{
+    QList *list = qlist_new();
+
+    qemu_foreach_nic(do_info_nic_tx_stats_one, list);
+    *ret_data = QOBJECT(list);
+}
+
 int do_set_link(Monitor *mon, const QDict *qdict, QObject **ret_data)
 {
     VLANState *vlan;
@@ -32,19 +32,34 @@
  * If a sent callback is provided to send(), the caller must handle a
  * zero return from the delivery handler by not sending any more packets
  * until we have invoked the callback. Only in that case will we queue
- * the packet.
+ * the packet.  The queued packet refers to the caller's buffers instead
+ * of copying them, so they must stay valid until the callback is invoked.
+ * Purging the packet invokes the callback with a length of zero.
  *
- * If a sent callback isn't provided, we just drop the packet to avoid
+ * If a sent callback isn't provided, the packet is copied, and it is
+ * dropped once the queue holds NET_QUEUE_MAX_LEN packets to avoid
  * unbounded queueing.
  */
 
+#define NET_QUEUE_MAX_LEN       1024
+
+/* Number of released packets kept around for reuse */
+#define NET_QUEUE_POOL_SIZE     64
+
+/* Number of iovecs that fit in a packet without a separate allocation */
+#define NET_PACKET_INLINE_IOV   16
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     VLANClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
-    uint8_t data[0];
+    struct iovec *iov;
+    int iovcnt;
+    /* private copy of the payload, NULL if iov refers to the sender's */
+    uint8_t *data;
+    struct iovec inline_iov[NET_PACKET_INLINE_IOV];
 };
 
 struct NetQueue {
@@ -53,6 +68,11 @@ struct NetQueue {
     void *opaque;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
+    unsigned int nq_count;
+    uint64_t dropped;
+
+    QTAILQ_HEAD(pool, NetPacket) pool;
+    unsigned int pool_count;
 
     unsigned delivering : 1;
 };
@@ -70,24 +90,79 @@ NetQueue *qemu_new_net_queue(NetPacketDeliver *deliver,
     queue->opaque = opaque;
 
     QTAILQ_INIT(&queue->packets);
+    QTAILQ_INIT(&queue->pool);
 
     queue->delivering = 0;
 
     return queue;
 }
 
+static NetPacket *qemu_net_packet_alloc(NetQueue *queue, int iovcnt)
+{
+    NetPacket *packet;
+
+    packet = QTAILQ_FIRST(&queue->pool);
+    if (packet) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
+        queue->pool_count--;
+    } else {
+        packet = g_malloc(sizeof(NetPacket));
+    }
+
+    if (iovcnt <= NET_PACKET_INLINE_IOV) {
+        packet->iov = packet->inline_iov;
+    } else {
+        packet->iov = g_malloc(sizeof(struct iovec) * iovcnt);
+    }
+    packet->iovcnt = iovcnt;
+    packet->data = NULL;
+
+    return packet;
+}
+
+static void qemu_net_packet_free(NetQueue *queue, NetPacket *packet)
+{
+    g_free(packet->data);
+    if (packet->iov != packet->inline_iov) {
+        g_free(packet->iov);
+    }
+
+    if (queue->pool_count < NET_QUEUE_POOL_SIZE) {
+        QTAILQ_INSERT_HEAD(&queue->pool, packet, entry);
+        queue->pool_count++;
+    } else {
+        g_free(packet);
+    }
+}
+
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
+        qemu_net_packet_free(queue, packet);
+    }
+
+    QTAILQ_FOREACH_SAFE(packet, &queue->pool, entry, next) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
         g_free(packet);
     }
 
     g_free(queue);
 }
 
+uint64_t qemu_net_queue_dropped(NetQueue *queue)
+{
+    return queue->dropped;
+}
+
+static void qemu_net_queue_insert(NetQueue *queue, NetPacket *packet)
+{
+    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    queue->nq_count++;
+}
+
 static ssize_t qemu_net_queue_append(NetQueue *queue,
                                      VLANClientState *sender,
                                      unsigned flags,
@@ -97,14 +172,27 @@ static ssize_t qemu_net_queue_append(NetQueue *queue,
 {
     NetPacket *packet;
 
-    packet = g_malloc(sizeof(NetPacket) + size);
+    if (!sent_cb && queue->nq_count >= NET_QUEUE_MAX_LEN) {
+        queue->dropped++;
+        return size;
+    }
+
+    packet = qemu_net_packet_alloc(queue, 1);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
-    memcpy(packet->data, buf, size);
 
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    if (sent_cb) {
+        packet->iov[0].iov_base = (uint8_t *)buf;
+    } else {
+        packet->data = g_malloc(size);
+        memcpy(packet->data, buf, size);
+        packet->iov[0].iov_base = packet->data;
+    }
+    packet->iov[0].iov_len = size;
+
+    qemu_net_queue_insert(queue, packet);
 
     return size;
 }
@@ -124,20 +212,32 @@ static ssize_t qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    if (!sent_cb && queue->nq_count >= NET_QUEUE_MAX_LEN) {
+        queue->dropped++;
+        return max_len;
+    }
+
+    if (sent_cb) {
+        /* Only the iovec array is copied, it may live on the stack */
+        packet = qemu_net_packet_alloc(queue, iovcnt);
+        memcpy(packet->iov, iov, sizeof(struct iovec) * iovcnt);
+    } else {
+        packet = qemu_net_packet_alloc(queue, 1);
+        packet->data = g_malloc(max_len);
+        max_len = 0;
+        for (i = 0; i < iovcnt; i++) {
+            memcpy(packet->data + max_len, iov[i].iov_base, iov[i].iov_len);
+            max_len += iov[i].iov_len;
+        }
+        packet->iov[0].iov_base = packet->data;
+        packet->iov[0].iov_len = max_len;
+    }
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
-    packet->size = 0;
-
-    for (i = 0; i < iovcnt; i++) {
-        size_t len = iov[i].iov_len;
+    packet->size = max_len;
 
-        memcpy(packet->data + packet->size, iov[i].iov_base, len);
-        packet->size += len;
-    }
-
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_insert(queue, packet);
 
     return packet->size;
 }
@@ -172,6 +272,24 @@ static ssize_t qemu_net_queue_deliver_iov(NetQueue *queue,
     return ret;
 }
 
+static ssize_t qemu_net_queue_deliver_packet(NetQueue *queue,
+                                             NetPacket *packet)
+{
+    if (packet->iovcnt == 1) {
+        return qemu_net_queue_deliver(queue,
+                                      packet->sender,
+                                      packet->flags,
+                                      packet->iov[0].iov_base,
+                                      packet->iov[0].iov_len);
+    }
+
+    return qemu_net_queue_deliver_iov(queue,
+                                      packet->sender,
+                                      packet->flags,
+                                      packet->iov,
+                                      packet->iovcnt);
+}
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             VLANClientState *sender,
                             unsigned flags,
@@ -227,7 +345,11 @@ void qemu_net_queue_purge(NetQueue *queue, VLANClientState *from)
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
-            g_free(packet);
+            queue->nq_count--;
+            if (packet->sent_cb) {
+                packet->sent_cb(packet->sender, 0);
+            }
+            qemu_net_packet_free(queue, packet);
         }
     }
 }
@@ -240,14 +362,12 @@ void qemu_net_queue_flush(NetQueue *queue)
 
         packet = QTAILQ_FIRST(&queue->packets);
         QTAILQ_REMOVE(&queue->packets, packet, entry);
+        queue->nq_count--;
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
+        ret = qemu_net_queue_deliver_packet(queue, packet);
         if (ret == 0) {
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
+            queue->nq_count++;
             break;
         }
 
@@ -255,6 +375,6 @@ void qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_packet_free(queue, packet);
     }
 }
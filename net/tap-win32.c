@@ -736,6 +736,16 @@ void tap_fd_set_vnet_hdr_len(int fd, int len)
 {
 }
 
+int tap_enable(VLANClientState *vc)
+{
+    return 0;
+}
+
+int tap_disable(VLANClientState *vc)
+{
+    return -1;
+}
+
 void tap_using_vnet_hdr(VLANClientState *vc, int using_vnet_hdr)
 {
 }
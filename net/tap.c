@@ -48,6 +48,10 @@
  */
 #define TAP_BUFSIZE (4096 + 65536)
 
+/* Maximum number of packets read from the tap device per wakeup, so that
+ * a busy tap cannot starve the main loop */
+#define TAP_RX_BURST 64
+
 typedef struct TAPState {
     VLANClientState nc;
     int fd;
@@ -58,6 +62,9 @@ typedef struct TAPState {
     unsigned int write_poll : 1;
     unsigned int using_vnet_hdr : 1;
     unsigned int has_ufo: 1;
+    unsigned int enabled : 1;
+    /* a packet queued by the peer still points into buf */
+    unsigned int send_pending : 1;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
 } TAPState;
@@ -70,10 +77,13 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
+    /* reading the next packet would overwrite the one that is queued */
+    int read = s->read_poll && s->enabled && !s->send_pending;
+
     qemu_set_fd_handler2(s->fd,
-                         s->read_poll  ? tap_can_send : NULL,
-                         s->read_poll  ? tap_send     : NULL,
-                         s->write_poll ? tap_writable : NULL,
+                         read ? tap_can_send : NULL,
+                         read ? tap_send     : NULL,
+                         s->write_poll && s->enabled ? tap_writable : NULL,
                          s);
 }
 
@@ -185,6 +195,7 @@ ssize_t tap_read_packet(int tapfd, uint8_t *buf, int maxlen)
 static void tap_send_completed(VLANClientState *nc, ssize_t len)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    s->send_pending = 0;
     tap_read_poll(s, 1);
 }
 
@@ -192,7 +203,9 @@ static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
     int size;
+    int packets = 0;
 
+    qemu_send_batch_begin(&s->nc);
     do {
         uint8_t *buf = s->buf;
 
@@ -208,9 +221,12 @@ static void tap_send(void *opaque)
 
         size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
         if (size == 0) {
+            s->send_pending = 1;
             tap_read_poll(s, 0);
         }
-    } while (size > 0 && qemu_can_send_packet(&s->nc));
+    } while (size > 0 && ++packets < TAP_RX_BURST &&
+             qemu_can_send_packet(&s->nc));
+    qemu_send_batch_end(&s->nc);
 }
 
 int tap_has_ufo(VLANClientState *nc)
@@ -252,6 +268,45 @@ void tap_set_vnet_hdr_len(VLANClientState *nc, int len)
     s->host_vnet_hdr_len = len;
 }
 
+int tap_enable(VLANClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int ret;
+
+    assert(nc->info->type == NET_CLIENT_TYPE_TAP);
+
+    if (s->enabled) {
+        return 0;
+    }
+
+    ret = tap_fd_enable(s->fd);
+    if (ret == 0) {
+        s->enabled = 1;
+        tap_update_fd_handler(s);
+    }
+    return ret;
+}
+
+int tap_disable(VLANClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int ret;
+
+    assert(nc->info->type == NET_CLIENT_TYPE_TAP);
+
+    if (!s->enabled) {
+        return 0;
+    }
+
+    ret = tap_fd_disable(s->fd);
+    if (ret == 0) {
+        qemu_purge_queued_packets(nc);
+        s->enabled = 0;
+        tap_update_fd_handler(s);
+    }
+    return ret;
+}
+
 void tap_using_vnet_hdr(VLANClientState *nc, int using_vnet_hdr)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -337,6 +392,7 @@ static TAPState *net_tap_fd_init(VLANState *vlan,
     s->fd = fd;
     s->host_vnet_hdr_len = vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
     s->using_vnet_hdr = 0;
+    s->enabled = 1;
     s->has_ufo = tap_probe_has_ufo(s->fd);
     tap_set_offload(&s->nc, 0, 0, 0, 0, 0);
     tap_read_poll(s, 1);
@@ -388,7 +444,9 @@ static int launch_script(const char *setup_script, const char *ifname, int fd)
     return -1;
 }
 
-static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
+/* The setup script is only run for the first queue of the interface */
+static int net_tap_init(QemuOpts *opts, int *vnet_hdr, int mq_required,
+                        int run_script)
 {
     int fd, vnet_hdr_required;
     char ifname[128] = {0,};
@@ -405,13 +463,14 @@ static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
         vnet_hdr_required = 0;
     }
 
-    TFR(fd = tap_open(ifname, sizeof(ifname), vnet_hdr, vnet_hdr_required));
+    TFR(fd = tap_open(ifname, sizeof(ifname), vnet_hdr, vnet_hdr_required,
+                      mq_required));
     if (fd < 0) {
         return -1;
     }
 
     setup_script = qemu_opt_get(opts, "script");
-    if (setup_script &&
+    if (run_script && setup_script &&
         setup_script[0] != '\0' &&
         strcmp(setup_script, "no") != 0 &&
         launch_script(setup_script, ifname, fd)) {
@@ -419,60 +478,22 @@ static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
         return -1;
     }
 
-    qemu_opt_set(opts, "ifname", ifname);
+    if (run_script) {
+        qemu_opt_set(opts, "ifname", ifname);
+    }
 
     return fd;
 }
 
-int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan)
+static int net_init_tap_one(QemuOpts *opts, Monitor *mon, TAPState *s,
+                            int queue_index)
 {
-    TAPState *s;
-    int fd, vnet_hdr = 0;
-
-    if (qemu_opt_get(opts, "fd")) {
-        if (qemu_opt_get(opts, "ifname") ||
-            qemu_opt_get(opts, "script") ||
-            qemu_opt_get(opts, "downscript") ||
-            qemu_opt_get(opts, "vnet_hdr")) {
-            error_report("ifname=, script=, downscript= and vnet_hdr= is invalid with fd=");
-            return -1;
-        }
-
-        fd = net_handle_fd_param(mon, qemu_opt_get(opts, "fd"));
-        if (fd == -1) {
-            return -1;
-        }
-
-        fcntl(fd, F_SETFL, O_NONBLOCK);
-
-        vnet_hdr = tap_probe_vnet_hdr(fd);
-    } else {
-        if (!qemu_opt_get(opts, "script")) {
-            qemu_opt_set(opts, "script", DEFAULT_NETWORK_SCRIPT);
-        }
-
-        if (!qemu_opt_get(opts, "downscript")) {
-            qemu_opt_set(opts, "downscript", DEFAULT_NETWORK_DOWN_SCRIPT);
-        }
-
-        fd = net_tap_init(opts, &vnet_hdr);
-        if (fd == -1) {
-            return -1;
-        }
-    }
-
-    s = net_tap_fd_init(vlan, "tap", name, fd, vnet_hdr);
-    if (!s) {
-        close(fd);
-        return -1;
-    }
-
     if (tap_set_sndbuf(s->fd, opts) < 0) {
         return -1;
     }
 
     if (qemu_opt_get(opts, "fd")) {
-        snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", fd);
+        snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", s->fd);
     } else {
         const char *ifname, *script, *downscript;
 
@@ -484,7 +505,7 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
                  "ifname=%s,script=%s,downscript=%s",
                  ifname, script, downscript);
 
-        if (strcmp(downscript, "no") != 0) {
+        if (queue_index == 0 && strcmp(downscript, "no") != 0) {
             snprintf(s->down_script, sizeof(s->down_script), "%s", downscript);
             snprintf(s->down_script_arg, sizeof(s->down_script_arg), "%s", ifname);
         }
@@ -516,6 +537,100 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
     return 0;
 }
 
+int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan)
+{
+    TAPState *s;
+    int fd, vnet_hdr = 0;
+    int i, queues;
+
+    queues = qemu_opt_get_number(opts, "queues", 1);
+    if (queues < 1) {
+        error_report("queues= must be at least 1");
+        return -1;
+    }
+    if (queues > 1) {
+        if (vlan) {
+            error_report("queues= is only supported with -netdev");
+            return -1;
+        }
+        if (qemu_opt_get(opts, "fd") || qemu_opt_get(opts, "vhostfd")) {
+            error_report("fd= and vhostfd= are invalid with queues=");
+            return -1;
+        }
+    }
+
+    if (qemu_opt_get(opts, "fd")) {
+        if (qemu_opt_get(opts, "ifname") ||
+            qemu_opt_get(opts, "script") ||
+            qemu_opt_get(opts, "downscript") ||
+            qemu_opt_get(opts, "vnet_hdr")) {
+            error_report("ifname=, script=, downscript= and vnet_hdr= is invalid with fd=");
+            return -1;
+        }
+
+        fd = net_handle_fd_param(mon, qemu_opt_get(opts, "fd"));
+        if (fd == -1) {
+            return -1;
+        }
+
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+
+        vnet_hdr = tap_probe_vnet_hdr(fd);
+
+        s = net_tap_fd_init(vlan, "tap", name, fd, vnet_hdr);
+        if (!s) {
+            close(fd);
+            return -1;
+        }
+
+        return net_init_tap_one(opts, mon, s, 0);
+    }
+
+    if (!qemu_opt_get(opts, "script")) {
+        qemu_opt_set(opts, "script", DEFAULT_NETWORK_SCRIPT);
+    }
+
+    if (!qemu_opt_get(opts, "downscript")) {
+        qemu_opt_set(opts, "downscript", DEFAULT_NETWORK_DOWN_SCRIPT);
+    }
+
+    /* Every queue is a separate client with the same name; the NIC that
+     * takes the first one finds the others with qemu_find_netdev_queues() */
+    for (i = 0; i < queues; i++) {
+        fd = net_tap_init(opts, &vnet_hdr, queues > 1, i == 0);
+        if (fd == -1) {
+            goto fail;
+        }
+
+        s = net_tap_fd_init(vlan, "tap", name, fd, vnet_hdr);
+        if (!s) {
+            close(fd);
+            goto fail;
+        }
+
+        if (net_init_tap_one(opts, mon, s, i) < 0) {
+            qemu_del_vlan_client(&s->nc);
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    /* Delete the queues that were set up already, the first one last so
+     * that its down script runs once all of them are closed */
+    if (i > 0) {
+        VLANClientState **ncs = g_malloc(i * sizeof(ncs[0]));
+        int n = MIN(qemu_find_netdev_queues(name, ncs, i), i);
+
+        while (n-- > 0) {
+            qemu_del_vlan_client(ncs[n]);
+        }
+        g_free(ncs);
+    }
+    return -1;
+}
+
 VHostNetState *tap_get_vhost_net(VLANClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
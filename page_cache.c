@@ -0,0 +1,200 @@
+/*
+ * Page cache for QEMU
+ * The cache is based on a hash of the page address
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "host-utils.h"
+#include "page_cache.h"
+
+//#define DEBUG_CACHE
+
+#ifdef DEBUG_CACHE
+#define DPRINTF(fmt, ...) \
+    do { fprintf(stdout, "cache: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+typedef struct CacheItem CacheItem;
+
+struct CacheItem {
+    uint64_t it_addr;
+    uint8_t *it_data;
+};
+
+struct PageCache {
+    CacheItem *page_cache;
+    unsigned int page_size;
+    int64_t max_num_items;
+    int64_t num_items;
+};
+
+static int64_t cache_round_num_pages(int64_t num_pages)
+{
+    if (num_pages < 1) {
+        return 0;
+    }
+    /* round down to the nearest power of two so we can mask the hash */
+    return 1LL << (63 - clz64(num_pages));
+}
+
+PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+{
+    int64_t i;
+    PageCache *cache;
+
+    num_pages = cache_round_num_pages(num_pages);
+    if (num_pages <= 0) {
+        DPRINTF("invalid number of pages\n");
+        return NULL;
+    }
+
+    cache = g_malloc(sizeof(*cache));
+    cache->page_size = page_size;
+    cache->num_items = 0;
+    cache->max_num_items = num_pages;
+
+    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+
+    cache->page_cache = g_malloc(cache->max_num_items *
+                                 sizeof(*cache->page_cache));
+
+    for (i = 0; i < cache->max_num_items; i++) {
+        cache->page_cache[i].it_data = NULL;
+        cache->page_cache[i].it_addr = -1;
+    }
+
+    return cache;
+}
+
+void cache_fini(PageCache *cache)
+{
+    int64_t i;
+
+    g_assert(cache);
+    g_assert(cache->page_cache);
+
+    for (i = 0; i < cache->max_num_items; i++) {
+        g_free(cache->page_cache[i].it_data);
+    }
+
+    g_free(cache->page_cache);
+    g_free(cache);
+}
+
+static size_t cache_get_cache_pos(const PageCache *cache, uint64_t address)
+{
+    g_assert(cache->max_num_items);
+    return (address / cache->page_size) & (cache->max_num_items - 1);
+}
+
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
+{
+    size_t pos;
+
+    g_assert(cache);
+    g_assert(cache->page_cache);
+
+    pos = cache_get_cache_pos(cache, addr);
+
+    return cache->page_cache[pos].it_addr == addr;
+}
+
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+{
+    size_t pos;
+
+    g_assert(cache);
+    g_assert(cache->page_cache);
+
+    pos = cache_get_cache_pos(cache, addr);
+
+    return &cache->page_cache[pos];
+}
+
+uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (it->it_addr != addr) {
+        return NULL;
+    }
+    return it->it_data;
+}
+
+uint8_t *cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (!it->it_data) {
+        it->it_data = g_malloc(cache->page_size);
+        cache->num_items++;
+    }
+
+    memcpy(it->it_data, pdata, cache->page_size);
+    it->it_addr = addr;
+
+    return it->it_data;
+}
+
+int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
+{
+    CacheItem *new_items;
+    int64_t i, new_max;
+
+    g_assert(cache);
+
+    new_max = cache_round_num_pages(new_num_pages);
+    if (new_max <= 0) {
+        return -1;
+    }
+
+    if (new_max == cache->max_num_items) {
+        return new_max;
+    }
+
+    new_items = g_malloc(new_max * sizeof(*new_items));
+    for (i = 0; i < new_max; i++) {
+        new_items[i].it_data = NULL;
+        new_items[i].it_addr = -1;
+    }
+
+    /* move all data from the old cache that still fits, free the rest */
+    cache->num_items = 0;
+    for (i = 0; i < cache->max_num_items; i++) {
+        CacheItem *old_it = &cache->page_cache[i];
+        CacheItem *new_it;
+
+        if (old_it->it_addr == -1) {
+            g_free(old_it->it_data);
+            continue;
+        }
+
+        new_it = &new_items[(old_it->it_addr / cache->page_size) &
+                            (new_max - 1)];
+        if (new_it->it_data) {
+            /* collision: keep whichever page got there first */
+            g_free(old_it->it_data);
+        } else {
+            *new_it = *old_it;
+            cache->num_items++;
+        }
+    }
+
+    g_free(cache->page_cache);
+    cache->page_cache = new_items;
+    cache->max_num_items = new_max;
+
+    return new_max;
+}
+
+int64_t cache_max_num_items(const PageCache *cache)
+{
+    return cache->max_num_items;
+}
@@ -0,0 +1,85 @@
+/*
+ * Page cache for QEMU
+ * The cache is based on a hash of the page address
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include "qemu-common.h"
+
+/* Page cache for storing previous pages as basis for XBZRLE compression */
+typedef struct PageCache PageCache;
+
+/**
+ * cache_init: Initialize the page cache
+ *
+ * Returns new allocated cache or NULL on error
+ *
+ * @num_pages: cache maximal number of cached pages, rounded down to a
+ *             power of two
+ * @page_size: cache page size
+ */
+PageCache *cache_init(int64_t num_pages, unsigned int page_size);
+
+/**
+ * cache_fini: free all cache resources
+ * @cache: pointer to the PageCache struct
+ */
+void cache_fini(PageCache *cache);
+
+/**
+ * cache_is_cached: Checks to see if the page is cached
+ *
+ * Returns %true if page is cached
+ *
+ * @cache: pointer to the PageCache struct
+ * @addr: page address
+ */
+bool cache_is_cached(const PageCache *cache, uint64_t addr);
+
+/**
+ * get_cached_data: Get the data cached for an addr
+ *
+ * Returns pointer to the data cached or NULL if not cached
+ *
+ * @cache: pointer to the PageCache struct
+ * @addr: page address
+ */
+uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
+
+/**
+ * cache_insert: insert the page into the cache, evicting whatever page
+ * currently occupies its slot.  The data is copied into the cache.
+ *
+ * Returns pointer to the cached copy of the data
+ *
+ * @cache: pointer to the PageCache struct
+ * @addr: page address
+ * @pdata: pointer to the page
+ */
+uint8_t *cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata);
+
+/**
+ * cache_resize: resize the page cache.  In case of size reduction the extra
+ * pages will be freed.
+ *
+ * Returns the new number of pages in the cache or -1 on error
+ *
+ * @cache: pointer to the PageCache struct
+ * @num_pages: new page cache size (in pages)
+ */
+int64_t cache_resize(PageCache *cache, int64_t num_pages);
+
+/**
+ * cache_max_num_items: number of pages the cache can hold
+ *
+ * @cache: pointer to the PageCache struct
+ */
+int64_t cache_max_num_items(const PageCache *cache);
+
+#endif
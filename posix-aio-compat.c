@@ -27,7 +27,17 @@
 #include "qemu-common.h"
 #include "trace.h"
 #include "block_int.h"
-#include "compatfd.h"
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#if defined(CONFIG_FALLOCATE_PUNCH_HOLE) || defined(CONFIG_FALLOCATE_ZERO_RANGE)
+#include <fcntl.h>
+#include <linux/falloc.h>
+#endif
+#ifdef CONFIG_XFS
+#include <xfs/xfs.h>
+#endif
 
 #include "block/raw-posix-aio.h"
 
@@ -42,7 +52,6 @@ struct qemu_paiocb {
     int aio_niov;
     size_t aio_nbytes;
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
-    int ev_signo;
     off_t aio_offset;
 
     QTAILQ_ENTRY(qemu_paiocb) node;
@@ -53,8 +62,20 @@ struct qemu_paiocb {
 };
 
 typedef struct PosixAioState {
-    int fd;
-    struct qemu_paiocb *first_aio;
+    int rfd, wfd;
+    /*
+     * Finished requests, pushed by the worker threads without taking the
+     * lock and taken all at once by the main thread.
+     */
+    struct qemu_paiocb *completed;
+    /*
+     * Requests taken from completed, in order of completion, whose callbacks
+     * have not run yet.  Kept here rather than on the stack so that a flush
+     * from one of the callbacks completes the rest.
+     */
+    struct qemu_paiocb *done;
+    /* submitted requests that have not been completed or cancelled yet */
+    int requests;
 } PosixAioState;
 
 
@@ -63,9 +84,12 @@ static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 static pthread_t thread_id;
 static pthread_attr_t attr;
 static int max_threads = 64;
+static int idle_timeout = 10;
 static int cur_threads = 0;
 static int idle_threads = 0;
+static int queued_requests = 0;
 static QTAILQ_HEAD(, qemu_paiocb) request_list;
+static PosixAioState *posix_aio_state;
 
 #ifdef CONFIG_PREADV
 static int preadv_present = 1;
@@ -146,6 +170,106 @@ static ssize_t handle_aiocb_flush(struct qemu_paiocb *aiocb)
     return 0;
 }
 
+static int do_discard(struct qemu_paiocb *aiocb)
+{
+    int fd = aiocb->aio_fildes;
+    struct stat st;
+    int ret = -ENOTSUP;
+
+    if (fstat(fd, &st) < 0) {
+        return -errno;
+    }
+
+    if (S_ISBLK(st.st_mode)) {
+#ifdef BLKDISCARD
+        uint64_t range[2] = { aiocb->aio_offset, aiocb->aio_nbytes };
+
+        do {
+            ret = ioctl(fd, BLKDISCARD, range) < 0 ? -errno : 0;
+        } while (ret == -EINTR);
+#endif
+        return ret;
+    }
+
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+    do {
+        ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        aiocb->aio_offset, aiocb->aio_nbytes) < 0 ? -errno : 0;
+    } while (ret == -EINTR);
+#endif
+
+#ifdef CONFIG_XFS
+    /* Kernels before 2.6.38 cannot punch holes with fallocate on XFS */
+    if ((ret == -ENOTSUP || ret == -EOPNOTSUPP) && platform_test_xfs_fd(fd)) {
+        struct xfs_flock64 fl;
+
+        memset(&fl, 0, sizeof(fl));
+        fl.l_whence = SEEK_SET;
+        fl.l_start = aiocb->aio_offset;
+        fl.l_len = aiocb->aio_nbytes;
+
+        ret = xfsctl(NULL, fd, XFS_IOC_UNRESVSP64, &fl) < 0 ? -errno : 0;
+    }
+#endif
+
+    return ret;
+}
+
+static ssize_t handle_aiocb_discard(struct qemu_paiocb *aiocb)
+{
+    int ret = do_discard(aiocb);
+
+    /* Discard is only a hint, if the host cannot do it the data just stays */
+    if (ret == -ENOTSUP || ret == -EOPNOTSUPP || ret == -ENOTTY ||
+        ret == -ENOSYS) {
+        ret = 0;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    return aiocb->aio_nbytes;
+}
+
+static ssize_t handle_aiocb_write_zeroes(struct qemu_paiocb *aiocb)
+{
+    int fd = aiocb->aio_fildes;
+    struct stat st;
+    int ret = -ENOTSUP;
+
+    if (fstat(fd, &st) < 0) {
+        return -errno;
+    }
+
+    if (S_ISBLK(st.st_mode)) {
+#ifdef BLKZEROOUT
+        uint64_t range[2] = { aiocb->aio_offset, aiocb->aio_nbytes };
+
+        do {
+            ret = ioctl(fd, BLKZEROOUT, range) < 0 ? -errno : 0;
+        } while (ret == -EINTR);
+#endif
+    } else {
+#ifdef CONFIG_FALLOCATE_ZERO_RANGE
+        do {
+            ret = fallocate(fd, FALLOC_FL_ZERO_RANGE, aiocb->aio_offset,
+                            aiocb->aio_nbytes) < 0 ? -errno : 0;
+        } while (ret == -EINTR);
+#endif
+    }
+
+    /*
+     * The host cannot do it at all, let the block layer write out zeroes.
+     * -EINVAL is returned as it is, it may only be this request's range.
+     */
+    if (ret == -EOPNOTSUPP || ret == -ENOTTY || ret == -ENOSYS) {
+        ret = -ENOTSUP;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    return aiocb->aio_nbytes;
+}
+
 #ifdef CONFIG_PREADV
 
 static ssize_t
@@ -306,12 +430,40 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
     return nbytes;
 }
 
-static void *aio_thread(void *unused)
+/*
+ * Hands a finished request over to the main thread.  Only the completion
+ * that makes the list non-empty needs to wake it up, the others are picked
+ * up together with that one.
+ */
+static void paio_complete(struct qemu_paiocb *aiocb)
 {
-    pid_t pid;
+    PosixAioState *s = posix_aio_state;
+    struct qemu_paiocb *head;
+    /* Write 8 bytes to be compatible with eventfd.  */
+    static const uint64_t val = 1;
+    ssize_t ret;
+
+    do {
+        head = s->completed;
+        aiocb->next = head;
+    } while (!__sync_bool_compare_and_swap(&s->completed, head, aiocb));
+
+    if (head) {
+        return;
+    }
 
-    pid = getpid();
+    do {
+        ret = write(s->wfd, &val, sizeof(val));
+    } while (ret < 0 && errno == EINTR);
 
+    /* EAGAIN is fine, a read must be pending.  */
+    if (ret < 0 && errno != EAGAIN) {
+        die("write to completion eventfd");
+    }
+}
+
+static void *aio_thread(void *unused)
+{
     while (1) {
         struct qemu_paiocb *aiocb;
         ssize_t ret = 0;
@@ -319,7 +471,7 @@ static void *aio_thread(void *unused)
         struct timespec ts;
 
         qemu_gettimeofday(&tv);
-        ts.tv_sec = tv.tv_sec + 10;
+        ts.tv_sec = tv.tv_sec + idle_timeout;
         ts.tv_nsec = 0;
 
         mutex_lock(&lock);
@@ -336,6 +488,7 @@ static void *aio_thread(void *unused)
 
         aiocb = QTAILQ_FIRST(&request_list);
         QTAILQ_REMOVE(&request_list, aiocb, node);
+        queued_requests--;
         aiocb->active = 1;
         mutex_unlock(&lock);
 
@@ -363,6 +516,12 @@ static void *aio_thread(void *unused)
         case QEMU_AIO_IOCTL:
             ret = handle_aiocb_ioctl(aiocb);
             break;
+        case QEMU_AIO_DISCARD:
+            ret = handle_aiocb_discard(aiocb);
+            break;
+        case QEMU_AIO_WRITE_ZEROES:
+            ret = handle_aiocb_write_zeroes(aiocb);
+            break;
         default:
             fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
             ret = -EINVAL;
@@ -373,7 +532,7 @@ static void *aio_thread(void *unused)
         aiocb->ret = ret;
         mutex_unlock(&lock);
 
-        if (kill(pid, aiocb->ev_signo)) die("kill failed");
+        paio_complete(aiocb);
     }
 
     cur_threads--;
@@ -401,10 +560,17 @@ static void qemu_paio_submit(struct qemu_paiocb *aiocb)
 {
     aiocb->ret = -EINPROGRESS;
     aiocb->active = 0;
+    posix_aio_state->requests++;
     mutex_lock(&lock);
-    if (idle_threads == 0 && cur_threads < max_threads)
-        spawn_thread();
     QTAILQ_INSERT_TAIL(&request_list, aiocb, node);
+    queued_requests++;
+    /*
+     * Grow the pool when the idle threads cannot take all queued requests.
+     * A woken thread only stops counting as idle once it runs, so checking
+     * for idle_threads == 0 would leave a burst of requests to one thread.
+     */
+    if (queued_requests > idle_threads && cur_threads < max_threads)
+        spawn_thread();
     mutex_unlock(&lock);
     cond_signal(&cond);
 }
@@ -435,80 +601,65 @@ static int qemu_paio_error(struct qemu_paiocb *aiocb)
 static int posix_aio_process_queue(void *opaque)
 {
     PosixAioState *s = opaque;
-    struct qemu_paiocb *acb, **pacb;
-    int ret;
-    int result = 0;
-
-    for(;;) {
-        pacb = &s->first_aio;
-        for(;;) {
-            acb = *pacb;
-            if (!acb)
-                return result;
-
-            ret = qemu_paio_error(acb);
-            if (ret == ECANCELED) {
-                /* remove the request */
-                *pacb = acb->next;
-                qemu_aio_release(acb);
-                result = 1;
-            } else if (ret != EINPROGRESS) {
-                /* end of aio */
-                if (ret == 0) {
-                    ret = qemu_paio_return(acb);
-                    if (ret == acb->aio_nbytes)
-                        ret = 0;
-                    else
-                        ret = -EINVAL;
-                } else {
-                    ret = -ret;
-                }
-
-                trace_paio_complete(acb, acb->common.opaque, ret);
-
-                /* remove the request */
-                *pacb = acb->next;
-                /* call the callback */
-                acb->common.cb(acb->common.opaque, ret);
-                qemu_aio_release(acb);
-                result = 1;
-                break;
-            } else {
-                pacb = &acb->next;
-            }
+    struct qemu_paiocb *acb, *next, *list, **tail;
+    ssize_t ret;
+
+    do {
+        list = s->completed;
+    } while (!__sync_bool_compare_and_swap(&s->completed, list, NULL));
+
+    if (!list && !s->done) {
+        return 0;
+    }
+
+    /* the list is in reverse order of completion, append it to done */
+    acb = NULL;
+    while (list) {
+        next = list->next;
+        list->next = acb;
+        acb = list;
+        list = next;
+    }
+    for (tail = &s->done; *tail; tail = &(*tail)->next) {
+        /* nothing */
+    }
+    *tail = acb;
+
+    while ((acb = s->done) != NULL) {
+        s->done = acb->next;
+        s->requests--;
+
+        ret = acb->ret;
+        if (ret == -ECANCELED) {
+            qemu_aio_release(acb);
+            continue;
         }
+
+        if (ret == (ssize_t)acb->aio_nbytes) {
+            ret = 0;
+        } else if (ret >= 0) {
+            ret = -EINVAL;
+        }
+
+        trace_paio_complete(acb, acb->common.opaque, ret);
+
+        acb->common.cb(acb->common.opaque, ret);
+        qemu_aio_release(acb);
     }
 
-    return result;
+    return 1;
 }
 
 static void posix_aio_read(void *opaque)
 {
     PosixAioState *s = opaque;
-    union {
-        struct qemu_signalfd_siginfo siginfo;
-        char buf[128];
-    } sig;
-    size_t offset;
-
-    /* try to read from signalfd, don't freak out if we can't read anything */
-    offset = 0;
-    while (offset < 128) {
-        ssize_t len;
-
-        len = read(s->fd, sig.buf + offset, 128 - offset);
-        if (len == -1 && errno == EINTR)
-            continue;
-        if (len == -1 && errno == EAGAIN) {
-            /* there is no natural reason for this to happen,
-             * so we'll spin hard until we get everything just
-             * to be on the safe side. */
-            if (offset > 0)
-                continue;
-        }
+    ssize_t len;
+    char buffer[512];
 
-        offset += len;
-    }
+    /* Drain the notify pipe.  For eventfd, only 8 bytes will be read.  */
+    do {
+        len = read(s->rfd, buffer, sizeof(buffer));
+    } while ((len == -1 && errno == EINTR) || len == sizeof(buffer));
 
     posix_aio_process_queue(s);
 }
@@ -516,28 +667,7 @@ static void posix_aio_read(void *opaque)
 static int posix_aio_flush(void *opaque)
 {
     PosixAioState *s = opaque;
-    return !!s->first_aio;
-}
-
-static PosixAioState *posix_aio_state;
-
-static void paio_remove(struct qemu_paiocb *acb)
-{
-    struct qemu_paiocb **pacb;
-
-    /* remove the callback from the queue */
-    pacb = &posix_aio_state->first_aio;
-    for(;;) {
-        if (*pacb == NULL) {
-            fprintf(stderr, "paio_remove: aio request not found!\n");
-            break;
-        } else if (*pacb == acb) {
-            *pacb = acb->next;
-            qemu_aio_release(acb);
-            break;
-        }
-        pacb = &(*pacb)->next;
-    }
+    return s->requests > 0;
 }
 
 static void paio_cancel(BlockDriverAIOCB *blockacb)
@@ -550,7 +680,13 @@ static void paio_cancel(BlockDriverAIOCB *blockacb)
     mutex_lock(&lock);
     if (!acb->active) {
         QTAILQ_REMOVE(&request_list, acb, node);
-        acb->ret = -ECANCELED;
+        queued_requests--;
+        mutex_unlock(&lock);
+
+        /* never reached a worker thread, so it is not on the completed list */
+        posix_aio_state->requests--;
+        qemu_aio_release(acb);
+        return;
     } else if (acb->ret == -EINPROGRESS) {
         active = 1;
     }
@@ -563,7 +699,10 @@ static void paio_cancel(BlockDriverAIOCB *blockacb)
             ;
     }
 
-    paio_remove(acb);
+    /* completed, drop it without a callback when it shows up */
+    mutex_lock(&lock);
+    acb->ret = -ECANCELED;
+    mutex_unlock(&lock);
 }
 
 static AIOPool raw_aio_pool = {
@@ -582,17 +721,14 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
         return NULL;
     acb->aio_type = type;
     acb->aio_fildes = fd;
-    acb->ev_signo = SIGUSR2;
 
     if (qiov) {
         acb->aio_iov = qiov->iov;
         acb->aio_niov = qiov->niov;
     }
-    acb->aio_nbytes = nb_sectors * 512;
-    acb->aio_offset = sector_num * 512;
-
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
+    /* discards and zero writes may be larger than what fits an int */
+    acb->aio_nbytes = (size_t)nb_sectors * BDRV_SECTOR_SIZE;
+    acb->aio_offset = sector_num * BDRV_SECTOR_SIZE;
 
     trace_paio_submit(acb, opaque, sector_num, nb_sectors, type);
     qemu_paio_submit(acb);
@@ -610,44 +746,51 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
         return NULL;
     acb->aio_type = QEMU_AIO_IOCTL;
     acb->aio_fildes = fd;
-    acb->ev_signo = SIGUSR2;
     acb->aio_offset = 0;
     acb->aio_ioctl_buf = buf;
     acb->aio_ioctl_cmd = req;
 
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
-
     qemu_paio_submit(acb);
     return &acb->common;
 }
 
+void paio_set_threads(int threads, int timeout)
+{
+    mutex_lock(&lock);
+    if (threads > 0) {
+        max_threads = threads;
+    }
+    if (timeout > 0) {
+        idle_timeout = timeout;
+    }
+    mutex_unlock(&lock);
+}
+
 int paio_init(void)
 {
-    sigset_t mask;
     PosixAioState *s;
+    int fds[2];
     int ret;
 
     if (posix_aio_state)
         return 0;
 
-    s = g_malloc(sizeof(PosixAioState));
-
-    /* Make sure to block AIO signal */
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGUSR2);
-    sigprocmask(SIG_BLOCK, &mask, NULL);
-
-    s->first_aio = NULL;
-    s->fd = qemu_signalfd(&mask);
-    if (s->fd == -1) {
-        fprintf(stderr, "failed to create signalfd\n");
+    if (qemu_eventfd(fds) == -1) {
+        fprintf(stderr, "failed to create completion eventfd\n");
         return -1;
     }
 
-    fcntl(s->fd, F_SETFL, O_NONBLOCK);
+    fcntl_setfl(fds[0], O_NONBLOCK);
+    fcntl_setfl(fds[1], O_NONBLOCK);
+
+    s = g_malloc(sizeof(PosixAioState));
+    s->rfd = fds[0];
+    s->wfd = fds[1];
+    s->completed = NULL;
+    s->done = NULL;
+    s->requests = 0;
 
-    qemu_aio_set_fd_handler(s->fd, posix_aio_read, NULL, posix_aio_flush,
+    qemu_aio_set_fd_handler(s->rfd, posix_aio_read, NULL, posix_aio_flush,
         posix_aio_process_queue, s);
 
     ret = pthread_attr_init(&attr);
@@ -0,0 +1,316 @@
+/*
+ * Post-copy live migration, destination side RAM handling
+ *
+ * After the switch to post-copy the guest runs on the destination while
+ * part of its RAM is still on the source.  Missing pages are caught with
+ * userfaultfd: a fault thread requests them from the source over the
+ * migration socket and a listen thread places the pages that arrive on the
+ * migration stream, waking up whoever was waiting for them.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "cpu.h"
+#include "hw/hw.h"
+#include "migration.h"
+#include "qemu-thread.h"
+
+//#define DEBUG_POSTCOPY
+
+#ifdef DEBUG_POSTCOPY
+#define DPRINTF(fmt, ...) \
+    do { printf("postcopy: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+#ifdef CONFIG_USERFAULTFD
+
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+static int uffd = -1;
+static int return_fd = -1;
+/* written to by the listen thread to stop the fault thread */
+static int quit_fds[2] = { -1, -1 };
+static QemuThread fault_thread;
+static QemuThread listen_thread;
+static int listening;
+
+int postcopy_ram_supported(void)
+{
+    return TARGET_PAGE_SIZE == getpagesize();
+}
+
+/* Asks the source for the page containing host address addr */
+static int postcopy_request_page(uint64_t addr)
+{
+    RAMBlock *block;
+    uint8_t buf[1 + 256 + 8];
+    uint64_t offset;
+    int len, done, ret;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (addr >= (uintptr_t)block->host &&
+            addr < (uintptr_t)block->host + block->length) {
+            break;
+        }
+    }
+    if (!block) {
+        fprintf(stderr, "postcopy: fault at unknown address 0x%" PRIx64 "\n",
+                addr);
+        return -EINVAL;
+    }
+
+    /* idstr length, idstr, be64 offset in the block */
+    len = strlen(block->idstr);
+    buf[0] = len;
+    memcpy(buf + 1, block->idstr, len);
+    offset = cpu_to_be64((addr - (uintptr_t)block->host) & TARGET_PAGE_MASK);
+    memcpy(buf + 1 + len, &offset, 8);
+    len += 1 + 8;
+
+    for (done = 0; done < len; done += ret) {
+        ret = write(return_fd, buf + done, len - done);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                ret = 0;
+                continue;
+            }
+            return -errno;
+        }
+    }
+
+    return 0;
+}
+
+static void *postcopy_ram_fault_thread(void *opaque)
+{
+    struct uffd_msg msg;
+    struct pollfd pfd[2];
+    int ret;
+
+    pfd[0].fd = uffd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = quit_fds[0];
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        pfd[0].revents = pfd[1].revents = 0;
+        ret = poll(pfd, 2, -1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "postcopy: fault thread poll: %s\n",
+                    strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            DPRINTF("fault thread quitting\n");
+            break;
+        }
+
+        ret = read(uffd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            fprintf(stderr, "postcopy: short read on userfaultfd\n");
+            break;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        DPRINTF("fault at 0x%llx\n", (unsigned long long)
+                msg.arg.pagefault.address);
+        if (postcopy_request_page(msg.arg.pagefault.address) < 0) {
+            fprintf(stderr, "postcopy: failed to request page\n");
+            break;
+        }
+    }
+
+    close(uffd);
+    uffd = -1;
+    close(quit_fds[0]);
+    return NULL;
+}
+
+int postcopy_ram_incoming_init(int fd)
+{
+    struct uffdio_api api;
+    RAMBlock *block;
+
+    if (!postcopy_ram_supported()) {
+        fprintf(stderr, "postcopy: target and host page size differ\n");
+        return -ENOTSUP;
+    }
+    if (fd < 0) {
+        fprintf(stderr, "postcopy: migration channel has no return path\n");
+        return -ENOTSUP;
+    }
+
+    uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (uffd < 0) {
+        fprintf(stderr, "postcopy: userfaultfd: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    api.api = UFFD_API;
+    api.features = 0;
+    if (ioctl(uffd, UFFDIO_API, &api)) {
+        fprintf(stderr, "postcopy: UFFDIO_API: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        struct uffdio_register reg;
+
+        reg.range.start = (uintptr_t)block->host;
+        reg.range.len = block->length;
+        reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+        if (ioctl(uffd, UFFDIO_REGISTER, &reg)) {
+            fprintf(stderr, "postcopy: cannot register block %s: %s\n",
+                    block->idstr, strerror(errno));
+            goto fail;
+        }
+        if (!(reg.ioctls & (1ULL << _UFFDIO_COPY)) ||
+            !(reg.ioctls & (1ULL << _UFFDIO_ZEROPAGE))) {
+            fprintf(stderr, "postcopy: missing userfaultfd ioctls\n");
+            goto fail;
+        }
+    }
+
+    if (qemu_pipe(quit_fds) < 0) {
+        goto fail;
+    }
+
+    return_fd = fd;
+    qemu_thread_create(&fault_thread, postcopy_ram_fault_thread, NULL);
+
+    return 0;
+
+fail:
+    close(uffd);
+    uffd = -1;
+    return -EINVAL;
+}
+
+int postcopy_place_page(void *host, const void *from)
+{
+    struct uffdio_copy copy;
+
+    copy.dst = (uintptr_t)host;
+    copy.src = (uintptr_t)from;
+    copy.len = TARGET_PAGE_SIZE;
+    copy.mode = 0;
+
+    /* EEXIST: the page was both requested and pushed, the first one won */
+    if (ioctl(uffd, UFFDIO_COPY, &copy) && errno != EEXIST) {
+        return -errno;
+    }
+    return 0;
+}
+
+int postcopy_place_zero_page(void *host)
+{
+    struct uffdio_zeropage zero;
+
+    zero.range.start = (uintptr_t)host;
+    zero.range.len = TARGET_PAGE_SIZE;
+    zero.mode = 0;
+
+    if (ioctl(uffd, UFFDIO_ZEROPAGE, &zero) && errno != EEXIST) {
+        return -errno;
+    }
+    return 0;
+}
+
+static void *postcopy_ram_listen_thread(void *opaque)
+{
+    QEMUFile *f = opaque;
+    int ret;
+
+    ret = ram_postcopy_incoming_load(f);
+
+    /* all pages are in place, faults can no longer happen */
+    if (write(quit_fds[1], "", 1) != 1) {
+        fprintf(stderr, "postcopy: failed to stop fault thread\n");
+    }
+    close(quit_fds[1]);
+
+    if (ret < 0) {
+        /* part of guest RAM is lost with the source, there is no way out */
+        fprintf(stderr, "postcopy: load of migration failed\n");
+        exit(1);
+    }
+    DPRINTF("all pages received\n");
+
+    qemu_fclose(f);
+    close(return_fd);
+    return_fd = -1;
+    return NULL;
+}
+
+/*
+ * From here on the listen thread owns f and the return path, the caller
+ * must not touch either of them again.
+ */
+int postcopy_ram_incoming_listen(QEMUFile *f)
+{
+    if (uffd < 0) {
+        fprintf(stderr, "postcopy: no RAM was set up for post-copy\n");
+        return -EINVAL;
+    }
+
+    listening = 1;
+    qemu_thread_create(&listen_thread, postcopy_ram_listen_thread, f);
+    return 0;
+}
+
+int postcopy_ram_incoming_running(void)
+{
+    return listening;
+}
+
+#else
+
+int postcopy_ram_supported(void)
+{
+    return 0;
+}
+
+int postcopy_ram_incoming_init(int fd)
+{
+    fprintf(stderr, "postcopy: not supported on this host\n");
+    return -ENOTSUP;
+}
+
+int postcopy_place_page(void *host, const void *from)
+{
+    return -ENOTSUP;
+}
+
+int postcopy_place_zero_page(void *host)
+{
+    return -ENOTSUP;
+}
+
+int postcopy_ram_incoming_listen(QEMUFile *f)
+{
+    return -ENOTSUP;
+}
+
+int postcopy_ram_incoming_running(void)
+{
+    return 0;
+}
+
+#endif
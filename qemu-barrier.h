@@ -3,6 +3,8 @@
 
 /* FIXME: arch dependant, x86 version */
 #define smp_wmb()   asm volatile("" ::: "memory")
+#define smp_rmb()   asm volatile("" ::: "memory")
+#define smp_mb()    __sync_synchronize()
 
 /* Compiler barrier */
 #define barrier()   asm volatile("" ::: "memory")
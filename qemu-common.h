@@ -143,6 +143,7 @@ time_t mktimegm(struct tm *tm);
 int qemu_fls(int i);
 int qemu_fdatasync(int fd);
 int fcntl_setfl(int fd, int flag);
+int buffer_is_zero(const void *buf, size_t len);
 
 /*
  * strtosz() suffixes used to specify the default treatment of an
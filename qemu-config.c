@@ -88,6 +88,46 @@ static QemuOptsList qemu_drive_opts = {
             .name = "boot",
             .type = QEMU_OPT_BOOL,
             .help = "make this a boot drive",
+        },{
+            .name = "copy-on-read",
+            .type = QEMU_OPT_BOOL,
+            .help = "copy read data from backing file into image file",
+        },{
+            .name = "l2-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum L2 table cache size (qcow2)",
+        },{
+            .name = "l2-cache-coverage",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the disk area the L2 table cache covers (qcow2)",
+        },{
+            .name = "refcount-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum refcount block cache size (qcow2)",
+        },{
+            .name = "iops",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit total I/O operations per second",
+        },{
+            .name = "iops_rd",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit read operations per second",
+        },{
+            .name = "iops_wr",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit write operations per second",
+        },{
+            .name = "bps",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit total bytes per second",
+        },{
+            .name = "bps_rd",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit read bytes per second",
+        },{
+            .name = "bps_wr",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit write bytes per second",
         },
         { /* end of list */ }
     },
@@ -266,6 +306,23 @@ static QemuOptsList qemu_rtc_opts = {
     },
 };
 
+static QemuOptsList qemu_aio_threads_opts = {
+    .name = "aio-threads",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_aio_threads_opts.head),
+    .desc = {
+        {
+            .name = "max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "maximum number of AIO worker threads",
+        },{
+            .name = "idle-timeout",
+            .type = QEMU_OPT_NUMBER,
+            .help = "seconds an idle AIO worker thread waits before exiting",
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_global_opts = {
     .name = "global",
     .head = QTAILQ_HEAD_INITIALIZER(qemu_global_opts.head),
@@ -517,6 +574,7 @@ static QemuOptsList *vm_config_groups[32] = {
     &qemu_netdev_opts,
     &qemu_net_opts,
     &qemu_rtc_opts,
+    &qemu_aio_threads_opts,
     &qemu_global_opts,
     &qemu_mon_opts,
     &qemu_cpudef_opts,
@@ -76,6 +76,10 @@ static void help(void)
            "    name=value format. Use -o ? for an overview of the options supported by the\n"
            "    used format\n"
            "  '-c' indicates that target image must be compressed (qcow format only)\n"
+           "  '-m' is the number of requests convert keeps in flight (1 to 16, default 8)\n"
+           "  '-r' is the size of each convert request (default 2M)\n"
+           "  '-W' allows convert to write out of order, which is faster but may\n"
+           "       fragment the output image\n"
            "  '-u' enables unsafe rebasing. It is assumed that old and new backing file\n"
            "       match exactly. The image doesn't need a working backing file before\n"
            "       rebasing in this case (useful for renaming the backing file)\n"
@@ -531,40 +535,6 @@ static int img_commit(int argc, char **argv)
     return 0;
 }
 
-/*
- * Checks whether the sector is not a zero sector.
- *
- * Attention! The len must be a multiple of 4 * sizeof(long) due to
- * restriction of optimizations in this function.
- */
-static int is_not_zero(const uint8_t *sector, int len)
-{
-    /*
-     * Use long as the biggest available internal data type that fits into the
-     * CPU register and unroll the loop to smooth out the effect of memory
-     * latency.
-     */
-
-    int i;
-    long d0, d1, d2, d3;
-    const long * const data = (const long *) sector;
-
-    len /= sizeof(long);
-
-    for(i = 0; i < len; i += 4) {
-        d0 = data[i + 0];
-        d1 = data[i + 1];
-        d2 = data[i + 2];
-        d3 = data[i + 3];
-
-        if (d0 || d1 || d2 || d3) {
-            return 1;
-        }
-    }
-
-    return 0;
-}
-
 /*
  * Returns true iff the first sector pointed to by 'buf' contains at least
  * a non-NUL byte.
@@ -580,10 +550,10 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
         *pnum = 0;
         return 0;
     }
-    v = is_not_zero(buf, 512);
+    v = !buffer_is_zero(buf, 512);
     for(i = 1; i < n; i++) {
         buf += 512;
-        if (v != is_not_zero(buf, 512))
+        if (v != !buffer_is_zero(buf, 512))
             break;
     }
     *pnum = i;
@@ -623,23 +593,359 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+#define CONVERT_DEFAULT_REQUESTS 8
+#define CONVERT_MAX_REQUESTS     16
+#define CONVERT_MAX_BUF_SIZE     (32 * 1024 * 1024)
+
+typedef enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_ZERO,
+    BLK_BACKING_FILE,
+} ImgConvertBlockStatus;
+
+/*
+ * img_convert() runs num_requests coroutines that each take the next chunk
+ * of the input, read it and write it out.  Reads always overlap; writes
+ * are issued in the order of the chunks unless wr_in_order is false.
+ */
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    bool *src_has_backing;
+    int src_num;
+    int64_t total_sectors;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool target_has_backing;
+    bool compressed;
+    bool wr_in_order;
+    int cluster_sectors;
+    int buf_sectors;
+    int num_requests;
+
+    CoMutex lock;               /* protects sector_num and the src cursor */
+    int64_t sector_num;         /* next sector to hand out */
+    int src_cur;
+    int64_t src_cur_offset;
+    int64_t wr_offs;            /* everything before is written */
+    Coroutine *co[CONVERT_MAX_REQUESTS];
+    int64_t wait_sector_num[CONVERT_MAX_REQUESTS];
+    int running;
+    int ret;
+} ImgConvertState;
+
+/*
+ * Returns the length of the next chunk starting at sector_num and what has
+ * to be done with it.  A chunk stays within one source image, except for
+ * compressed output which needs whole clusters.
+ */
+static int coroutine_fn convert_iteration_sectors(ImgConvertState *s,
+    int64_t sector_num, ImgConvertBlockStatus *status)
+{
+    int64_t src_sector;
+    int n, pnum, ret;
+
+    while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
+        s->src_cur_offset += s->src_sectors[s->src_cur];
+        s->src_cur++;
+        assert(s->src_cur < s->src_num);
+    }
+    src_sector = sector_num - s->src_cur_offset;
+
+    n = MIN(s->total_sectors - sector_num, s->buf_sectors);
+    *status = BLK_DATA;
+
+    if (src_sector + n > s->src_sectors[s->src_cur]) {
+        if (s->compressed) {
+            return n;
+        }
+        n = s->src_sectors[s->src_cur] - src_sector;
+    }
+
+    /* Unallocated sectors that read from the source's backing file */
+    if (!s->target_has_backing && s->src_has_backing[s->src_cur]) {
+        return n;
+    }
+
+    ret = bdrv_co_is_allocated(s->src[s->src_cur], src_sector, n, &pnum);
+    if (ret < 0) {
+        return ret;
+    }
+    if (pnum <= 0 || pnum > n) {
+        pnum = n;
+    }
+
+    if (ret) {
+        if (!s->compressed) {
+            n = pnum;
+        }
+    } else if (pnum == n || !s->compressed) {
+        /*
+         * With a backing file for the output, unallocated sectors are
+         * assumed to be present in both base images.  Otherwise they read
+         * as zeroes.
+         */
+        n = pnum;
+        *status = s->target_has_backing ? BLK_BACKING_FILE : BLK_ZERO;
+    }
+
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s,
+    int64_t sector_num, int nb_sectors, uint8_t *buf)
+{
+    int64_t src_offset = 0;
+    int src_cur = 0;
+    int ret;
+
+    while (nb_sectors > 0) {
+        QEMUIOVector qiov;
+        struct iovec iov;
+        int n;
+
+        while (sector_num - src_offset >= s->src_sectors[src_cur]) {
+            src_offset += s->src_sectors[src_cur];
+            src_cur++;
+            assert(src_cur < s->src_num);
+        }
+
+        n = MIN(nb_sectors,
+                s->src_sectors[src_cur] - (sector_num - src_offset));
+        iov.iov_base = buf;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->src[src_cur], sector_num - src_offset, n,
+                            &qiov);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+    int64_t sector_num, int nb_sectors, uint8_t *buf,
+    ImgConvertBlockStatus status)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret, n;
+
+    if (status == BLK_BACKING_FILE) {
+        return 0;
+    }
+
+    if (status == BLK_ZERO) {
+        if (s->has_zero_init) {
+            return 0;
+        }
+        return bdrv_co_write_zeroes(s->target, sector_num, nb_sectors);
+    }
+
+    if (s->compressed) {
+        int cluster_size = s->cluster_sectors * BDRV_SECTOR_SIZE;
+
+        /* The last cluster may be partial, pad it with zeroes */
+        if (nb_sectors < s->cluster_sectors) {
+            memset(buf + nb_sectors * BDRV_SECTOR_SIZE, 0,
+                   cluster_size - nb_sectors * BDRV_SECTOR_SIZE);
+        }
+        if (buffer_is_zero(buf, cluster_size)) {
+            return 0;
+        }
+        return bdrv_write_compressed(s->target, sector_num, buf,
+                                     s->cluster_sectors);
+    }
+
+    while (nb_sectors > 0) {
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, sectors that are entirely 0
+           are zeroed explicitly, since whatever data was already there is
+           garbage, not 0s.  The output driver can usually do this without
+           writing out the zeroes. */
+        n = nb_sectors;
+        if (s->target_has_backing || is_allocated_sectors(buf, nb_sectors, &n)) {
+            iov.iov_base = buf;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+            if (ret < 0) {
+                return ret;
+            }
+        } else if (!s->has_zero_init) {
+            ret = bdrv_co_write_zeroes(s->target, sector_num, n);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+/* Enters the coroutines waiting for wr_offs, or all of them after an error */
+static void convert_wake_waiters(ImgConvertState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_requests; i++) {
+        if (s->co[i] && s->wait_sector_num[i] >= 0 &&
+            (s->ret != -EINPROGRESS || s->wait_sector_num[i] == s->wr_offs)) {
+            /*
+             * A waiter has wait_sector_num set only while it is yielded, so
+             * it cannot be somewhere up our own call chain.
+             */
+            qemu_coroutine_enter(s->co[i], NULL);
+        }
+    }
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int i, index = -1;
+
+    for (i = 0; i < s->num_requests; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running++;
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (s->ret == -EINPROGRESS) {
+        ImgConvertBlockStatus status;
+        int64_t sector_num;
+        int n, ret;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        sector_num = s->sector_num;
+        n = convert_iteration_sectors(s, sector_num, &status);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", sector_num, strerror(-n));
+            s->ret = n;
+            break;
+        }
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64 ": %s",
+                             sector_num, strerror(-ret));
+                s->ret = ret;
+                break;
+            }
+        }
+
+        if (s->wr_in_order) {
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+            if (s->ret != -EINPROGRESS) {
+                break;
+            }
+        }
+
+        ret = convert_co_write(s, sector_num, n, buf, status);
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64 ": %s",
+                         sector_num, strerror(-ret));
+            s->ret = ret;
+            break;
+        }
+
+        qemu_progress_print(100.0f * n / s->total_sectors, 100);
+
+        if (s->wr_in_order) {
+            s->wr_offs = sector_num + n;
+            convert_wake_waiters(s);
+        }
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running--;
+
+    if (s->ret != -EINPROGRESS) {
+        convert_wake_waiters(s);
+    } else if (s->running == 0) {
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int i;
+
+    qemu_co_mutex_init(&s->lock);
+    s->ret = -EINPROGRESS;
+    for (i = 0; i < s->num_requests; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+    }
+
+    for (i = 0; i < s->num_requests; i++) {
+        if (s->co[i]) {
+            qemu_coroutine_enter(s->co[i], s);
+        }
+    }
+
+    while (s->running > 0) {
+        qemu_aio_wait();
+    }
+
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, bs_n, bs_i, compress, cluster_size, cluster_sectors;
     int progress = 0, flags;
+    int num_requests = CONVERT_DEFAULT_REQUESTS;
+    int buf_sectors = IO_BUF_SIZE / 512;
+    bool wr_in_order = true;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
+    int64_t total_sectors = 0, *src_sectors = NULL;
+    int64_t start_time, copy_time = 0, sval;
     uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
+    bool *src_has_backing = NULL;
+    char *end;
     BlockDriverInfo bdi;
+    ImgConvertState state;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
     char *options = NULL;
     const char *snapshot_name = NULL;
-    float local_progress;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -647,7 +953,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pt:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pt:m:r:W");
         if (c == -1) {
             break;
         }
@@ -688,9 +994,39 @@ static int img_convert(int argc, char **argv)
         case 't':
             cache = optarg;
             break;
+        case 'm':
+            num_requests = strtol(optarg, &end, 10);
+            if (*end || num_requests < 1 ||
+                num_requests > CONVERT_MAX_REQUESTS) {
+                error_report("Invalid number of parallel requests '%s', "
+                             "must be between 1 and %d", optarg,
+                             CONVERT_MAX_REQUESTS);
+                return 1;
+            }
+            break;
+        case 'r':
+            sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval < 512 || *end || sval > CONVERT_MAX_BUF_SIZE ||
+                sval % 512) {
+                error_report("Invalid request size '%s', must be a multiple "
+                             "of 512 bytes up to %dM", optarg,
+                             CONVERT_MAX_BUF_SIZE >> 20);
+                return 1;
+            }
+            buf_sectors = sval / 512;
+            break;
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
+    if (compress && !wr_in_order) {
+        error_report("Out-of-order writes and compression are mutually "
+                     "exclusive");
+        return 1;
+    }
+
     bs_n = argc - optind - 1;
     if (bs_n < 1) {
         help();
@@ -831,11 +1167,7 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = g_malloc(IO_BUF_SIZE);
-
+    cluster_sectors = 0;
     if (compress) {
         ret = bdrv_get_info(out_bs, &bdi);
         if (ret < 0) {
@@ -849,164 +1181,59 @@ static int img_convert(int argc, char **argv)
             goto out;
         }
         cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-
-        nb_sectors = total_sectors;
-        local_progress = (float)100 /
-            (nb_sectors / MIN(nb_sectors, cluster_sectors));
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
+        buf_sectors = cluster_sectors;
+    }
 
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading");
-                    goto out;
-                }
+    src_sectors = g_malloc(bs_n * sizeof(int64_t));
+    src_has_backing = g_malloc(bs_n * sizeof(bool));
+    for (bs_i = 0; bs_i < bs_n; bs_i++) {
+        char backing_filename[1024];
 
-                buf2 += nlow * 512;
-                bs_num += nlow;
+        bdrv_get_geometry(bs[bs_i], &bs_sectors);
+        src_sectors[bs_i] = bs_sectors;
+        bdrv_get_backing_filename(bs[bs_i], backing_filename,
+                                  sizeof(backing_filename));
+        src_has_backing[bs_i] = backing_filename[0] != '\0';
+    }
+
+    state = (ImgConvertState) {
+        .src                = bs,
+        .src_sectors        = src_sectors,
+        .src_has_backing    = src_has_backing,
+        .src_num            = bs_n,
+        .total_sectors      = total_sectors,
+        .target             = out_bs,
+        .has_zero_init      = bdrv_has_zero_init(out_bs),
+        .target_has_backing = !!out_baseimg,
+        .compressed         = compress,
+        .wr_in_order        = wr_in_order,
+        .cluster_sectors    = cluster_sectors,
+        .buf_sectors        = buf_sectors,
+        .num_requests       = num_requests,
+    };
 
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
+    start_time = get_clock();
+    ret = convert_do_copy(&state);
+    if (ret < 0) {
+        goto out;
+    }
+    copy_time = get_clock() - start_time;
 
-            if (n < cluster_sectors) {
-                memset(buf + n * 512, 0, cluster_size - n * 512);
-            }
-            if (is_not_zero(buf, cluster_size)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf,
-                                            cluster_sectors);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64,
-                          sector_num);
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(local_progress, 100);
-        }
+    if (compress) {
         /* signal EOF to align */
         bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        local_progress = (float)100 /
-            (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
-
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading");
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors(buf1, n, &n1)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing");
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
     }
 out:
     qemu_progress_end();
+    if (progress && copy_time > 0) {
+        printf("Converted %" PRId64 " MB in %.1f s (%.1f MB/s)\n",
+               (total_sectors * 512) >> 20, copy_time / 1e9,
+               total_sectors * 512.0 / (1 << 20) / (copy_time / 1e9));
+    }
     free_option_parameters(create_options);
     free_option_parameters(param);
-    g_free(buf);
+    g_free(src_sectors);
+    g_free(src_has_backing);
     if (out_bs) {
         bdrv_delete(out_bs);
     }
@@ -135,7 +135,9 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
-    "       [,readonly=on|off][,boot=on|off]\n"
+    "       [,readonly=on|off][,boot=on|off][,copy-on-read=on|off]\n"
+    "       [,l2-cache-size=size|l2-cache-coverage=size][,refcount-cache-size=size]\n"
+    "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -185,6 +187,22 @@ The default setting is @option{werror=enospc} and @option{rerror=report}.
 Open drive @option{file} as read-only. Guest write attempts will fail.
 @item boot=@var{boot}
 @var{boot} is "on" or "off" and allows for booting from non-traditional interfaces, such as virtio.
+@item copy-on-read=@var{copy-on-read}
+@var{copy-on-read} is "on" or "off" and enables whether to copy read backing
+file sectors into the image file.  Data that is read once from a slow or
+shared backing file is then served from the image file.
+@item l2-cache-size=@var{size},refcount-cache-size=@var{size}
+Maximum size of the qcow2 L2 table and refcount block caches, with an optional
+k, M or G suffix.  Each cached table takes one cluster.
+@item l2-cache-coverage=@var{size}
+Size the qcow2 L2 table cache so that it maps @var{size} bytes of the virtual
+disk, e.g. 8G.  Cannot be combined with @option{l2-cache-size}.
+@item bps=@var{b},bps_rd=@var{r},bps_wr=@var{w}
+Limit the throughput of the drive to @var{b} bytes per second in total, or to
+@var{r} and @var{w} bytes per second for reads and writes.  Requests above the
+limit are delayed.  @option{bps} cannot be combined with the other two.
+@item iops=@var{i},iops_rd=@var{r},iops_wr=@var{w}
+The same for the number of requests per second.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -258,6 +276,19 @@ qemu -hda a -hdb b
 @end example
 ETEXI
 
+DEF("aio-threads", HAS_ARG, QEMU_OPTION_aio_threads,
+    "-aio-threads [max=n][,idle-timeout=secs]\n"
+    "                size of the thread pool used for aio=threads drives\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -aio-threads [max=@var{n}][,idle-timeout=@var{secs}]
+@findex -aio-threads
+Configure the thread pool that runs the requests of drives using
+@option{aio=threads}.  Threads are started as requests queue up, up to
+@var{n} of them (64 by default), and exit after being idle for @var{secs}
+seconds (10 by default).
+ETEXI
+
 DEF("set", HAS_ARG, QEMU_OPTION_set,
     "-set group.id.arg=value\n"
     "                set <arg> parameter for item <id> of type <group>\n"
@@ -1147,7 +1178,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net tap[,vlan=n][,name=str],ifname=name\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
 #else
-    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off]\n"
+    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off][,queues=n]\n"
     "                connect the host TAP network interface to VLAN 'n' and use the\n"
     "                network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1161,6 +1192,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                    (only has effect for virtio guests which use MSIX)\n"
     "                use vhostforce=on to force vhost on for non-MSIX virtio guests\n"
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
+    "                use 'queues=n' to open n queues of a multiqueue TAP interface (-netdev only)\n"
 #endif
     "-net socket[,vlan=n][,name=str][,fd=h][,listen=[host]:port][,connect=host:port]\n"
     "                connect the vlan 'n' to another VLAN using a socket connection\n"
@@ -1340,6 +1372,16 @@ qemu linux.img -net nic,vlan=0 -net tap,vlan=0,ifname=tap0 \
                -net nic,vlan=1 -net tap,vlan=1,ifname=tap1
 @end example
 
+With @option{-netdev}, @option{queues}=@var{n} opens @var{n} queues of
+a multiqueue TAP interface, each with its own vhost-net instance when
+@option{vhost=on}.  A virtio-net device connected to it gets one receive
+and one transmit virtqueue per TAP queue; give it @var{2n+2} MSI-X
+vectors so every queue gets its own interrupt:
+@example
+qemu linux.img -netdev tap,id=hn0,queues=4,vhost=on \
+               -device virtio-net-pci,netdev=hn0,vectors=10
+@end example
+
 @item -net socket[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}] [,listen=[@var{host}]:@var{port}][,connect=@var{host}:@var{port}]
 
 Connect the VLAN @var{n} to a remote VLAN in another QEMU virtual
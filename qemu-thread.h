@@ -37,5 +37,8 @@ void qemu_thread_create(QemuThread *thread,
 void qemu_thread_get_self(QemuThread *thread);
 int qemu_thread_is_self(QemuThread *thread);
 void qemu_thread_exit(void *retval);
+#ifndef _WIN32
+void *qemu_thread_join(QemuThread *thread);
+#endif
 
 #endif
@@ -458,13 +458,22 @@ EQMP
 
     {
         .name       = "migrate",
-        .args_type  = "detach:-d,blk:-b,inc:-i,uri:s",
-        .params     = "[-d] [-b] [-i] uri",
+        .args_type  = "detach:-d,blk:-b,inc:-i,xbzrle:-x,compress:-c,postcopy:-p,auto-converge:-a,zero-skip:-z,uri:s",
+        .params     = "[-d] [-b] [-i] [-x] [-c] [-p] [-a] [-z] uri",
         .help       = "migrate to URI (using -d to not wait for completion)"
 		      "\n\t\t\t -b for migration without shared storage with"
 		      " full copy of disk\n\t\t\t -i for migration without "
 		      "shared storage with incremental copy of disk "
-		      "(base image shared between src and destination)",
+		      "(base image shared between src and destination)"
+		      "\n\t\t\t -x to delta-encode (XBZRLE) pages that are"
+		      " sent again"
+		      "\n\t\t\t -c to compress pages with multiple threads"
+		      "\n\t\t\t -p to switch to the destination after a"
+		      " bounded precopy and send the rest on demand"
+		      "\n\t\t\t -a to throttle the guest CPUs if it dirties"
+		      " memory too fast for the migration to converge"
+		      "\n\t\t\t -z to skip zero pages and disk blocks in"
+		      " the first pass (destination must support it)",
         .user_print = monitor_user_noop,	
 	.mhandler.cmd_new = do_migrate,
     },
@@ -479,6 +488,15 @@ Arguments:
 
 - "blk": block migration, full disk copy (json-bool, optional)
 - "inc": incremental disk copy (json-bool, optional)
+- "xbzrle": XBZRLE delta encoding of resent pages (json-bool, optional)
+- "compress": multi-threaded compression of pages (json-bool, optional)
+- "postcopy": resume the guest on the destination after a bounded precopy
+  phase and fetch the remaining pages on demand (json-bool, optional)
+- "auto-converge": throttle the guest CPUs while the guest dirties memory
+  faster than it can be sent (json-bool, optional)
+- "zero-skip": skip zero pages in the first pass over RAM and send zero disk
+  blocks without data; needs a destination that supports it
+  (json-bool, optional)
 - "uri": Destination URI (json-string)
 
 Example:
@@ -493,6 +511,10 @@ Notes:
 (2) All boolean arguments default to false
 (3) The user Monitor's "detach" argument is invalid in QMP and should not
     be used
+(4) "postcopy" needs a tcp: or unix: URI and a destination host with
+    userfaultfd support.  Once the guest runs on the destination a failure
+    of either side loses the guest, and the speed limit set with
+    migrate_set_speed no longer applies.
 
 EQMP
 
@@ -570,6 +592,94 @@ Example:
 -> { "execute": "migrate_set_downtime", "arguments": { "value": 0.1 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate_set_cache_size",
+        .args_type  = "value:o",
+        .params     = "value",
+        .help       = "set cache size (in bytes) for XBZRLE migrations",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_cache_size,
+    },
+
+SQMP
+migrate_set_cache_size
+----------------------
+
+Set cache size to be used by XBZRLE migration, the cache size will be rounded
+down to the nearest power of 2.  Takes effect immediately on a running
+migration.
+
+Arguments:
+
+- "value": cache size in bytes (json-int)
+
+Example:
+
+-> { "execute": "migrate_set_cache_size", "arguments": { "value": 536870912 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate_set_compress_params",
+        .args_type  = "level:i?,threads:i?,dthreads:i?",
+        .params     = "[level] [threads] [dthreads]",
+        .help       = "set compression parameters for compressed migrations",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_compress_params,
+    },
+
+SQMP
+migrate_set_compress_params
+---------------------------
+
+Set the parameters used by migrations with "compress" enabled.  Takes effect
+with the next migration; the destination reads "dthreads" when the first
+compressed page arrives.
+
+Arguments:
+
+- "level": zlib compression level, 0-9, default 1 (json-int, optional)
+- "threads": number of compression threads, 1-64, default 8 (json-int, optional)
+- "dthreads": number of decompression threads, 1-64, default 2
+              (json-int, optional)
+
+Example:
+
+-> { "execute": "migrate_set_compress_params",
+     "arguments": { "level": 6, "threads": 4 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate_set_channels",
+        .args_type  = "channels:i",
+        .params     = "channels",
+        .help       = "set the number of RAM data channels for tcp migrations",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_channels,
+    },
+
+SQMP
+migrate_set_channels
+--------------------
+
+Set the number of extra tcp connections that full RAM pages are striped over
+during tcp migrations.  Takes effect with the next migration; cannot be
+combined with "postcopy" or "compress".
+
+Arguments:
+
+- "channels": number of data channels, 0-16, 0 disables them (json-int)
+
+Example:
+
+-> { "execute": "migrate_set_channels", "arguments": { "channels": 4 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -691,6 +801,196 @@ Example:
 -> { "execute": "block_resize", "arguments": { "device": "scratch", "size": 1073741824 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_set_io_throttle,
+    },
+
+SQMP
+block_set_io_throttle
+---------------------
+
+Change I/O throttle limits for a block drive.  Requests that exceed the
+limits are delayed, a value of 0 disables the respective limit.
+
+Arguments:
+
+- "device": device name (json-string)
+- "bps":  total throughput limit in bytes per second (json-int)
+- "bps_rd":  read throughput limit in bytes per second (json-int)
+- "bps_wr":  write throughput limit in bytes per second (json-int)
+- "iops":  total I/O operations per second (json-int)
+- "iops_rd":  read I/O operations per second (json-int)
+- "iops_wr":  write I/O operations per second (json-int)
+
+"bps" cannot be combined with "bps_rd" or "bps_wr", and "iops" cannot be
+combined with "iops_rd" or "iops_wr".
+
+Example:
+
+-> { "execute": "block_set_io_throttle", "arguments": { "device": "virtio0",
+                                               "bps": 1000000,
+                                               "bps_rd": 0,
+                                               "bps_wr": 0,
+                                               "iops": 0,
+                                               "iops_rd": 0,
+                                               "iops_wr": 0 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_stream",
+        .args_type  = "device:B,speed:o?",
+        .params     = "device [speed]",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream,
+    },
+
+SQMP
+block_stream
+------------
+
+Copy data from a backing file into a block device.  The copy runs in the
+background while the guest keeps using the device; unallocated ranges of
+the image are read from the backing file and written to the image.  Once
+every range is allocated the backing file is dropped from the image.
+
+Progress can be followed with query-block-jobs.  When the operation ends a
+BLOCK_JOB_COMPLETED event is emitted.
+
+Arguments:
+
+- "device": device name (json-string)
+- "speed":  maximum speed in bytes per second, 0 means unlimited
+            (json-int, optional)
+
+Errors:
+
+- If the device does not exist, DeviceNotFound
+- If the device has no backing file, InvalidParameterValue
+- If another operation is active on the device, DeviceInUse
+
+Example:
+
+-> { "execute": "block_stream", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "drive-mirror",
+        .args_type  = "device:B,target:s,format:s?,speed:o?",
+        .params     = "device target [format] [speed]",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_drive_mirror,
+    },
+
+SQMP
+drive-mirror
+------------
+
+Copy a running block device to a new image and switch the device over to
+it, without stopping the guest.  The whole device is copied once, then the
+ranges the guest wrote in the meantime are copied again until the two
+images are in sync.  At that point the device is reopened on the new image
+and a BLOCK_JOB_COMPLETED event is emitted.  The new image does not use the
+backing file of the original one.
+
+The operation can be followed with query-block-jobs and stopped with
+block_job_cancel, in which case the device keeps using the original image.
+
+Arguments:
+
+- "device": device name (json-string)
+- "target": name of the new image file, it is created (json-string)
+- "format": format of the new image, defaults to the format of the
+            current image (json-string, optional)
+- "speed":  maximum speed in bytes per second, 0 means unlimited
+            (json-int, optional)
+
+Errors:
+
+- If the device does not exist, DeviceNotFound
+- If another operation is active on the device, DeviceInUse
+- If the format is unknown, InvalidBlockFormat
+- If the new image cannot be opened, OpenFileFailed
+
+Example:
+
+-> { "execute": "drive-mirror", "arguments": { "device": "virtio0",
+                                               "target": "/array2/disk.qcow2" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_job_set_speed",
+        .args_type  = "device:B,value:o",
+        .params     = "device value",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_set_speed,
+    },
+
+SQMP
+block_job_set_speed
+-------------------
+
+Set maximum speed for a background block operation.  This command can only
+be issued when there is an active block job.
+
+Arguments:
+
+- "device": device name (json-string)
+- "value":  maximum speed in bytes per second, 0 means unlimited (json-int)
+
+Errors:
+
+- If no background operation is active on the device, BlockJobNotActive
+- If the operation does not support a speed limit, Unsupported
+
+Example:
+
+-> { "execute": "block_job_set_speed",
+     "arguments": { "device": "virtio0", "value": 1048576 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_job_cancel",
+        .args_type  = "device:B",
+        .params     = "device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_cancel,
+    },
+
+SQMP
+block_job_cancel
+----------------
+
+Stop an active background block operation.  Cancellation is asynchronous,
+the operation stops at the next chunk boundary and a BLOCK_JOB_CANCELLED
+event is emitted.  The data copied so far stays in the image.
+
+Arguments:
+
+- "device": device name (json-string)
+
+Errors:
+
+- If no background operation is active on the device, BlockJobNotActive
+
+Example:
+
+-> { "execute": "block_job_cancel", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1143,6 +1443,12 @@ Each json-object contain the following:
                                 "tftp", "vdi", "vmdk", "vpc", "vvfat"
          - "backing_file": backing file name (json-string, optional)
          - "encrypted": true if encrypted, false otherwise (json-bool)
+         - "bps": total throughput limit in bytes per second (json-int)
+         - "bps_rd": read throughput limit in bytes per second (json-int)
+         - "bps_wr": write throughput limit in bytes per second (json-int)
+         - "iops": total I/O operations per second (json-int)
+         - "iops_rd": read I/O operations per second (json-int)
+         - "iops_wr": write I/O operations per second (json-int)
 
 Example:
 
@@ -1157,7 +1463,13 @@ Example:
                "ro":false,
                "drv":"qcow2",
                "encrypted":false,
-               "file":"disks/test.img"
+               "file":"disks/test.img",
+               "bps":1000000,
+               "bps_rd":0,
+               "bps_wr":0,
+               "iops":0,
+               "iops_rd":0,
+               "iops_wr":0
             },
             "type":"unknown"
          },
@@ -1203,6 +1515,16 @@ Each json-object contain the following:
     - "wr_operations": write operations (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "rd_throttled_operations": read operations that were delayed by I/O
+                                 throttling (json-int)
+    - "wr_throttled_operations": write operations that were delayed by I/O
+                                 throttling (json-int)
+    - "l2_cache_hits": L2 table cache hits, only for formats with
+                       a metadata cache such as qcow2 (json-int, optional)
+    - "l2_cache_misses": L2 table cache misses (json-int, optional)
+    - "refcount_cache_hits": refcount block cache hits (json-int, optional)
+    - "refcount_cache_misses": refcount block cache misses
+                               (json-int, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -1267,6 +1589,64 @@ Example:
 
 EQMP
 
+SQMP
+query-block-jobs
+----------------
+
+Show progress of ongoing block device operations.
+
+Return a json-array of all operations.  Each one is represented by a
+json-object with the following keys:
+
+- "type": job type, "stream" or "mirror" (json-string)
+- "device": device name (json-string)
+- "len": amount of work in bytes (json-int)
+- "offset": amount of work completed in bytes (json-int)
+- "speed": speed limit in bytes per second, 0 means unlimited (json-int)
+
+For "mirror", "offset" can go down again when the guest writes to ranges
+that were already copied.
+
+Example:
+
+-> { "execute": "query-block-jobs" }
+<- { "return": [ { "type": "stream", "device": "virtio0",
+                   "len": 10737418240, "offset": 709632,
+                   "speed": 0 } ] }
+
+EQMP
+
+SQMP
+query-nic-tx-stats
+------------------
+
+Show transmit statistics of the network cards that keep them.
+
+Return a json-array.  Each network card is represented by a json-object
+with the following keys:
+
+- "name": network card name (json-string)
+- "tx": transmit mode, "bh", "timer" or "adaptive" (json-string)
+- "kicks": number of guest notifications on the transmit queues (json-int)
+- "batches": number of flushes of the transmit queues that sent at least
+             one packet (json-int)
+- "packets": number of packets sent (json-int)
+- "average-batch": packets divided by batches (json-int)
+- "timer-queues": number of transmit queues that currently coalesce
+                  notifications with a timer (json-int)
+
+Only virtio-net cards keep these statistics.  With "tx": "adaptive", each
+queue switches between the "bh" and "timer" behaviours at runtime.
+
+Example:
+
+-> { "execute": "query-nic-tx-stats" }
+<- { "return": [ { "name": "net0", "tx": "adaptive", "kicks": 10334,
+                   "batches": 9871, "packets": 152043,
+                   "average-batch": 15, "timer-queues": 1 } ] }
+
+EQMP
+
 SQMP
 query-cpus
 ----------
@@ -1768,16 +2148,44 @@ The main json-object contains the following:
 
 - "status": migration status (json-string)
      - Possible values: "active", "completed", "failed", "cancelled"
-- "ram": only present if "status" is "active", it is a json-object with the
-  following RAM information (in bytes):
-         - "transferred": amount transferred (json-int)
-         - "remaining": amount remaining (json-int)
-         - "total": total (json-int)
+- "total-time": only present if "status" is "active" or "completed", time
+  in milliseconds since the migration started, or that it took (json-int)
+- "expected-downtime": only present if "status" is "active", time in
+  milliseconds the rest of RAM would take at the current bandwidth
+  (json-int)
+- "downtime": only present if "status" is "completed", time in milliseconds
+  the guest was stopped at the end of the migration (json-int)
+- "ram": only present if "status" is "active" or "completed", it is a
+  json-object with the following RAM information:
+         - "transferred": amount transferred, in bytes (json-int)
+         - "remaining": amount remaining, in bytes (json-int)
+         - "total": total, in bytes (json-int)
+         - "duplicate": number of pages sent as a single byte (json-int)
+         - "skipped": number of zero pages not sent (json-int)
+         - "normal": number of full pages sent (json-int)
+         - "normal-bytes": size of the full pages sent, in bytes (json-int)
+         - "dirty-pages-rate": pages dirtied per second during the last
+                               iteration (json-int)
+         - "dirty-sync-count": number of iterations, each of which syncs the
+                               dirty bitmap (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information (in bytes):
          - "transferred": amount transferred (json-int)
          - "remaining": amount remaining (json-int)
          - "total": total (json-int)
+- "xbzrle-cache": only present if "status" is "active" and XBZRLE is enabled,
+  it is a json-object with the following XBZRLE information:
+         - "cache-size": XBZRLE cache size in bytes (json-int)
+         - "bytes": number of bytes sent XBZRLE encoded (json-int)
+         - "pages": number of pages sent XBZRLE encoded (json-int)
+         - "cache-hit": number of dirty pages found in the cache (json-int)
+         - "cache-miss": number of dirty pages not in the cache (json-int)
+         - "overflow": number of pages whose encoding was larger than the
+                       page itself, sent uncompressed (json-int)
+         - "bytes-saved": bytes not sent thanks to XBZRLE (json-int)
+- "cpu-throttle-percentage": only present if "status" is "active" and
+  auto-converge is enabled, percentage of time the guest CPUs are kept
+  from running (json-int)
 
 Examples:
 
@@ -1789,7 +2197,24 @@ Examples:
 2. Migration is done and has succeeded
 
 -> { "execute": "query-migrate" }
-<- { "return": { "status": "completed" } }
+<- {
+      "return":{
+         "status":"completed",
+         "total-time":12345,
+         "downtime":12,
+         "ram":{
+            "transferred":123,
+            "remaining":0,
+            "total":246,
+            "duplicate":123,
+            "skipped":0,
+            "normal":123,
+            "normal-bytes":123456,
+            "dirty-pages-rate":0,
+            "dirty-sync-count":15
+         }
+      }
+   }
 
 3. Migration is done and has failed
 
@@ -1802,10 +2227,18 @@ Examples:
 <- {
       "return":{
          "status":"active",
+         "total-time":12345,
+         "expected-downtime":12345,
          "ram":{
             "transferred":123,
             "remaining":123,
-            "total":246
+            "total":246,
+            "duplicate":123,
+            "skipped":0,
+            "normal":123,
+            "normal-bytes":123456,
+            "dirty-pages-rate":1100,
+            "dirty-sync-count":3
          }
       }
    }
@@ -1829,6 +2262,29 @@ Examples:
       }
    }
 
+6. Migration is being performed and XBZRLE is active:
+
+-> { "execute": "query-migrate" }
+<- {
+      "return":{
+         "status":"active",
+         "ram":{
+            "total":1057024,
+            "remaining":1053304,
+            "transferred":3720
+         },
+         "xbzrle-cache":{
+            "cache-size":67108864,
+            "bytes":20971520,
+            "pages":2444343,
+            "cache-hit":2450000,
+            "cache-miss":2244,
+            "overflow":34434,
+            "bytes-saved":9990000000
+         }
+      }
+   }
+
 EQMP
 
 SQMP
@@ -0,0 +1,557 @@
+/*
+ * Multi-channel RAM migration
+ *
+ * Full RAM pages can be striped over extra TCP connections, the data
+ * channels, that run next to the main migration stream.  On the source a
+ * sender thread per channel writes out the pages the migration thread
+ * queued for it; on the destination a receiver thread per channel stores
+ * them straight into guest RAM.  Pages that find all channels full go on
+ * the main stream.
+ *
+ * A page is sent at most once per ram_save_live() call, so the order in
+ * which pages arrive only matters from one call to the next.  Every call
+ * ends with a sync point that is queued on all channels and announced on
+ * the main stream with RAM_SAVE_FLAG_CHANNELS.  On the destination neither
+ * the main stream nor any channel gets past a sync point before all of them
+ * have reached it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "cpu.h"
+#include "hw/hw.h"
+#include "migration.h"
+#include "buffered_file.h"
+#include "qemu-thread.h"
+#include "qemu_socket.h"
+
+//#define DEBUG_RAM_CHANNELS
+
+#ifdef DEBUG_RAM_CHANNELS
+#define DPRINTF(fmt, ...) \
+    do { printf("ram-channels: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+#ifdef _WIN32
+#define SHUT_RDWR SD_BOTH
+#endif
+
+/* record types on a data channel */
+#define CHANNEL_PAGE    1
+#define CHANNEL_SYNC    2
+#define CHANNEL_EOS     3
+
+/* queued bytes after which a channel takes no more pages */
+#define CHANNEL_MAX_PENDING (1 << 20)
+
+typedef struct ChannelOut {
+    QemuThread thread;
+    QemuCond cond;
+    int fd;
+    /* filled by the migration thread */
+    uint8_t *buf;
+    size_t len;
+    size_t size;
+    /* written out by the sender thread */
+    uint8_t *out;
+    size_t out_size;
+    /* close the socket once the queue is empty */
+    int closing;
+} ChannelOut;
+
+static ChannelOut chan_out[MAX_MIGRATION_CHANNELS];
+static int chan_out_created;
+/* channels used by the current migration, 0 if none */
+static int chan_out_nr;
+static int chan_out_next;
+static int chan_out_error;
+static uint64_t chan_out_seq;
+
+/* protects chan_out and chan_out_error */
+static QemuMutex chan_out_lock;
+/* signalled when a sender thread took a queue or closed its socket */
+static QemuCond chan_out_done_cond;
+
+typedef struct ChannelIn {
+    QemuThread thread;
+    QEMUFile *file;
+    int fd;
+    uint64_t synced;
+    int error;
+} ChannelIn;
+
+static ChannelIn chan_in[MAX_MIGRATION_CHANNELS];
+static int chan_in_nr;
+static uint64_t chan_in_released;
+static int chan_in_failed;
+
+/* protects chan_in synced and error, chan_in_released and chan_in_failed */
+static QemuMutex chan_in_lock;
+static QemuCond chan_in_cond;
+
+/* source side */
+
+static void *channel_send_thread(void *opaque)
+{
+    ChannelOut *ch = opaque;
+    uint8_t *tmp;
+    size_t len;
+    int ret;
+
+    qemu_mutex_lock(&chan_out_lock);
+    for (;;) {
+        while (ch->fd < 0 || (!ch->len && !ch->closing)) {
+            qemu_cond_wait(&ch->cond, &chan_out_lock);
+        }
+
+        if (!ch->len) {
+            DPRINTF("closing channel %d\n", (int)(ch - chan_out));
+            closesocket(ch->fd);
+            ch->fd = -1;
+            ch->closing = 0;
+            qemu_cond_broadcast(&chan_out_done_cond);
+            continue;
+        }
+
+        /* swap the queues, the migration thread refills the other one */
+        tmp = ch->out;
+        ch->out = ch->buf;
+        ch->buf = tmp;
+        len = ch->out_size;
+        ch->out_size = ch->size;
+        ch->size = len;
+
+        len = ch->len;
+        ch->len = 0;
+        qemu_cond_broadcast(&chan_out_done_cond);
+        qemu_mutex_unlock(&chan_out_lock);
+
+        ret = send_all(ch->fd, ch->out, len);
+
+        qemu_mutex_lock(&chan_out_lock);
+        if (ret != (int)len) {
+            DPRINTF("error writing to channel %d\n", (int)(ch - chan_out));
+            chan_out_error = 1;
+            /* nothing gets through anymore, throw the rest away */
+            ch->len = 0;
+            qemu_cond_broadcast(&chan_out_done_cond);
+        }
+    }
+
+    return NULL;
+}
+
+static uint8_t *channel_reserve(ChannelOut *ch, size_t len)
+{
+    uint8_t *p;
+
+    if (ch->len + len > ch->size) {
+        ch->size = MAX(ch->len + len, CHANNEL_MAX_PENDING + len);
+        ch->buf = g_realloc(ch->buf, ch->size);
+    }
+    p = ch->buf + ch->len;
+    ch->len += len;
+    return p;
+}
+
+static uint8_t *channel_put_be32(uint8_t *p, uint32_t v)
+{
+    v = cpu_to_be32(v);
+    memcpy(p, &v, 4);
+    return p + 4;
+}
+
+static uint8_t *channel_put_be64(uint8_t *p, uint64_t v)
+{
+    v = cpu_to_be64(v);
+    memcpy(p, &v, 8);
+    return p + 8;
+}
+
+/*
+ * Hands the connected sockets in fds over to the sender threads, which close
+ * them when the migration ends.  Called before the migration starts.
+ */
+void ram_channels_setup(const int *fds, int nr)
+{
+    int i;
+
+    if (!chan_out_created) {
+        qemu_mutex_init(&chan_out_lock);
+        qemu_cond_init(&chan_out_done_cond);
+    }
+
+    qemu_mutex_lock(&chan_out_lock);
+    for (i = 0; i < nr; i++) {
+        ChannelOut *ch = &chan_out[i];
+
+        ch->fd = fds[i];
+        ch->len = 0;
+        ch->closing = 0;
+        if (i >= chan_out_created) {
+            qemu_cond_init(&ch->cond);
+            qemu_thread_create(&ch->thread, channel_send_thread, ch);
+            chan_out_created++;
+        }
+    }
+    chan_out_nr = nr;
+    chan_out_next = 0;
+    chan_out_error = 0;
+    chan_out_seq = 0;
+    qemu_mutex_unlock(&chan_out_lock);
+
+    DPRINTF("sending on %d channels\n", nr);
+}
+
+int ram_channels_active(void)
+{
+    return chan_out_nr;
+}
+
+/*
+ * Queues the page p at offset in block on the least loaded channel and
+ * accounts for it in the bandwidth limit of f.  Returns 1 without queueing
+ * the page if all channels are full; the caller then sends it on the main
+ * stream instead of waiting for a sender thread with the global mutex held.
+ */
+int ram_channels_send_page(QEMUFile *f, RAMBlock *block, uint64_t offset,
+                           const uint8_t *p)
+{
+    ChannelOut *ch;
+    size_t idlen = strlen(block->idstr);
+    size_t len = 4 + 1 + idlen + 8 + TARGET_PAGE_SIZE;
+    uint8_t *q;
+    int i, idx;
+
+    qemu_mutex_lock(&chan_out_lock);
+    ch = &chan_out[chan_out_next];
+    for (i = 1; i < chan_out_nr; i++) {
+        idx = (chan_out_next + i) % chan_out_nr;
+        if (chan_out[idx].len < ch->len) {
+            ch = &chan_out[idx];
+        }
+    }
+
+    if (chan_out_error) {
+        qemu_mutex_unlock(&chan_out_lock);
+        return -EIO;
+    }
+    if (ch->len >= CHANNEL_MAX_PENDING) {
+        qemu_mutex_unlock(&chan_out_lock);
+        return 1;
+    }
+
+    q = channel_reserve(ch, len);
+    q = channel_put_be32(q, CHANNEL_PAGE);
+    *q++ = idlen;
+    memcpy(q, block->idstr, idlen);
+    q = channel_put_be64(q + idlen, offset);
+    memcpy(q, p, TARGET_PAGE_SIZE);
+
+    chan_out_next = (ch - chan_out + 1) % chan_out_nr;
+    qemu_cond_signal(&ch->cond);
+    qemu_mutex_unlock(&chan_out_lock);
+
+    qemu_buffered_file_account(f, len);
+    return 0;
+}
+
+/*
+ * Ends the pages queued so far with a sync point on every channel and
+ * writes its number to the main stream, after RAM_SAVE_FLAG_CHANNELS.
+ */
+void ram_channels_sync(QEMUFile *f)
+{
+    uint8_t *q;
+    int i;
+
+    qemu_mutex_lock(&chan_out_lock);
+    chan_out_seq++;
+    for (i = 0; i < chan_out_nr; i++) {
+        q = channel_reserve(&chan_out[i], 4 + 8);
+        q = channel_put_be32(q, CHANNEL_SYNC);
+        channel_put_be64(q, chan_out_seq);
+        qemu_cond_signal(&chan_out[i].cond);
+    }
+    qemu_mutex_unlock(&chan_out_lock);
+
+    qemu_put_be32(f, chan_out_nr);
+    qemu_put_be64(f, chan_out_seq);
+}
+
+/* Makes the sender threads close their sockets once their queue is empty */
+static void channels_close(int drop)
+{
+    int i;
+
+    for (i = 0; i < chan_out_nr; i++) {
+        ChannelOut *ch = &chan_out[i];
+
+        if (drop) {
+            ch->len = 0;
+            /* kick the sender thread out of a blocking write */
+            if (ch->fd >= 0) {
+                shutdown(ch->fd, SHUT_RDWR);
+            }
+        } else {
+            channel_put_be32(channel_reserve(ch, 4), CHANNEL_EOS);
+        }
+        ch->closing = 1;
+        qemu_cond_signal(&ch->cond);
+    }
+}
+
+static void channels_wait_closed(void)
+{
+    int i, busy;
+
+    do {
+        busy = 0;
+        for (i = 0; i < chan_out_nr; i++) {
+            if (chan_out[i].fd >= 0) {
+                busy = 1;
+                qemu_cond_wait(&chan_out_done_cond, &chan_out_lock);
+                break;
+            }
+        }
+    } while (busy);
+
+    chan_out_nr = 0;
+}
+
+/*
+ * Queues the end of stream on every channel.  Called after the final sync
+ * point; ram_channels_wait() then waits until the channels are written out.
+ */
+int ram_channels_finish(void)
+{
+    int ret;
+
+    qemu_mutex_lock(&chan_out_lock);
+    channels_close(0);
+    ret = chan_out_error ? -EIO : 0;
+    qemu_mutex_unlock(&chan_out_lock);
+
+    return ret;
+}
+
+/*
+ * Waits until the sender threads wrote out and closed every channel after
+ * ram_channels_finish().  This may take long, so it is called from the
+ * migration thread without the global mutex.
+ */
+int ram_channels_wait(void)
+{
+    int ret;
+
+    qemu_mutex_lock(&chan_out_lock);
+    channels_wait_closed();
+    ret = chan_out_error ? -EIO : 0;
+    qemu_mutex_unlock(&chan_out_lock);
+
+    return ret;
+}
+
+void ram_channels_cancel(void)
+{
+    if (!chan_out_nr) {
+        return;
+    }
+
+    qemu_mutex_lock(&chan_out_lock);
+    channels_close(1);
+    channels_wait_closed();
+    qemu_mutex_unlock(&chan_out_lock);
+}
+
+/* destination side */
+
+static RAMBlock *channel_find_block(const char *id)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(block->idstr))) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+static void *channel_recv_thread(void *opaque)
+{
+    ChannelIn *ch = opaque;
+    QEMUFile *f = ch->file;
+    RAMBlock *block = NULL;
+    char id[256];
+    uint64_t offset, seq;
+    int type, len, failed, ret = -EIO;
+
+    for (;;) {
+        type = qemu_get_be32(f);
+        if (qemu_file_has_error(f)) {
+            break;
+        }
+
+        if (type == CHANNEL_PAGE) {
+            len = qemu_get_byte(f);
+            qemu_get_buffer(f, (uint8_t *)id, len);
+            id[len] = 0;
+            offset = qemu_get_be64(f);
+
+            if (!block || strcmp(id, block->idstr)) {
+                block = channel_find_block(id);
+            }
+            if (!block || offset >= block->length ||
+                (offset & ~TARGET_PAGE_MASK)) {
+                fprintf(stderr, "Invalid page on RAM data channel\n");
+                break;
+            }
+            qemu_get_buffer(f, block->host + offset, TARGET_PAGE_SIZE);
+        } else if (type == CHANNEL_SYNC) {
+            seq = qemu_get_be64(f);
+            if (qemu_file_has_error(f)) {
+                break;
+            }
+
+            qemu_mutex_lock(&chan_in_lock);
+            ch->synced = seq;
+            qemu_cond_broadcast(&chan_in_cond);
+            while (chan_in_released < seq && !chan_in_failed) {
+                qemu_cond_wait(&chan_in_cond, &chan_in_lock);
+            }
+            failed = chan_in_failed;
+            qemu_mutex_unlock(&chan_in_lock);
+            if (failed) {
+                break;
+            }
+        } else if (type == CHANNEL_EOS) {
+            ret = 0;
+            break;
+        } else {
+            fprintf(stderr, "Unknown record %d on RAM data channel\n", type);
+            break;
+        }
+    }
+
+    if (ret < 0) {
+        qemu_mutex_lock(&chan_in_lock);
+        ch->error = 1;
+        qemu_cond_broadcast(&chan_in_cond);
+        qemu_mutex_unlock(&chan_in_lock);
+    }
+    DPRINTF("channel %d done\n", (int)(ch - chan_in));
+
+    qemu_fclose(f);
+    closesocket(ch->fd);
+    return NULL;
+}
+
+/* Takes the nr data channels the source opened off the listening socket */
+static int channels_accept(int nr)
+{
+    int listen_fd = migration_incoming_listen_fd();
+    ChannelIn *ch;
+    QEMUFile *f;
+    uint32_t magic, idx;
+    int i, c;
+
+    if (listen_fd < 0) {
+        fprintf(stderr, "RAM data channels need a tcp migration\n");
+        return -EINVAL;
+    }
+    if (nr < 1 || nr > MAX_MIGRATION_CHANNELS) {
+        fprintf(stderr, "Invalid number of RAM data channels %d\n", nr);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < nr; i++) {
+        do {
+            c = qemu_accept(listen_fd, NULL, NULL);
+        } while (c == -1 && socket_error() == EINTR);
+        if (c == -1) {
+            fprintf(stderr, "Could not accept RAM data channel\n");
+            return -EIO;
+        }
+
+        f = qemu_fopen_socket(c);
+        magic = qemu_get_be32(f);
+        idx = qemu_get_be32(f);
+        if (qemu_file_has_error(f) || magic != RAM_CHANNEL_MAGIC ||
+            idx >= nr || chan_in[idx].file) {
+            fprintf(stderr, "Invalid RAM data channel header\n");
+            qemu_fclose(f);
+            closesocket(c);
+            return -EINVAL;
+        }
+        chan_in[idx].file = f;
+        chan_in[idx].fd = c;
+    }
+
+    qemu_mutex_init(&chan_in_lock);
+    qemu_cond_init(&chan_in_cond);
+    chan_in_nr = nr;
+    for (i = 0; i < nr; i++) {
+        ch = &chan_in[i];
+        qemu_thread_create(&ch->thread, channel_recv_thread, ch);
+    }
+
+    DPRINTF("receiving on %d channels\n", nr);
+    return 0;
+}
+
+/*
+ * Handles RAM_SAVE_FLAG_CHANNELS: waits until every channel reached the
+ * sync point read from f, then lets them go on.  The first one sets up the
+ * channels.
+ */
+int ram_channels_load_sync(QEMUFile *f)
+{
+    int nr = qemu_get_be32(f);
+    uint64_t seq = qemu_get_be64(f);
+    int i, done, failed;
+
+    if (qemu_file_has_error(f)) {
+        return -EIO;
+    }
+    if (!chan_in_nr) {
+        if (channels_accept(nr) < 0) {
+            return -EINVAL;
+        }
+    } else if (nr != chan_in_nr) {
+        return -EINVAL;
+    }
+
+    qemu_mutex_lock(&chan_in_lock);
+    for (;;) {
+        done = 1;
+        failed = 0;
+        for (i = 0; i < chan_in_nr; i++) {
+            if (chan_in[i].error) {
+                failed = 1;
+            } else if (chan_in[i].synced < seq) {
+                done = 0;
+            }
+        }
+        if (done || failed) {
+            break;
+        }
+        qemu_cond_wait(&chan_in_cond, &chan_in_lock);
+    }
+
+    if (failed) {
+        chan_in_failed = 1;
+    } else {
+        chan_in_released = seq;
+    }
+    qemu_cond_broadcast(&chan_in_cond);
+    qemu_mutex_unlock(&chan_in_lock);
+
+    return failed ? -EIO : 0;
+}
@@ -332,6 +332,64 @@ QEMUFile *qemu_fopen_socket(int fd)
     return s->file;
 }
 
+/* QEMUFile in memory, the buffer grows as it is written to */
+typedef struct QEMUFileMem
+{
+    uint8_t *buf;
+    int64_t size;
+    QEMUFile *file;
+} QEMUFileMem;
+
+static int mem_put_buffer(void *opaque, const uint8_t *buf,
+                          int64_t pos, int size)
+{
+    QEMUFileMem *s = opaque;
+
+    if (pos + size > s->size) {
+        s->buf = g_realloc(s->buf, pos + size);
+        s->size = pos + size;
+    }
+    memcpy(s->buf + pos, buf, size);
+    return size;
+}
+
+static int mem_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileMem *s = opaque;
+
+    if (pos >= s->size) {
+        return 0;
+    }
+    size = MIN(size, s->size - pos);
+    memcpy(buf, s->buf + pos, size);
+    return size;
+}
+
+static int mem_close(void *opaque)
+{
+    QEMUFileMem *s = opaque;
+    g_free(s->buf);
+    g_free(s);
+    return 0;
+}
+
+/* Reads from buf, which is freed on close, or writes if buf is NULL */
+static QEMUFileMem *qemu_fopen_mem(uint8_t *buf, int64_t size)
+{
+    QEMUFileMem *s = g_malloc0(sizeof(QEMUFileMem));
+
+    s->buf = buf;
+    s->size = size;
+    if (buf) {
+        s->file = qemu_fopen_ops(s, NULL, mem_get_buffer, mem_close,
+                                 NULL, NULL, NULL);
+    } else {
+        s->file = qemu_fopen_ops(s, mem_put_buffer, NULL, mem_close,
+                                 NULL, NULL, NULL);
+    }
+    return s;
+}
+
 static int file_put_buffer(void *opaque, const uint8_t *buf,
                             int64_t pos, int size)
 {
@@ -1051,6 +1109,8 @@ typedef struct SaveStateEntry {
     int instance_id;
     int alias_id;
     int version_id;
+    /* version a live section is written with, see savevm_set_save_version */
+    int save_version_id;
     int section_id;
     SaveSetParamsHandler *set_params;
     SaveLiveStateHandler *save_live_state;
@@ -1116,6 +1176,7 @@ int register_savevm_live(DeviceState *dev,
 
     se = g_malloc0(sizeof(SaveStateEntry));
     se->version_id = version_id;
+    se->save_version_id = version_id;
     se->section_id = global_section_id++;
     se->set_params = set_params;
     se->save_live_state = save_live_state;
@@ -1447,6 +1508,7 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_POSTCOPY_DEVICES     0x06
 
 bool qemu_savevm_state_blocked(Monitor *mon)
 {
@@ -1493,7 +1555,7 @@ int qemu_savevm_state_begin(Monitor *mon, QEMUFile *f, int blk_enable,
         qemu_put_buffer(f, (uint8_t *)se->idstr, len);
 
         qemu_put_be32(f, se->instance_id);
-        qemu_put_be32(f, se->version_id);
+        qemu_put_be32(f, se->save_version_id);
 
         se->save_live_state(mon, f, QEMU_VM_SECTION_START, se->opaque);
     }
@@ -1540,12 +1602,10 @@ int qemu_savevm_state_iterate(Monitor *mon, QEMUFile *f)
     return 0;
 }
 
-int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
+static void qemu_savevm_state_live_end(Monitor *mon, QEMUFile *f)
 {
     SaveStateEntry *se;
 
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (se->save_live_state == NULL)
             continue;
@@ -1556,6 +1616,11 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
 
         se->save_live_state(mon, f, QEMU_VM_SECTION_END, se->opaque);
     }
+}
+
+static void qemu_savevm_state_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
@@ -1577,6 +1642,14 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
 
         vmstate_save(f, se);
     }
+}
+
+int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
+{
+    cpu_synchronize_all_states();
+
+    qemu_savevm_state_live_end(mon, f);
+    qemu_savevm_state_devices(f);
 
     qemu_put_byte(f, QEMU_VM_EOF);
 
@@ -1586,6 +1659,36 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
     return 0;
 }
 
+/*
+ * Like qemu_savevm_state_complete, but for a post-copy migration: the
+ * device state is sent as a single blob, so that the destination can load
+ * it in one go while it starts receiving the remaining RAM pages from the
+ * rest of the stream.
+ */
+int qemu_savevm_state_complete_postcopy(Monitor *mon, QEMUFile *f)
+{
+    QEMUFileMem *mem;
+
+    cpu_synchronize_all_states();
+
+    qemu_savevm_state_live_end(mon, f);
+
+    mem = qemu_fopen_mem(NULL, 0);
+    qemu_savevm_state_devices(mem->file);
+    qemu_put_byte(mem->file, QEMU_VM_EOF);
+    qemu_fflush(mem->file);
+
+    qemu_put_byte(f, QEMU_VM_POSTCOPY_DEVICES);
+    qemu_put_be32(f, mem->size);
+    qemu_put_buffer(f, mem->buf, mem->size);
+    qemu_fclose(mem->file);
+
+    if (qemu_file_has_error(f))
+        return -EIO;
+
+    return 0;
+}
+
 void qemu_savevm_state_cancel(Monitor *mon, QEMUFile *f)
 {
     SaveStateEntry *se;
@@ -1652,6 +1755,21 @@ static SaveStateEntry *find_se(const char *idstr, int instance_id)
     return NULL;
 }
 
+/*
+ * Write live section idstr with an older version than the one it was
+ * registered with, for destinations that cannot load the newer format.
+ * Meant to be called from the set_params handler; loading still accepts
+ * every version up to the registered one.
+ */
+void savevm_set_save_version(const char *idstr, int instance_id,
+                             int version_id)
+{
+    SaveStateEntry *se = find_se(idstr, instance_id);
+
+    assert(se && version_id <= se->version_id);
+    se->save_version_id = version_id;
+}
+
 static const VMStateDescription *vmstate_get_subsection(const VMStateSubsection *sub, char *idstr)
 {
     while(sub && sub->needed) {
@@ -1731,6 +1849,7 @@ int qemu_loadvm_state(QEMUFile *f)
     QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
         QLIST_HEAD_INITIALIZER(loadvm_handlers);
     LoadStateEntry *le, *new_le;
+    QEMUFileMem *mem = NULL;
     uint8_t section_type;
     unsigned int v;
     int ret;
@@ -1821,6 +1940,30 @@ int qemu_loadvm_state(QEMUFile *f)
                 goto out;
             }
             break;
+        case QEMU_VM_POSTCOPY_DEVICES:
+            if (mem) {
+                ret = -EINVAL;
+                goto out;
+            }
+            len = qemu_get_be32(f);
+            if (len <= 0) {
+                ret = -EINVAL;
+                goto out;
+            }
+            mem = qemu_fopen_mem(g_malloc(len), len);
+            qemu_get_buffer(f, mem->buf, len);
+            if (qemu_file_has_error(f)) {
+                ret = -EIO;
+                goto out;
+            }
+
+            /* the rest of f carries RAM pages and belongs to post-copy now */
+            ret = postcopy_ram_incoming_listen(f);
+            if (ret < 0) {
+                goto out;
+            }
+            f = mem->file;
+            break;
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
             ret = -EINVAL;
@@ -1841,6 +1984,10 @@ out:
     if (qemu_file_has_error(f))
         ret = -EIO;
 
+    if (mem) {
+        qemu_fclose(mem->file);
+    }
+
     return ret;
 }
 
@@ -2053,7 +2200,7 @@ int load_vmstate(const char *name)
     }
 
     /* Flush all IO requests so they don't interfere with the new state.  */
-    qemu_aio_flush();
+    bdrv_drain_all();
 
     bs = NULL;
     while ((bs = bdrv_next(bs))) {
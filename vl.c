@@ -137,6 +137,9 @@ int main(int argc, char **argv)
 #include "block.h"
 #include "blockdev.h"
 #include "block-migration.h"
+#ifndef _WIN32
+#include "block/raw-posix-aio.h"
+#endif
 #include "dma.h"
 #include "audio/audio.h"
 #include "migration.h"
@@ -2262,6 +2265,17 @@ int main(int argc, char **argv, char **envp)
                     exit(1);
                 }
 	        break;
+            case QEMU_OPTION_aio_threads:
+                opts = qemu_opts_parse(qemu_find_opts("aio-threads"),
+                                       optarg, 0);
+                if (!opts) {
+                    exit(1);
+                }
+#ifndef _WIN32
+                paio_set_threads(qemu_opt_get_number(opts, "max", 0),
+                                 qemu_opt_get_number(opts, "idle-timeout", 0));
+#endif
+                break;
             case QEMU_OPTION_set:
                 if (qemu_set_option(optarg) != 0)
                     exit(1);
@@ -3209,8 +3223,8 @@ int main(int argc, char **argv, char **envp)
     default_drive(default_sdcard, snapshot, machine->use_scsi,
                   IF_SD, 0, SD_OPTS);
 
-    register_savevm_live(NULL, "ram", 0, 4, NULL, ram_save_live, NULL,
-                         ram_load, NULL);
+    register_savevm_live(NULL, "ram", 0, 5, ram_set_params, ram_save_live,
+                         NULL, ram_load, NULL);
 
     if (nb_numa_nodes > 0) {
         int i;